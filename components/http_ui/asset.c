@@ -0,0 +1,63 @@
+#include <string.h>
+#include "esp_log.h"
+#include "esp_http_server.h"
+
+#include "asset.h"
+#include "assets.h"
+
+static const char *ASSET_TAG = "ASSET";
+
+// asset_find
+// Looks up an asset by the path it's served at, anything after a '?' is ignored
+const asset_t *asset_find(const char *path) {
+   size_t len = strcspn(path, "?");
+
+   for (size_t i = 0; i < asset_count; i++) {
+       if (strlen(assets[i].path) == len && strncmp(assets[i].path, path, len) == 0) {
+           return &assets[i];
+       }
+   }
+   return NULL;
+}
+
+// asset_is_cached
+// Whether the client already has this version, If-None-Match can be a list and the tags in it
+// can be weak, so it's enough for ours to be in there
+static bool asset_is_cached(httpd_req_t *req, const asset_t *asset) {
+   char tags[128];
+
+   if (httpd_req_get_hdr_value_str(req, "If-None-Match", tags, sizeof(tags)) != ESP_OK) {
+       return false;
+   }
+   return strstr(tags, asset->etag) != NULL || strcmp(tags, "*") == 0;
+}
+
+// asset_send
+// Sends an asset as it's stored, gzipped. Every browser that can get on the AP takes gzip, so
+// there's no plain copy to fall back to
+esp_err_t asset_send(httpd_req_t *req, const asset_t *asset) {
+   httpd_resp_set_hdr(req, "ETag", asset->etag);
+   httpd_resp_set_hdr(req, "Cache-Control", asset->immutable ? ASSET_CACHE_IMMUTABLE : "no-cache");
+
+   if (asset_is_cached(req, asset)) {
+       httpd_resp_set_status(req, "304 Not Modified");
+       return httpd_resp_send(req, NULL, 0);
+   }
+
+   httpd_resp_set_type(req, asset->type);
+   httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+   return httpd_resp_send(req, (const char *)asset->data, asset->len);
+}
+
+// asset_get_handler
+// Serves everything under /assets/
+esp_err_t asset_get_handler(httpd_req_t *req) {
+   const asset_t *asset = asset_find(req->uri);
+
+   if (!asset) {
+       ESP_LOGW(ASSET_TAG, "No asset at %s", req->uri);
+       httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, NULL);
+       return ESP_FAIL;
+   }
+   return asset_send(req, asset);
+}
@@ -0,0 +1,39 @@
+// Static asset config
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "esp_http_server.h"
+
+// Cache-Control for an asset with the hash in its name, it never changes
+// under that name so browsers can keep it as long as they go (a year)
+#define ASSET_CACHE_IMMUTABLE "public, max-age=31536000, immutable"
+
+// A file from assets/, minified and gzipped at build time by tools/mkassets.py into
+// assets.c/assets.h. The ETag is the hash of the minified file. Immutable ones have the hash in
+// their path too and are cached for good, the rest (the page itself) are revalidated every time,
+// which is a 304 with no body as long as the build hasn't changed
+typedef struct {
+   const char *path;
+   const char *type;
+   const uint8_t *data;
+   uint32_t len;
+   const char *etag;
+   bool immutable;
+} asset_t;
+
+// prototypes
+const asset_t *asset_find(const char *path);
+esp_err_t asset_send(httpd_req_t *req, const asset_t *asset);
+esp_err_t asset_get_handler(httpd_req_t *req);
+
+#ifdef __cplusplus
+}
+#endif
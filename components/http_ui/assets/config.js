@@ -0,0 +1,94 @@
+// The ESP32 configuration page, see config.html
+
+function get(url, done) {
+  var xhr = new XMLHttpRequest();
+  xhr.onreadystatechange = function() {
+    if (xhr.readyState == 4 && xhr.status == 200) {
+      done(JSON.parse(xhr.responseText));
+    }
+  };
+  xhr.open('GET', url, true);
+  xhr.send();
+}
+
+function text(id, s) {
+  document.getElementById(id).textContent = s;
+}
+
+function showConfig(c) {
+  var fields = [c.wifi, c.email, c.dns];
+  fields.forEach(function(group) {
+    for (var k in group) {
+      var input = document.querySelector("input[name='" + k + "']");
+      if (input) input.value = group[k];
+    }
+  });
+
+  var d = c.dns;
+  text('dns-stats', 'Cache: ' + d.entries + ' entries, ' + d.hits + ' hits, ' + d.misses +
+       ' misses, ' + d.prefetched + ' prefetched, ' + d.refreshed + ' refreshed');
+
+  var lists = document.getElementById('blocklists');
+  lists.textContent = '';
+  if (c.blocklists.length == 0) c.blocklists.push(null);
+  c.blocklists.forEach(function(l) {
+    var p = document.createElement('p');
+    p.textContent = l ? l.name + ': ' + l.entries + ' domains, ' + l.hits + ' blocked lookups' :
+                        'No lists loaded';
+    lists.appendChild(p);
+  });
+
+  var db = c.cheatdb;
+  text('cheatdb-stats', db.pages + ' pages in flash (' + db.kb + ' KB), ' + db.hits + ' served');
+  text('cheatdb-sync', db.syncing ? 'Sync running: ' + db.sync_pages + ' of ' + db.sync_total + ' pages' : '');
+
+  var mq = c.outbox;
+  var state = mq.sending ? ', sending now' : mq.queued && mq.next_retry ? ', next try in ' + mq.next_retry + ' s' : '';
+  text('outbox-stats', 'Outgoing mail: ' + mq.queued + ' queued' + state + ', ' + mq.sent + ' sent, ' +
+       mq.failed + ' failed, ' + mq.retries + ' retries');
+  text('outbox-error', mq.error ? 'Last problem: ' + mq.error : '');
+}
+
+function showBLE(s) {
+  ['bda', 'connected', 'manufacturer', 'battery'].forEach(function(k) {
+    text('ble-' + k, s[k]);
+  });
+  text('ble-notice', s.notice ? 'Power cycle the Nintendo64 to finalize BLE bonding' : '');
+}
+
+// The status is pushed on /ble_events whenever it changes, polling is only
+// for browsers without EventSource or when the stream can't be opened
+function pollBLE() {
+  var update = function() { get('/ble_status', showBLE); };
+  update();
+  setInterval(update, 5000);
+}
+
+function listenBLE() {
+  if (!window.EventSource) return pollBLE();
+  var events = new EventSource('/ble_events');
+  events.addEventListener('ble', function(e) {
+    showBLE(JSON.parse(e.data));
+  });
+  events.onerror = function() {
+    if (events.readyState == EventSource.CLOSED) pollBLE();
+  };
+}
+
+function uploadBlocklist() {
+  var f = document.getElementById('bl_file').files[0];
+  var n = document.getElementById('bl_name').value;
+  var xhr = new XMLHttpRequest();
+  xhr.onreadystatechange = function() {
+    if (xhr.readyState == 4) {
+      document.getElementById('bl_status').innerHTML = xhr.responseText;
+    }
+  };
+  document.getElementById('bl_status').innerHTML = 'Uploading...';
+  xhr.open('POST', '/blocklist?list=' + encodeURIComponent(n), true);
+  xhr.send(f ? f : '');
+}
+
+document.getElementById('bl_upload').onclick = uploadBlocklist;
+get('/config.json', showConfig);
+listenBLE();
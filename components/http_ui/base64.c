@@ -0,0 +1,140 @@
+#include "base64.h"
+
+static const char base64_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// What each character decodes to, BASE64_PAD for '=' and BASE64_SKIP for anything that isn't
+// base64. Both have the top bit set so a whole group can be checked with one test
+#define BASE64_PAD 0xfe
+#define BASE64_SKIP 0xff
+static const uint8_t base64_values[256] = {
+   0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+   0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+   0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x3e, 0xff, 0xff, 0xff, 0x3f,
+   0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0xff, 0xff, 0xff, 0xfe, 0xff, 0xff,
+   0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+   0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0xff,
+   0xff, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+   0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0xff, 0xff, 0xff, 0xff, 0xff,
+   0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+   0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+   0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+   0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+   0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+   0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+   0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+   0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
+
+// base64_encode
+// Encodes len bytes of in into out, null terminated. out has to have room for
+// BASE64_ENCODED_LEN(len) + 1, if it doesn't nothing is written and ESP_ERR_INVALID_SIZE is
+// returned
+esp_err_t base64_encode(const void *in, size_t len, char *out, size_t size) {
+   const uint8_t *p = in;
+
+   // Worked out from size so a huge len can't overflow it
+   if (size == 0 || len > (size - 1) / 4 * 3) return ESP_ERR_INVALID_SIZE;
+
+   // Whole groups of three, no checks on the way
+   const uint8_t *end = p + len / 3 * 3;
+   while (p < end) {
+       uint32_t val = (p[0] << 16) | (p[1] << 8) | p[2];
+       out[0] = base64_alphabet[val >> 18];
+       out[1] = base64_alphabet[(val >> 12) & 0x3F];
+       out[2] = base64_alphabet[(val >> 6) & 0x3F];
+       out[3] = base64_alphabet[val & 0x3F];
+       p += 3;
+       out += 4;
+   }
+
+   // And the one or two bytes left over, padded
+   size_t left = len % 3;
+   if (left) {
+       uint32_t val = (p[0] << 16) | (left == 2 ? p[1] << 8 : 0);
+       out[0] = base64_alphabet[val >> 18];
+       out[1] = base64_alphabet[(val >> 12) & 0x3F];
+       out[2] = (left == 2) ? base64_alphabet[(val >> 6) & 0x3F] : '=';
+       out[3] = '=';
+       out += 4;
+   }
+   *out = '\0';
+   return ESP_OK;
+}
+
+// base64_decode_begin
+void base64_decode_begin(base64_decoder_t *d) {
+   d->bits = 0;
+   d->count = 0;
+}
+
+// base64_decode_flush
+// Writes out what a group cut short by padding (or the end of the text) has in it. A single
+// character left over is only six bits, not a byte, and is dropped
+static size_t base64_decode_flush(base64_decoder_t *d, uint8_t *out) {
+   size_t n = 0;
+
+   if (d->count == 2) {
+       out[n++] = d->bits >> 4;
+   } else if (d->count == 3) {
+       out[n++] = d->bits >> 10;
+       out[n++] = d->bits >> 2;
+   }
+   d->bits = 0;
+   d->count = 0;
+   return n;
+}
+
+// base64_decode_feed
+// Decodes the next len characters of the text into out, which needs room for
+// BASE64_DECODED_MAX(len). Returns how many bytes were written
+size_t base64_decode_feed(base64_decoder_t *d, const char *in, size_t len, uint8_t *out) {
+   const uint8_t *p = (const uint8_t *)in;
+   const uint8_t *end = p + len;
+   uint8_t *o = out;
+
+   while (p < end) {
+       // Between groups, four good characters in a row (nearly all of a body is lines of them)
+       // go straight through
+       if (d->count == 0) {
+           while (end - p >= 4) {
+               uint8_t a = base64_values[p[0]];
+               uint8_t b = base64_values[p[1]];
+               uint8_t c = base64_values[p[2]];
+               uint8_t e = base64_values[p[3]];
+               if ((a | b | c | e) & 0x80) break;
+               uint32_t val = (a << 18) | (b << 12) | (c << 6) | e;
+               o[0] = val >> 16;
+               o[1] = val >> 8;
+               o[2] = val;
+               o += 3;
+               p += 4;
+           }
+           if (p == end) break;
+       }
+
+       // A line break, padding or a group cut across two pieces, a character at a time
+       uint8_t v = base64_values[*p++];
+       if (v == BASE64_SKIP) continue;
+       if (v == BASE64_PAD) {
+           o += base64_decode_flush(d, o);
+           continue;
+       }
+       d->bits = (d->bits << 6) | v;
+       if (++d->count == 4) {
+           o[0] = d->bits >> 16;
+           o[1] = d->bits >> 8;
+           o[2] = d->bits;
+           o += 3;
+           d->bits = 0;
+           d->count = 0;
+       }
+   }
+   return o - out;
+}
+
+// base64_decode_finish
+// Writes out the last group if the text ended without its padding, out needs room for 2 bytes.
+// Returns how many were written
+size_t base64_decode_finish(base64_decoder_t *d, uint8_t *out) {
+   return base64_decode_flush(d, out);
+}
@@ -0,0 +1,37 @@
+// Base64 codec config
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+// Exact length of the base64 text for len bytes, padding included and the null not
+#define BASE64_ENCODED_LEN(len) (((len) + 2) / 3 * 4)
+
+// Most bytes base64_decode_feed can write for len characters, counting up to three left over
+// from the last piece. Anything that isn't base64 in them only makes it fewer
+#define BASE64_DECODED_MAX(len) (((len) + 3) * 3 / 4)
+
+// Decoder state kept between pieces of the text, which can be cut anywhere. Line breaks and
+// anything else that isn't base64 are skipped over, padding ends a group early so base64
+// pasted together (as some mailers do) still comes out right
+typedef struct {
+   uint32_t bits;
+   uint8_t count;
+} base64_decoder_t;
+
+// prototypes
+esp_err_t base64_encode(const void *in, size_t len, char *out, size_t size);
+void base64_decode_begin(base64_decoder_t *d);
+size_t base64_decode_feed(base64_decoder_t *d, const char *in, size_t len, uint8_t *out);
+size_t base64_decode_finish(base64_decoder_t *d, uint8_t *out);
+
+#ifdef __cplusplus
+}
+#endif
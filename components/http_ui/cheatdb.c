@@ -0,0 +1,539 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+
+#include "cheatdb.h"
+#include "cheatsearch.h"
+
+static const char *CHEATDB_TAG = "CHEATDB";
+
+// The cheat database is a set of finished, Sharkwire friendly pages keyed by request path,
+// living in their own flash partition and served straight out of the memory mapped image.
+// It's built either on the host by tools/mkcheatdb.py from a cheat dump, or on the device
+// by crawling gamegenie.com. The image looks like this:
+//
+//    [ header | page data ... | index | paths | search index ]
+//
+// The index is sorted by path so a lookup is a binary search, and each entry points at
+// one page in the data area. The search index over the game titles is optional (flagged in
+// the header), see cheatsearch.c for its layout. The CRC covers everything after the header sector.
+//
+// Like the blocklist, the partition is split into two slots of that. A sync writes into the one
+// that isn't being served from, which goes on being served until the new image is complete and
+// its header (magic last) is in. An interrupted sync leaves its slot with an erased header and
+// the old database in place. Of two valid slots the one with the higher seq is the newer, an
+// image from tools/mkcheatdb.py has seq 0 and clears the header of the second slot
+#define CHEATDB_MAGIC       0x44435753 // "SWCD"
+#define CHEATDB_VERSION     1
+#define CHEATDB_SECTOR      4096
+#define CHEATDB_DATA_OFFSET CHEATDB_SECTOR
+
+// Header flags
+#define CHEATDB_FLAG_SEARCH 0x0001
+
+// How much of the start of a page we look through for its <title>
+#define CHEATDB_TITLE_SCAN 512
+
+typedef struct {
+   uint32_t magic;
+   uint16_t version;
+   uint16_t flags;
+   uint32_t page_count;
+   uint32_t index_off;
+   uint32_t paths_off;
+   uint32_t image_size;
+   uint32_t crc;
+   uint32_t search_off;
+   uint32_t search_len;
+   uint32_t seq;
+   uint32_t reserved[6];
+} cheatdb_hdr_t;
+
+typedef struct {
+   uint32_t path_off;
+   uint32_t data_off;
+   uint32_t data_len;
+   uint32_t reserved;
+} cheatdb_entry_t;
+
+struct cheatdb_writer {
+   uint32_t base;
+   uint32_t seq;
+   uint32_t cursor;
+   uint32_t erased;
+   uint32_t crc;
+   cheatdb_entry_t *index;
+   size_t count;
+   size_t capacity;
+   char *paths;
+   size_t paths_len;
+   size_t paths_cap;
+};
+
+static const esp_partition_t *db_part = NULL;
+static uint32_t db_slot_size = 0;
+static int db_slot = -1;
+static esp_partition_mmap_handle_t db_map_handle;
+static const uint8_t *db_base = NULL;
+static const cheatdb_hdr_t *db_hdr = NULL;
+static const cheatdb_entry_t *db_index = NULL;
+static const char *db_paths = NULL;
+static const uint8_t *db_search = NULL;
+static size_t db_search_len = 0;
+static SemaphoreHandle_t db_lock = NULL;
+static int db_readers = 0;
+static bool db_writing = false;
+static uint32_t db_hits = 0;
+
+// cheatdb_entries_valid
+// Checks every index entry points inside the image, at a path that ends before it does, since
+// lookups and searches follow them without looking
+static bool cheatdb_entries_valid(const uint8_t *base, const cheatdb_hdr_t *hdr) {
+   const cheatdb_entry_t *index = (const cheatdb_entry_t *)(base + hdr->index_off);
+   const char *paths = (const char *)(base + hdr->paths_off);
+   size_t paths_len = hdr->image_size - hdr->paths_off;
+
+   for (uint32_t i = 0; i < hdr->page_count; i++) {
+       const cheatdb_entry_t *e = &index[i];
+       if (e->data_off < CHEATDB_DATA_OFFSET ||
+           (uint64_t)e->data_off + e->data_len > hdr->image_size ||
+           e->path_off >= paths_len ||
+           !memchr(paths + e->path_off, '\0', paths_len - e->path_off)) {
+           return false;
+       }
+   }
+   return true;
+}
+
+// cheatdb_hdr_valid
+// Checks a slot's header and everything it points at
+static bool cheatdb_hdr_valid(const uint8_t *base) {
+   const cheatdb_hdr_t *hdr = (const cheatdb_hdr_t *)base;
+
+   return hdr->magic == CHEATDB_MAGIC && hdr->version == CHEATDB_VERSION &&
+          hdr->image_size <= db_slot_size && hdr->image_size >= CHEATDB_DATA_OFFSET &&
+          (hdr->index_off & 3) == 0 && hdr->index_off >= CHEATDB_DATA_OFFSET &&
+          hdr->index_off + (uint64_t)hdr->page_count * sizeof(cheatdb_entry_t) <= hdr->image_size &&
+          hdr->paths_off <= hdr->image_size &&
+          esp_rom_crc32_le(0, base + CHEATDB_DATA_OFFSET, hdr->image_size - CHEATDB_DATA_OFFSET) == hdr->crc &&
+          cheatdb_entries_valid(base, hdr);
+}
+
+// cheatdb_map
+// Maps the partition and serves from the newest slot with a valid image. Must be called with
+// db_lock held
+static void cheatdb_map(void) {
+   const void *ptr = NULL;
+   const cheatdb_hdr_t *hdr = NULL;
+
+   db_hdr = NULL;
+   db_slot = -1;
+   if (esp_partition_mmap(db_part, 0, db_part->size, ESP_PARTITION_MMAP_DATA,
+                          &ptr, &db_map_handle) != ESP_OK) {
+       ESP_LOGE(CHEATDB_TAG, "Failed to mmap cheatdb partition");
+       return;
+   }
+
+   for (int slot = 0; slot < 2; slot++) {
+       const uint8_t *base = (const uint8_t *)ptr + slot * db_slot_size;
+       const cheatdb_hdr_t *h = (const cheatdb_hdr_t *)base;
+       if (hdr && (int32_t)(h->seq - hdr->seq) <= 0) continue;
+       if (!cheatdb_hdr_valid(base)) continue;
+       hdr = h;
+       db_slot = slot;
+   }
+   if (!hdr) {
+       ESP_LOGW(CHEATDB_TAG, "No valid cheat database in flash");
+       esp_partition_munmap(db_map_handle);
+       return;
+   }
+
+   db_base = (const uint8_t *)hdr;
+   db_index = (const cheatdb_entry_t *)(db_base + hdr->index_off);
+   db_paths = (const char *)(db_base + hdr->paths_off);
+   db_search = NULL;
+   db_search_len = 0;
+   if ((hdr->flags & CHEATDB_FLAG_SEARCH) && hdr->search_off >= CHEATDB_DATA_OFFSET &&
+       (uint64_t)hdr->search_off + hdr->search_len <= hdr->image_size) {
+       db_search = db_base + hdr->search_off;
+       db_search_len = hdr->search_len;
+   }
+   db_hdr = hdr;
+
+   ESP_LOGI(CHEATDB_TAG, "Cheat database mapped from slot %d: %d pages, %d bytes, %s", db_slot,
+            (int)hdr->page_count, (int)hdr->image_size, db_search ? "searchable" : "no search index");
+}
+
+// cheatdb_remap
+// Switches to whatever slot is newest now. Lookups stop while anyone still sending a page out
+// of the old mapping finishes with it
+static void cheatdb_remap(void) {
+   xSemaphoreTake(db_lock, portMAX_DELAY);
+   if (db_hdr) {
+       db_hdr = NULL;
+       while (db_readers > 0) {
+           xSemaphoreGive(db_lock);
+           vTaskDelay(pdMS_TO_TICKS(10));
+           xSemaphoreTake(db_lock, portMAX_DELAY);
+       }
+       esp_partition_munmap(db_map_handle);
+   }
+   cheatdb_map();
+   xSemaphoreGive(db_lock);
+}
+
+// cheatdb_init
+// Finds and maps the cheat database partition, this is called once from http_ui_task
+void cheatdb_init(void) {
+   if (db_lock) return;
+
+   db_lock = xSemaphoreCreateMutex();
+   db_part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+                                      CHEATDB_PARTITION);
+   if (!db_part) {
+       ESP_LOGW(CHEATDB_TAG, "No '%s' partition, Gamerz pages always come from the proxy", CHEATDB_PARTITION);
+       return;
+   }
+   db_slot_size = (db_part->size / 2) & ~(CHEATDB_SECTOR - 1);
+
+   xSemaphoreTake(db_lock, portMAX_DELAY);
+   cheatdb_map();
+   xSemaphoreGive(db_lock);
+}
+
+// cheatdb_lookup
+// Binary search over the mapped index. On a hit the page can be sent straight out of flash,
+// and the caller has to call cheatdb_release once it's done with it
+bool cheatdb_lookup(const char *path, const char **data, size_t *len) {
+   bool found = false;
+
+   if (!db_lock) return false;
+
+   xSemaphoreTake(db_lock, portMAX_DELAY);
+   if (db_hdr) {
+       uint32_t lo = 0, hi = db_hdr->page_count;
+       while (lo < hi) {
+           uint32_t mid = lo + (hi - lo) / 2;
+           int cmp = strcmp(db_paths + db_index[mid].path_off, path);
+           if (cmp == 0) {
+               *data = (const char *)db_base + db_index[mid].data_off;
+               *len = db_index[mid].data_len;
+               found = true;
+               break;
+           }
+           if (cmp < 0) lo = mid + 1;
+           else hi = mid;
+       }
+       if (found) {
+           db_readers++;
+           db_hits++;
+       }
+   }
+   xSemaphoreGive(db_lock);
+
+   return found;
+}
+
+// cheatdb_release
+// Lets go of a page from cheatdb_lookup
+void cheatdb_release(void) {
+   xSemaphoreTake(db_lock, portMAX_DELAY);
+   if (db_readers > 0) db_readers--;
+   xSemaphoreGive(db_lock);
+}
+
+// cheatdb_get_stats
+// Copies out the database size and hit count for the config and stats pages
+void cheatdb_get_stats(cheatdb_stats_t *out) {
+   memset(out, 0, sizeof(*out));
+   if (!db_lock) return;
+
+   xSemaphoreTake(db_lock, portMAX_DELAY);
+   if (db_hdr) {
+       out->pages = db_hdr->page_count;
+       out->image_size = db_hdr->image_size;
+       out->search_size = db_search_len;
+   }
+   out->hits = db_hits;
+   xSemaphoreGive(db_lock);
+}
+
+// cheatdb_page_title
+// Copies the text between <title> and </title> out of the start of a page. Proxied titles
+// can have markup in them, which gets dropped so a cut off title can't leave a tag open
+static bool cheatdb_page_title(const char *data, size_t len, char *out, size_t size) {
+   const char *end = data + len;
+   const char *p = data;
+
+   out[0] = '\0';
+   while (p + 7 <= end && strncasecmp(p, "<title>", 7) != 0) p++;
+   if (p + 7 > end) return false;
+   p += 7;
+
+   size_t n = 0;
+   while (p < end && n + 1 < size && !(p + 8 <= end && strncasecmp(p, "</title>", 8) == 0)) {
+       if (*p == '<') {
+           while (p < end && *p != '>') p++;
+           if (p < end) p++;
+           continue;
+       }
+       out[n++] = *p++;
+   }
+   out[n] = '\0';
+   return n > 0;
+}
+
+// cheatdb_is_game_page
+// Only the game pages go in the search index, not the alphabetical index pages
+static bool cheatdb_is_game_page(const char *path) {
+   const char *name = strrchr(path, '/');
+   name = name ? name + 1 : path;
+   return strncmp(name, "index", 5) != 0;
+}
+
+// cheatdb_search
+// Looks the query up in the search index and copies out the path and title of up to max
+// matching pages, *total gets how many matched in all
+size_t cheatdb_search(const char *query, cheatdb_result_t *results, size_t max, uint32_t *total) {
+   size_t count = 0;
+
+   *total = 0;
+   if (!db_lock) return 0;
+
+   uint32_t *docs = malloc(max * sizeof(uint32_t));
+   if (!docs) return 0;
+
+   xSemaphoreTake(db_lock, portMAX_DELAY);
+   if (db_hdr && db_search) {
+       count = cheatsearch_query(db_search, db_search_len, db_hdr->page_count, query, docs, max, total);
+       for (size_t i = 0; i < count; i++) {
+           const cheatdb_entry_t *e = &db_index[docs[i]];
+           snprintf(results[i].path, sizeof(results[i].path), "%s", db_paths + e->path_off);
+           if (!cheatdb_page_title((const char *)db_base + e->data_off,
+                                   e->data_len < CHEATDB_TITLE_SCAN ? e->data_len : CHEATDB_TITLE_SCAN,
+                                   results[i].title, sizeof(results[i].title))) {
+               snprintf(results[i].title, sizeof(results[i].title), "%s", results[i].path);
+           }
+       }
+   }
+   xSemaphoreGive(db_lock);
+
+   free(docs);
+   return count;
+}
+
+// cheatdb_searchable
+// Whether the mapped database has a search index
+bool cheatdb_searchable(void) {
+   return db_search != NULL;
+}
+
+// writer_write
+// Appends to the image, erasing sectors just ahead of the write cursor. Offsets are from the
+// start of the slot being written
+static esp_err_t writer_write(cheatdb_writer_t *w, const void *data, size_t len) {
+   if ((uint64_t)w->cursor + len > db_slot_size) return ESP_ERR_NO_MEM;
+
+   while (w->erased < w->cursor + len) {
+       esp_err_t err = esp_partition_erase_range(db_part, w->base + w->erased, CHEATDB_SECTOR);
+       if (err != ESP_OK) return err;
+       w->erased += CHEATDB_SECTOR;
+   }
+
+   esp_err_t err = esp_partition_write(db_part, w->base + w->cursor, data, len);
+   if (err != ESP_OK) return err;
+
+   w->crc = esp_rom_crc32_le(w->crc, data, len);
+   w->cursor += len;
+   return ESP_OK;
+}
+
+// cheatdb_write_begin
+// Starts writing a new image into the slot that isn't being served from, the current database
+// goes on being served until cheatdb_write_finish switches over to the new one
+cheatdb_writer_t *cheatdb_write_begin(void) {
+   if (!db_part) return NULL;
+
+   cheatdb_writer_t *w = calloc(1, sizeof(cheatdb_writer_t));
+   if (!w) return NULL;
+
+   xSemaphoreTake(db_lock, portMAX_DELAY);
+   if (db_writing) {
+       xSemaphoreGive(db_lock);
+       free(w);
+       return NULL;
+   }
+   db_writing = true;
+   w->base = (db_hdr ? !db_slot : 0) * db_slot_size;
+   w->seq = db_hdr ? db_hdr->seq + 1 : 1;
+   xSemaphoreGive(db_lock);
+
+   // Kill the slot's old header first, so nothing half written ever looks valid
+   if (esp_partition_erase_range(db_part, w->base, CHEATDB_SECTOR) != ESP_OK) {
+       cheatdb_write_abort(w);
+       return NULL;
+   }
+
+   w->erased = CHEATDB_SECTOR;
+   w->cursor = CHEATDB_DATA_OFFSET;
+   return w;
+}
+
+// cheatdb_write_page
+// Adds one page to the image, pages can be added in any order
+esp_err_t cheatdb_write_page(cheatdb_writer_t *w, const char *path, const char *data, size_t len) {
+   size_t path_len = strlen(path) + 1;
+   if (path_len > CHEATDB_PATH_LEN) return ESP_ERR_INVALID_ARG;
+
+   if (w->count == w->capacity) {
+       size_t new_cap = w->capacity ? w->capacity * 2 : 256;
+       cheatdb_entry_t *tmp = heap_caps_realloc(w->index, new_cap * sizeof(cheatdb_entry_t),
+                                                MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+       if (!tmp) return ESP_ERR_NO_MEM;
+       w->index = tmp;
+       w->capacity = new_cap;
+   }
+
+   if (w->paths_len + path_len > w->paths_cap) {
+       size_t new_cap = w->paths_cap ? w->paths_cap * 2 : 8192;
+       while (new_cap < w->paths_len + path_len) new_cap *= 2;
+       char *tmp = heap_caps_realloc(w->paths, new_cap, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+       if (!tmp) return ESP_ERR_NO_MEM;
+       w->paths = tmp;
+       w->paths_cap = new_cap;
+   }
+
+   cheatdb_entry_t *e = &w->index[w->count];
+   e->path_off = w->paths_len;
+   e->data_off = w->cursor;
+   e->data_len = len;
+   e->reserved = 0;
+
+   esp_err_t err = writer_write(w, data, len);
+   if (err != ESP_OK) return err;
+
+   memcpy(w->paths + w->paths_len, path, path_len);
+   w->paths_len += path_len;
+   w->count++;
+   return ESP_OK;
+}
+
+static const char *sort_paths = NULL;
+
+static int entry_cmp(const void *a, const void *b) {
+   const cheatdb_entry_t *ea = a;
+   const cheatdb_entry_t *eb = b;
+   return strcmp(sort_paths + ea->path_off, sort_paths + eb->path_off);
+}
+
+// writer_build_search
+// Builds the search index from the titles of the pages already written, documents being
+// positions in the sorted index. Returns NULL if there's nothing to index or no memory for it
+static uint8_t *writer_build_search(cheatdb_writer_t *w, size_t *len) {
+   cheatsearch_builder_t *b = cheatsearch_builder_new();
+   char *buf = malloc(CHEATDB_TITLE_SCAN);
+   char *title = malloc(CHEATDB_TITLE_SCAN);
+   uint8_t *search = NULL;
+   esp_err_t err = (b && buf && title) ? ESP_OK : ESP_ERR_NO_MEM;
+
+   for (size_t i = 0; i < w->count && err == ESP_OK; i++) {
+       const cheatdb_entry_t *e = &w->index[i];
+       size_t n = e->data_len < CHEATDB_TITLE_SCAN ? e->data_len : CHEATDB_TITLE_SCAN;
+
+       if (!cheatdb_is_game_page(w->paths + e->path_off)) continue;
+       if (esp_partition_read(db_part, w->base + e->data_off, buf, n) != ESP_OK) continue;
+       if (cheatdb_page_title(buf, n, title, CHEATDB_TITLE_SCAN)) {
+           err = cheatsearch_add(b, i, title, strlen(title));
+       }
+   }
+
+   if (err == ESP_OK) search = cheatsearch_build(b, len);
+   if (!search) ESP_LOGW(CHEATDB_TAG, "No search index for this cheat database");
+
+   cheatsearch_builder_free(b);
+   free(buf);
+   free(title);
+   return search;
+}
+
+// cheatdb_write_finish
+// Writes the sorted index, the paths, the search index and finally the header, then switches
+// over to the new image
+esp_err_t cheatdb_write_finish(cheatdb_writer_t *w) {
+   esp_err_t err = ESP_OK;
+   cheatdb_hdr_t hdr = {0};
+   static const uint8_t pad[4] = {0};
+
+   sort_paths = w->paths;
+   if (w->count > 0) qsort(w->index, w->count, sizeof(cheatdb_entry_t), entry_cmp);
+
+   if (w->cursor & 3) err = writer_write(w, pad, 4 - (w->cursor & 3));
+
+   hdr.index_off = w->cursor;
+   if (err == ESP_OK && w->count > 0) err = writer_write(w, w->index, w->count * sizeof(cheatdb_entry_t));
+
+   hdr.paths_off = w->cursor;
+   if (err == ESP_OK && w->paths_len > 0) err = writer_write(w, w->paths, w->paths_len);
+
+   size_t search_len = 0;
+   uint8_t *search = (err == ESP_OK) ? writer_build_search(w, &search_len) : NULL;
+   if (search) {
+       hdr.search_off = w->cursor;
+       hdr.search_len = search_len;
+       hdr.flags |= CHEATDB_FLAG_SEARCH;
+       err = writer_write(w, search, search_len);
+       heap_caps_free(search);
+   }
+
+   hdr.version = CHEATDB_VERSION;
+   hdr.page_count = w->count;
+   hdr.image_size = w->cursor;
+   hdr.crc = w->crc;
+   hdr.seq = w->seq;
+
+   // The header goes in with its magic still erased, then the magic on its own
+   hdr.magic = 0xFFFFFFFF;
+   if (err == ESP_OK) err = esp_partition_write(db_part, w->base, &hdr, sizeof(hdr));
+   uint32_t magic = CHEATDB_MAGIC;
+   if (err == ESP_OK) err = esp_partition_write(db_part, w->base, &magic, sizeof(magic));
+
+   if (err == ESP_OK) {
+       ESP_LOGI(CHEATDB_TAG, "Wrote cheat database: %d pages, %d bytes", (int)w->count, (int)w->cursor);
+   } else {
+       ESP_LOGE(CHEATDB_TAG, "Failed to write cheat database: %s", esp_err_to_name(err));
+   }
+
+   heap_caps_free(w->index);
+   heap_caps_free(w->paths);
+   free(w);
+
+   if (err == ESP_OK) cheatdb_remap();
+
+   xSemaphoreTake(db_lock, portMAX_DELAY);
+   db_writing = false;
+   xSemaphoreGive(db_lock);
+
+   return err;
+}
+
+// cheatdb_write_abort
+// Gives up on a write. Only the slot that wasn't being served from has been touched, so the
+// database from before carries on as it was
+void cheatdb_write_abort(cheatdb_writer_t *w) {
+   if (!w) return;
+
+   heap_caps_free(w->index);
+   heap_caps_free(w->paths);
+   free(w);
+
+   xSemaphoreTake(db_lock, portMAX_DELAY);
+   db_writing = false;
+   xSemaphoreGive(db_lock);
+}
@@ -0,0 +1,52 @@
+// Offline cheat database config
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+// Label of the flash partition that holds the cheat database image (see partitions.csv)
+#define CHEATDB_PARTITION "cheatdb"
+
+// Longest page path the database can hold
+#define CHEATDB_PATH_LEN 128
+
+// Longest title shown in search results, longer ones get cut off
+#define CHEATDB_TITLE_LEN 96
+
+typedef struct {
+   uint32_t pages;
+   uint32_t image_size;
+   uint32_t search_size;
+   uint32_t hits;
+} cheatdb_stats_t;
+
+typedef struct {
+   char path[CHEATDB_PATH_LEN];
+   char title[CHEATDB_TITLE_LEN];
+} cheatdb_result_t;
+
+typedef struct cheatdb_writer cheatdb_writer_t;
+
+// prototypes
+void cheatdb_init(void);
+bool cheatdb_lookup(const char *path, const char **data, size_t *len);
+void cheatdb_release(void);
+void cheatdb_get_stats(cheatdb_stats_t *out);
+size_t cheatdb_search(const char *query, cheatdb_result_t *results, size_t max, uint32_t *total);
+bool cheatdb_searchable(void);
+
+cheatdb_writer_t *cheatdb_write_begin(void);
+esp_err_t cheatdb_write_page(cheatdb_writer_t *w, const char *path, const char *data, size_t len);
+esp_err_t cheatdb_write_finish(cheatdb_writer_t *w);
+void cheatdb_write_abort(cheatdb_writer_t *w);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,456 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+#include "esp_http_server.h"
+
+#include "cheatsearch.h"
+#include "cheatdb.h"
+#include "tpl.h"
+#include "templates.h"
+
+static const char *CHEATSEARCH_TAG = "CHEATSEARCH";
+
+// The search index is an inverted index over the game titles in the cheat database, built
+// whenever the database is (by tools/mkcheatdb.py or at the end of a sync) and stored in the
+// same image, so it's read straight out of flash. Documents are page numbers in the database's
+// sorted index. The layout (everything little endian) is:
+//
+//    u32 term_count, u32 block_count, u32 postings_off, u32 block_off[block_count]
+//    blocks:   varint postings_base, then for each term:
+//              u8 prefix, u8 suffix_len, suffix, varint doc_count, varint postings_len
+//    postings: for each term, its documents as varint deltas from the one before
+//
+// Terms are sorted and front coded, each one only storing what's different from the term
+// before it in the block (the first term of a block is always whole). A term's postings
+// start at postings_base plus the postings_len of the terms before it in the block
+#define CHEATSEARCH_HDR_SIZE 12
+
+typedef struct {
+   char term[CHEATSEARCH_TERM_LEN];
+   uint32_t doc;
+} cheatsearch_pair_t;
+
+struct cheatsearch_builder {
+   cheatsearch_pair_t *pairs;
+   size_t count;
+   size_t capacity;
+};
+
+typedef struct {
+   uint8_t *buf;
+   size_t len;
+   size_t cap;
+   bool failed;
+} cheatsearch_buf_t;
+
+// cheatsearch_next_term
+// Pulls the next term out of some text: a lowercased run of letters and digits. Tags and
+// entities are skipped, since titles are HTML. Returns the term length, or 0 at the end
+static size_t cheatsearch_next_term(const char **pp, const char *end, char *term) {
+   const char *p = *pp;
+   size_t len = 0;
+
+   while (p < end) {
+       unsigned char c = *p;
+       if (c == '<') {
+           while (p < end && *p != '>') p++;
+           if (p < end) p++;
+       } else if (c == '&') {
+           p++;
+           while (p < end && (isalnum((unsigned char)*p) || *p == '#')) p++;
+           if (p < end && *p == ';') p++;
+       } else if (c < 0x80 && isalnum(c)) {
+           break;
+       } else {
+           p++;
+       }
+   }
+
+   while (p < end && (unsigned char)*p < 0x80 && isalnum((unsigned char)*p)) {
+       if (len < CHEATSEARCH_TERM_LEN - 1) term[len++] = tolower((unsigned char)*p);
+       p++;
+   }
+   term[len] = '\0';
+
+   *pp = p;
+   return len;
+}
+
+// cheatsearch_builder_new
+// Starts a new index, documents have to be added in order
+cheatsearch_builder_t *cheatsearch_builder_new(void) {
+   return calloc(1, sizeof(cheatsearch_builder_t));
+}
+
+// cheatsearch_add
+// Indexes every term in text under doc
+esp_err_t cheatsearch_add(cheatsearch_builder_t *b, uint32_t doc, const char *text, size_t len) {
+   const char *p = text;
+   const char *end = text + len;
+   char term[CHEATSEARCH_TERM_LEN];
+
+   while (cheatsearch_next_term(&p, end, term) > 0) {
+       if (b->count == b->capacity) {
+           size_t new_cap = b->capacity ? b->capacity * 2 : 1024;
+           cheatsearch_pair_t *tmp = heap_caps_realloc(b->pairs, new_cap * sizeof(cheatsearch_pair_t),
+                                                       MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+           if (!tmp) return ESP_ERR_NO_MEM;
+           b->pairs = tmp;
+           b->capacity = new_cap;
+       }
+       memcpy(b->pairs[b->count].term, term, sizeof(term));
+       b->pairs[b->count].doc = doc;
+       b->count++;
+   }
+   return ESP_OK;
+}
+
+static int pair_cmp(const void *a, const void *b) {
+   const cheatsearch_pair_t *pa = a;
+   const cheatsearch_pair_t *pb = b;
+   int cmp = strcmp(pa->term, pb->term);
+   if (cmp != 0) return cmp;
+   return (pa->doc > pb->doc) - (pa->doc < pb->doc);
+}
+
+// buf_put
+// Appends to a growing buffer in PSRAM, remembering if it ever ran out of memory
+static void buf_put(cheatsearch_buf_t *o, const void *data, size_t len) {
+   if (o->failed) return;
+
+   if (o->len + len > o->cap) {
+       size_t new_cap = o->cap ? o->cap * 2 : 4096;
+       while (new_cap < o->len + len) new_cap *= 2;
+       uint8_t *tmp = heap_caps_realloc(o->buf, new_cap, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+       if (!tmp) {
+           o->failed = true;
+           return;
+       }
+       o->buf = tmp;
+       o->cap = new_cap;
+   }
+   memcpy(o->buf + o->len, data, len);
+   o->len += len;
+}
+
+static void buf_put_u32(cheatsearch_buf_t *o, uint32_t v) {
+   uint8_t b[4] = { v & 0xFF, (v >> 8) & 0xFF, (v >> 16) & 0xFF, v >> 24 };
+   buf_put(o, b, 4);
+}
+
+static void buf_put_varint(cheatsearch_buf_t *o, uint32_t v) {
+   uint8_t b[5];
+   size_t n = 0;
+   while (v >= 0x80) {
+       b[n++] = (v & 0x7F) | 0x80;
+       v >>= 7;
+   }
+   b[n++] = v;
+   buf_put(o, b, n);
+}
+
+// cheatsearch_build
+// Sorts everything that was added and lays out the index. Returns it in PSRAM (free it with
+// heap_caps_free), or NULL if we ran out of memory or there was nothing to index
+uint8_t *cheatsearch_build(cheatsearch_builder_t *b, size_t *out_len) {
+   cheatsearch_buf_t terms = {0}, postings = {0}, out = {0};
+   uint32_t *block_off = NULL;
+   uint32_t term_count = 0, block_count = 0;
+
+   if (b->count == 0) return NULL;
+
+   qsort(b->pairs, b->count, sizeof(cheatsearch_pair_t), pair_cmp);
+
+   // One slot per term is plenty for the block offsets
+   block_off = malloc(((b->count + CHEATSEARCH_BLOCK_TERMS - 1) / CHEATSEARCH_BLOCK_TERMS) * sizeof(uint32_t));
+   if (!block_off) return NULL;
+
+   const char *prev = "";
+   size_t i = 0;
+   while (i < b->count) {
+       const char *term = b->pairs[i].term;
+       size_t start = postings.len;
+       uint32_t docs = 0, last = 0;
+
+       for (; i < b->count && strcmp(b->pairs[i].term, term) == 0; i++) {
+           uint32_t doc = b->pairs[i].doc;
+           if (docs > 0 && doc == last) continue;
+           buf_put_varint(&postings, docs > 0 ? doc - last : doc);
+           last = doc;
+           docs++;
+       }
+
+       size_t prefix = 0;
+       if (term_count % CHEATSEARCH_BLOCK_TERMS == 0) {
+           block_off[block_count++] = terms.len;
+           buf_put_varint(&terms, start);
+       } else {
+           while (prev[prefix] && prev[prefix] == term[prefix]) prefix++;
+       }
+
+       uint8_t lens[2] = { prefix, strlen(term) - prefix };
+       buf_put(&terms, lens, 2);
+       buf_put(&terms, term + prefix, lens[1]);
+       buf_put_varint(&terms, docs);
+       buf_put_varint(&terms, postings.len - start);
+
+       prev = term;
+       term_count++;
+   }
+
+   uint32_t blocks_start = CHEATSEARCH_HDR_SIZE + block_count * 4;
+   buf_put_u32(&out, term_count);
+   buf_put_u32(&out, block_count);
+   buf_put_u32(&out, blocks_start + terms.len);
+   for (uint32_t j = 0; j < block_count; j++) buf_put_u32(&out, blocks_start + block_off[j]);
+   buf_put(&out, terms.buf, terms.len);
+   buf_put(&out, postings.buf, postings.len);
+
+   free(block_off);
+   heap_caps_free(terms.buf);
+   heap_caps_free(postings.buf);
+
+   if (terms.failed || postings.failed || out.failed) {
+       heap_caps_free(out.buf);
+       return NULL;
+   }
+
+   ESP_LOGI(CHEATSEARCH_TAG, "Search index: %d terms in %d blocks, %d bytes",
+            (int)term_count, (int)block_count, (int)out.len);
+   *out_len = out.len;
+   return out.buf;
+}
+
+// cheatsearch_builder_free
+// Throws away the builder (not the index it built)
+void cheatsearch_builder_free(cheatsearch_builder_t *b) {
+   if (!b) return;
+   heap_caps_free(b->pairs);
+   free(b);
+}
+
+static uint32_t rd_u32(const uint8_t *p) {
+   return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static bool rd_varint(const uint8_t **pp, const uint8_t *end, uint32_t *v) {
+   const uint8_t *p = *pp;
+   uint32_t result = 0;
+
+   for (int shift = 0; shift < 35 && p < end; shift += 7) {
+       uint8_t c = *p++;
+       result |= (uint32_t)(c & 0x7F) << shift;
+       if (!(c & 0x80)) {
+           *v = result;
+           *pp = p;
+           return true;
+       }
+   }
+   return false;
+}
+
+// cheatsearch_match_word
+// Sets the bit of every document with a term starting with word
+static void cheatsearch_match_word(const uint8_t *blob, size_t blob_len, uint32_t doc_count,
+                                   const char *word, uint8_t *bits) {
+   const uint8_t *end = blob + blob_len;
+   uint32_t block_count = rd_u32(blob + 4);
+   uint32_t postings_off = rd_u32(blob + 8);
+   size_t wlen = strlen(word);
+
+   // Last block whose first term isn't past the word, anything matching starts in there
+   uint32_t lo = 0, hi = block_count, start = 0;
+   while (lo < hi) {
+       uint32_t mid = lo + (hi - lo) / 2;
+       const uint8_t *p = blob + rd_u32(blob + CHEATSEARCH_HDR_SIZE + mid * 4);
+       uint32_t base;
+       char first[CHEATSEARCH_TERM_LEN] = "";
+       if (rd_varint(&p, end, &base) && p + 2 <= end && p[1] < sizeof(first) && p + 2 + p[1] <= end) {
+           memcpy(first, p + 2, p[1]);
+           first[p[1]] = '\0';
+       }
+       if (strcmp(first, word) <= 0) {
+           start = mid;
+           lo = mid + 1;
+       } else {
+           hi = mid;
+       }
+   }
+
+   for (uint32_t blk = start; blk < block_count; blk++) {
+       const uint8_t *p = blob + rd_u32(blob + CHEATSEARCH_HDR_SIZE + blk * 4);
+       const uint8_t *block_end = (blk + 1 < block_count) ?
+                                  blob + rd_u32(blob + CHEATSEARCH_HDR_SIZE + (blk + 1) * 4) :
+                                  blob + postings_off;
+       char term[CHEATSEARCH_TERM_LEN] = "";
+       uint32_t post;
+
+       if (block_end > end || !rd_varint(&p, block_end, &post)) return;
+
+       while (p + 2 <= block_end) {
+           uint8_t prefix = p[0], suffix = p[1];
+           uint32_t docs, plen;
+
+           if (prefix + suffix >= CHEATSEARCH_TERM_LEN || prefix > strlen(term) || p + 2 + suffix > block_end) return;
+           memcpy(term + prefix, p + 2, suffix);
+           term[prefix + suffix] = '\0';
+           p += 2 + suffix;
+           if (!rd_varint(&p, block_end, &docs) || !rd_varint(&p, block_end, &plen)) return;
+
+           if (strncmp(term, word, wlen) == 0) {
+               const uint8_t *q = blob + postings_off + post;
+               const uint8_t *q_end = q + plen;
+               uint32_t doc = 0, delta;
+               if (q_end > end) return;
+               for (uint32_t d = 0; d < docs && rd_varint(&q, q_end, &delta); d++) {
+                   doc += delta;
+                   if (doc < doc_count) bits[doc / 8] |= 1 << (doc % 8);
+               }
+           } else if (strcmp(term, word) > 0) {
+               // Sorted, so nothing after this can match
+               return;
+           }
+           post += plen;
+       }
+   }
+}
+
+// cheatsearch_query
+// Finds the documents where every word of the query matches the start of some term. Up to
+// max_docs of them go into docs (in database order), and *total gets how many there were
+size_t cheatsearch_query(const uint8_t *blob, size_t blob_len, uint32_t doc_count,
+                         const char *query, uint32_t *docs, size_t max_docs, uint32_t *total) {
+   size_t found = 0;
+   size_t words = 0;
+   size_t nbytes = (doc_count + 7) / 8;
+   char word[CHEATSEARCH_TERM_LEN];
+   const char *p = query;
+   const char *end = query + strlen(query);
+
+   *total = 0;
+   if (!blob || blob_len < CHEATSEARCH_HDR_SIZE || doc_count == 0) return 0;
+
+   uint32_t block_count = rd_u32(blob + 4);
+   uint32_t postings_off = rd_u32(blob + 8);
+   if (CHEATSEARCH_HDR_SIZE + (uint64_t)block_count * 4 > blob_len || postings_off > blob_len) return 0;
+
+   uint8_t *result = malloc(nbytes);
+   uint8_t *bits = malloc(nbytes);
+   if (!result || !bits) {
+       free(result);
+       free(bits);
+       return 0;
+   }
+
+   while (words < CHEATSEARCH_MAX_WORDS && cheatsearch_next_term(&p, end, word) > 0) {
+       memset(bits, 0, nbytes);
+       cheatsearch_match_word(blob, blob_len, doc_count, word, bits);
+       if (words == 0) {
+           memcpy(result, bits, nbytes);
+       } else {
+           for (size_t i = 0; i < nbytes; i++) result[i] &= bits[i];
+       }
+       words++;
+   }
+
+   for (uint32_t doc = 0; words > 0 && doc < doc_count; doc++) {
+       if (!(result[doc / 8] & (1 << (doc % 8)))) continue;
+       if (found < max_docs) docs[found++] = doc;
+       (*total)++;
+   }
+
+   free(result);
+   free(bits);
+   return found;
+}
+
+// cheatsearch_clean_query
+// Boils the query down to just the words we search for, which is also safe to echo back
+static void cheatsearch_clean_query(const char *query, char *out, size_t size) {
+   const char *p = query;
+   const char *end = query + strlen(query);
+   char word[CHEATSEARCH_TERM_LEN];
+   size_t len = 0, words = 0;
+
+   out[0] = '\0';
+   while (words < CHEATSEARCH_MAX_WORDS && cheatsearch_next_term(&p, end, word) > 0) {
+       int n = snprintf(out + len, size - len, "%s%s", words ? " " : "", word);
+       if (n < 0 || (size_t)n >= size - len) break;
+       len += n;
+       words++;
+   }
+}
+
+// cheatsearch_handler
+// Serves CHEATSEARCH_PATH?q=words, a small page with the matching games linked to their
+// cheat pages in the offline database. Meant to be a few hundred bytes over the modem where
+// the alphabetical index pages are tens of KB
+esp_err_t cheatsearch_handler(httpd_req_t *req) {
+   char qs[192];
+   char raw[96] = "";
+   char query[96];
+   uint32_t total = 0;
+   size_t count = 0;
+   tpl_writer_t w;
+
+   if (httpd_req_get_url_query_str(req, qs, sizeof(qs)) == ESP_OK) {
+       httpd_query_key_value(qs, "q", raw, sizeof(raw));
+   }
+
+   // Undo the form encoding, anything that isn't a letter or digit is a separator anyway
+   for (char *s = raw, *d = raw; ; s++) {
+       if (*s == '+') {
+           *d++ = ' ';
+       } else if (*s == '%' && isxdigit((unsigned char)s[1]) && isxdigit((unsigned char)s[2])) {
+           char hex[3] = { s[1], s[2], 0 };
+           *d++ = (char)strtol(hex, NULL, 16);
+           s += 2;
+       } else {
+           *d++ = *s;
+           if (*s == '\0') break;
+       }
+   }
+   cheatsearch_clean_query(raw, query, sizeof(query));
+
+   cheatdb_result_t *results = NULL;
+   if (query[0]) {
+       results = malloc(CHEATSEARCH_MAX_RESULTS * sizeof(cheatdb_result_t));
+       if (!results) {
+           httpd_resp_send_err(req, 500, "malloc failed");
+           return ESP_FAIL;
+       }
+       count = cheatdb_search(query, results, CHEATSEARCH_MAX_RESULTS, &total);
+   }
+
+   tpl_search_head_args_t head = { .action = CHEATSEARCH_PATH, .query = query };
+   tpl_begin(&w, req, "text/html");
+   tpl_search_head(&w, &head);
+
+   if (!query[0]) {
+       tpl_search_hint(&w);
+   } else if (total == 0) {
+       if (cheatdb_searchable()) tpl_search_none(&w);
+       else tpl_search_none_unsynced(&w);
+   } else {
+       tpl_search_count_args_t found = {
+           .total = total,
+           .more = total > count ? ", showing the first ones" : "",
+       };
+       tpl_search_count(&w, &found);
+   }
+
+   for (size_t i = 0; i < count; i++) {
+       tpl_search_row_args_t row = { .path = results[i].path, .title = results[i].title };
+       tpl_search_row(&w, &row);
+   }
+   tpl_search_tail(&w);
+
+   ESP_LOGI(CHEATSEARCH_TAG, "Search '%s': %u results", query, (unsigned)total);
+
+   free(results);
+   return tpl_end(&w);
+}
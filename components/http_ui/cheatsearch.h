@@ -0,0 +1,45 @@
+// Cheat search config
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "esp_http_server.h"
+
+// Path of the search page, it lives with the rest of the Gamerz pages so it goes through the
+// same handler (and the same DNS redirect) as everything else
+#define CHEATSEARCH_PATH "/cheats/gameshark/n64/search.html"
+
+// Longest term kept in the index, longer words are cut down to this (less the NUL), which is
+// fine since every query word is matched as a prefix anyway
+#define CHEATSEARCH_TERM_LEN 24
+
+// Terms per front coded block, only the first term of a block is stored whole so a lookup
+// binary searches the blocks and then walks at most this many terms
+#define CHEATSEARCH_BLOCK_TERMS 16
+
+// Words in a query past this are ignored, every word has to match for a page to show up
+#define CHEATSEARCH_MAX_WORDS 4
+
+// Most results on one page, at around 60 bytes a link this keeps the page small
+#define CHEATSEARCH_MAX_RESULTS 30
+
+typedef struct cheatsearch_builder cheatsearch_builder_t;
+
+// prototypes
+cheatsearch_builder_t *cheatsearch_builder_new(void);
+esp_err_t cheatsearch_add(cheatsearch_builder_t *b, uint32_t doc, const char *text, size_t len);
+uint8_t *cheatsearch_build(cheatsearch_builder_t *b, size_t *out_len);
+void cheatsearch_builder_free(cheatsearch_builder_t *b);
+size_t cheatsearch_query(const uint8_t *blob, size_t blob_len, uint32_t doc_count,
+                         const char *query, uint32_t *docs, size_t max_docs, uint32_t *total);
+esp_err_t cheatsearch_handler(httpd_req_t *req);
+
+#ifdef __cplusplus
+}
+#endif
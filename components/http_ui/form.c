@@ -0,0 +1,268 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include "esp_log.h"
+#include "esp_http_server.h"
+
+#include "form.h"
+
+static const char *FORM_TAG = "FORM";
+
+// Size of the perfect hash table, see form_hash
+#define FORM_HASH_SIZE 32
+
+static const char *const form_names[FORM_FIELD_COUNT] = {
+   [FORM_SSID]        = "ssid",
+   [FORM_PASS]        = "pass",
+   [FORM_SMTP_SERVER] = "smtp_server",
+   [FORM_SMTP_PORT]   = "smtp_port",
+   [FORM_IMAP_SERVER] = "imap_server",
+   [FORM_IMAP_PORT]   = "imap_port",
+   [FORM_USERNAME]    = "username",
+   [FORM_PASSWORD]    = "password",
+   [FORM_WARM]        = "warm",
+   [FORM_T_NAME1]     = "t_name1",
+   [FORM_T_NAME2]     = "t_name2",
+   [FORM_T_PASSWORD1] = "t_password1",
+   [FORM_T_PASSWORD2] = "t_password2",
+   [FORM_DFROM]       = "DFrom",
+   [FORM_DTO]         = "DTo",
+   [FORM_DEMAILID]    = "DEmailID",
+   [FORM_DSUBJECT]    = "DSubject",
+   [FORM_BODY]        = "Body",
+};
+
+// Which field (plus one, zero is empty) each hash lands on. The constants in form_hash were
+// searched for so that no two of the names above collide, adding a name means finding new ones
+// and redoing this table
+static const uint8_t form_slots[FORM_HASH_SIZE] = {
+   [3]  = FORM_T_PASSWORD1 + 1,
+   [4]  = FORM_WARM + 1,
+   [8]  = FORM_DSUBJECT + 1,
+   [9]  = FORM_BODY + 1,
+   [11] = FORM_SMTP_SERVER + 1,
+   [13] = FORM_IMAP_SERVER + 1,
+   [14] = FORM_T_PASSWORD2 + 1,
+   [15] = FORM_DFROM + 1,
+   [17] = FORM_PASS + 1,
+   [19] = FORM_T_NAME1 + 1,
+   [21] = FORM_SSID + 1,
+   [22] = FORM_USERNAME + 1,
+   [24] = FORM_DEMAILID + 1,
+   [25] = FORM_SMTP_PORT + 1,
+   [27] = FORM_IMAP_PORT + 1,
+   [28] = FORM_PASSWORD + 1,
+   [29] = FORM_DTO + 1,
+   [30] = FORM_T_NAME2 + 1,
+};
+
+// form_hash
+// Length, first and last character are enough to tell all of our names apart
+static unsigned form_hash(const char *key, size_t len) {
+   return (len * 4 + (uint8_t)key[0] * 3 + (uint8_t)key[len - 1] * 11) % FORM_HASH_SIZE;
+}
+
+// form_lookup
+// Maps a field name to one of ours, or -1 if it isn't one
+static int form_lookup(const char *key, size_t len) {
+   if (len == 0) return -1;
+
+   int slot = form_slots[form_hash(key, len)];
+   if (slot == 0 || strcmp(form_names[slot - 1], key) != 0) return -1;
+   return slot - 1;
+}
+
+// form_hex
+static int form_hex(char c) {
+   if (c >= '0' && c <= '9') return c - '0';
+   if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+   if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+   return -1;
+}
+
+// form_put
+static esp_err_t form_put(form_t *form, char c) {
+   if (form->out >= form->limit) return ESP_ERR_INVALID_SIZE;
+   *form->out++ = c;
+   return ESP_OK;
+}
+
+// form_end_pair
+// Closes off the field being decoded. One without an '=' is dropped, and if a name shows up
+// more than once the first one wins
+static esp_err_t form_end_pair(form_t *form) {
+   if (!form->value) {
+       form->out = form->key;
+       return ESP_OK;
+   }
+
+   esp_err_t err = form_put(form, '\0');
+   if (err != ESP_OK) return err;
+
+   if (form->count < FORM_MAX_FIELDS) {
+       form->pairs[form->count].key = form->key;
+       form->pairs[form->count].value = form->value;
+       form->count++;
+   }
+
+   int field = form_lookup(form->key, form->value - form->key - 1);
+   if (field >= 0 && !form->values[field]) form->values[field] = form->value;
+
+   form->key = form->out;
+   form->value = NULL;
+   return ESP_OK;
+}
+
+// form_flush_esc
+// A '%' that didn't turn out to be an escape is kept as it was
+static esp_err_t form_flush_esc(form_t *form) {
+   esp_err_t err = ESP_OK;
+
+   if (form->esc >= 1) err = form_put(form, '%');
+   if (form->esc == 2 && err == ESP_OK) err = form_put(form, form->esc_raw);
+   form->esc = 0;
+   return err;
+}
+
+// form_begin
+// Starts decoding a form into buf, which has to have room for at least the raw body plus one.
+// Nothing decoded ever gets ahead of the raw body, so buf can also be where the body is
+esp_err_t form_begin(form_t *form, char *buf, size_t size) {
+   memset(form, 0, sizeof(*form));
+   if (!buf || size == 0) return ESP_ERR_INVALID_ARG;
+
+   form->body = buf;
+   form->out = buf;
+   form->limit = buf + size;
+   form->key = buf;
+   return ESP_OK;
+}
+
+// form_feed
+// Decodes the next piece of a body. The pieces can be split anywhere, even in the middle of an
+// escape, so this can be handed whatever each receive got
+esp_err_t form_feed(form_t *form, const char *data, size_t len) {
+   esp_err_t err = ESP_OK;
+
+   for (size_t i = 0; i < len && err == ESP_OK; i++) {
+       char c = data[i];
+
+       if (form->esc) {
+           int v = form_hex(c);
+           if (v >= 0 && form->esc == 1) {
+               form->esc_raw = c;
+               form->esc = 2;
+               continue;
+           }
+           if (v >= 0) {
+               err = form_put(form, (char)(form_hex(form->esc_raw) << 4 | v));
+               form->esc = 0;
+               continue;
+           }
+           err = form_flush_esc(form);
+           if (err != ESP_OK) break;
+       }
+
+       if (c == '%') {
+           form->esc = 1;
+       } else if (c == '&') {
+           err = form_end_pair(form);
+       } else if (c == '=' && !form->value) {
+           err = form_put(form, '\0');
+           form->value = form->out;
+       } else {
+           err = form_put(form, (c == '+') ? ' ' : c);
+       }
+   }
+
+   return err;
+}
+
+// form_finish
+// Closes off the last field once the whole body is in
+esp_err_t form_finish(form_t *form) {
+   esp_err_t err = form_flush_esc(form);
+   if (err == ESP_OK) err = form_end_pair(form);
+   return err;
+}
+
+// form_parse
+// Decodes a body that's already all in memory, in place
+esp_err_t form_parse(form_t *form, char *body, size_t len) {
+   esp_err_t err = form_begin(form, body, len + 1);
+   if (err == ESP_OK) err = form_feed(form, body, len);
+   if (err == ESP_OK) err = form_finish(form);
+   return err;
+}
+
+// form_read_body
+// Reads a request body a piece at a time as it comes in and hands each piece to sink, so a
+// handler can get going on it before the rest arrives and never needs the whole thing in memory.
+// Bodies longer than max (unless it's 0) are turned away before anything is read
+esp_err_t form_read_body(httpd_req_t *req, size_t max, form_sink_t sink, void *ctx) {
+   char chunk[FORM_RECV_CHUNK];
+   size_t remaining = req->content_len;
+   int retries = 0;
+
+   if (max && remaining > max) {
+       ESP_LOGE(FORM_TAG, "Body too large for %s: %d bytes", req->uri, (int)remaining);
+       return ESP_ERR_INVALID_SIZE;
+   }
+
+   while (remaining > 0) {
+       int r = httpd_req_recv(req, chunk, (remaining < sizeof(chunk)) ? remaining : sizeof(chunk));
+       if (r == HTTPD_SOCK_ERR_TIMEOUT && retries++ < FORM_RECV_RETRIES) continue;
+       if (r <= 0) {
+           ESP_LOGE(FORM_TAG, "Error receiving body for %s: %d", req->uri, r);
+           return ESP_FAIL;
+       }
+       retries = 0;
+
+       esp_err_t err = sink(ctx, chunk, r);
+       if (err != ESP_OK) return err;
+       remaining -= r;
+   }
+
+   return ESP_OK;
+}
+
+// form_sink
+static esp_err_t form_sink(void *ctx, const char *data, size_t len) {
+   return form_feed(ctx, data, len);
+}
+
+// form_recv
+// Receives and decodes a form body as it comes in. The buffer it's decoded into is sized from
+// the Content-Length, which is held to FORM_MAX_BODY, and a client sending more than it said
+// can't write past it
+esp_err_t form_recv(httpd_req_t *req, form_t *form) {
+   memset(form, 0, sizeof(*form));
+
+   if (req->content_len > FORM_MAX_BODY) {
+       ESP_LOGE(FORM_TAG, "Form too large: %d bytes", (int)req->content_len);
+       return ESP_ERR_INVALID_SIZE;
+   }
+
+   char *buf = malloc(req->content_len + 1);
+   if (!buf) return ESP_ERR_NO_MEM;
+
+   esp_err_t err = form_begin(form, buf, req->content_len + 1);
+   form->owned = true;
+   if (err == ESP_OK) err = form_read_body(req, FORM_MAX_BODY, form_sink, form);
+   if (err == ESP_OK) err = form_finish(form);
+   if (err != ESP_OK) form_free(form);
+   return err;
+}
+
+// form_get
+// Returns the decoded value of one of our fields, or NULL if the form didn't have it
+const char *form_get(const form_t *form, form_field_t field) {
+   return form->values[field];
+}
+
+// form_free
+// Only a form from form_recv owns its buffer, one from form_parse is left to the caller
+void form_free(form_t *form) {
+   if (form->owned) free(form->body);
+   memset(form, 0, sizeof(*form));
+}
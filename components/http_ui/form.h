@@ -0,0 +1,90 @@
+// Form decoder config
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "esp_http_server.h"
+
+// Biggest form body we'll take
+#define FORM_MAX_BODY (8 * 1024)
+
+// Max number of fields kept from one form, anything past that is dropped
+#define FORM_MAX_FIELDS 24
+
+// Times in a row a receive that timed out is retried before giving up on the body, the N64 can be
+// slow getting a long email out at 19200bps
+#define FORM_RECV_RETRIES 3
+
+// Most of a request body read from the socket at a time
+#define FORM_RECV_CHUNK 512
+
+// Every field name any of our forms use. Looking one of these up is a single array index, the
+// names are matched to them with a perfect hash as the body is parsed (see form_slots in form.c,
+// which has to be regenerated when one is added)
+typedef enum {
+   FORM_SSID,
+   FORM_PASS,
+   FORM_SMTP_SERVER,
+   FORM_SMTP_PORT,
+   FORM_IMAP_SERVER,
+   FORM_IMAP_PORT,
+   FORM_USERNAME,
+   FORM_PASSWORD,
+   FORM_WARM,
+   FORM_T_NAME1,
+   FORM_T_NAME2,
+   FORM_T_PASSWORD1,
+   FORM_T_PASSWORD2,
+   FORM_DFROM,
+   FORM_DTO,
+   FORM_DEMAILID,
+   FORM_DSUBJECT,
+   FORM_BODY,
+   FORM_FIELD_COUNT
+} form_field_t;
+
+typedef struct {
+   const char *key;
+   const char *value;
+} form_pair_t;
+
+// A decoded form. The body is URL decoded as it comes in, into one buffer that every key and
+// value points into, so the whole form is one allocation no matter how many fields it has. The
+// rest is the decoder's state between pieces of the body
+typedef struct {
+   char *body;
+   size_t count;
+   form_pair_t pairs[FORM_MAX_FIELDS];
+   const char *values[FORM_FIELD_COUNT];
+   char *out;
+   char *limit;
+   char *key;
+   char *value;
+   uint8_t esc;
+   char esc_raw;
+   bool owned;
+} form_t;
+
+// Gets each piece of a request body as it comes off the socket
+typedef esp_err_t (*form_sink_t)(void *ctx, const char *data, size_t len);
+
+// prototypes
+esp_err_t form_read_body(httpd_req_t *req, size_t max, form_sink_t sink, void *ctx);
+esp_err_t form_begin(form_t *form, char *buf, size_t size);
+esp_err_t form_feed(form_t *form, const char *data, size_t len);
+esp_err_t form_finish(form_t *form);
+esp_err_t form_recv(httpd_req_t *req, form_t *form);
+esp_err_t form_parse(form_t *form, char *body, size_t len);
+const char *form_get(const form_t *form, form_field_t field);
+void form_free(form_t *form);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,702 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+#include "esp_http_server.h"
+#include "esp_http_client.h"
+#include "esp_crt_bundle.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "gamegenie.h"
+#include "page_cache.h"
+#include "cheatdb.h"
+#include "cheatsearch.h"
+#include "resp.h"
+#include "worker.h"
+#include "http_pool.h"
+
+static const char *GAMEGENIE_TAG = "GAMEGENIE";
+
+// The page is streamed through these so they're all the proxy needs
+#define GAMEGENIE_READ_SIZE 1024
+#define GAMEGENIE_TITLE_SIZE 256
+#define GAMEGENIE_MARKER_MAX 32
+
+// Starting size of the copy kept for the page cache
+#define GAMEGENIE_CAPTURE_SIZE 4096
+
+// Everything the proxy serves lives under here
+#define GAMEGENIE_BASE_PATH "/cheats/gameshark/n64/"
+
+typedef struct {
+   const char *str;
+   size_t len;
+   size_t matched;
+   uint8_t fail[GAMEGENIE_MARKER_MAX];
+} marker_scan_t;
+
+typedef enum {
+   GG_SEEK_NAME,
+   GG_TITLE,
+   GG_SEEK_CHEATS,
+   GG_CONTENT,
+   GG_DONE
+} gg_state_t;
+
+typedef struct {
+   httpd_req_t *req;
+   gg_state_t state;
+   bool index_page;
+   bool head_sent;
+   esp_err_t err;
+   marker_scan_t scan;
+
+   // Partial <pre> or </pre> tag being held back, and whether we're skipping to the end of one
+   char tag[8];
+   size_t tag_len;
+   bool skip_tag;
+
+   char title[GAMEGENIE_TITLE_SIZE];
+   size_t title_len;
+
+   resp_t out;
+
+   // Copy of everything sent, for the page cache. Grows in PSRAM up to PAGE_CACHE_MAX_PAGE_SIZE
+   bool capture;
+   char *cap;
+   size_t cap_len;
+   size_t cap_size;
+
+   // Validators from the upstream response, kept so the cached page can be revalidated
+   char etag[PAGE_CACHE_VALIDATOR_LEN];
+   char last_modified[PAGE_CACHE_VALIDATOR_LEN];
+
+   char in[GAMEGENIE_READ_SIZE];
+} gg_stream_t;
+
+// marker_init
+// Sets up a scanner for a marker, building the KMP failure table so a partial match
+// can fall back without ever having to look at earlier bytes of the stream again
+static void marker_init(marker_scan_t *m, const char *str) {
+   m->str = str;
+   m->len = strlen(str);
+   m->matched = 0;
+   m->fail[0] = 0;
+
+   for (size_t i = 1, k = 0; i < m->len; i++) {
+       while (k > 0 && str[i] != str[k]) k = m->fail[k - 1];
+       if (str[i] == str[k]) k++;
+       m->fail[i] = k;
+   }
+}
+
+// marker_step
+// Feeds one byte into a marker scanner and returns true once the whole marker has been seen.
+// Bytes that could still be part of the marker are held back, and when they turn out not to be
+// *release is set to how many of them to let through (always the start of the marker), followed
+// by 'c' itself if *release_c is set
+static bool marker_step(marker_scan_t *m, char c, size_t *release, bool *release_c) {
+   size_t before = m->matched;
+
+   while (m->matched > 0 && m->str[m->matched] != c) m->matched = m->fail[m->matched - 1];
+   if (m->str[m->matched] == c) m->matched++;
+
+   *release_c = (m->matched == 0);
+   *release = before + 1 - m->matched - (*release_c ? 1 : 0);
+
+   if (m->matched == m->len) {
+       m->matched = 0;
+       return true;
+   }
+   return false;
+}
+
+// gg_capture
+// Keeps a copy of the output for the page cache, giving up on it if the page gets too big
+static void gg_capture(gg_stream_t *s, const char *data, size_t len) {
+   if (!s->capture) return;
+
+   if (s->cap_len + len > s->cap_size) {
+       size_t size = s->cap_size ? s->cap_size * 2 : GAMEGENIE_CAPTURE_SIZE;
+       while (size < s->cap_len + len) size *= 2;
+
+       char *cap = (size <= PAGE_CACHE_MAX_PAGE_SIZE) ?
+                   heap_caps_realloc(s->cap, size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT) : NULL;
+       if (!cap) {
+           heap_caps_free(s->cap);
+           s->cap = NULL;
+           s->capture = false;
+           return;
+       }
+       s->cap = cap;
+       s->cap_size = size;
+   }
+
+   memcpy(s->cap + s->cap_len, data, len);
+   s->cap_len += len;
+}
+
+// gg_out
+// Output goes to the page cache copy and is buffered for the N64, going out a full segment at a
+// time as the buffer fills
+static void gg_out(gg_stream_t *s, const char *data, size_t len) {
+   if (s->err != ESP_OK) return;
+   gg_capture(s, data, len);
+   if (!s->req) return;
+   resp_write(&s->out, data, len);
+   s->err = s->out.err;
+}
+
+// gg_send_head
+// Starts the page once we have the title. On index pages the title is part of the
+// content too, so it goes out again right after the head
+static void gg_send_head(gg_stream_t *s) {
+   static const char *body_head =
+       "</title></head>"
+       "<center><font size=\"1\">Powered by gamegenie.com</font></center>"
+       // SharkWire color scheme: "<body bgcolor=\"#000099\" text=\"#E0E040\" link=\"#FFCC00\" vlink=\"#FFCC00\" alink=\"#FFCC00\">"
+       "<body bgcolor=\"#FFFFFF\" text=\"#000000\" link=\"#0000FF\" vlink=\"#800080\" alink=\"#FF0000\">"
+       "<font size=\"1\">";
+
+   // Index pages get a search box, which is a lot quicker than paging through them
+   static const char *search_form =
+       "<form method=\"GET\" action=\"" CHEATSEARCH_PATH "\">"
+       "<input type=\"text\" name=\"q\" size=\"16\">"
+       "<input type=\"submit\" value=\"Search\"></form>";
+
+   s->head_sent = true;
+   gg_out(s, "<html><head><title>", strlen("<html><head><title>"));
+   gg_out(s, s->title, s->title_len);
+   gg_out(s, body_head, strlen(body_head));
+   if (s->index_page) {
+       gg_out(s, search_form, strlen(search_form));
+       gg_out(s, s->title, s->title_len);
+   }
+}
+
+// gg_filter_byte
+// This does on the fly what add_line_breaks used to do to the whole page. I didn't like the way
+// it rendered preformatted text, so the <pre> tags get dropped and line breaks are forced instead,
+// because it looked better IMO with the adjusted font. A possible <pre> or </pre> tag is held
+// back (at most 6 bytes) until we know whether it's one
+static void gg_filter_byte(gg_stream_t *s, char c) {
+   if (s->skip_tag) {
+       if (c == '>') s->skip_tag = false;
+       return;
+   }
+
+   if (s->tag_len > 0 || c == '<') {
+       s->tag[s->tag_len++] = c;
+
+       // Skip opening <pre> tags, attributes and all
+       if (s->tag_len == 4 && strncasecmp(s->tag, "<pre", 4) == 0) {
+           s->tag_len = 0;
+           s->skip_tag = true;
+           return;
+       }
+
+       // Skip closing </pre> tag
+       if (s->tag_len == 6 && strncasecmp(s->tag, "</pre>", 6) == 0) {
+           s->tag_len = 0;
+           return;
+       }
+
+       if ((s->tag_len < 4 && strncasecmp(s->tag, "<pre", s->tag_len) == 0) ||
+           (s->tag_len < 6 && strncasecmp(s->tag, "</pre>", s->tag_len) == 0)) {
+           return;
+       }
+
+       // Not a tag we strip, let the '<' through and run the rest back through in case
+       // another '<' in there starts one
+       char held[sizeof(s->tag)];
+       size_t n = s->tag_len;
+       memcpy(held, s->tag, n);
+       s->tag_len = 0;
+       gg_out(s, held, 1);
+       for (size_t i = 1; i < n; i++) gg_filter_byte(s, held[i]);
+       return;
+   }
+
+   // Copy character and insert <br> after newline
+   gg_out(s, &c, 1);
+   if (c == '\n') gg_out(s, "<br>", 4);
+}
+
+// gg_content
+// Passes content bytes on, rewriting them unless it's an index page
+static void gg_content(gg_stream_t *s, const char *data, size_t len) {
+   if (s->index_page) {
+       gg_out(s, data, len);
+       return;
+   }
+   for (size_t i = 0; i < len; i++) gg_filter_byte(s, data[i]);
+}
+
+// gg_title_byte
+// Collects the title, if it's too long for the buffer the page just gets started with what we have
+static void gg_title_byte(gg_stream_t *s, char c) {
+   if (!s->head_sent) {
+       if (s->title_len < sizeof(s->title)) {
+           s->title[s->title_len++] = c;
+           return;
+       }
+       gg_send_head(s);
+   }
+   if (s->index_page) gg_out(s, &c, 1);
+}
+
+// gg_feed
+// Runs one byte of the upstream page through the extractor. The sections we want are
+// "<!-- NAME -->" to "<!-- /NAME -->" for the title, and then on index pages everything from
+// "<!-- NAME -->" to "<!-- DNET LINKS & BANNER -->", or from "<!-- GAME CHEATS -->" on anything else
+static void gg_feed(gg_stream_t *s, char c) {
+   size_t release;
+   bool release_c;
+   bool hit = marker_step(&s->scan, c, &release, &release_c);
+
+   switch (s->state) {
+   case GG_SEEK_NAME:
+       if (hit) {
+           s->state = GG_TITLE;
+           marker_init(&s->scan, "<!-- /NAME -->");
+       }
+       break;
+
+   case GG_TITLE:
+       for (size_t i = 0; i < release; i++) gg_title_byte(s, s->scan.str[i]);
+       if (release_c) gg_title_byte(s, c);
+       if (hit) {
+           if (!s->head_sent) gg_send_head(s);
+           if (s->index_page) {
+               gg_out(s, s->scan.str, s->scan.len);
+               s->state = GG_CONTENT;
+               marker_init(&s->scan, "<!-- DNET LINKS & BANNER -->");
+           } else {
+               s->state = GG_SEEK_CHEATS;
+               marker_init(&s->scan, "<!-- GAME CHEATS -->");
+           }
+       }
+       break;
+
+   case GG_SEEK_CHEATS:
+       if (hit) {
+           s->state = GG_CONTENT;
+           marker_init(&s->scan, "<!-- DNET LINKS & BANNER -->");
+       }
+       break;
+
+   case GG_CONTENT:
+       gg_content(s, s->scan.str, release);
+       if (release_c) gg_content(s, &c, 1);
+       if (hit) {
+           gg_out(s, s->tag, s->tag_len);
+           s->tag_len = 0;
+           s->state = GG_DONE;
+       }
+       break;
+
+   case GG_DONE:
+       break;
+   }
+}
+
+// gg_http_event_handler
+// Picks the validators out of the upstream response headers
+static esp_err_t gg_http_event_handler(esp_http_client_event_t *evt) {
+   gg_stream_t *s = evt->user_data;
+
+   if (evt->event_id == HTTP_EVENT_ON_HEADER && s) {
+       if (strcasecmp(evt->header_key, "ETag") == 0) {
+           snprintf(s->etag, sizeof(s->etag), "%s", evt->header_value);
+       } else if (strcasecmp(evt->header_key, "Last-Modified") == 0) {
+           snprintf(s->last_modified, sizeof(s->last_modified), "%s", evt->header_value);
+       }
+   }
+   return ESP_OK;
+}
+
+// gg_fetch
+// Fetches a page from gamegenie.com and runs it through the extractor. With a request the
+// result goes out to the N64 as it's produced, without one (background revalidation) it's only
+// collected for the cache. The validators turn it into a conditional GET. If out is given the
+// finished page is handed back to the caller (who frees it with heap_caps_free) instead of going
+// into the page cache. Returns the upstream HTTP status, or -1 if the page couldn't be produced (or sent)
+static int gg_fetch(const char *path, httpd_req_t *req, const char *etag, const char *last_modified,
+                    char **out, size_t *out_len) {
+   char *full_url = malloc(1024);
+   if (!full_url) {
+       if (req) httpd_resp_send_err(req, 500, "malloc failed");
+       return -1;
+   }
+
+   snprintf(full_url, 1024, "https://gamegenie.com%s", path);
+
+   gg_stream_t *s = calloc(1, sizeof(gg_stream_t));
+   if (!s) {
+       free(full_url);
+       if (req) httpd_resp_send_err(req, 500, "malloc failed");
+       return -1;
+   }
+
+   esp_http_client_config_t config = {
+       .url = full_url,
+       .crt_bundle_attach = esp_crt_bundle_attach,
+       .timeout_ms = 8000,
+       .event_handler = gg_http_event_handler,
+       .user_data = s,
+   };
+
+   // Pages are fetched one after another as the N64 browses, so the connection to gamegenie.com
+   // is kept open between them instead of doing DNS, TCP and TLS over again for each one
+   esp_http_client_handle_t client = http_pool_get(&config);
+   if (!client) {
+       free(s);
+       free(full_url);
+       if (req) httpd_resp_send_err(req, 502, "client init failed");
+       return -1;
+   }
+
+   // A pooled client still has the last request's validators on it
+   if (etag && etag[0]) esp_http_client_set_header(client, "If-None-Match", etag);
+   else esp_http_client_delete_header(client, "If-None-Match");
+   if (last_modified && last_modified[0]) esp_http_client_set_header(client, "If-Modified-Since", last_modified);
+   else esp_http_client_delete_header(client, "If-Modified-Since");
+
+   if (http_pool_request(client) != ESP_OK) {
+       http_pool_release(client, false);
+       free(s);
+       free(full_url);
+       if (req) httpd_resp_send_err(req, 502, "request failed");
+       return -1;
+   }
+
+   int status = esp_http_client_get_status_code(client);
+   if (status == 304 || (!req && status != 200)) {
+       http_pool_release(client, true);
+       free(s);
+       free(full_url);
+       return status;
+   }
+
+   s->req = req;
+   s->state = GG_SEEK_NAME;
+   s->index_page = strstr(path, "index.html") != NULL;
+   s->capture = (status == 200);
+   marker_init(&s->scan, "<!-- NAME -->");
+
+   if (req) resp_begin(&s->out, req, "text/html");
+
+   bool read_failed = false;
+   while (s->state != GG_DONE && s->err == ESP_OK) {
+       int r = esp_http_client_read(client, s->in, sizeof(s->in));
+       if (r < 0) {
+           read_failed = true;
+           break;
+       } else if (r == 0) {
+           break;
+       }
+
+       // What the extractor produces goes out to the N64 a full segment at a time as it builds up.
+       // gamegenie.com is so much faster than the PPP link that pushing out what we have after
+       // every read would only cut the page into partial segments without getting it there sooner
+       for (int i = 0; i < r && s->state != GG_DONE; i++) gg_feed(s, s->in[i]);
+   }
+
+   free(full_url);
+
+   if (!s->head_sent) {
+       // Nothing has gone out yet, so we can still send a proper error
+       if (req) {
+           if (read_failed) httpd_resp_send_err(req, 502, "read failed");
+           else httpd_resp_send_err(req, 500, "required sections not found");
+       }
+       http_pool_release(client, !read_failed);
+       heap_caps_free(s->cap);
+       free(s);
+       return -1;
+   }
+
+   gg_out(s, "</font></body></html>", strlen("</font></body></html>"));
+   if (req && s->err == ESP_OK) s->err = resp_end(&s->out);
+
+   // Only now that the N64 has the whole page, as giving the connection back can mean reading
+   // through the rest of the upstream one
+   http_pool_release(client, !read_failed);
+
+   // Only a page we got all the way through is worth keeping
+   if (s->capture && s->state == GG_DONE) {
+       if (out) {
+           *out = s->cap;
+           *out_len = s->cap_len;
+           s->cap = NULL;
+       } else {
+           page_cache_put(path, s->cap, s->cap_len, s->etag, s->last_modified);
+       }
+   } else if (!req) {
+       status = -1;
+   }
+   if (s->err != ESP_OK) status = -1;
+
+   heap_caps_free(s->cap);
+   free(s);
+   return status;
+}
+
+// gg_revalidate
+// Used by page_cache_task to check a cached page with a conditional GET
+static int gg_revalidate(const char *path, const char *etag, const char *last_modified) {
+   return gg_fetch(path, NULL, etag, last_modified, NULL, NULL);
+}
+
+// gamegenie_init
+// Sets up the page cache for the proxy, page_cache_task does the background revalidation
+void gamegenie_init(void) {
+   page_cache_init(gg_revalidate);
+}
+
+// Sync state, shown on the config page
+static volatile bool sync_running = false;
+static volatile uint32_t sync_pages = 0;
+static volatile uint32_t sync_total = 0;
+
+// gg_resolve_link
+// Turns an href from a proxied page into a path on gamegenie.com, relative links are resolved
+// against the page they came from. Returns false for anything that isn't another page under
+// the N64 section (other hosts, anchors, images and so on)
+static bool gg_resolve_link(const char *page_path, const char *href, size_t href_len, char *out, size_t size) {
+   static const char *hosts[] = { "https://gamegenie.com", "http://gamegenie.com",
+                                  "https://www.gamegenie.com", "http://www.gamegenie.com" };
+   char link[CHEATDB_PATH_LEN];
+
+   if (href_len == 0 || href_len >= sizeof(link)) return false;
+   memcpy(link, href, href_len);
+   link[href_len] = '\0';
+
+   // Drop any fragment or query, the proxy doesn't care about either
+   link[strcspn(link, "#?")] = '\0';
+   if (link[0] == '\0') return false;
+
+   const char *p = link;
+   for (size_t i = 0; i < sizeof(hosts) / sizeof(hosts[0]); i++) {
+       size_t n = strlen(hosts[i]);
+       if (strncasecmp(p, hosts[i], n) == 0 && (p[n] == '/' || p[n] == '\0')) {
+           p += n;
+           break;
+       }
+   }
+   if (strstr(p, "://") || strncasecmp(p, "mailto:", 7) == 0 || strncasecmp(p, "javascript:", 11) == 0) {
+       return false;
+   }
+
+   if (p[0] == '/') {
+       snprintf(out, size, "%s", p);
+   } else {
+       // Relative to the directory the page is in
+       const char *slash = strrchr(page_path, '/');
+       int dir_len = slash ? (int)(slash - page_path) + 1 : 0;
+       if (snprintf(out, size, "%.*s%s", dir_len, page_path, p) >= (int)size) return false;
+   }
+
+   if (strstr(out, "..") || strstr(out, "/./")) return false;
+   if (strncmp(out, GAMEGENIE_BASE_PATH, strlen(GAMEGENIE_BASE_PATH)) != 0) return false;
+
+   size_t len = strlen(out);
+   return (len > 5 && strcasecmp(out + len - 5, ".html") == 0) ||
+          (len > 4 && strcasecmp(out + len - 4, ".htm") == 0);
+}
+
+// gg_collect_links
+// Adds every new page linked from html to the crawl list
+static void gg_collect_links(const char *page_path, const char *html, size_t len,
+                             char (*paths)[CHEATDB_PATH_LEN], uint32_t *count) {
+   const char *end = html + len;
+   const char *p = html;
+
+   while (*count < GAMEGENIE_SYNC_MAX_PAGES && p + 5 < end) {
+       if (strncasecmp(p, "href=", 5) != 0) {
+           p++;
+           continue;
+       }
+       p += 5;
+
+       const char *value = p;
+       const char *value_end;
+       if (*p == '"' || *p == '\'') {
+           char quote = *p;
+           value = ++p;
+           while (p < end && *p != quote) p++;
+       } else {
+           while (p < end && *p != ' ' && *p != '>') p++;
+       }
+       value_end = p;
+
+       char path[CHEATDB_PATH_LEN];
+       if (!gg_resolve_link(page_path, value, value_end - value, path, sizeof(path))) continue;
+
+       bool seen = false;
+       for (uint32_t i = 0; i < *count && !seen; i++) seen = (strcmp(paths[i], path) == 0);
+       if (!seen) {
+           memcpy(paths[*count], path, sizeof(path));
+           (*count)++;
+       }
+   }
+}
+
+// gamegenie_sync_task
+// Crawls the N64 section of gamegenie.com starting at the index, runs every page through the
+// same extractor the proxy uses and writes the results into the offline cheat database. The
+// current database is served until the new one is finished, so a sync that can't reach
+// gamegenie.com or fails part way leaves it alone
+static void gamegenie_sync_task(void *arg) {
+   char (*paths)[CHEATDB_PATH_LEN] = heap_caps_calloc(GAMEGENIE_SYNC_MAX_PAGES, CHEATDB_PATH_LEN,
+                                                      MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+   cheatdb_writer_t *w = NULL;
+   uint32_t count = 1;
+
+   if (!paths) {
+       ESP_LOGE(GAMEGENIE_TAG, "Not enough memory for the sync crawl list");
+       goto done;
+   }
+   snprintf(paths[0], CHEATDB_PATH_LEN, "%sindex.html", GAMEGENIE_BASE_PATH);
+
+   for (uint32_t i = 0; i < count; i++) {
+       char *html = NULL;
+       size_t len = 0;
+
+       int status = gg_fetch(paths[i], NULL, NULL, NULL, &html, &len);
+       if (status != 200 || !html) {
+           ESP_LOGW(GAMEGENIE_TAG, "Sync: couldn't fetch %s (%d)", paths[i], status);
+           heap_caps_free(html);
+           if (i == 0) goto done;
+           continue;
+       }
+
+       gg_collect_links(paths[i], html, len, paths, &count);
+       sync_total = count;
+
+       if (!w && !(w = cheatdb_write_begin())) {
+           heap_caps_free(html);
+           goto done;
+       }
+
+       esp_err_t err = cheatdb_write_page(w, paths[i], html, len);
+       heap_caps_free(html);
+       if (err != ESP_OK) {
+           // Most likely the partition is full, keep what fits
+           ESP_LOGW(GAMEGENIE_TAG, "Sync: stopping at %s: %s", paths[i], esp_err_to_name(err));
+           break;
+       }
+       sync_pages++;
+
+       // Go easy on gamegenie.com
+       vTaskDelay(pdMS_TO_TICKS(GAMEGENIE_SYNC_DELAY_MS));
+   }
+
+   if (w) {
+       if (cheatdb_write_finish(w) == ESP_OK) {
+           ESP_LOGI(GAMEGENIE_TAG, "Sync finished, %u pages in the cheat database", (unsigned)sync_pages);
+       } else {
+           ESP_LOGE(GAMEGENIE_TAG, "Sync failed writing the cheat database");
+       }
+   }
+
+done:
+   heap_caps_free(paths);
+   sync_running = false;
+   vTaskDelete(NULL);
+}
+
+// gamegenie_sync_start
+// Kicks off a cheat database sync unless one is already going
+esp_err_t gamegenie_sync_start(void) {
+   if (sync_running) return ESP_ERR_INVALID_STATE;
+
+   sync_running = true;
+   sync_pages = 0;
+   sync_total = 0;
+   if (xTaskCreate(gamegenie_sync_task, "gg_sync", GAMEGENIE_SYNC_TASK_SIZE, NULL,
+                   GAMEGENIE_SYNC_TASK_PRI, NULL) != pdPASS) {
+       sync_running = false;
+       return ESP_ERR_NO_MEM;
+   }
+   return ESP_OK;
+}
+
+// gamegenie_sync_status
+// Returns whether a sync is running, along with how far it's got
+bool gamegenie_sync_status(uint32_t *pages, uint32_t *total) {
+   if (pages) *pages = sync_pages;
+   if (total) *total = sync_total;
+   return sync_running;
+}
+
+// gamegenie_fetch_handler
+// A page that has to come from gamegenie.com, run on the worker pool since it takes a while
+static esp_err_t gamegenie_fetch_handler(httpd_req_t *req) {
+   int status = gg_fetch(req->uri, req, NULL, NULL, NULL, NULL);
+   return (status < 0) ? ESP_FAIL : ESP_OK;
+}
+
+static worker_job_t gamegenie_fetch_job = {
+   .name = "gamegenie",
+   .handler = gamegenie_fetch_handler,
+};
+
+// gamegenie_proxy_handler
+// Basically this handles access to gamegenie.com which we use for the 
+// "Gamerz" Sharkwire home page link, and this works by going directly to the N64 gameshark
+// section of the gamegenie.com website via the Gamerz link, then that causes our custom DNS
+// server to point to ESP32, which then causes it to go here via a registered handler for the
+// specified path. When that happens, ESP32 will then reach out to the HTTPS version of the site
+// and extract the needed HTML sections in order to build a (hopefully) Sharkwire online compatible
+// stripped down interface that renders in the content section of our Sharkwire Online home page.
+//
+// The page is never held in memory, each piece that comes in from upstream is run through the
+// extractor and whatever it produces goes out to the N64 as soon as there's a segment's worth.
+// This assumes the NAME section comes before the GAME CHEATS section, which it does on every
+// page I've seen.
+//
+// Cheat pages almost never change, so the finished pages are kept in the page cache and served
+// from there, with the cache checking them with gamegenie.com in the background. Anything in the
+// offline cheat database is served straight out of flash before either of those. Those are all
+// answered right here, only the trip to gamegenie.com is handed to the worker pool
+esp_err_t gamegenie_proxy_handler(httpd_req_t *req) {
+   const char *base_path = GAMEGENIE_BASE_PATH;
+   const char *request_path = req->uri;
+
+   if (strncmp(request_path, base_path, strlen(base_path)) != 0) {
+       httpd_resp_send_err(req, 400, "invalid path");
+       return ESP_FAIL;
+   }
+
+   // Search is answered from the index in the offline database, never from upstream
+   size_t search_len = strlen(CHEATSEARCH_PATH);
+   if (strncmp(request_path, CHEATSEARCH_PATH, search_len) == 0 &&
+       (request_path[search_len] == '\0' || request_path[search_len] == '?')) {
+       return cheatsearch_handler(req);
+   }
+
+   // The offline database comes first, it's right there in flash and doesn't need PPP up
+   const char *data;
+   size_t len;
+   if (cheatdb_lookup(request_path, &data, &len)) {
+       ESP_LOGI(GAMEGENIE_TAG, "Cheat database hit: %s", request_path);
+       esp_err_t err = resp_send(req, "text/html", data, len);
+       cheatdb_release();
+       return err;
+   }
+
+   page_cache_page_t *page = page_cache_get(request_path);
+   if (page) {
+       ESP_LOGI(GAMEGENIE_TAG, "Cache hit: %s", request_path);
+       esp_err_t err = resp_send(req, "text/html", page->data, page->len);
+       page_cache_release(page);
+       return err;
+   }
+
+   return worker_submit(req, &gamegenie_fetch_job);
+}
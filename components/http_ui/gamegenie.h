@@ -0,0 +1,36 @@
+// gamegenie.com proxy
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "esp_http_server.h"
+
+// Most pages a cheat database sync will crawl, the crawl list lives in PSRAM
+#define GAMEGENIE_SYNC_MAX_PAGES 1024
+
+// Pause between page fetches during a sync so we don't hammer gamegenie.com
+#define GAMEGENIE_SYNC_DELAY_MS 250
+
+// Set the task size for the cheat database sync task, it
+// crawls gamegenie.com over HTTPS and writes to flash
+#define GAMEGENIE_SYNC_TASK_SIZE 8192
+
+// Set the task priority for the cheat database sync task,
+// it's background work so it stays below the HTTP server
+#define GAMEGENIE_SYNC_TASK_PRI 4
+
+// prototypes
+void gamegenie_init(void);
+esp_err_t gamegenie_proxy_handler(httpd_req_t *req);
+esp_err_t gamegenie_sync_start(void);
+bool gamegenie_sync_status(uint32_t *pages, uint32_t *total);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,298 @@
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_http_client.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "http_pool.h"
+
+static const char *HTTP_POOL_TAG = "HTTP_POOL";
+
+// One pooled client. A slot is empty when it has no client and isn't busy, idle when it has a
+// client that isn't busy. While busy it belongs to whoever got it from http_pool_get, which is
+// what makes it safe for them to touch handler and user_data without the lock
+typedef struct {
+   esp_http_client_handle_t client;
+   char host[HTTP_POOL_HOST_LEN];
+   bool busy;
+   bool reused;
+   bool close;
+   uint32_t uses;
+   int64_t idle_us;
+
+   // The caller's event handler, every event goes through http_pool_event on its way there
+   http_event_handle_cb handler;
+   void *user_data;
+} http_pool_conn_t;
+
+static http_pool_conn_t conns[HTTP_POOL_CONNS];
+static SemaphoreHandle_t pool_lock = NULL;
+static http_pool_stats_t pool_stats = {0};
+
+// http_pool_host
+// The scheme://host:port part of a URL, that's what a connection can be used again for
+static bool http_pool_host(const char *url, char *out, size_t size) {
+   const char *p = url ? strstr(url, "://") : NULL;
+   if (!p) return false;
+
+   size_t len = (p + 3 - url) + strcspn(p + 3, "/?#");
+   if (len >= size) return false;
+   memcpy(out, url, len);
+   out[len] = '\0';
+   return true;
+}
+
+// http_pool_event
+// Watches for the server saying it's going to close the connection, then hands the event on to
+// the caller's handler with the caller's user_data
+static esp_err_t http_pool_event(esp_http_client_event_t *evt) {
+   http_pool_conn_t *conn = evt->user_data;
+
+   if (evt->event_id == HTTP_EVENT_ON_HEADER && strcasecmp(evt->header_key, "Connection") == 0 &&
+       strcasestr(evt->header_value, "close")) {
+       conn->close = true;
+   }
+
+   if (!conn->handler) return ESP_OK;
+   evt->user_data = conn->user_data;
+   esp_err_t err = conn->handler(evt);
+   evt->user_data = conn;
+   return err;
+}
+
+// http_pool_find
+// The slot a client came from, NULL if it isn't one of the pool's
+static http_pool_conn_t *http_pool_find(esp_http_client_handle_t client) {
+   http_pool_conn_t *conn = NULL;
+
+   if (!pool_lock) return NULL;
+   xSemaphoreTake(pool_lock, portMAX_DELAY);
+   for (int i = 0; i < HTTP_POOL_CONNS; i++) {
+       if (conns[i].busy && conns[i].client == client) {
+           conn = &conns[i];
+           break;
+       }
+   }
+   xSemaphoreGive(pool_lock);
+   return conn;
+}
+
+// http_pool_expire
+// Takes idle connections that have sat too long out of the pool, they go into closing for the
+// caller to clean up once the lock is let go. Must be called with pool_lock held
+static void http_pool_expire(int64_t now, esp_http_client_handle_t *closing, size_t *nclosing) {
+   for (int i = 0; i < HTTP_POOL_CONNS; i++) {
+       http_pool_conn_t *c = &conns[i];
+       if (c->client && !c->busy && now - c->idle_us > (int64_t)HTTP_POOL_IDLE_S * 1000000) {
+           closing[(*nclosing)++] = c->client;
+           c->client = NULL;
+           c->host[0] = '\0';
+           pool_stats.expired++;
+           pool_stats.idle--;
+       }
+   }
+}
+
+// http_pool_pick
+// An idle connection to host if there is one, or else an empty slot for a new one (closing the
+// idle connection used longest ago to make one if it has to). NULL if every slot is busy. Must
+// be called with pool_lock held
+static http_pool_conn_t *http_pool_pick(const char *host, esp_http_client_handle_t *closing,
+                                        size_t *nclosing) {
+   http_pool_conn_t *empty = NULL;
+   http_pool_conn_t *oldest = NULL;
+
+   for (int i = 0; i < HTTP_POOL_CONNS; i++) {
+       http_pool_conn_t *c = &conns[i];
+       if (c->busy) continue;
+       if (c->client && strcmp(c->host, host) == 0) {
+           c->busy = true;
+           c->reused = true;
+           pool_stats.idle--;
+           return c;
+       }
+       if (!c->client && !empty) empty = c;
+       if (c->client && (!oldest || c->idle_us < oldest->idle_us)) oldest = c;
+   }
+
+   if (!empty && oldest) {
+       closing[(*nclosing)++] = oldest->client;
+       oldest->client = NULL;
+       pool_stats.idle--;
+       empty = oldest;
+   }
+   if (empty) {
+       snprintf(empty->host, sizeof(empty->host), "%s", host);
+       empty->busy = true;
+       empty->reused = false;
+       empty->uses = 0;
+   }
+   return empty;
+}
+
+// http_pool_send
+// Sends the request and reads the response headers
+static esp_err_t http_pool_send(esp_http_client_handle_t client) {
+   if (esp_http_client_open(client, 0) != ESP_OK) return ESP_FAIL;
+   if (esp_http_client_fetch_headers(client) < 0) return ESP_FAIL;
+   return ESP_OK;
+}
+
+// http_pool_drain
+// Reads through what's left of the response so the next request on the connection starts at
+// the next response. Returns false if that's more than it's worth or the read fails
+static bool http_pool_drain(esp_http_client_handle_t client) {
+   char buf[256];
+   size_t drained = 0;
+
+   // These never have a body, whatever the headers say
+   int status = esp_http_client_get_status_code(client);
+   if ((status >= 100 && status < 200) || status == 204 || status == 304) return true;
+
+   while (!esp_http_client_is_complete_data_received(client) && drained < HTTP_POOL_DRAIN_MAX) {
+       int r = esp_http_client_read(client, buf, sizeof(buf));
+       if (r <= 0) break;
+       drained += r;
+   }
+   return esp_http_client_is_complete_data_received(client);
+}
+
+// http_pool_init
+// Call before anything fetches
+void http_pool_init(void) {
+   pool_lock = xSemaphoreCreateMutex();
+   if (!pool_lock) ESP_LOGE(HTTP_POOL_TAG, "Failed to create the pool lock, every fetch gets a new connection");
+}
+
+// http_pool_get
+// Gets a client for config like esp_http_client_init, one that's still connected to the same
+// server from an earlier request if there is one. Headers set on it by an earlier request are
+// still there, so set or esp_http_client_delete_header every one the request uses. Make the
+// request with http_pool_request and give it back with http_pool_release
+esp_http_client_handle_t http_pool_get(const esp_http_client_config_t *config) {
+   esp_http_client_handle_t closing[HTTP_POOL_CONNS];
+   size_t nclosing = 0;
+   http_pool_conn_t *conn = NULL;
+   char host[HTTP_POOL_HOST_LEN];
+
+   if (pool_lock && http_pool_host(config->url, host, sizeof(host))) {
+       int64_t now = esp_timer_get_time();
+       xSemaphoreTake(pool_lock, portMAX_DELAY);
+       http_pool_expire(now, closing, &nclosing);
+       conn = http_pool_pick(host, closing, &nclosing);
+       xSemaphoreGive(pool_lock);
+   }
+   for (size_t i = 0; i < nclosing; i++) esp_http_client_cleanup(closing[i]);
+
+   if (!conn) return esp_http_client_init(config);
+
+   conn->handler = config->event_handler;
+   conn->user_data = config->user_data;
+   conn->close = false;
+
+   if (conn->client) {
+       // Still connected, only the request changes
+       esp_http_client_set_url(conn->client, config->url);
+       esp_http_client_set_method(conn->client, config->method);
+       if (config->timeout_ms) esp_http_client_set_timeout_ms(conn->client, config->timeout_ms);
+       return conn->client;
+   }
+
+   esp_http_client_config_t pooled = *config;
+   pooled.event_handler = http_pool_event;
+   pooled.user_data = conn;
+   esp_http_client_handle_t client = esp_http_client_init(&pooled);
+
+   xSemaphoreTake(pool_lock, portMAX_DELAY);
+   if (client) {
+       conn->client = client;
+   } else {
+       conn->host[0] = '\0';
+       conn->busy = false;
+   }
+   xSemaphoreGive(pool_lock);
+   return client;
+}
+
+// http_pool_request
+// Sends the request and reads the response headers, like esp_http_client_open and
+// esp_http_client_fetch_headers. A kept connection the server has closed since is only found
+// out about here, so that gets one more try on a new connection
+esp_err_t http_pool_request(esp_http_client_handle_t client) {
+   http_pool_conn_t *conn = http_pool_find(client);
+   bool reused = conn && conn->reused;
+
+   esp_err_t err = http_pool_send(client);
+   if (err != ESP_OK && reused) {
+       ESP_LOGI(HTTP_POOL_TAG, "Kept connection to %s was closed, reconnecting", conn->host);
+       esp_http_client_close(client);
+       conn->close = false;
+       reused = false;
+       xSemaphoreTake(pool_lock, portMAX_DELAY);
+       pool_stats.stale++;
+       xSemaphoreGive(pool_lock);
+       err = http_pool_send(client);
+   }
+
+   if (pool_lock) xSemaphoreTake(pool_lock, portMAX_DELAY);
+   if (reused) pool_stats.reused++;
+   else pool_stats.opened++;
+   if (conn) {
+       conn->uses = reused ? conn->uses + 1 : 1;
+       conn->reused = true;
+   }
+   if (pool_lock) xSemaphoreGive(pool_lock);
+   return err;
+}
+
+// http_pool_release
+// Gives a client from http_pool_get back. reuse is whether the response went as it should,
+// if so and the server didn't say otherwise the connection is kept open for the next request
+// to the same server
+void http_pool_release(esp_http_client_handle_t client, bool reuse) {
+   esp_http_client_handle_t closing = NULL;
+
+   if (!client) return;
+
+   http_pool_conn_t *conn = http_pool_find(client);
+   if (!conn) {
+       esp_http_client_cleanup(client);
+       return;
+   }
+
+   reuse = reuse && !conn->close && conn->uses < HTTP_POOL_MAX_USES && http_pool_drain(client);
+
+   xSemaphoreTake(pool_lock, portMAX_DELAY);
+   conn->handler = NULL;
+   conn->user_data = NULL;
+
+   int idle = 0;
+   for (int i = 0; i < HTTP_POOL_CONNS; i++) {
+       if (conns[i].client && !conns[i].busy && strcmp(conns[i].host, conn->host) == 0) idle++;
+   }
+
+   if (reuse && idle < HTTP_POOL_IDLE_PER_HOST) {
+       conn->idle_us = esp_timer_get_time();
+       pool_stats.idle++;
+   } else {
+       closing = conn->client;
+       conn->client = NULL;
+       conn->host[0] = '\0';
+   }
+   conn->busy = false;
+   xSemaphoreGive(pool_lock);
+
+   if (closing) esp_http_client_cleanup(closing);
+}
+
+// http_pool_get_stats
+// Copies out the connection counters for the stats page
+void http_pool_get_stats(http_pool_stats_t *out) {
+   if (pool_lock) xSemaphoreTake(pool_lock, portMAX_DELAY);
+   *out = pool_stats;
+   if (pool_lock) xSemaphoreGive(pool_lock);
+}
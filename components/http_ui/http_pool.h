@@ -0,0 +1,54 @@
+// Upstream HTTP connection pool config
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "esp_http_client.h"
+
+// Most clients the pool keeps at once, in use or idle. Past this a request gets a client of its
+// own that's closed when it's done, like before there was a pool
+#define HTTP_POOL_CONNS 4
+
+// Most idle connections kept open to any one server
+#define HTTP_POOL_IDLE_PER_HOST 2
+
+// An idle connection left longer than this is closed instead of used, servers drop them
+// around then anyway
+#define HTTP_POOL_IDLE_S 30
+
+// Requests made on one connection before it's closed and a fresh one opened
+#define HTTP_POOL_MAX_USES 100
+
+// Longest scheme://host:port a connection is pooled for
+#define HTTP_POOL_HOST_LEN 96
+
+// Most of a response that's read through and thrown away so its connection can be used again,
+// a longer one costs more than a new connection
+#define HTTP_POOL_DRAIN_MAX (16 * 1024)
+
+// Connection counters for the stats page. reused is requests that went out on a connection
+// that was already open, stale is kept connections the server had closed in the meantime
+typedef struct {
+   uint32_t opened;
+   uint32_t reused;
+   uint32_t stale;
+   uint32_t expired;
+   uint32_t idle;
+} http_pool_stats_t;
+
+// prototypes
+void http_pool_init(void);
+esp_http_client_handle_t http_pool_get(const esp_http_client_config_t *config);
+esp_err_t http_pool_request(esp_http_client_handle_t client);
+void http_pool_release(esp_http_client_handle_t client, bool reuse);
+void http_pool_get_stats(http_pool_stats_t *out);
+
+#ifdef __cplusplus
+}
+#endif
@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <ctype.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 
 #include "esp_tls.h"
 #include "nvs_flash.h"
@@ -10,50 +12,37 @@
 #include "esp_http_server.h"
 #include "esp_http_client.h"
 #include "esp_crt_bundle.h"
+#include "esp_heap_caps.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/idf_additions.h"
 
 #include "esp_hid_host.h"
 #include "http_ui.h"
 #include "modem.h"
+#include "blocklist.h"
+#include "dns_cache.h"
+#include "gamegenie.h"
+#include "page_cache.h"
+#include "storage.h"
+#include "cheatdb.h"
+#include "tpl.h"
+#include "resp.h"
+#include "worker.h"
+#include "form.h"
+#include "settings.h"
+#include "sse.h"
+#include "imap.h"
+#include "outbox.h"
+#include "tls_cache.h"
+#include "http_pool.h"
+#include "asset.h"
+#include "assets.h"
+#include "templates.h"
 
 static const char *HTTP_UI_TAG = "HTTP_UI";
 static const char *EMAIL_TAG = "EMAIL";
 
-#ifndef MIN
-#define MIN(a,b) ((a) < (b) ? (a) : (b))
-#endif
-
-// Used in our gamegenie proxy
-#define INITIAL_BUFFER_SIZE 4096
-#define MAX_DOWNLOAD_SIZE (256 * 1024)
-
-// Used in our POST handlers when extracting post data
-#define MAX_POST_SIZE (8 * 1024) 
-typedef struct {
-   char *key;
-   char *value;
-} FormField;
-
-// Used for saving/restoring email settings
-typedef struct {
-    char smtp_server[128];
-    char smtp_port[16];
-    char imap_server[128];
-    char imap_port[16];
-    char username[128];
-    char password[128];
-} email_credentials_t;
-
-// free_form_fields
-// Cleanup any allocated form fields
-void free_form_fields(FormField *fields, size_t count) {
-    if (!fields) return;
-    for (size_t i = 0; i < count; i++) {
-        free(fields[i].key);
-        free(fields[i].value);
-    }
-    free(fields);
-}
-
 // url_decode
 // Decode URL encoded values (POST, etc)
 static void url_decode(char *str) {
@@ -77,135 +66,67 @@ static void url_decode(char *str) {
     *dst = '\0';
 }
 
-// parse_post_data
-// Used to parse POST data key-value pairs
-bool parse_post_data(char *data, FormField **out_fields, size_t *out_count) {
-    if (!data || !out_fields || !out_count) return false;
-
-    *out_fields = NULL;
-    *out_count = 0;
-
-    char *saveptr = NULL;
-    char *pair = strtok_r(data, "&", &saveptr);
-
-    while (pair) {
-        char *eq = strchr(pair, '=');
-        if (eq) {
-            *eq = '\0';
-            char *key = pair;
-            char *value = eq + 1;
-
-            url_decode(key);
-            url_decode(value);
-
-            // Allocate space for new field
-            FormField *tmp = realloc(*out_fields, (*out_count + 1) * sizeof(FormField));
-            if (!tmp) {
-                free_form_fields(*out_fields, *out_count);
-                return false;
-            }
-            *out_fields = tmp;
-
-            (*out_fields)[*out_count].key = strdup(key ? key : "");
-            (*out_fields)[*out_count].value = strdup(value ? value : "");
-
-            if (!(*out_fields)[*out_count].key || !(*out_fields)[*out_count].value) {
-                free_form_fields(*out_fields, *out_count);
-                return false;
-            }
-
-            (*out_count)++;
+// escape_html
+// This escapes HTML special characters for safe display
+static void escape_html(const char *src, char *dst, size_t dst_size) {
+    size_t j = 0;
+    for (size_t i = 0; src[i] != '\0' && j + 1 < dst_size; i++) {
+        char c = src[i];
+        const char *rep = NULL;
+        switch (c) {
+            case '&':  rep = "&amp;";  break;
+            case '<':  rep = "&lt;";   break;
+            case '>':  rep = "&gt;";   break;
+            case '"':  rep = "&quot;"; break;
+            case '\'': rep = "&#39;";  break;
+            default: dst[j++] = c; continue;
         }
-        pair = strtok_r(NULL, "&", &saveptr);
-    }
-
-    return true;
-}
-
-// get_post_value
-// Used to get POST data value from key
-const char *get_post_value(const char *key, FormField *fields, int field_count) {
-    for (int i = 0; i < field_count; i++) {
-        if (strcmp(fields[i].key, key) == 0) {
-            return fields[i].value;
+        size_t rep_len = strlen(rep);
+        if (j + rep_len < dst_size) {
+            memcpy(&dst[j], rep, rep_len);
+            j += rep_len;
+        } else {
+            break; // Prevent overflow
         }
     }
-    return NULL;
+    dst[j] = '\0';
 }
 
-// sharkwire_encode
+// sharkwire_key
 // When sharkwire goes to do any settings changes and/or activation, it uses a 
 // special tagging system where certain mega tags have their content "encoded"
 // before it'll attempt to set values. This encoding is based off of the remote IP
 // address, which would be known server side and passed in as a response with proper
-// formatting. This is the encode portion of that action
+// formatting. This sets up the key for the encode portion of that action, the encoding
+// itself is done by the sw slots in the templates as the page goes out (see tpl_put_sw)
 //
 // Very special thanks to jhynjhiruu for helping to figure this out 
-static char *sharkwire_encode(const char *tag) {
+static void sharkwire_key(tpl_writer_t *w) {
 
    // Get remote IP to use as key for specialized tag encoding
-   const char *ip = ip4addr_ntoa(netif_ip4_gw(&ppp_netif));
-
-   size_t tag_len = strlen(tag);
-   size_t ip_len = strlen(ip);
-   size_t out_len = tag_len * 2;
-
-   // Allocate the output string +1 for null terminator
-   char *outbuf = malloc(out_len + 1);
-   if (!outbuf) return NULL;
-
-   for (size_t tag_index = 0, ip_index = 0; tag_index < tag_len; tag_index++, ip_index++) {
-       unsigned char encoded_value = (tag[tag_index] + ip[ip_index % ip_len] - 1) % 255;
-       sprintf(&outbuf[tag_index * 2], "%02X", encoded_value);
-   }
-
-   outbuf[out_len] = '\0';
-   return outbuf;
+   tpl_set_sw_key(w, ip4addr_ntoa(netif_ip4_gw(&ppp_netif)));
 }
 
 // save_sta_credentials
-// Saves the credentials to NVS for the ESP32 <-> router connection
+// Saves the credentials for the ESP32 <-> router connection, the modem picks them up and
+// reconnects as soon as they're in (see on_wifi_settings)
 void save_sta_credentials(const char *ssid, const char *pass) {
     if (!ssid || !pass || strlen(ssid) == 0) {
         ESP_LOGE(HTTP_UI_TAG, "Invalid SSID or password");
         return;
     }
 
-    nvs_handle_t handle;
-    esp_err_t err = nvs_open("wifi", NVS_READWRITE, &handle);
-    if (err != ESP_OK) {
-        ESP_LOGE(HTTP_UI_TAG, "Failed to open NVS namespace '%s': %s",
-                 "wifi", esp_err_to_name(err));
-        return;
-    }
-
-    err = nvs_set_str(handle, "ssid", ssid);
-    if (err != ESP_OK) {
-        ESP_LOGE(HTTP_UI_TAG, "Failed to set SSID: %s", esp_err_to_name(err));
-        nvs_close(handle);
-        return;
-    }
-
-    err = nvs_set_str(handle, "pass", pass);
-    if (err != ESP_OK) {
-        ESP_LOGE(HTTP_UI_TAG, "Failed to set password: %s", esp_err_to_name(err));
-        nvs_close(handle);
-        return;
-    }
+    settings_wifi_t wifi = {0};
+    strncpy(wifi.ssid, ssid, sizeof(wifi.ssid) - 1);
+    strncpy(wifi.pass, pass, sizeof(wifi.pass) - 1);
+    settings_set_wifi(&wifi);
 
-    err = nvs_commit(handle);
-    if (err != ESP_OK) {
-        ESP_LOGE(HTTP_UI_TAG, "Failed to commit NVS changes: %s", esp_err_to_name(err));
-    } else {
-        ESP_LOGI(HTTP_UI_TAG, "Saved WiFi credentials (SSID='%s', pass len=%d)",
-                 ssid, (int)strlen(pass));
-    }
-
-    nvs_close(handle);
+    ESP_LOGI(HTTP_UI_TAG, "Saved WiFi credentials (SSID='%s', pass len=%d)",
+             wifi.ssid, (int)strlen(wifi.pass));
 }
 
 // load_sta_credentials
-// Loads the credentials from NVS for the ESP32 <-> router connection
+// Loads the credentials for the ESP32 <-> router connection
 bool load_sta_credentials(wifi_config_t *sta_config) {
     if (!sta_config) {
         ESP_LOGE(HTTP_UI_TAG, "sta_config is NULL");
@@ -214,108 +135,62 @@ bool load_sta_credentials(wifi_config_t *sta_config) {
 
     memset(sta_config, 0, sizeof(wifi_config_t));
 
-    nvs_handle_t handle;
-    esp_err_t err = nvs_open("wifi", NVS_READONLY, &handle);
-    if (err != ESP_OK) {
-        ESP_LOGW(HTTP_UI_TAG, "No WiFi credentials found in NVS");
-        return false;
-    }
-
-    size_t size = sizeof(sta_config->sta.ssid);
-    err = nvs_get_str(handle, "ssid", (char *)sta_config->sta.ssid, &size);
-    if (err != ESP_OK) {
-        ESP_LOGW(HTTP_UI_TAG, "Failed to read SSID: %s", esp_err_to_name(err));
-        nvs_close(handle);
+    settings_t cfg;
+    settings_get(&cfg);
+    if (!(cfg.present & SETTINGS_WIFI)) {
+        ESP_LOGW(HTTP_UI_TAG, "No WiFi credentials saved");
         return false;
     }
 
-    size = sizeof(sta_config->sta.password);
-    err = nvs_get_str(handle, "pass", (char *)sta_config->sta.password, &size);
-    if (err != ESP_OK) {
-        ESP_LOGW(HTTP_UI_TAG, "Failed to read password: %s", esp_err_to_name(err));
-        nvs_close(handle);
-        return false;
-    }
-
-    nvs_close(handle);
-
-    // Sanity check for empty SSID
-    if (strlen((char *)sta_config->sta.ssid) == 0) {
-        ESP_LOGW(HTTP_UI_TAG, "SSID in NVS is empty");
-        return false;
-    }
+    // The SSID field isn't null terminated when it's all 32 bytes, esp_wifi is fine with that
+    memcpy(sta_config->sta.ssid, cfg.wifi.ssid, sizeof(sta_config->sta.ssid));
+    memcpy(sta_config->sta.password, cfg.wifi.pass, sizeof(sta_config->sta.password));
 
     ESP_LOGI(HTTP_UI_TAG, "Loaded WiFi credentials (SSID='%s', pass len=%d)",
-             sta_config->sta.ssid, (int)strlen((char *)sta_config->sta.password));
+             cfg.wifi.ssid, (int)strlen(cfg.wifi.pass));
     return true;
 }
 
 // save_email_credentials
-// Saves the credentials to NVS for the User and IMAP (Inbound) and SMTP (Outbound) email config
-void save_email_credentials(const email_credentials_t *creds) {
-   nvs_handle_t handle;
+// Saves the credentials for the User and IMAP (Inbound) and SMTP (Outbound) email config
+void save_email_credentials(settings_email_t *creds) {
+   url_decode(creds->smtp_server);
+   url_decode(creds->smtp_port);
+   url_decode(creds->imap_server);
+   url_decode(creds->imap_port);
+   url_decode(creds->username);
+   url_decode(creds->password);
 
-   if (nvs_open("email", NVS_READWRITE, &handle) != ESP_OK) {
-       ESP_LOGE(EMAIL_TAG, "Failed to open NVS for writing");
-       return;
-   }
+   settings_set_email(creds);
 
-   url_decode((char *)creds->smtp_server);
-   url_decode((char *)creds->smtp_port);
-   url_decode((char *)creds->imap_server);
-   url_decode((char *)creds->imap_port);
-   url_decode((char *)creds->username);
-   url_decode((char *)creds->password);
+   ESP_LOGI(EMAIL_TAG, "Email credentials saved");
+}
 
-   nvs_set_str(handle, "smtp_server", creds->smtp_server);
-   nvs_set_str(handle, "smtp_port", creds->smtp_port);
-   nvs_set_str(handle, "imap_server", creds->imap_server);
-   nvs_set_str(handle, "imap_port", creds->imap_port);
-   nvs_set_str(handle, "username", creds->username);
-   nvs_set_str(handle, "password", creds->password);
+// save_dns_settings
+// Saves the list of names the DNS cache pre-resolves as soon as PPP comes up, warm comes from the
+// form already decoded
+void save_dns_settings(char *warm) {
+   settings_dns_t dns = {0};
 
-   nvs_commit(handle);
-   nvs_close(handle);
+   strncpy(dns.warm, warm, sizeof(dns.warm) - 1);
+   settings_set_dns(&dns);
 
-   ESP_LOGI(EMAIL_TAG, "Email credentials saved");
+   ESP_LOGI(HTTP_UI_TAG, "DNS prefetch list saved");
 }
 
 // load_email_credentials
-// Loads the credentials from NVS for the User and IMAP (Inbound) and SMTP (Outbound) email config
-bool load_email_credentials(email_credentials_t *email_credentials) {
-   nvs_handle_t handle;
-   size_t size;
+// Loads the credentials for the User and IMAP (Inbound) and SMTP (Outbound) email config
+bool load_email_credentials(settings_email_t *email_credentials) {
+   settings_t cfg;
 
-   if (nvs_open("email", NVS_READONLY, &handle) != ESP_OK) {
-       ESP_LOGE(EMAIL_TAG, "No Email credentials found in NVS");
+   settings_get(&cfg);
+   if (!(cfg.present & SETTINGS_EMAIL)) {
+       ESP_LOGE(EMAIL_TAG, "No Email credentials saved");
        return false;
    }
 
-   size = sizeof(email_credentials->smtp_server);
-   if (nvs_get_str(handle, "smtp_server", email_credentials->smtp_server, &size) != ESP_OK) goto fail;
-
-   size = sizeof(email_credentials->smtp_port);
-   if (nvs_get_str(handle, "smtp_port", email_credentials->smtp_port, &size) != ESP_OK) goto fail;
-
-   size = sizeof(email_credentials->imap_server);
-   if (nvs_get_str(handle, "imap_server", email_credentials->imap_server, &size) != ESP_OK) goto fail;
-
-   size = sizeof(email_credentials->imap_port);
-   if (nvs_get_str(handle, "imap_port", email_credentials->imap_port, &size) != ESP_OK) goto fail;
-
-   size = sizeof(email_credentials->username);
-   if (nvs_get_str(handle, "username", email_credentials->username, &size) != ESP_OK) goto fail;
-
-   size = sizeof(email_credentials->password);
-   if (nvs_get_str(handle, "password", email_credentials->password, &size) != ESP_OK) goto fail;
-
-   nvs_close(handle);
+   *email_credentials = cfg.email;
    return true;
-
-   fail:
-       ESP_LOGE(EMAIL_TAG, "One or more email credentials missing in NVS");
-       nvs_close(handle);
-       return false;
 }
 
 // config_post_handler
@@ -338,37 +213,20 @@ esp_err_t config_post_handler(httpd_req_t *req) {
 
     // === Save WiFi Credentials Endpoint ===
     if ((req->method == HTTP_POST) && strcmp(req->uri, "/save_wifi") == 0) {
-        char *post_buf = malloc(req->content_len + 1);
-        if (!post_buf) return ESP_FAIL;
-
-        int ret = httpd_req_recv(req, post_buf, req->content_len);
-        if (ret <= 0) { free(post_buf); return ESP_FAIL; }
-        post_buf[ret] = '\0';
-
-        FormField *fields = NULL;
-        size_t field_count = 0;
+        form_t form;
+        if (form_recv(req, &form) != ESP_OK) return ESP_FAIL;
 
-        if (!parse_post_data(post_buf, &fields, &field_count)) {
-            free(post_buf);
-            return ESP_FAIL;
-        }
-
-        const char *ssid = "";
-        const char *pass = "";
-        for (size_t i = 0; i < field_count; i++) {
-            if (strcmp(fields[i].key, "ssid") == 0) ssid = fields[i].value;
-            if (strcmp(fields[i].key, "pass") == 0) pass = fields[i].value;
-        }
+        const char *ssid = form_get(&form, FORM_SSID);
+        const char *pass = form_get(&form, FORM_PASS);
 
-        save_sta_credentials(ssid, pass);
+        save_sta_credentials(ssid ? ssid : "", pass ? pass : "");
 
-        free_form_fields(fields, field_count);
-        free(post_buf);
+        form_free(&form);
 
         httpd_resp_send(req,
             "<html><body style=\"background-color:black; color:white;\">"
             "<center><strong><h3><p style=\"color:red;\">"
-            "Power cycle the Nintendo64 to finalize saving WiFi credentials"
+            "WiFi credentials saved, reconnecting to the new network"
             "</p></h3></strong></center>"
             "</body></html>", HTTPD_RESP_USE_STRLEN);
         return ESP_OK;
@@ -376,51 +234,80 @@ esp_err_t config_post_handler(httpd_req_t *req) {
 
     // === Save Email SMTP/IMAP/User Settings Endpoint ===
     if ((req->method == HTTP_POST) && strcmp(req->uri, "/save_email") == 0) {
-        char *post_buf = malloc(req->content_len + 1);
-        if (!post_buf) return ESP_FAIL;
+        form_t form;
+        if (form_recv(req, &form) != ESP_OK) return ESP_FAIL;
 
-        int ret = httpd_req_recv(req, post_buf, req->content_len);
-        if (ret <= 0) { free(post_buf); return ESP_FAIL; }
-        post_buf[ret] = '\0';
-
-        FormField *fields = NULL;
-        size_t field_count = 0;
-
-        if (!parse_post_data(post_buf, &fields, &field_count)) {
-            free(post_buf);
-            return ESP_FAIL;
-        }
-
-        email_credentials_t creds = {0};
+        settings_email_t creds = {0};
         const char *val;
 
-        if ((val = get_post_value("smtp_server", fields, field_count)))
+        if ((val = form_get(&form, FORM_SMTP_SERVER)))
             strncpy(creds.smtp_server, val, sizeof(creds.smtp_server) - 1);
 
-        if ((val = get_post_value("smtp_port", fields, field_count)))
+        if ((val = form_get(&form, FORM_SMTP_PORT)))
             strncpy(creds.smtp_port, val, sizeof(creds.smtp_port) - 1);
 
-        if ((val = get_post_value("imap_server", fields, field_count)))
+        if ((val = form_get(&form, FORM_IMAP_SERVER)))
             strncpy(creds.imap_server, val, sizeof(creds.imap_server) - 1);
 
-        if ((val = get_post_value("imap_port", fields, field_count)))
+        if ((val = form_get(&form, FORM_IMAP_PORT)))
             strncpy(creds.imap_port, val, sizeof(creds.imap_port) - 1);
 
-        if ((val = get_post_value("username", fields, field_count)))
+        if ((val = form_get(&form, FORM_USERNAME)))
             strncpy(creds.username, val, sizeof(creds.username) - 1);
 
-        if ((val = get_post_value("password", fields, field_count)))
+        if ((val = form_get(&form, FORM_PASSWORD)))
             strncpy(creds.password, val, sizeof(creds.password) - 1);
 
         save_email_credentials(&creds);
 
-        free_form_fields(fields, field_count);
-        free(post_buf);
+        form_free(&form);
 
         httpd_resp_send(req,
             "<html><body style=\"background-color:black; color:white;\">"
             "<center><strong><h3><p style=\"color:red;\">"
-            "Power cycle the Nintendo64 to finalize saving E-Mail credentials"
+            "E-Mail credentials saved"
+            "</p></h3></strong></center>"
+            "</body></html>", HTTPD_RESP_USE_STRLEN);
+        return ESP_OK;
+    }
+
+    // === Save DNS Prefetch Settings Endpoint ===
+    if ((req->method == HTTP_POST) && strcmp(req->uri, "/save_dns") == 0) {
+        form_t form;
+        if (form_recv(req, &form) != ESP_OK) return ESP_FAIL;
+
+        char warm[256] = "";
+        const char *val;
+
+        if ((val = form_get(&form, FORM_WARM)))
+            strncpy(warm, val, sizeof(warm) - 1);
+
+        save_dns_settings(warm);
+
+        form_free(&form);
+
+        httpd_resp_send(req,
+            "<html><body style=\"background-color:black; color:white;\">"
+            "<center><strong><h3><p style=\"color:red;\">"
+            "DNS prefetch list saved, it will be used on the next connection"
+            "</p></h3></strong></center>"
+            "</body></html>", HTTPD_RESP_USE_STRLEN);
+        return ESP_OK;
+    }
+
+    // === Cheat Database Sync Endpoint ===
+    if ((req->method == HTTP_POST) && strcmp(req->uri, "/cheatdb_sync") == 0) {
+        esp_err_t err = gamegenie_sync_start();
+
+        httpd_resp_send(req, (err == ESP_OK) ?
+            "<html><body style=\"background-color:black; color:white;\">"
+            "<center><strong><h3><p style=\"color:red;\">"
+            "Cheat database sync started, this takes a while, check back on the config page"
+            "</p></h3></strong></center>"
+            "</body></html>" :
+            "<html><body style=\"background-color:black; color:white;\">"
+            "<center><strong><h3><p style=\"color:red;\">"
+            "A cheat database sync is already running"
             "</p></h3></strong></center>"
             "</body></html>", HTTPD_RESP_USE_STRLEN);
         return ESP_OK;
@@ -431,531 +318,482 @@ esp_err_t config_post_handler(httpd_req_t *req) {
     return ESP_FAIL;
 }
 
-// ble_status_get_handler
-// This is used to get the ble status so that it can be updated at an interval without having to
-// refresh the entire config page 
-static esp_err_t ble_status_get_handler(httpd_req_t *req) {
-
-   char *ble_section = malloc(4096);
-   if (!ble_section) {
-       free(ble_section);
-       ESP_LOGE(HTTP_UI_TAG, "Memory allocation failed");
-       return ESP_ERR_NO_MEM;
-   }
+// Pages on the AP listening for BLE status changes at /ble_events
+static sse_stream_t ble_events;
 
-   char bda_str[64] = "N/A";
+// What the BLE status section shows
+typedef struct {
+   char bda[18];
+   bool connected;
+   const char *manufacturer;
+   char battery[16];
+   bool notice;
+} ble_status_t;
+
+// get_ble_status
+// Collects the BLE status from the keyboard component
+static void get_ble_status(ble_status_t *st) {
    esp_bd_addr_t bda;
+   bool bonded = get_bonded_device_address(bda);
 
-   if (get_bonded_device_address(bda)) {
-       snprintf(bda_str, sizeof(bda_str), "%02X:%02X:%02X:%02X:%02X:%02X",
+   strcpy(st->bda, "N/A");
+   if (bonded) {
+       snprintf(st->bda, sizeof(st->bda), "%02X:%02X:%02X:%02X:%02X:%02X",
                 bda[0], bda[1], bda[2], bda[3], bda[4], bda[5]);
    }
 
-   bool connected = is_ble_connected();
+   st->connected = is_ble_connected();
+   st->manufacturer = get_ble_manufacturer();
+
    int battery = get_ble_battery_level();
-   char battery_str[16] = "N/A";
-   if (connected && battery >= 0) {
+   strcpy(st->battery, "N/A");
+   if (st->connected && battery >= 0) {
        if (battery > 100) battery = 100;
-       snprintf(battery_str, sizeof(battery_str), "%d%%", battery);
-   }
-
-   char restart_n64_msg[128] = "";
-   if (strcmp(bda_str, "N/A") == 0 && connected) {
-       snprintf(restart_n64_msg, sizeof(restart_n64_msg),
-           "<strong><p style=\"color:red;\">Power cycle the Nintendo64 to finalize BLE pairing</p></strong>");
+       snprintf(st->battery, sizeof(st->battery), "%d%%", battery);
    }
 
-   snprintf(ble_section, 512,
-       "<center><h3>BLE Status</h3></center>"
-       "<p>Bonded Device: %s</p>"
-       "<p>Connected: %s</p>"
-       "<p>Manufacturer: %s</p>"
-       "<p>Battery: %s</p>"
-       "%s"
-       "<form method=\"POST\" action=\"/unbond_ble_device\">"
-       "<input type=\"submit\" value=\"Unpair BLE Device\">"
-       "</form>",
-       bda_str,
-       connected ? "Yes" : "No",
-       get_ble_manufacturer(),
-       battery_str,
-       restart_n64_msg
-   );
-
-   httpd_resp_send(req, ble_section, HTTPD_RESP_USE_STRLEN);
-   free(ble_section);
-
-   return ESP_OK;
+   // Connected but not bonded yet, the bond only shows up after a restart
+   st->notice = !bonded && st->connected;
 }
 
-// add_line_breaks
-// This was a quick hack to do some parsing on the <pre> tag text from
-// our gamegenie proxy, because I didn't like the way it rendered preformatted
-// text, so I did away with that and just forced line breaks because it looked better
-// IMO with adjusted font and the <pre> tags remove
-// sizing looked better when removing pre tags izing
-char *add_line_breaks(const char *input, size_t *out_len) {
-   size_t len = strlen(input);
-   char *output = malloc(len * 6 + 1);
-   if (!output) return NULL;
-
-   size_t i = 0, j = 0;
-   while (i < len) {
-       // Skip opening <pre> tags
-       if (strncasecmp(&input[i], "<pre", 4) == 0) {
-           i += 4;
-           while (i < len && input[i] != '>') i++;
-           if (i < len && input[i] == '>') i++;
-           continue;
-       }
+// json_escape
+// Copies a string into a JSON string body, dropping control characters
+static void json_escape(const char *src, char *dst, size_t dst_size) {
+   size_t j = 0;
+   for (; *src && j + 2 < dst_size; src++) {
+       unsigned char c = *src;
+       if (c < 0x20) continue;
+       if (c == '"' || c == '\\') dst[j++] = '\\';
+       dst[j++] = c;
+   }
+   dst[j] = '\0';
+}
 
-       // Skip closing </pre> tag
-       if (strncasecmp(&input[i], "</pre>", 6) == 0) {
-           i += 6;
-           continue;
-       }
+// ble_status_json
+// The BLE status as the one line of JSON config.js shows it from, both pushed on /ble_events
+// and served at /ble_status
+static void ble_status_json(char *out, size_t size) {
+   ble_status_t st;
+   char manufacturer[128];
 
-       // Copy character and insert <br> after newline
-       char c = input[i++];
-       output[j++] = c;
-       if (c == '\n') {
-           memcpy(&output[j], "<br>", 4);
-           j += 4;
-       }
-   }
+   get_ble_status(&st);
+   json_escape(st.manufacturer, manufacturer, sizeof(manufacturer));
 
-   output[j] = '\0';
-   if (out_len) *out_len = j;
-   return output;
+   snprintf(out, size,
+            "{\"bda\":\"%s\",\"connected\":\"%s\",\"manufacturer\":\"%s\",\"battery\":\"%s\",\"notice\":%s}",
+            st.bda, st.connected ? "Yes" : "No", manufacturer, st.battery, st.notice ? "true" : "false");
 }
 
-// extract_section
-// This is used as another quick hack to extract sections by markers, used mostly to very roughly
-// piece together the sections for the gamegenie.com proxy
-static char *extract_section(const char *start_marker, const char *end_marker, const char *source, size_t *out_len) {
-   char *start = strstr(source, start_marker);
-   if (!start) return NULL;
-   start += strlen(start_marker);
-
-   char *end = strstr(start, end_marker);
-   if (!end || end <= start) return NULL;
+// ble_events_push
+// Sends the BLE status to every page listening, runs on the config server's task
+static void ble_events_push(void *arg) {
+   char json[256];
 
-   *out_len = end - start;
-   char *result = malloc(*out_len + 1);
-   if (!result) return NULL;
+   ble_status_json(json, sizeof(json));
+   sse_send(&ble_events, "ble", json);
+}
 
-   strncpy(result, start, *out_len);
-   result[*out_len] = '\0';
-   return result;
+// ble_status_notify
+// Called by the keyboard component when the BLE status changes, the send is handed to the
+// config server's task so the BLE event handler isn't held up by a slow client
+static void ble_status_notify(void) {
+   if (ble_events.count > 0) httpd_queue_work(ble_events.server, ble_events_push, NULL);
 }
 
-// gamegenie_proxy_handler
-// Basically this handles access to gamegenie.com which we use for the 
-// "Gamerz" Sharkwire home page link, and this works by going directly to the N64 gameshark
-// section of the gamegenie.com website via the Gamerz link, then that causes our custom DNS
-// server to point to ESP32, which then causes it to go here via a registered handler for the
-// specified path. When that happens, ESP32 will then reach out to the HTTPS version of the site
-// and extract the needed HTML sections in order to build a (hopefully) Sharkwire online compatible
-// stripped down interface that renders in the content section of our Sharkwire Online home page
-esp_err_t gamegenie_proxy_handler(httpd_req_t *req) {
-   const char *base_path = "/cheats/gameshark/n64/";
-   const char *request_path = req->uri;
-
-   if (strncmp(request_path, base_path, strlen(base_path)) != 0) {
-       httpd_resp_send_err(req, 400, "invalid path");
+// ble_events_get_handler
+// The config page listens here for BLE status changes instead of polling /ble_status, it gets
+// the current status as soon as it connects and then again whenever something changes
+static esp_err_t ble_events_get_handler(httpd_req_t *req) {
+   if (sse_open(&ble_events, req) != ESP_OK) {
        return ESP_FAIL;
    }
+   ble_events_push(NULL);
+   return ESP_OK;
+}
 
-   char *full_url = malloc(1024);
-   if (!full_url) {
-       httpd_resp_send_err(req, 500, "malloc failed");
-       return ESP_ERR_NO_MEM;
-   }
+// ble_status_get_handler
+// This is used to get the ble status so that it can be updated without having to refresh the
+// entire config page, for browsers that can't listen on /ble_events
+static esp_err_t ble_status_get_handler(httpd_req_t *req) {
+   char json[256];
 
-   snprintf(full_url, 1024, "https://gamegenie.com%s", request_path);
+   ble_status_json(json, sizeof(json));
+   return resp_send(req, "application/json", json, strlen(json));
+}
 
-   esp_http_client_config_t config = {
-       .url = full_url,
-       .crt_bundle_attach = esp_crt_bundle_attach,
-       .timeout_ms = 8000,
-   };
+// blocklist_sink
+// Domains are added to the list as the upload comes in
+static esp_err_t blocklist_sink(void *ctx, const char *data, size_t len) {
+   blocklist_update_feed(ctx, data, len);
+   return ESP_OK;
+}
 
-   esp_http_client_handle_t client = esp_http_client_init(&config);
-   if (!client) {
-       free(full_url);
-       httpd_resp_send_err(req, 502, "client init failed");
+// blocklist_post_handler
+// This takes an uploaded domain list (plain, hosts file or adblock style) from the config page
+// and streams it into the flash blocklist used by the DNS server, replacing any list of the
+// same name. An empty upload removes the list
+static esp_err_t blocklist_post_handler(httpd_req_t *req) {
+   char query[64];
+   char list_name[BLOCKLIST_NAME_LEN] = {0};
+
+   if (httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK ||
+       httpd_query_key_value(query, "list", list_name, sizeof(list_name)) != ESP_OK) {
+       httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Missing list name");
        return ESP_FAIL;
    }
+   url_decode(list_name);
 
-   if (esp_http_client_open(client, 0) != ESP_OK) {
-       esp_http_client_cleanup(client);
-       free(full_url);
-       httpd_resp_send_err(req, 502, "open failed");
+   if (list_name[0] == '\0') {
+       httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Missing list name");
        return ESP_FAIL;
    }
 
-   if (esp_http_client_fetch_headers(client) < 0) {
-       esp_http_client_cleanup(client);
-       free(full_url);
-       httpd_resp_send_err(req, 502, "failed to fetch headers");
+   blocklist_update_t *upd = blocklist_update_begin(list_name);
+   if (!upd) {
+       httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Blocklist unavailable");
        return ESP_FAIL;
    }
 
-   char *body = malloc(INITIAL_BUFFER_SIZE);
-   if (!body) {
-       esp_http_client_cleanup(client);
-       free(full_url);
-       httpd_resp_send_err(req, 500, "malloc failed");
-       return ESP_ERR_NO_MEM;
+   if (form_read_body(req, 0, blocklist_sink, upd) != ESP_OK) {
+       ESP_LOGE(HTTP_UI_TAG, "Error receiving blocklist upload");
+       blocklist_update_abort(upd);
+       return ESP_FAIL;
    }
 
-   size_t capacity = INITIAL_BUFFER_SIZE;
-   size_t total = 0;
+   uint32_t entries = 0;
+   esp_err_t err = blocklist_update_finish(upd, &entries);
 
-   while (1) {
-       if (total + 1024 > capacity) {
-           if (capacity >= MAX_DOWNLOAD_SIZE) {
-               free(body);
-               free(full_url);
-               esp_http_client_cleanup(client);
-               httpd_resp_send_err(req, 500, "body too large");
-               return ESP_FAIL;
-           }
-           capacity *= 2;
-           char *new_body = realloc(body, capacity);
-           if (!new_body) {
-               free(body);
-               free(full_url);
-               esp_http_client_cleanup(client);
-               httpd_resp_send_err(req, 500, "realloc failed");
-               return ESP_ERR_NO_MEM;
-           }
-           body = new_body;
-       }
+   char esc_name[BLOCKLIST_NAME_LEN * 6];
+   escape_html(list_name, esc_name, sizeof(esc_name));
 
-       int r = esp_http_client_read(client, body + total, capacity - total);
-       if (r < 0) {
-           free(body);
-           free(full_url);
-           esp_http_client_cleanup(client);
-           httpd_resp_send_err(req, 502, "read failed");
-           return ESP_FAIL;
-       } else if (r == 0) {
-           break;
-       }
-       total += r;
+   char resp[160];
+   if (err == ESP_OK) {
+       snprintf(resp, sizeof(resp), "Blocklist '%s' saved (%u domains)", esc_name, (unsigned)entries);
+   } else {
+       snprintf(resp, sizeof(resp), "Failed to save blocklist '%s': %s", esc_name, esp_err_to_name(err));
    }
 
-   body[total] = '\0';
-   esp_http_client_cleanup(client);
-   free(full_url);
+   httpd_resp_send(req, resp, HTTPD_RESP_USE_STRLEN);
+   return err == ESP_OK ? ESP_OK : ESP_FAIL;
+}
 
-   const char *start_marker = strstr(request_path, "index.html") ? "<!-- NAME -->" : "<!-- GAME CHEATS -->";
-   const char *end_marker = "<!-- DNET LINKS & BANNER -->";
+// stats_get_handler
+// A small page with the cache counters, plain enough that it renders on the N64 too
+static esp_err_t stats_get_handler(httpd_req_t *req) {
+   page_cache_stats_t pc;
+   dns_cache_stats_t dns;
+   imap_status_t mb;
+   tls_cache_stats_t tls;
+   http_pool_stats_t hp;
+   cheatdb_stats_t cdb;
+   resp_stats_t rs;
+   tpl_writer_t w;
+
+   page_cache_get_stats(&pc);
+   dns_cache_get_stats(&dns);
+   cheatdb_get_stats(&cdb);
+   resp_get_stats(&rs);
+   imap_get_status(&mb);
+   tls_cache_get_stats(&tls);
+   http_pool_get_stats(&hp);
+
+   uint32_t pc_lookups = pc.hits + pc.misses;
+   uint32_t dns_lookups = dns.hits + dns.misses;
+   uint32_t hp_requests = hp.opened + hp.reused;
+
+   tpl_stats_args_t args = {
+       .pc_pages = pc.pages,
+       .pc_kb = pc.bytes / 1024,
+       .pc_hits = pc.hits,
+       .pc_misses = pc.misses,
+       .pc_ratio = pc_lookups ? (uint64_t)pc.hits * 100 / pc_lookups : 0,
+       .pc_spill_hits = pc.spill_hits,
+       .pc_revalidated = pc.revalidated,
+       .pc_refreshed = pc.refreshed,
+       .cdb_pages = cdb.pages,
+       .cdb_kb = cdb.image_size / 1024,
+       .cdb_search = cdb.search_size,
+       .cdb_hits = cdb.hits,
+       .dns_entries = dns.entries,
+       .dns_hits = dns.hits,
+       .dns_misses = dns.misses,
+       .dns_ratio = dns_lookups ? (uint64_t)dns.hits * 100 / dns_lookups : 0,
+       .dns_prefetched = dns.prefetched,
+       .dns_refreshed = dns.refreshed,
+       .rs_responses = rs.responses,
+       .rs_segments = rs.segments,
+       .rs_partial = rs.partial,
+       .rs_other = rs.other,
+       .rs_kb = rs.bytes / 1024,
+       .mb_state = mb.idle ? "Idling" : mb.connected ? "Connected" : "Not connected",
+       .mb_cached = mb.cached,
+       .mb_exists = mb.exists,
+       .mb_syncs = mb.syncs,
+       .mb_connects = mb.connects,
+       .mb_failures = mb.failures,
+       .tls_full = tls.full,
+       .tls_full_ms = tls.full ? tls.full_us / tls.full / 1000 : 0,
+       .tls_resumed = tls.resumed,
+       .tls_resumed_ms = tls.resumed ? tls.resumed_us / tls.resumed / 1000 : 0,
+       .tls_failed = tls.failed,
+       .tls_sessions = tls.sessions,
+       .hp_opened = hp.opened,
+       .hp_reused = hp.reused,
+       .hp_ratio = hp_requests ? (uint64_t)hp.reused * 100 / hp_requests : 0,
+       .hp_stale = hp.stale,
+       .hp_expired = hp.expired,
+       .hp_idle = hp.idle,
+   };
 
-   size_t content_len = 0;
-   char *raw_content = extract_section(start_marker, end_marker, body, &content_len);
-   if (!raw_content) { free(body); httpd_resp_send_err(req, 500, "no content"); return ESP_FAIL; }
+   tpl_begin(&w, req, "text/html");
+   tpl_stats(&w, &args);
+
+   worker_job_t jobs[WORKER_MAX_JOBS];
+   size_t njobs = worker_get_stats(jobs, WORKER_MAX_JOBS);
+   for (size_t i = 0; i < njobs; i++) {
+       uint32_t served = jobs[i].served ? jobs[i].served : 1;
+       tpl_stats_worker_row_args_t row = {
+           .name = jobs[i].name,
+           .served = jobs[i].served,
+           .inline_runs = jobs[i].inline_runs,
+           .wait_avg_ms = jobs[i].wait_us / served / 1000,
+           .wait_max_ms = jobs[i].wait_max_us / 1000,
+           .service_avg_ms = jobs[i].service_us / served / 1000,
+           .service_max_ms = jobs[i].service_max_us / 1000,
+       };
+       tpl_stats_worker_row(&w, &row);
+   }
 
-   char *content = raw_content;
-   if (!strstr(request_path, "index.html")) {
-       size_t new_len = 0;
-       content = add_line_breaks(raw_content, &new_len);
-       free(raw_content);
-       if (!content) { free(body); httpd_resp_send_err(req, 500, "br insert failed"); return ESP_FAIL; }
-       content_len = new_len;
+   tpl_stats_tail(&w);
+   return tpl_end(&w);
+}
+
+// sock_from_ap
+// Checks if a connection came from a client on the ESP32's own AP, rather than from the N64
+// over the PPP link
+static bool sock_from_ap(int sockfd) {
+   struct sockaddr_storage peer;
+   socklen_t peer_len = sizeof(peer);
+   uint32_t addr;
+
+   if (getpeername(sockfd, (struct sockaddr *)&peer, &peer_len) != 0) return false;
+
+#if LWIP_IPV6
+   // With IPv6 in lwip the server listens on an IPv6 socket, so IPv4 peers show up mapped
+   if (peer.ss_family == AF_INET6) {
+       memcpy(&addr, &((struct sockaddr_in6 *)&peer)->sin6_addr.s6_addr[12], 4);
+       return is_ap_client(addr);
    }
+#endif
+   if (peer.ss_family != AF_INET) return false;
+   addr = ((struct sockaddr_in *)&peer)->sin_addr.s_addr;
 
-   size_t title_len = 0;
-   char *title = extract_section("<!-- NAME -->", "<!-- /NAME -->", body, &title_len);
+   return is_ap_client(addr);
+}
+
+// req_from_ap
+static bool req_from_ap(httpd_req_t *req) {
+   return sock_from_ap(httpd_req_to_sockfd(req));
+}
 
-   if (!content || !title) {
-       free(body);
-       if (content) free(content);
-       if (title) free(title);
-       httpd_resp_send_err(req, 500, "required sections not found");
+// ap_server_open
+// The config server is only for clients on our AP, the N64 has no business on it
+static esp_err_t ap_server_open(httpd_handle_t hd, int sockfd) {
+   if (!sock_from_ap(sockfd)) {
+       ESP_LOGW(HTTP_UI_TAG, "Refusing config server connection from outside the AP");
        return ESP_FAIL;
    }
+   return resp_session_open(hd, sockfd);
+}
 
-  const char *html_template =
-   "<html><head><title>%s</title></head>"
-   "<center><font size=\"1\">Powered by gamegenie.com</font></center>"
-   // SharkWire color scheme: "<body bgcolor=\"#000099\" text=\"#E0E040\" link=\"#FFCC00\" vlink=\"#FFCC00\" alink=\"#FFCC00\">"
-   "<body bgcolor=\"#FFFFFF\" text=\"#000000\" link=\"#0000FF\" vlink=\"#800080\" alink=\"#FF0000\">"
-   "<font size=\"1\">%s</font>"
-   "</body></html>";
-
-   size_t html_len = strlen(html_template) + title_len + content_len + 1;
-
-   char *full_html = malloc(html_len);
-   if (!full_html) {
-       free(body);
-       free(content);
-       free(title);
-       httpd_resp_send_err(req, 500, "malloc failed");
-       return ESP_ERR_NO_MEM;
+typedef struct {
+   const char *path;
+   const char *status;
+   const char *type;
+   const char *body;
+} captive_probe_t;
+
+// The URLs OS connectivity checks fetch, and what each one expects back when there's internet
+static const captive_probe_t captive_probes[] = {
+   { "/generate_204",               "204 No Content", "text/plain", "" },
+   { "/gen_204",                    "204 No Content", "text/plain", "" },
+   { "/hotspot-detect.html",        "200 OK", "text/html",
+     "<HTML><HEAD><TITLE>Success</TITLE></HEAD><BODY>Success</BODY></HTML>" },
+   { "/library/test/success.html",  "200 OK", "text/html",
+     "<HTML><HEAD><TITLE>Success</TITLE></HEAD><BODY>Success</BODY></HTML>" },
+   { "/connecttest.txt",            "200 OK", "text/plain", "Microsoft Connect Test" },
+   { "/ncsi.txt",                   "200 OK", "text/plain", "Microsoft NCSI" },
+   { "/success.txt",                "200 OK", "text/plain", "success\n" },
+   { "/canonical.html",             "200 OK", "text/html",
+     "<meta http-equiv=\"refresh\" content=\"0;url=https://support.mozilla.org/kb/captive-portal\"/>" },
+   { "/check_network_status.txt",   "200 OK", "text/plain", "NetworkManager is online\n" },
+};
+
+// captive_404_handler
+// Catches everything the Sharkwire server doesn't have a handler for. For clients on our AP
+// that's mostly OS connectivity checks, which get the answer they're looking for once the STA
+// side has internet. Anything else from the AP (including the checks while there's no internet
+// yet) is sent over to the config server, so http://192.168.4.1 still lands on the config page.
+// The N64 just gets the normal 404
+static esp_err_t captive_404_handler(httpd_req_t *req, httpd_err_code_t err) {
+   if (!req_from_ap(req)) {
+       httpd_resp_send_err(req, err, NULL);
+       return ESP_FAIL;
    }
 
-   snprintf(full_html, html_len, html_template, title, content);
+   const captive_probe_t *probe = NULL;
+   for (size_t i = 0; i < sizeof(captive_probes) / sizeof(captive_probes[0]); i++) {
+       size_t n = strlen(captive_probes[i].path);
+       if (strncmp(req->uri, captive_probes[i].path, n) == 0 && (req->uri[n] == '\0' || req->uri[n] == '?')) {
+           probe = &captive_probes[i];
+           break;
+       }
+   }
 
-   httpd_resp_set_type(req, "text/html");
-   httpd_resp_send(req, full_html, strlen(full_html));
+   if (probe && is_sta_connected()) {
+       httpd_resp_set_status(req, probe->status);
+       httpd_resp_set_type(req, probe->type);
+       httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+       httpd_resp_send(req, probe->body, HTTPD_RESP_USE_STRLEN);
+       return ESP_OK;
+   }
 
-   free(full_html);
-   free(body);
-   free(content);
-   free(title);
-   return ESP_OK;
-}
+   char location[40];
+   uint32_t ap_ip = get_ap_ip();
+   snprintf(location, sizeof(location), "http://%u.%u.%u.%u:%d/",
+            (unsigned)(ap_ip & 0xFF), (unsigned)((ap_ip >> 8) & 0xFF),
+            (unsigned)((ap_ip >> 16) & 0xFF), (unsigned)(ap_ip >> 24), AP_HTTPD_PORT);
 
-// escape_html
-// This escapes HTML special characters for safe display
-static void escape_html(const char *src, char *dst, size_t dst_size) {
-    size_t j = 0;
-    for (size_t i = 0; src[i] != '\0' && j + 1 < dst_size; i++) {
-        char c = src[i];
-        const char *rep = NULL;
-        switch (c) {
-            case '&':  rep = "&amp;";  break;
-            case '<':  rep = "&lt;";   break;
-            case '>':  rep = "&gt;";   break;
-            case '"':  rep = "&quot;"; break;
-            case '\'': rep = "&#39;";  break;
-            default: dst[j++] = c; continue;
-        }
-        size_t rep_len = strlen(rep);
-        if (j + rep_len < dst_size) {
-            memcpy(&dst[j], rep, rep_len);
-            j += rep_len;
-        } else {
-            break; // Prevent overflow
-        }
-    }
-    dst[j] = '\0';
+   ESP_LOGI(HTTP_UI_TAG, "Config redirect: %s", req->uri);
+
+   httpd_resp_set_status(req, "302 Found");
+   httpd_resp_set_hdr(req, "Location", location);
+   httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+   httpd_resp_send(req, NULL, 0);
+   return ESP_OK;
 }
 
 // config_get_handler
 // This handles the GET request of the config WiFi and EMAIL credentials setup page that displays at 192.168.4.1
 // when you connect to the ESP32 SSID while its AP is running, and it also shows the current bonded
-// BLE device information (we only support 1 for now)
+// BLE device information (we only support 1 for now). The page is the same every time and comes
+// gzipped out of flash (see assets/), so a phone that's been here before just gets a 304 and
+// config.js fills it in from config_json_handler
 esp_err_t config_get_handler(httpd_req_t *req) {
-   wifi_config_t sta_config = {0};
-   email_credentials_t email_config = {0};
-
-   char *html = malloc(8192);
-   char *ble_section = malloc(1024);
-   if (!html || !ble_section) {
-       ESP_LOGE(HTTP_UI_TAG, "Memory allocation failed");
-       free(html);
-       free(ble_section);
-       return ESP_ERR_NO_MEM;
-   }
-
-   bool has_sta   = load_sta_credentials(&sta_config);
-   bool has_email = load_email_credentials(&email_config);
-
-   // Ensure null-termination
-   sta_config.sta.ssid[sizeof(sta_config.sta.ssid) - 1] = 0;
-   sta_config.sta.password[sizeof(sta_config.sta.password) - 1] = 0;
-   email_config.smtp_server[sizeof(email_config.smtp_server) - 1] = 0;
-   email_config.smtp_port[sizeof(email_config.smtp_port) - 1] = 0;
-   email_config.imap_server[sizeof(email_config.imap_server) - 1] = 0;
-   email_config.imap_port[sizeof(email_config.imap_port) - 1] = 0;
-   email_config.username[sizeof(email_config.username) - 1] = 0;
-   email_config.password[sizeof(email_config.password) - 1] = 0;
-
-   // Escape HTML values to prevent injection
-   char esc_ssid[64], esc_pass[64], esc_smtp[64], esc_smtp_port[16];
-   char esc_imap[64], esc_imap_port[16], esc_user[64], esc_email_pass[64];
-
-   escape_html((char*)sta_config.sta.ssid,     esc_ssid, sizeof(esc_ssid));
-   escape_html((char*)sta_config.sta.password, esc_pass, sizeof(esc_pass));
-   escape_html(email_config.smtp_server,       esc_smtp, sizeof(esc_smtp));
-   escape_html(email_config.smtp_port,         esc_smtp_port, sizeof(esc_smtp_port));
-   escape_html(email_config.imap_server,       esc_imap, sizeof(esc_imap));
-   escape_html(email_config.imap_port,         esc_imap_port, sizeof(esc_imap_port));
-   escape_html(email_config.username,          esc_user, sizeof(esc_user));
-   escape_html(email_config.password,          esc_email_pass, sizeof(esc_email_pass));
-
-   // BLE status section
-   char bda_str[64] = "N/A";
-   esp_bd_addr_t bda;
-   if (get_bonded_device_address(bda)) {
-       snprintf(bda_str, sizeof(bda_str), "%02X:%02X:%02X:%02X:%02X:%02X",
-                bda[0], bda[1], bda[2], bda[3], bda[4], bda[5]);
+   // Time from joining the AP to landing here, to keep an eye on the captive portal path
+   if (req_from_ap(req)) {
+       int64_t elapsed_ms = get_ap_assoc_elapsed_ms();
+       if (elapsed_ms >= 0) {
+           ESP_LOGI(HTTP_UI_TAG, "Config page reached %lld ms after AP association", (long long)elapsed_ms);
+       }
    }
 
-   bool connected = is_ble_connected();
-   int battery = get_ble_battery_level();
-   char battery_str[16] = "N/A";
-   if (connected && battery >= 0) {
-       if (battery > 100) battery = 100;
-       snprintf(battery_str, sizeof(battery_str), "%d%%", battery);
-   }
+   return asset_send(req, asset_find(ASSET_CONFIG_HTML));
+}
 
-   char restart_n64_msg[128] = "";
-   if (strcmp(bda_str, "N/A") == 0 && connected) {
-       snprintf(restart_n64_msg, sizeof(restart_n64_msg),
-                "<strong><p style=\"color:red;\">Power cycle the Nintendo64 to finalize BLE bonding</p></strong>");
-   }
+// config_json_handler
+// Everything on the config page that changes, the settings and the DNS, blocklist, cheat
+// database and outgoing mail stats (the BLE status comes in on /ble_events)
+static esp_err_t config_json_handler(httpd_req_t *req) {
+   settings_t cfg;
+   tpl_writer_t w;
+
+   // Everything on the page comes from one snapshot of the settings
+   settings_get(&cfg);
+   bool has_sta   = cfg.present & SETTINGS_WIFI;
+   bool has_email = cfg.present & SETTINGS_EMAIL;
+
+   // DNS cache section, the prefetch list plus how well the cache is doing
+   dns_cache_stats_t dns_stats;
+   dns_cache_get_stats(&dns_stats);
+
+   // The values are escaped by the template as they go out
+   tpl_config_json_head_args_t head = {
+       .ssid        = has_sta   ? cfg.wifi.ssid         : "",
+       .pass        = has_sta   ? cfg.wifi.pass         : "",
+       .smtp_server = has_email ? cfg.email.smtp_server : "",
+       .smtp_port   = has_email ? cfg.email.smtp_port   : "",
+       .imap_server = has_email ? cfg.email.imap_server : "",
+       .imap_port   = has_email ? cfg.email.imap_port   : "",
+       .username    = has_email ? cfg.email.username    : "",
+       .password    = has_email ? cfg.email.password    : "",
+       .warm = (cfg.present & SETTINGS_DNS) ? cfg.dns.warm : DNS_PREFETCH_DEFAULT,
+       .dns_entries = dns_stats.entries,
+       .dns_hits = dns_stats.hits,
+       .dns_misses = dns_stats.misses,
+       .dns_prefetched = dns_stats.prefetched,
+       .dns_refreshed = dns_stats.refreshed,
+   };
 
-   snprintf(ble_section, 1024,
-       "<center><h3>BLE Status</h3></center>"
-       "<p>Bonded Device: %s</p>"
-       "<p>Connected: %s</p>"
-       "<p>Manufacturer: %s</p>"
-       "<p>Battery: %s</p>"
-       "%s"
-       "<form method=\"POST\" action=\"/unbond_ble_device\">"
-       "<input type=\"submit\" value=\"Unbond BLE Device\">"
-       "</form>",
-       bda_str,
-       connected ? "Yes" : "No",
-       get_ble_manufacturer(),
-       battery_str,
-       restart_n64_msg
-   );
-
-   // Main HTML
-   int html_len = snprintf(html, 8192,
-       "<html><head><style>"
-       "body { background:white; color:black; font-family:sans-serif; margin:0; padding:20px; }"
-       ".container { width: 400px; margin:0 auto; padding:20px; border:1px solid #ccc; "
-       "border-radius:8px; box-shadow:2px 2px 12px rgba(0,0,0,0.1); }"
-       "input[type=text], input[type=password] { width:100%%; padding:8px; margin:6px 0; box-sizing:border-box; }"
-       "input[type=submit] { width:100%%; padding:10px; background:#007acc; color:white; border:none; border-radius:4px; cursor:pointer; }"
-       "input[type=submit]:hover { background:#005f99; }"
-       "h3 { margin-top: 20px; }"
-       "</style></head><body>"
-       "<div class='container'>"
-       "<center><h1><strong>SharkShit64</strong></h1></center>"
-
-       // Wi-Fi
-       "<center><h3>Wi-Fi Settings</h3></center>"
-       "<form method='POST' action='/save_wifi'>"
-       "SSID:<input type='text' name='ssid' value='%s'><br>"
-       "Password:<input type='password' name='pass' value='%s'><br>"
-       "<input type='submit' value='Save WiFi Credentials'>"
-       "</form>"
-
-       // Email
-       "<center><h3>Email (SMTP) Settings</h3></center>"
-       "<form method='POST' action='/save_email'>"
-       "SMTP Server:<input type='text' name='smtp_server' value='%s'><br>"
-       "SMTP Port:<input type='text' name='smtp_port' value='%s'><br>"
-       "<center><h3>Email (IMAP) Settings</h3></center>"
-       "IMAP Server:<input type='text' name='imap_server' value='%s'><br>"
-       "IMAP Port:<input type='text' name='imap_port' value='%s'><br>"
-       "<center><h3>Email Credentials</h3></center>"
-       "Username:<input type='text' name='username' value='%s'><br>"
-       "Password:<input type='password' name='password' value='%s'><br>"
-       "<input type='submit' value='Save Email Settings'>"
-       "</form>"
-
-       "%s"
-       "</div>"
-
-       "<script>"
-       "function updateBLE() {"
-       "  var xhr = new XMLHttpRequest();"
-       "  xhr.onreadystatechange = function() {"
-       "    if (xhr.readyState == 4 && xhr.status == 200) {"
-       "      document.getElementById('ble-status').innerHTML = xhr.responseText;"
-       "    }"
-       "  };"
-       "  xhr.open('GET', '/ble_status', true);"
-       "  xhr.send();"
-       "}"
-       "setInterval(updateBLE, 5000);"
-       "</script>"
-       "</body></html>",
-
-       has_sta   ? esc_ssid     : "",
-       has_sta   ? esc_pass     : "",
-       has_email ? esc_smtp     : "",
-       has_email ? esc_smtp_port: "",
-       has_email ? esc_imap     : "",
-       has_email ? esc_imap_port: "",
-       has_email ? esc_user     : "",
-       has_email ? esc_email_pass: "",
-       ble_section
-   );
-
-   if (html_len < 0 || html_len >= 8192) {
-       ESP_LOGE(HTTP_UI_TAG, "HTML output truncated");
-       free(html);
-       free(ble_section);
-       return ESP_FAIL;
+   tpl_begin(&w, req, "application/json");
+   tpl_config_json_head(&w, &head);
+
+   // DNS blocklist section, one entry per list with its size and how many lookups it has caught
+   blocklist_stats_t lists[BLOCKLIST_MAX_LISTS];
+   size_t list_count = blocklist_get_stats(lists, BLOCKLIST_MAX_LISTS);
+   for (size_t i = 0; i < list_count; i++) {
+       tpl_config_json_blocklist_args_t row = {
+           .sep = i ? "," : "",
+           .name = lists[i].name,
+           .entries = lists[i].entries,
+           .hits = lists[i].hits,
+       };
+       tpl_config_json_blocklist(&w, &row);
    }
 
-   httpd_resp_send(req, html, html_len);
-
-   free(html);
-   free(ble_section);
-   return ESP_OK;
+   // Offline cheat database section, what's in flash and how far along a sync is
+   cheatdb_stats_t cdb_stats;
+   cheatdb_get_stats(&cdb_stats);
+   tpl_config_json_tail_args_t tail = {
+       .pages = cdb_stats.pages,
+       .kb = cdb_stats.image_size / 1024,
+       .hits = cdb_stats.hits,
+   };
+   tail.syncing = gamegenie_sync_status(&tail.sync_pages, &tail.sync_total) ? "true" : "false";
+
+   // Outgoing mail section, what's still queued and how delivery has been going
+   outbox_status_t mq;
+   outbox_get_status(&mq);
+   tail.mq_queued = mq.queued;
+   tail.mq_sent = mq.sent;
+   tail.mq_failed = mq.failed;
+   tail.mq_retries = mq.retries;
+   tail.mq_sending = mq.sending ? "true" : "false";
+   tail.mq_next_retry = mq.next_retry_s;
+   tail.mq_error = mq.last_error;
+   tpl_config_json_tail(&w, &tail);
+
+   return tpl_end(&w);
 }
 
 // home_get_handler
 // This handles the GET request from whenever Sharkwire attempts to land on the
 // sharkwireonline.com homepage
 esp_err_t home_get_handler(httpd_req_t *req) {
+   tpl_writer_t w;
 
-   char *html = malloc(4096);
-   if (!html) {
-       ESP_LOGE(HTTP_UI_TAG, "Memory allocation failed");
-       return ESP_ERR_NO_MEM;
-   }
-
-   snprintf(html, 4096,
-       "<!DOCTYPE html>"
-       "<html>"
-       "<head>"
-       "<title>SharkWire Online</title>"
-       "</head>"
-       "<frameset cols=\"25%%,75%%\">"
-       "<frame src=\"menu.htm\" name=\"menu\">"
-       "<frame src=\"content.htm\" name=\"content\">"
-       "</frameset>"
-       "</html>"
-   );
-
-   httpd_resp_send(req, html, HTTPD_RESP_USE_STRLEN);
-
-   free(html);
-   return ESP_OK;
+   tpl_begin(&w, req, NULL);
+   tpl_home(&w);
+   return tpl_end(&w);
 }
 
 esp_err_t menu_get_handler(httpd_req_t *req) {
-   const char *html =
-       "<html><head><title>SharkWire Online</title></head>"
-       "<body bgcolor=\"#000099\" text=\"#E0E040\" link=\"#FFCC00\" vlink=\"#FFCC00\" alink=\"#FFCC00\">"
-       "<body background=\"file:///c:/dm/shrkimg/all_w_xx_circles.gif\">"
-       "<img src=\"file:///c:/dm/shrkimg/all_l_xx_logo.gif\" border=\"0\" vspace=\"0\" hspace=\"0\">"
-
-       "<a href=\"http://gamegenie.com/cheats/gameshark/n64/index.html\" target=\"content\">"
-       "<img src=\"file:///c:/dm/shrkimg/gmr_n_xx.gif\" border=\"0\" vspace=\"2\" hspace=\"2\"></a>"
-
-       "<a href=\"http://68k.news\" target=\"content\">"
-       "<img src=\"file:///c:/dm/shrkimg/klt_n_xx.gif\" border=\"0\" vspace=\"2\" hspace=\"2\"></a>"
+   tpl_writer_t w;
 
-       "</body></html>";
-
-   httpd_resp_send(req, html, HTTPD_RESP_USE_STRLEN);
-   return ESP_OK;
+   tpl_begin(&w, req, NULL);
+   tpl_menu(&w);
+   return tpl_end(&w);
 }
 
 // content_get_handler
 // This is the page that shows in the content section of the Sharkwire Online home page when it first
 // loads (not the menu, just the content section)
 esp_err_t content_get_handler(httpd_req_t *req) {
-   const char *html =
-       "<html><title>SharkWire Online</title>"
-       "<body bgcolor=\"#000099\" text=\"#E0E040\" link=\"#FFCC00\" vlink=\"#FFCC00\" alink=\"#FFCC00\">"
-       "<h1>Welcome to Sharkwire Online</h1>"
-       "</body></html>";
+   tpl_writer_t w;
 
-   httpd_resp_send(req, html, HTTPD_RESP_USE_STRLEN);
-   return ESP_OK;
+   tpl_begin(&w, req, NULL);
+   tpl_content(&w);
+   return tpl_end(&w);
 }
 
 // activation_handler
@@ -964,7 +802,7 @@ esp_err_t content_get_handler(httpd_req_t *req) {
 // It processes as a single handler but really works in 2 parts ( act1 and act2 )
 // where act1 is for setting up the ISP connection ( username, password, access number,
 // and dialing prefix ) and returns some specialized meta content by encoding them with
-// the sharkwire_encode function
+// the sw slots in its template (see sharkwire_key)
 //
 // act2 is for setting up Sharkwire username/email accounts, like when going to "Add new user"
 // from the sharkwire menu. This works in much the same way but has a few more tags it sets in
@@ -1008,106 +846,48 @@ esp_err_t activation_handler(httpd_req_t *req) {
              req->uri);
 
     // POST parsing if needed
-    FormField *fields = NULL;
-    size_t field_count = 0;
-    char *post_buf = NULL;
+    form_t form = {0};
 
     if (req->method == HTTP_POST && req->content_len > 0) {
-        post_buf = malloc(req->content_len + 1);
-        if (!post_buf) return ESP_FAIL;
-
-        int ret = httpd_req_recv(req, post_buf, req->content_len);
-        if (ret <= 0) {
-            free(post_buf);
-            return ESP_FAIL;
-        }
-        post_buf[ret] = '\0';
-
-        if (!parse_post_data(post_buf, &fields, &field_count)) {
-            free(post_buf);
-            return ESP_FAIL;
-        }
-
+        if (form_recv(req, &form) != ESP_OK) return ESP_FAIL;
     }
 
     // === ACT_1 ===
     if ((req->method == HTTP_POST || req->method == HTTP_GET) &&
         strcmp(req->uri, "/cgi-bin/netshark/act_1") == 0) {
 
-        char *new_user_ok_encoded = sharkwire_encode("NEW_USER_OK");
-        char *cangoto_yes_encoded = sharkwire_encode("YES");
-
-        if (!new_user_ok_encoded || !cangoto_yes_encoded) {
-            httpd_resp_send(req, "Encoding error", HTTPD_RESP_USE_STRLEN);
-            goto cleanup;
-        }
-
-        char *resp = NULL;
-        asprintf(&resp,
-                 "<HTML><head>"
-                 "<meta height=150 width=540 top=150 left=130 popup=1>"
-                 "<meta name=\"TARGETRES\" content=\"640x240\">"
-                 "<meta name=\"WINDOWTYPE\" content=\"POPUP\">"
-                 "<meta name=\"SHARKWIRE_MAGIC\" content=\"D64A2756_SW_FE62\">"
-                 "<meta name=\"SHARKWIRE_CANGOTO\" content=\"%s\">"
-                 "<meta name=\"SHARKWIRE_GENERAL_DISCONNECT\" content=\"%s\">"
-                 "<meta name=\"SHARKWIRE_LASTTAG\" content=\"\">"
-                 "<title>Sharkwire Activation</title></head>"
-                 "<body><h1>Sharkwire Activation</h1></body></HTML>",
-                 cangoto_yes_encoded, new_user_ok_encoded);
-
-        if (!resp) {
-            httpd_resp_send(req, "Error building HTML", HTTPD_RESP_USE_STRLEN);
-            goto cleanup;
-        }
-
-        httpd_resp_set_type(req, "text/html");
-        httpd_resp_send(req, resp, HTTPD_RESP_USE_STRLEN);
-        ESP_LOGI(HTTP_UI_TAG, "Served ACT_1 page with encoded disconnect: %s", new_user_ok_encoded);
-
-        free(resp);
-        free(new_user_ok_encoded);
-        free(cangoto_yes_encoded);
+        tpl_writer_t w;
+        tpl_act1_args_t args = {
+            .cangoto = "YES",
+            .disconnect = "NEW_USER_OK",
+        };
+
+        tpl_begin(&w, req, "text/html");
+        sharkwire_key(&w);
+        tpl_act1(&w, &args);
+        tpl_end(&w);
+        ESP_LOGI(HTTP_UI_TAG, "Served ACT_1 page");
     }
 
     // === ACT_2 ===
     else if ((req->method == HTTP_POST || req->method == HTTP_GET) &&
              strcmp(req->uri, "/cgi-bin/netshark/act_2") == 0) {
 
-        const char *resp =
-            "<HTML><head>"
-            "<meta height=70 width=560 top=0 left=0 popup=1>"
-            "<meta name=\"TARGETRES\" content=\"640x240\">"
-            "<meta name=\"SHARKWIRE_MAGIC\" content=\"D64A2756_SW_FE62\">"
-            "<meta name=\"SHARKWIRE_LASTTAG\" content=\"\">"
-            "<title>Sharkwire new user activation</title></head>"
-            "<body bgcolor=\"#000099\" text=\"#FFFFCC\" link=\"#CCFFFF\">"
-            "<CENTER><IMG SRC=\"file:///c:/dm/html/interface_3/browser/images_03/sharkwire.gif\" ALT=\"Interact\"></CENTER>"
-            "<FORM name=\"nameandpassword\" METHOD=POST ACTION=\"/cgi-bin/netshark/newuserform\">"
-            "<center><table border=1>"
-            "<tr><td align=center>Enter Username:</td><td><input type=text name=\"t_name1\" size=16 maxlength=16></td></tr>"
-            "<tr><td align=center>Confirm Username:</td><td><input type=text name=\"t_name2\" size=16 maxlength=16></td></tr>"
-            "<tr><td align=center>Enter Password:</td><td><input type=password name=\"t_password1\" size=16 maxlength=16></td></tr>"
-            "<tr><td align=center>Confirm Password:</td><td><input type=password name=\"t_password2\" size=16 maxlength=16></td></tr>"
-            "<tr><td align=center><A href=\"file:///c:/dm/html/interface_3/browser/useractivation/newusercancelled.htm\">"
-            "<img src=\"file:///c:/dm/html/interface_3/browser/images_03/mcancel.gif\" vspace=0 border=0 alt=\"CANCEL\"></A></td>"
-            "<td align=center><INPUT name=\"btn_ok\" TYPE=SUBMIT VALUE=\" Add to account \"></td></tr>"
-            "</table></center></form></body></HTML>";
-
-        httpd_resp_set_type(req, "text/html");
-        httpd_resp_send(req, resp, HTTPD_RESP_USE_STRLEN);
+        tpl_writer_t w;
+
+        tpl_begin(&w, req, "text/html");
+        tpl_act2(&w);
+        tpl_end(&w);
         ESP_LOGI(HTTP_UI_TAG, "Served ACT_2 page");
     }
 
     // === Unknown endpoint ===
     else {
-        httpd_resp_send(req, "Unhandled HTTP endpoint", HTTPD_RESP_USE_STRLEN);
+        resp_send(req, NULL, "Unhandled HTTP endpoint", strlen("Unhandled HTTP endpoint"));
         ESP_LOGE(HTTP_UI_TAG, "Unhandled HTTP endpoint: %s", req->uri);
     }
 
-cleanup:
-    if (fields) free_form_fields(fields, field_count);
-    if (post_buf) free(post_buf);
+    form_free(&form);
     return ESP_OK;
 }
 
@@ -1127,27 +907,15 @@ esp_err_t newuserform_handler(httpd_req_t *req) {
         return ESP_FAIL;
     }
 
-    // === Read POST body ===
-    char *post_buf = malloc(req->content_len + 1);
-    if (!post_buf) return ESP_ERR_NO_MEM;
-
-    int ret = httpd_req_recv(req, post_buf, req->content_len);
-    if (ret <= 0) { free(post_buf); return ESP_FAIL; }
-    post_buf[ret] = '\0';
-
-    // === Parse POST data ===
-    FormField *fields = NULL;
-    size_t field_count = 0;
-
-    if (!parse_post_data(post_buf, &fields, &field_count)) {
-        free(post_buf);
-        return ESP_FAIL;
-    }
+    // === Read and parse POST body ===
+    form_t form;
+    esp_err_t err = form_recv(req, &form);
+    if (err != ESP_OK) return err;
 
-    const char *username1 = get_post_value("t_name1", fields, field_count);
-    const char *password1 = get_post_value("t_password1", fields, field_count);
-    const char *username2 = get_post_value("t_name2", fields, field_count);
-    const char *password2 = get_post_value("t_password2", fields, field_count);
+    const char *username1 = form_get(&form, FORM_T_NAME1);
+    const char *password1 = form_get(&form, FORM_T_PASSWORD1);
+    const char *username2 = form_get(&form, FORM_T_NAME2);
+    const char *password2 = form_get(&form, FORM_T_PASSWORD2);
 
     if (!username1) username1 = "";
     if (!username2) username2 = "";
@@ -1159,214 +927,38 @@ esp_err_t newuserform_handler(httpd_req_t *req) {
 
         ESP_LOGI(HTTP_UI_TAG, "Got POST data: t_name1=%s t_password1=%s", username1, password1);
 
-        // Encode tags
-        char *username_encoded    = sharkwire_encode(username1);
-        char *password_encoded    = sharkwire_encode(password1);
-        char *new_user_ok_encoded = sharkwire_encode("NEW_USER_OK");
-        char *cangoto_yes_encoded = sharkwire_encode("YES");
-
-        if (!username_encoded || !password_encoded ||
-            !new_user_ok_encoded || !cangoto_yes_encoded) {
-            httpd_resp_send(req, "Encoding error", HTTPD_RESP_USE_STRLEN);
-            goto cleanup;
-        }
-
-        // Build HTML response
-        char *resp = NULL;
-        asprintf(&resp,
-            "<HTML><head>"
-            "<meta height=150 width=540 top=150 left=130 popup=1>"
-            "<meta name=\"TARGETRES\" content=\"640x240\">"
-            "<meta name=\"WINDOWTYPE\" content=\"POPUP\">"
-            "<meta name=\"SHARKWIRE_MAGIC\" content=\"D64A2756_SW_FE62\">"
-            "<meta name=\"SHARKWIRE_EMAILNAME\" content=\"%s\">"
-            "<meta name=\"SHARKWIRE_EMAILPWD\" content=\"%s\">"
-            "<meta name=\"SHARKWIRE_CANGOTO\" content=\"%s\">"
-            "<meta name=\"SHARKWIRE_GENERAL_DISCONNECT\" content=\"%s\">"
-            "<meta name=\"SHARKWIRE_LASTTAG\" content=\"\">"
-            "<title>Sharkwire Username Activation</title></head>"
-            "<body><h1>Sharkwire Username Activation</h1></body></HTML>",
-            username_encoded, password_encoded, cangoto_yes_encoded, new_user_ok_encoded);
-
-        if (!resp) {
-            httpd_resp_send(req, "Error building HTML", HTTPD_RESP_USE_STRLEN);
-            goto cleanup;
-        }
-
-        httpd_resp_set_type(req, "text/html");
-        httpd_resp_send(req, resp, HTTPD_RESP_USE_STRLEN);
-        free(resp);
-
-        ESP_LOGI(HTTP_UI_TAG, "Served ACT_2 with encoded Username: %s and Password: %s",
-                 username_encoded, password_encoded);
-
-    cleanup:
-        free(username_encoded);
-        free(password_encoded);
-        free(new_user_ok_encoded);
-        free(cangoto_yes_encoded);
+        // The tags get encoded as the page goes out
+        tpl_writer_t w;
+        tpl_newuser_ok_args_t args = {
+            .username = username1,
+            .password = password1,
+            .cangoto = "YES",
+            .disconnect = "NEW_USER_OK",
+        };
+
+        tpl_begin(&w, req, "text/html");
+        sharkwire_key(&w);
+        tpl_newuser_ok(&w, &args);
+        tpl_end(&w);
+
+        ESP_LOGI(HTTP_UI_TAG, "Served ACT_2 with encoded Username and Password");
     } else {
-        httpd_resp_set_type(req, "text/html");
-        httpd_resp_send(req,
-            "<html><body><center><h1>Username and/or Password didn't match</h1></center></body></html>",
-            HTTPD_RESP_USE_STRLEN);
+        tpl_writer_t w;
+
+        tpl_begin(&w, req, "text/html");
+        tpl_newuser_mismatch(&w);
+        tpl_end(&w);
         ESP_LOGE(HTTP_UI_TAG, "Username or Password did not match");
     }
 
-    free_form_fields(fields, field_count);
-    free(post_buf);
+    form_free(&form);
     return ESP_OK;
 }
 
-// base64_encode
-// This is used to do base64 encoding for the ESP32 side of the email handling
-static const char b64_table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-static void base64_encode(const char *in, char *out) {
-   int i = 0, j = 0, len = strlen(in);
-   while (len--) {
-       int val = (unsigned char)in[i++];
-       out[j++] = b64_table[(val >> 2) & 0x3F];
-       if (len--) {
-           val = ((val & 0x03) << 8) | (unsigned char)in[i++];
-           out[j++] = b64_table[(val >> 4) & 0x3F];
-           if (len--) {
-               val = ((val & 0x0F) << 8) | (unsigned char)in[i++];
-               out[j++] = b64_table[(val >> 6) & 0x3F];
-               out[j++] = b64_table[val & 0x3F];
-           } else {
-               out[j++] = b64_table[(val << 4) & 0x3F];
-               out[j++] = '=';
-               break;
-           }
-       } else {
-           out[j++] = b64_table[(val << 4) & 0x3F];
-           out[j++] = '=';
-           out[j++] = '=';
-           break;
-       }
-   }
-   out[j] = '\0';
-}
-
-// imap_send
-// Used to send IMAP commands over the configured IMAP email server connection
-static int imap_send(esp_tls_t *tls, const char *cmd) {
-    int len = strlen(cmd);
-    int ret = esp_tls_conn_write(tls, cmd, len);
-    if (ret < 0) {
-        ESP_LOGE(EMAIL_TAG, "Send failed");
-        return -1;
-    }
-    return ret;
-}
-
-// imap_recv
-// Used to recv IMAP return data from the configured IMAP email server connection
-static int imap_recv(esp_tls_t *tls, char *buf, size_t buf_len) {
-    int ret = esp_tls_conn_read(tls, buf, buf_len - 1);
-    if (ret >= 0) {
-        buf[ret] = '\0';
-        return ret;
-    }
-    return -1;
-}
-
-// smtp_cmd
-// Used to send SMTP commands over the configured SMTP server connection
-static esp_err_t smtp_cmd(esp_tls_t *tls, const char *cmd, const char *expect) {
-   char buf[512];
-   if (cmd) {
-       esp_tls_conn_write(tls, cmd, strlen(cmd));
-   }
-   int len = esp_tls_conn_read(tls, buf, sizeof(buf) - 1);
-   if (len > 0) {
-       buf[len] = 0;
-       if (expect && !strstr(buf, expect)) {
-           return ESP_FAIL;
-       }
-   }
-   return ESP_OK;
-}
-
-// smtp_send_email
-// Used to send outbound email via SMTP connection (for offline email from menu)
-esp_err_t smtp_send_email(const char *from_email, const char *password,
-                         const char *to_email, const char *subject,
-                         const char *body) {
-   esp_tls_cfg_t cfg = {
-       .crt_bundle_attach = esp_crt_bundle_attach
-   };
-
-   esp_tls_t *tls = esp_tls_init();
-   if (!tls) {
-       ESP_LOGE(EMAIL_TAG, "Failed to allocate TLS handle");
-       return ESP_FAIL;
-   }
-
-   email_credentials_t email_cfg = {0};
-
-   if (!load_email_credentials(&email_cfg)) {
-       ESP_LOGE(EMAIL_TAG, "No email credentials saved in NVS");
-       return ESP_FAIL;
-   }
-
-   // Null terminate NVS values
-   email_cfg.smtp_server[sizeof(email_cfg.smtp_server) - 1] = '\0';
-   email_cfg.smtp_port[sizeof(email_cfg.smtp_port) - 1] = '\0';
-   email_cfg.imap_server[sizeof(email_cfg.imap_server) - 1] = '\0';
-   email_cfg.imap_port[sizeof(email_cfg.imap_port) - 1] = '\0';
-   email_cfg.username[sizeof(email_cfg.username) - 1] = '\0';
-   email_cfg.password[sizeof(email_cfg.password) - 1] = '\0';
-
-   // Convert port from string to int
-   int smtp_port_num = atoi(email_cfg.smtp_port);
-   if (smtp_port_num <= 0) smtp_port_num = 465; // fallback SMTP port
-
-   if (esp_tls_conn_new_sync(email_cfg.smtp_server, strlen(email_cfg.smtp_server), smtp_port_num, &cfg, tls) <= 0) {
-       ESP_LOGE(EMAIL_TAG, "TLS connection failed");
-       esp_tls_conn_destroy(tls);
-       return ESP_FAIL;
-   }
-
-   char cmd[256];
-   char user_b64[128], pass_b64[128];
-   base64_encode(from_email, user_b64);
-   base64_encode(password, pass_b64);
-
-   smtp_cmd(tls, NULL, "220"); // Greeting
-   smtp_cmd(tls, "EHLO esp32\r\n", "250");
-
-   // AUTH LOGIN
-   smtp_cmd(tls, "AUTH LOGIN\r\n", "334");
-   strcat(user_b64, "\r\n");
-   smtp_cmd(tls, user_b64, "334");
-   strcat(pass_b64, "\r\n");
-   smtp_cmd(tls, pass_b64, "235");
-
-   // MAIL FROM / RCPT TO
-   snprintf(cmd, sizeof(cmd), "MAIL FROM:<%s>\r\n", from_email);
-   smtp_cmd(tls, cmd, "250");
-
-   snprintf(cmd, sizeof(cmd), "RCPT TO:<%s>\r\n", to_email);
-   smtp_cmd(tls, cmd, "250");
-
-   smtp_cmd(tls, "DATA\r\n", "354");
-
-   snprintf(cmd, sizeof(cmd),
-      "From: %s\r\n"
-      "To: %s\r\n"
-      "Subject: %s\r\n"
-      "\r\n"
-      "%s\r\n"
-      ".\r\n",
-      from_email, to_email, subject, body);
-
-   smtp_cmd(tls, cmd, "250");
-
-   smtp_cmd(tls, "QUIT\r\n", "221");
-
-   esp_tls_conn_destroy(tls);
-
+// log_body_sink
+// Logs a request body a piece at a time, for the debug handlers
+static esp_err_t log_body_sink(void *ctx, const char *data, size_t len) {
+   ESP_LOGI(HTTP_UI_TAG, "Body: %.*s", (int)len, data);
    return ESP_OK;
 }
 
@@ -1404,21 +996,12 @@ static esp_err_t email_send_get_handler(httpd_req_t *req) {
         }
     }
 
-    buf_len = req->content_len;
-    if (buf_len > 0) {
-        char *body = malloc(buf_len + 1);
-        if (body) {
-            int ret = httpd_req_recv(req, body, buf_len);
-            if (ret > 0) {
-                body[ret] = '\0';
-                ESP_LOGI(HTTP_UI_TAG, "Body: %s", body);
-            }
-            free(body);
-        }
+    if (req->content_len > 0) {
+        form_read_body(req, FORM_MAX_BODY, log_body_sink, NULL);
     }
 
     const char *resp_str = "email_send_get_handler was called";
-    httpd_resp_send(req, resp_str, HTTPD_RESP_USE_STRLEN);
+    resp_send(req, NULL, resp_str, strlen(resp_str));
 
     return ESP_OK;
 
@@ -1428,12 +1011,8 @@ static esp_err_t email_send_get_handler(httpd_req_t *req) {
 // This is the handler for the offline email sender (from the main menu)
 static esp_err_t email_send_post_handler(httpd_req_t *req) {
     esp_err_t ret_status = ESP_FAIL;
-    char *post_buf = NULL;
-    FormField *fields = NULL;
-    size_t field_count = 0;
+    form_t form = {0};
     char *EMAIL_TO_mut = NULL;
-    char *resp = NULL;
-    char *email_id_encoded = NULL;
 
     ESP_LOGI(HTTP_UI_TAG, "Request: %s %s",
         (req->method == HTTP_GET) ? "GET" :
@@ -1442,70 +1021,36 @@ static esp_err_t email_send_post_handler(httpd_req_t *req) {
         (req->method == HTTP_DELETE) ? "DELETE" : "OTHER",
         req->uri);
 
-    size_t post_len = req->content_len;
-    ESP_LOGI(HTTP_UI_TAG, "Content-Length: %d", (int)post_len);
+    ESP_LOGI(HTTP_UI_TAG, "Content-Length: %d", (int)req->content_len);
 
-    // Reject overly large POSTs
-    if (post_len > MAX_POST_SIZE) {
-        ESP_LOGE(HTTP_UI_TAG, "POST too large: %d bytes", (int)post_len);
+    // Receive and parse the POST body
+    esp_err_t err = form_recv(req, &form);
+    if (err == ESP_ERR_INVALID_SIZE) {
         httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "POST too large");
         return ESP_FAIL;
+    } else if (err != ESP_OK) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Error receiving POST body");
+        return ESP_FAIL;
     }
 
-    // Allocate post buffer
-    post_buf = malloc(post_len + 1);
-    if (!post_buf) {
-        ESP_LOGE(HTTP_UI_TAG, "Out of memory allocating POST buffer");
-        goto cleanup;
-    }
-
-    // Receive POST body
-    size_t received = 0;
-    while (received < post_len) {
-        int r = httpd_req_recv(req, post_buf + received, post_len - received);
-        if (r <= 0) {
-            ESP_LOGE(HTTP_UI_TAG, "Error receiving POST body");
-            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Error receiving POST body");
-            goto cleanup;
-        }
-        received += r;
-    }
-    post_buf[received] = '\0';
-
-    ESP_LOGI(HTTP_UI_TAG, "POST body:\n%s", post_buf);
-
-    // Parse form fields (allocates inside)
-    parse_post_data(post_buf, &fields, &field_count);
+    ESP_LOGI(HTTP_UI_TAG, "POST body: %d fields", (int)form.count);
 
-    const char *EMAIL_FROM    = get_post_value("DFrom",    fields, field_count);
-    const char *EMAIL_TO      = get_post_value("DTo",      fields, field_count);
-    const char *EMAIL_ID      = get_post_value("DEmailID", fields, field_count);
-    const char *EMAIL_SUBJECT = get_post_value("DSubject", fields, field_count);
-    const char *EMAIL_BODY    = get_post_value("Body",     fields, field_count);
+    const char *EMAIL_FROM    = form_get(&form, FORM_DFROM);
+    const char *EMAIL_TO      = form_get(&form, FORM_DTO);
+    const char *EMAIL_ID      = form_get(&form, FORM_DEMAILID);
+    const char *EMAIL_SUBJECT = form_get(&form, FORM_DSUBJECT);
+    const char *EMAIL_BODY    = form_get(&form, FORM_BODY);
 
-    // Load email credentials
-    email_credentials_t email_cfg = {0};
+    // Without email settings there's nothing that could ever send it
+    settings_email_t email_cfg = {0};
     if (!load_email_credentials(&email_cfg)) {
         ESP_LOGE(EMAIL_TAG, "No email credentials saved in NVS");
         goto send_failure;
     }
 
-    // Null-terminate NVS strings
-    email_cfg.smtp_server[sizeof(email_cfg.smtp_server) - 1] = '\0';
-    email_cfg.smtp_port[sizeof(email_cfg.smtp_port) - 1] = '\0';
-    email_cfg.imap_server[sizeof(email_cfg.imap_server) - 1] = '\0';
-    email_cfg.imap_port[sizeof(email_cfg.imap_port) - 1] = '\0';
-    email_cfg.username[sizeof(email_cfg.username) - 1] = '\0';
-    email_cfg.password[sizeof(email_cfg.password) - 1] = '\0';
-
-    // Convert SMTP port
-    int smtp_port_num = atoi(email_cfg.smtp_port);
-    if (smtp_port_num <= 0) smtp_port_num = 465;
-
-    // Make mutable copy of TO address for trimming & decoding
+    // Trim & decode the TO address, it's in the form's own buffer so this is done in place
     if (EMAIL_TO && *EMAIL_TO) {
-        EMAIL_TO_mut = strdup(EMAIL_TO);
-        if (!EMAIL_TO_mut) goto cleanup;
+        EMAIL_TO_mut = (char *)EMAIL_TO;
 
         size_t len = strlen(EMAIL_TO_mut);
         if (len > 0 && EMAIL_TO_mut[len - 1] == ',') {
@@ -1521,13 +1066,13 @@ static esp_err_t email_send_post_handler(httpd_req_t *req) {
              EMAIL_SUBJECT ? EMAIL_SUBJECT : "(null)",
              EMAIL_BODY ? EMAIL_BODY : "(null)");
 
-    // Attempt to send
-    if (smtp_send_email(email_cfg.username, email_cfg.password,
-                        EMAIL_TO_mut, EMAIL_SUBJECT, EMAIL_BODY) == ESP_OK) {
-        ESP_LOGI(EMAIL_TAG, "Email sent successfully!");
+    // Queue it for outbox_task to deliver, the N64 gets its answer without waiting on the
+    // mail server and the message survives the server being down for a while
+    err = outbox_add(EMAIL_TO_mut, EMAIL_SUBJECT, EMAIL_BODY);
+    if (err == ESP_OK) {
         goto send_success;
     } else {
-        ESP_LOGE(EMAIL_TAG, "Failed to send email");
+        ESP_LOGE(EMAIL_TAG, "Failed to queue email: %s", esp_err_to_name(err));
         goto send_failure;
     }
 
@@ -1537,31 +1082,13 @@ send_success: {
                  (int)(sizeof(demailid_buf) - strlen("DEMailID=") - 1),
                  EMAIL_ID ? EMAIL_ID : "");
 
-        email_id_encoded = sharkwire_encode(demailid_buf);
-
-        asprintf(&resp,
-           "<html>\n"
-           "<head>\n"
-           "<title>SharkWire Online Email Sent</title>\n"
-           "<STYLE TYPE=\"text/css\">\n"
-           "</STYLE>\n"
-           "<meta name=\"SHARKWIRE_MAGIC\" content=\"D64A2756_SW_FE62\">\n"
-           "<meta name=\"TARGETRES\" content=\"640x240\">\n"
-           "<meta name=\"SHARKWIRE_EMAILSENDOK\" content=\"%s\">\n"
-           "<meta name=\"SHARKWIRE_LASTTAG\" content=\"\">\n"
-           "</head>\n"
-           "<body bgCOLOR=\"#000099\" text=\"#FFFFCC\">\n"
-           "<br clear=all>\n"
-           "<input type =\"hidden\" Name=\"DEmailId\" Value=\"%s\">\n"
-           "<center><img src=\"file:///c:/dm/shrkimg/all_l_gr_sharkwire.gif\" alt=\"Interact\" width=\"360\" height=\"60\" vspace=\"4\" border=\"0\" align=\"top\">\n"
-           "<p align=\"center\">Your message was sent successfully!\n"
-           "</p>\n"
-           "</body>\n"
-           "</html>\n",
-           email_id_encoded,  // Encoded DEMailID for meta tag
-           email_id_encoded); // Encoded DEMailID for hidden form
-
-        httpd_resp_send(req, resp, HTTPD_RESP_USE_STRLEN);
+        // Encoded DEMailID goes in both the meta tag and the hidden form field
+        tpl_writer_t w;
+        tpl_email_sent_args_t args = { .email_id = demailid_buf };
+        tpl_begin(&w, req, NULL);
+        sharkwire_key(&w);
+        tpl_email_sent(&w, &args);
+        tpl_end(&w);
         ret_status = ESP_OK;
         goto cleanup;
     }
@@ -1572,119 +1099,156 @@ send_failure: {
                  (int)(sizeof(demailid_buf) - strlen("DEMailID=") - 1),
                  EMAIL_ID ? EMAIL_ID : "");
 
-        email_id_encoded = sharkwire_encode(demailid_buf);
-
-        asprintf(&resp,
-           "<html>\n"
-           "<head>\n"
-           "<title>SharkWire Online Email Error</title>\n"
-           "<STYLE TYPE=\"text/css\">\n"
-           "</STYLE>\n"
-           "<meta name=\"SHARKWIRE_MAGIC\" content=\"D64A2756_SW_FE62\">\n"
-           "<meta name=\"TARGETRES\" content=\"640x240\">\n"
-           "<meta name=\"SHARKWIRE_EMAILSENDFAILURE\" content=\"%s\">\n"
-           "<meta name=\"SHARKWIRE_LASTTAG\" content=\"\">\n"
-           "</head>\n"
-           "<body bgCOLOR=\"#000099\" text=\"#FFFFCC\">\n"
-           "<br clear=all>\n"
-           "<input type =\"hidden\" Name=\"DEmailId\" Value=\"%s\">\n"
-           "<center><img src=\"file:///c:/dm/shrkimg/all_l_gr_sharkwire.gif\" alt=\"Interact\" width=\"360\" height=\"60\" vspace=\"4\" border=\"0\" align=\"top\">\n"
-           "<p align=\"center\">Your message was NOT SENT!<br><br>Please setup WiFi and Email credentials by logging into the ESP32 configuration UI</a>\n"
-           "</p>\n"
-           "</body>\n"
-           "</html>\n",
-           email_id_encoded,  // Encoded DEMailID for meta tag
-           email_id_encoded); // Encoded DEMailID for hidden form
-
-        httpd_resp_send(req, resp, HTTPD_RESP_USE_STRLEN);
+        tpl_writer_t w;
+        tpl_email_failed_args_t args = { .email_id = demailid_buf };
+        tpl_begin(&w, req, NULL);
+        sharkwire_key(&w);
+        tpl_email_failed(&w, &args);
+        tpl_end(&w);
         ret_status = ESP_FAIL;
         goto cleanup;
     }
 
 cleanup:
-    if (post_buf) free(post_buf);
-    if (fields) free(fields);
-    if (EMAIL_TO_mut) free(EMAIL_TO_mut);
-    if (resp) free(resp);
-    if (email_id_encoded) free(email_id_encoded);
+    form_free(&form);
     return ret_status;
 }
 
-// email_recv_get_handler
-// This is the handler for the "Email->View Inbox" selection from main menu
-static esp_err_t email_recv_get_handler(httpd_req_t *req) {
-   email_credentials_t email_cfg = {0};
-
-   if (!load_email_credentials(&email_cfg)) {
-       ESP_LOGE(EMAIL_TAG, "No email credentials saved in NVS");
-       return ESP_FAIL;
+// Older inbox pages and messages from them wait on the IMAP task to fetch them
+static esp_err_t email_recv_fetch_handler(httpd_req_t *req);
+static worker_job_t email_fetch_job = {
+   .name = "email fetch",
+   .handler = email_recv_fetch_handler,
+};
+
+// email_recv_render
+// Renders the inbox for the "Email->View Inbox" selection from main menu, "?page=" for older
+// messages and "?uid=" to show one. The newest page and its messages come from the mailbox
+// cache imap_task keeps in sync, so there's no waiting on the mail server for them. Anything
+// else has to be fetched by the task: with 'fetch' set this waits for it, otherwise the request
+// is handed to the worker pool to do the waiting
+static esp_err_t email_recv_render(httpd_req_t *req, bool fetch) {
+   imap_status_t st;
+   tpl_writer_t w;
+   char query[48];
+   char val[12];
+   uint32_t page = 0;
+
+   imap_get_status(&st);
+
+   bool have_query = (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK);
+   if (have_query && httpd_query_key_value(query, "page", val, sizeof(val)) == ESP_OK) {
+       page = strtoul(val, NULL, 10);
    }
 
-   // Null terminate NVS values
-   email_cfg.smtp_server[sizeof(email_cfg.smtp_server) - 1] = '\0';
-   email_cfg.smtp_port[sizeof(email_cfg.smtp_port) - 1] = '\0';
-   email_cfg.imap_server[sizeof(email_cfg.imap_server) - 1] = '\0';
-   email_cfg.imap_port[sizeof(email_cfg.imap_port) - 1] = '\0';
-   email_cfg.username[sizeof(email_cfg.username) - 1] = '\0';
-   email_cfg.password[sizeof(email_cfg.password) - 1] = '\0';
-
-   // Convert SMTP port from string to int
-   int smtp_port_num = atoi(email_cfg.smtp_port);
-   if (smtp_port_num <= 0) smtp_port_num = 465; // fallback SMTP port
+   if (have_query && httpd_query_key_value(query, "uid", val, sizeof(val)) == ESP_OK) {
+       uint32_t uid = strtoul(val, NULL, 10);
+       imap_summary_t msg;
+       char *body = heap_caps_malloc(IMAP_BODY_MAX + 1, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+       if (!body) {
+           httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+           return ESP_FAIL;
+       }
 
-   // Convert IMAP port from string to int
-   int imap_port_num = atoi(email_cfg.imap_port);
-   if (imap_port_num <= 0) imap_port_num = 993; // fallback IMAP port
+       if (!imap_get_body(uid, &msg, body, IMAP_BODY_MAX + 1)) {
+           if (!fetch) {
+               heap_caps_free(body);
+               return worker_submit(req, &email_fetch_job);
+           }
+           if (imap_request_body(uid) != ESP_OK || !imap_get_body(uid, &msg, body, IMAP_BODY_MAX + 1)) {
+               heap_caps_free(body);
+               httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "Message not found");
+               return ESP_FAIL;
+           }
+       }
 
-   ESP_LOGI(HTTP_UI_TAG, "URI: %s", req->uri);
+       tpl_message_head_args_t head = {
+           .from = msg.from,
+           .subject = msg.subject,
+           .date = msg.date,
+       };
+       tpl_message_tail_args_t tail = {
+           .body = body,
+           .page = page,
+       };
+       tpl_begin(&w, req, "text/html");
+       tpl_message_head(&w, &head);
+       if (msg.attachments[0]) {
+           tpl_message_attachments_args_t att = {.names = msg.attachments};
+           tpl_message_attachments(&w, &att);
+       }
+       tpl_message_tail(&w, &tail);
+       heap_caps_free(body);
+       return tpl_end(&w);
+   }
 
-   esp_tls_t *tls = esp_tls_init();
-   if (!tls) {
-       ESP_LOGE(EMAIL_TAG, "TLS init failed");
+   imap_summary_t *msgs = heap_caps_malloc(IMAP_PAGE_SIZE * sizeof(imap_summary_t),
+                                           MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+   if (!msgs) {
+       httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
        return ESP_FAIL;
    }
 
-   esp_tls_cfg_t cfg = {
-       .crt_bundle_attach = esp_crt_bundle_attach
-   };
-   
-   if (esp_tls_conn_new_sync(email_cfg.imap_server, strlen(email_cfg.imap_server), imap_port_num, &cfg, tls) != 1) {
-       ESP_LOGE(EMAIL_TAG, "TLS connection to IMAP server failed");
-       esp_tls_conn_destroy(tls);
-       return ESP_FAIL;
+   size_t count = 0;
+   bool listed = imap_list(page, msgs, IMAP_PAGE_SIZE, &count);
+   if (!listed && page > 0) {
+       if (!fetch) {
+           heap_caps_free(msgs);
+           return worker_submit(req, &email_fetch_job);
+       }
+       listed = (imap_request_page(page) == ESP_OK) && imap_list(page, msgs, IMAP_PAGE_SIZE, &count);
    }
 
-   char imap_recv_buf[2048];
+   // Looking at the inbox is a good time to check for new mail, whatever that finds is there
+   // the next time it's opened (and right away when the server can IDLE)
+   imap_sync_now();
 
-   // Wait for server greeting
-   imap_recv(tls, imap_recv_buf, sizeof(imap_recv_buf));
-   ESP_LOGI(EMAIL_TAG, "Server: %s", imap_recv_buf);
+   tpl_inbox_head_args_t head = { .exists = st.exists };
+   tpl_begin(&w, req, "text/html");
+   tpl_inbox_head(&w, &head);
 
-   // Login
-   char login_cmd[512];
-   snprintf(login_cmd, sizeof(login_cmd),
-         "a LOGIN \"%s\" \"%s\"\r\n",
-         email_cfg.username, email_cfg.password);
-   imap_send(tls, login_cmd);
-   imap_recv(tls, imap_recv_buf, sizeof(imap_recv_buf));
-   ESP_LOGI(EMAIL_TAG, "Login: %s", imap_recv_buf);
+   if (!listed) {
+       if (page == 0) tpl_inbox_syncing(&w);
+       else tpl_inbox_unavailable(&w);
+   } else if (count == 0) {
+       tpl_inbox_empty(&w);
+   }
+   for (size_t i = 0; i < count; i++) {
+       tpl_inbox_row_args_t row = {
+           .uid = msgs[i].uid,
+           .page = page,
+           .subject = msgs[i].subject[0] ? msgs[i].subject : "(no subject)",
+           .from = msgs[i].from,
+           .date = msgs[i].date,
+       };
+       tpl_inbox_row(&w, &row);
+   }
 
-   // Select inbox
-   imap_send(tls, "a SELECT INBOX\r\n");
-   imap_recv(tls, imap_recv_buf, sizeof(imap_recv_buf));
-   ESP_LOGI(EMAIL_TAG, "Select: %s", imap_recv_buf);
+   if (page > 0) {
+       tpl_inbox_newer_args_t newer = { .page = page - 1 };
+       tpl_inbox_newer(&w, &newer);
+   }
+   if ((uint64_t)(page + 1) * IMAP_PAGE_SIZE < st.exists) {
+       tpl_inbox_older_args_t older = { .page = page + 1 };
+       tpl_inbox_older(&w, &older);
+   }
 
-   // Fetch first few emails
-   imap_send(tls, "a FETCH 1:5 (BODY[HEADER.FIELDS (FROM SUBJECT DATE)])\r\n");
-   imap_recv(tls, imap_recv_buf, sizeof(imap_recv_buf));
-   ESP_LOGI(EMAIL_TAG, "Emails:\n%s", imap_recv_buf);
+   tpl_inbox_tail(&w);
+   heap_caps_free(msgs);
+   return tpl_end(&w);
+}
 
-   // Send pretty HTML back to browser
-   httpd_resp_set_type(req, "text/html");
-   httpd_resp_send(req, imap_recv_buf, HTTPD_RESP_USE_STRLEN);
+// email_recv_fetch_handler
+// For an inbox page or message that isn't cached, runs on the worker pool while the IMAP task
+// fetches it
+static esp_err_t email_recv_fetch_handler(httpd_req_t *req) {
+   return email_recv_render(req, true);
+}
 
-   esp_tls_conn_destroy(tls);
-   return ESP_OK;
+// email_recv_get_handler
+// This is the handler for the "Email->View Inbox" selection from main menu
+static esp_err_t email_recv_get_handler(httpd_req_t *req) {
+   return email_recv_render(req, false);
 }
 
 // email_recv_post_handler
@@ -1694,22 +1258,12 @@ static esp_err_t email_recv_post_handler(httpd_req_t *req) {
    ESP_LOGI(HTTP_UI_TAG, "Received POST request: URI = %s", req->uri);
 
    // Read the body
-   int total_len = req->content_len;
-   int received = 0;
-   char post_buf[256];
-
-   while (received < total_len) {
-       int ret = httpd_req_recv(req, post_buf, MIN(sizeof(post_buf), total_len - received));
-       if (ret <= 0) {
-           ESP_LOGE(HTTP_UI_TAG, "Error receiving body!");
-           return ESP_FAIL;
-       }
-       post_buf[ret] = 0; // Null-terminate
-       ESP_LOGI(HTTP_UI_TAG, "POST data: %s", post_buf);
-       received += ret;
+   if (form_read_body(req, FORM_MAX_BODY, log_body_sink, NULL) != ESP_OK) {
+       ESP_LOGE(HTTP_UI_TAG, "Error receiving body!");
+       return ESP_FAIL;
    }
 
-   httpd_resp_send(req, "POST received", HTTPD_RESP_USE_STRLEN);
+   resp_send(req, NULL, "POST received", strlen("POST received"));
    return ESP_OK;
 }
 
@@ -1719,13 +1273,70 @@ static esp_err_t email_recv_post_handler(httpd_req_t *req) {
 void http_ui_task(void *arg) {
    ESP_LOGI(HTTP_UI_TAG, "http_ui started on core %d", xPortGetCoreID());
 
-   httpd_config_t config = HTTPD_DEFAULT_CONFIG();
-   config.uri_match_fn = httpd_uri_match_wildcard;
-   config.stack_size = 16384;
-   config.max_uri_handlers = 20;
+   // Mount the flash filesystem and set up the Gamerz page cache (which spills to it), then
+   // map in the offline cheat database if one has been flashed
+   storage_init();
+   cheatdb_init();
+   http_pool_init();
+   gamegenie_init();
+   xTaskCreate(page_cache_task, "page_cache_task", PAGE_CACHE_TASK_SIZE, NULL, PAGE_CACHE_TASK_PRI, NULL);
+
+   // Workers for the handlers that go out over TLS, so they don't hold up the server task
+   worker_init();
+
+   // Sessions saved from the mail servers' handshakes, so reconnecting can resume them
+   tls_cache_init();
+
+   // The mailbox cache the inbox is served from, kept in sync with the IMAP server in the background
+   imap_init();
+   if (xTaskCreateWithCaps(imap_task, "imap_task", IMAP_TASK_SIZE, NULL, IMAP_TASK_PRI, NULL,
+                           MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT) != pdPASS) {
+       ESP_LOGE(HTTP_UI_TAG, "Failed to start the mailbox sync task");
+   }
+
+   // Outgoing mail is queued in flash and sent from its own task, with retries
+   outbox_init();
+   if (xTaskCreateWithCaps(outbox_task, "outbox_task", OUTBOX_TASK_SIZE, NULL, OUTBOX_TASK_PRI, NULL,
+                           MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT) != pdPASS) {
+       ESP_LOGE(HTTP_UI_TAG, "Failed to start the mail sender task");
+   }
 
-   httpd_handle_t server = NULL;
-   httpd_start(&server, &config);
+   // The N64's server, everything the Sharkwire software asks for over PPP. It gets its own
+   // task above the config server's so a phone on the AP can't hold up a page on its way to the N64
+   httpd_config_t ppp_config = HTTPD_DEFAULT_CONFIG();
+   ppp_config.uri_match_fn = httpd_uri_match_wildcard;
+   ppp_config.server_port = SHARKWIRE_HTTPD_PORT;
+   ppp_config.ctrl_port = SHARKWIRE_HTTPD_CTRL_PORT;
+   ppp_config.stack_size = SHARKWIRE_HTTPD_TASK_SIZE;
+   ppp_config.task_priority = SHARKWIRE_HTTPD_TASK_PRI;
+   ppp_config.core_id = SHARKWIRE_HTTPD_CORE;
+   ppp_config.max_open_sockets = SHARKWIRE_HTTPD_MAX_SOCKETS;
+   ppp_config.max_uri_handlers = 20;
+   ppp_config.lru_purge_enable = true;
+   ppp_config.open_fn = resp_session_open;
+
+   httpd_handle_t ppp_server = NULL;
+   if (httpd_start(&ppp_server, &ppp_config) != ESP_OK) {
+       ESP_LOGE(HTTP_UI_TAG, "Failed to start Sharkwire HTTP server");
+   }
+
+   // The config server for phones and laptops on the AP
+   httpd_config_t ap_config = HTTPD_DEFAULT_CONFIG();
+   ap_config.uri_match_fn = httpd_uri_match_wildcard;
+   ap_config.server_port = AP_HTTPD_PORT;
+   ap_config.ctrl_port = AP_HTTPD_CTRL_PORT;
+   ap_config.stack_size = AP_HTTPD_TASK_SIZE;
+   ap_config.task_priority = AP_HTTPD_TASK_PRI;
+   ap_config.core_id = AP_HTTPD_CORE;
+   ap_config.max_open_sockets = AP_HTTPD_MAX_SOCKETS;
+   ap_config.max_uri_handlers = 16;
+   ap_config.lru_purge_enable = true;
+   ap_config.open_fn = ap_server_open;
+
+   httpd_handle_t ap_server = NULL;
+   if (httpd_start(&ap_server, &ap_config) != ESP_OK) {
+       ESP_LOGE(HTTP_UI_TAG, "Failed to start config HTTP server");
+   }
 
    // We will handle these in the config_post_handler since they're all part of the config page
    httpd_uri_t config_get_uri = {.uri="/", .method=HTTP_GET, .handler=config_get_handler};
@@ -1733,6 +1344,8 @@ void http_ui_task(void *arg) {
    httpd_uri_t unbond_ble_device_post_uri = {.uri="/unbond_ble_device", .method=HTTP_POST, .handler=config_post_handler};
    httpd_uri_t save_wifi_post_uri = {.uri="/save_wifi", .method=HTTP_POST, .handler=config_post_handler};
    httpd_uri_t save_email_post_uri = {.uri="/save_email", .method=HTTP_POST, .handler=config_post_handler};
+   httpd_uri_t save_dns_post_uri = {.uri="/save_dns", .method=HTTP_POST, .handler=config_post_handler};
+   httpd_uri_t cheatdb_sync_post_uri = {.uri="/cheatdb_sync", .method=HTTP_POST, .handler=config_post_handler};
 
    httpd_uri_t email_send_get_uri = {.uri="/cgi-bin/netshark/ONetParser", .method=HTTP_GET, .handler=email_send_get_handler};
    httpd_uri_t email_send_post_uri = {.uri="/cgi-bin/netshark/ONetParser", .method=HTTP_POST, .handler=email_send_post_handler};
@@ -1783,6 +1396,30 @@ void http_ui_task(void *arg) {
        .handler = ble_status_get_handler,
    };
 
+   httpd_uri_t config_json_uri = {
+       .uri = "/config.json",
+       .method = HTTP_GET,
+       .handler = config_json_handler,
+   };
+
+   httpd_uri_t assets_uri = {
+       .uri = "/assets/*",
+       .method = HTTP_GET,
+       .handler = asset_get_handler,
+   };
+
+   httpd_uri_t ble_events_uri = {
+       .uri = "/ble_events",
+       .method = HTTP_GET,
+       .handler = ble_events_get_handler,
+   };
+
+   httpd_uri_t blocklist_post_uri = {
+       .uri = "/blocklist",
+       .method = HTTP_POST,
+       .handler = blocklist_post_handler,
+   };
+
    httpd_uri_t menu_uri = {
        .uri = "/swo/menu.htm",
        .method = HTTP_GET,
@@ -1795,6 +1432,12 @@ void http_ui_task(void *arg) {
        .handler = content_get_handler,
    };
 
+   httpd_uri_t stats_uri = {
+       .uri = "/stats",
+       .method = HTTP_GET,
+       .handler = stats_get_handler,
+   };
+
    httpd_uri_t gamegenie_handler = {
       .uri      = "/cheats/gameshark/n64/*",
       .method   = HTTP_GET,
@@ -1804,82 +1447,122 @@ void http_ui_task(void *arg) {
 
    // Register URI handlers
 
-   if (httpd_register_uri_handler(server, &ble_status_uri) != ESP_OK) {
+   if (httpd_register_uri_handler(ap_server, &ble_status_uri) != ESP_OK) {
        ESP_LOGE(HTTP_UI_TAG, "Failed to BLE status handler");
    }
 
-   if (httpd_register_uri_handler(server, &menu_uri) != ESP_OK) {
+   if (httpd_register_uri_handler(ap_server, &config_json_uri) != ESP_OK) {
+       ESP_LOGE(HTTP_UI_TAG, "Failed to register config JSON handler");
+   }
+
+   if (httpd_register_uri_handler(ap_server, &assets_uri) != ESP_OK) {
+       ESP_LOGE(HTTP_UI_TAG, "Failed to register assets handler");
+   }
+
+   sse_init(&ble_events, ap_server);
+   if (httpd_register_uri_handler(ap_server, &ble_events_uri) != ESP_OK) {
+       ESP_LOGE(HTTP_UI_TAG, "Failed to register BLE events handler");
+   }
+   ble_status_subscribe(ble_status_notify);
+
+   if (httpd_register_uri_handler(ap_server, &blocklist_post_uri) != ESP_OK) {
+       ESP_LOGE(HTTP_UI_TAG, "Failed to register blocklist POST handler");
+   }
+
+   if (httpd_register_uri_handler(ppp_server, &menu_uri) != ESP_OK) {
        ESP_LOGE(HTTP_UI_TAG, "Failed to register home menu handler");
    }
 
-   if (httpd_register_uri_handler(server, &content_uri) != ESP_OK) {
+   if (httpd_register_uri_handler(ppp_server, &content_uri) != ESP_OK) {
        ESP_LOGE(HTTP_UI_TAG, "Failed to register home content handler");
    }
 
-   if (httpd_register_uri_handler(server, &gamegenie_handler) != ESP_OK) {
+   if (httpd_register_uri_handler(ppp_server, &gamegenie_handler) != ESP_OK) {
        ESP_LOGE(HTTP_UI_TAG, "Failed to register gamegenie handler");
    }
 
-   if (httpd_register_uri_handler(server, &save_email_post_uri) != ESP_OK) {
+   // Stats are plain enough to read on the N64 as well
+   if (httpd_register_uri_handler(ap_server, &stats_uri) != ESP_OK) {
+       ESP_LOGE(HTTP_UI_TAG, "Failed to register /stats GET handler on the AP server");
+   }
+
+   if (httpd_register_uri_handler(ppp_server, &stats_uri) != ESP_OK) {
+       ESP_LOGE(HTTP_UI_TAG, "Failed to register /stats GET handler on the PPP server");
+   }
+
+   if (httpd_register_uri_handler(ap_server, &save_email_post_uri) != ESP_OK) {
        ESP_LOGE(HTTP_UI_TAG, "Failed to register save_email POST handler");
    }
 
-   if (httpd_register_uri_handler(server, &save_wifi_post_uri) != ESP_OK) {
+   if (httpd_register_uri_handler(ap_server, &save_dns_post_uri) != ESP_OK) {
+       ESP_LOGE(HTTP_UI_TAG, "Failed to register save_dns POST handler");
+   }
+
+   if (httpd_register_uri_handler(ap_server, &cheatdb_sync_post_uri) != ESP_OK) {
+       ESP_LOGE(HTTP_UI_TAG, "Failed to register cheatdb_sync POST handler");
+   }
+
+   if (httpd_register_uri_handler(ap_server, &save_wifi_post_uri) != ESP_OK) {
        ESP_LOGE(HTTP_UI_TAG, "Failed to register save_wifi POST handler");
    }
 
-   if (httpd_register_uri_handler(server, &config_get_uri) != ESP_OK) {
+   if (httpd_register_uri_handler(ap_server, &config_get_uri) != ESP_OK) {
        ESP_LOGE(HTTP_UI_TAG, "Failed to register config page GET handler");
    }
 
-   if (httpd_register_uri_handler(server, &config_post_uri) != ESP_OK) {
+   if (httpd_register_uri_handler(ap_server, &config_post_uri) != ESP_OK) {
        ESP_LOGE(HTTP_UI_TAG, "Failed to register config page POST handler");
    }
 
-   if (httpd_register_uri_handler(server, &email_send_get_uri) != ESP_OK) {
+   if (httpd_register_uri_handler(ppp_server, &email_send_get_uri) != ESP_OK) {
        ESP_LOGE(HTTP_UI_TAG, "Failed to register email send page GET handler");
    }
 
-   if (httpd_register_uri_handler(server, &email_send_post_uri) != ESP_OK) {
+   if (httpd_register_uri_handler(ppp_server, &email_send_post_uri) != ESP_OK) {
        ESP_LOGE(HTTP_UI_TAG, "Failed to register email send page POST handler");
    }
 
-   if (httpd_register_uri_handler(server, &email_recv_get_uri) != ESP_OK) {
+   if (httpd_register_uri_handler(ppp_server, &email_recv_get_uri) != ESP_OK) {
        ESP_LOGE(HTTP_UI_TAG, "Failed to register email recv page GET handler");
    }
 
-   if (httpd_register_uri_handler(server, &email_recv_post_uri) != ESP_OK) {
+   if (httpd_register_uri_handler(ppp_server, &email_recv_post_uri) != ESP_OK) {
        ESP_LOGE(HTTP_UI_TAG, "Failed to register email recv page POST handler");
    }
 
-   if (httpd_register_uri_handler(server, &unbond_ble_device_post_uri) != ESP_OK) {
+   if (httpd_register_uri_handler(ap_server, &unbond_ble_device_post_uri) != ESP_OK) {
        ESP_LOGE(HTTP_UI_TAG, "Failed to register unbond_ble_device page POST handler");
    }
 
-   if (httpd_register_uri_handler(server, &home_get_uri) != ESP_OK) {
+   if (httpd_register_uri_handler(ppp_server, &home_get_uri) != ESP_OK) {
        ESP_LOGE(HTTP_UI_TAG, "Failed to register /swo/shark.home GET handler");
    }
 
-   if (httpd_register_uri_handler(server, &activation1_get_uri) != ESP_OK) {
+   if (httpd_register_uri_handler(ppp_server, &activation1_get_uri) != ESP_OK) {
        ESP_LOGE(HTTP_UI_TAG, "Failed to register /cgi-bin/netshark/act_1 GET handler");
    }
 
-   if (httpd_register_uri_handler(server, &activation1_post_uri) != ESP_OK) {
+   if (httpd_register_uri_handler(ppp_server, &activation1_post_uri) != ESP_OK) {
        ESP_LOGE(HTTP_UI_TAG, "Failed to register /cgi-bin/netshark/act_1 POST handler");
    }
 
-   if (httpd_register_uri_handler(server, &activation2_get_uri) != ESP_OK) {
+   if (httpd_register_uri_handler(ppp_server, &activation2_get_uri) != ESP_OK) {
        ESP_LOGE(HTTP_UI_TAG, "Failed to register /cgi-bin/netshark/act_2 GET handler");
    }
 
-   if (httpd_register_uri_handler(server, &activation2_post_uri) != ESP_OK) {
+   if (httpd_register_uri_handler(ppp_server, &activation2_post_uri) != ESP_OK) {
        ESP_LOGE(HTTP_UI_TAG, "Failed to register /cgi-bin/netshark/act_2 POST handler");
    }
 
-   if (httpd_register_uri_handler(server, &newuserform_post_uri) != ESP_OK) {
+   if (httpd_register_uri_handler(ppp_server, &newuserform_post_uri) != ESP_OK) {
        ESP_LOGE(HTTP_UI_TAG, "Failed to register /cgi-bin/netshark/newuserform POST handler");
    }
 
+   // Anything without a handler might be an OS connectivity check from a client on our AP
+   if (httpd_register_err_handler(ppp_server, HTTPD_404_NOT_FOUND, captive_404_handler) != ESP_OK) {
+       ESP_LOGE(HTTP_UI_TAG, "Failed to register captive portal 404 handler");
+   }
+
    while (1) {
        vTaskDelay(pdMS_TO_TICKS(50));
    }
@@ -4,6 +4,54 @@
 extern "C" {
 #endif
 
+// Set the task size for the page cache task that revalidates
+// cached Gamerz pages with gamegenie.com in the background,
+// it does full HTTPS requests so it needs the room
+#define PAGE_CACHE_TASK_SIZE 8192
+
+// Set the task priority for the page cache task, it's all
+// background work so it stays below the HTTP server
+#define PAGE_CACHE_TASK_PRI 5
+
+// Set the task size for the task that keeps the IMAP connection open and the
+// mailbox cache in sync. It's all TLS, and the stack is in PSRAM so this
+// doesn't come out of internal RAM
+#define IMAP_TASK_SIZE 12288
+
+// Set the task priority for the mailbox sync task, it's background work
+// like the page cache and stays under both HTTP servers
+#define IMAP_TASK_PRI 3
+
+// Set the task size and priority for the task that sends the queued
+// outgoing mail. Same as the mailbox sync task, TLS on a PSRAM stack
+// and background work
+#define OUTBOX_TASK_SIZE 12288
+#define OUTBOX_TASK_PRI 3
+
+// Set the port, control port, task size, priority, core and
+// socket limit for the HTTP server the N64 talks to over PPP.
+// The Sharkwire pages are all on port 80, and it runs above the
+// config server and on the other core so a phone on the AP
+// never competes with the N64 for the worker or a socket
+#define SHARKWIRE_HTTPD_PORT 80
+#define SHARKWIRE_HTTPD_CTRL_PORT 32768
+#define SHARKWIRE_HTTPD_TASK_SIZE 16384
+#define SHARKWIRE_HTTPD_TASK_PRI 7
+#define SHARKWIRE_HTTPD_CORE 1
+#define SHARKWIRE_HTTPD_MAX_SOCKETS 4
+
+// Set the same for the config server on the AP side. esp_http_server
+// can't bind to one address, so it's on its own port and refuses
+// anyone that isn't an AP client, and the Sharkwire server sends AP
+// clients that land on port 80 over here
+#define AP_HTTPD_PORT 8080
+#define AP_HTTPD_CTRL_PORT 32769
+#define AP_HTTPD_TASK_SIZE 8192
+#define AP_HTTPD_TASK_PRI 4
+#define AP_HTTPD_CORE 0
+#define AP_HTTPD_MAX_SOCKETS 3
+
+// prototypes
 void http_ui_task(void *arg);
 bool load_sta_credentials(wifi_config_t *sta_config);
 
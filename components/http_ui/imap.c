@@ -0,0 +1,1386 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <strings.h>
+#include <ctype.h>
+#include "esp_log.h"
+#include "esp_tls.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "esp_crt_bundle.h"
+#include "lwip/sockets.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include "imap.h"
+#include "mime.h"
+#include "modem.h"
+#include "settings.h"
+#include "tls_cache.h"
+
+static const char *IMAP_TAG = "IMAP";
+
+// Read result for when nothing at all came in before the timeout
+#define IMAP_TIMEOUT (-2)
+
+// What imap_response read, other than a tagged response's tag
+#define IMAP_UNTAGGED 0
+#define IMAP_CONTINUE (-3)
+
+// What FETCH items the inbox list is made from
+#define IMAP_SUMMARY_ITEMS "(UID ENVELOPE BODYSTRUCTURE)"
+
+// A cached message, the body is in PSRAM and null terminated (NULL until it's been fetched)
+typedef struct {
+   imap_summary_t hdr;
+   char *body;
+} imap_msg_t;
+
+// Tokens of a server response, from imap_next
+typedef enum {
+   IMAP_TOK_EOL,
+   IMAP_TOK_ATOM,
+   IMAP_TOK_STRING,
+   IMAP_TOK_NIL,
+   IMAP_TOK_OPEN,
+   IMAP_TOK_CLOSE,
+} imap_tok_type_t;
+
+typedef struct {
+   imap_tok_type_t type;
+   char *s;
+   size_t len;
+} imap_tok_t;
+
+// One FETCH response, with whichever items were asked for. A BODY[...] section isn't kept here,
+// it goes to the connection's sink as it's read and body says it did
+typedef struct {
+   uint32_t seq;
+   imap_summary_t hdr;
+   bool body;
+} imap_fetch_t;
+
+// One connection to the server and what we've learned about the mailbox on it
+typedef struct {
+   esp_tls_t *tls;
+   char buf[1024];
+   size_t len;
+   size_t pos;
+   unsigned tag;
+   bool can_idle;
+   bool changed;
+   bool expunged;
+   bool bye;
+   uint32_t exists;
+   uint32_t synced_exists;
+   uint32_t uidvalidity;
+   char line[IMAP_LINE_LEN];
+   char lit[IMAP_LINE_LEN];
+   mime_t *sink;
+   uint32_t sink_uid;
+   bool in_body;
+   imap_fetch_t fetch;
+} imap_conn_t;
+
+// Called for each FETCH response once it's been read
+typedef void (*imap_fetch_fn)(void *ctx, const imap_fetch_t *f);
+
+// Something a page asked the task to fetch, see imap_request
+typedef enum {
+   IMAP_REQ_NONE,
+   IMAP_REQ_PAGE,
+   IMAP_REQ_BODY,
+} imap_req_kind_t;
+
+// The cache, newest message first. Everything in it is only touched with cache_lock held, and so
+// are the older page and the extra message below
+static SemaphoreHandle_t cache_lock = NULL;
+static imap_msg_t *cache = NULL;
+static size_t cache_count = 0;
+static uint32_t cache_uidvalidity = 0;
+static imap_status_t status = {0};
+
+// The last older page that was asked for, and which mailbox it came from so it's known to be
+// stale once that changes
+static imap_summary_t *page = NULL;
+static size_t page_count = 0;
+static uint32_t page_no = 0;
+static uint32_t page_exists = 0;
+static uint32_t page_uidvalidity = 0;
+
+// The last message opened that isn't in the cache
+static imap_msg_t extra = {0};
+
+// One request to the task at a time, req_lock is held by whoever is waiting on it. The fields
+// below it are shared between that caller and the task and only touched under req_mux
+static SemaphoreHandle_t req_lock = NULL;
+static SemaphoreHandle_t req_done = NULL;
+static portMUX_TYPE req_mux = portMUX_INITIALIZER_UNLOCKED;
+static imap_req_kind_t req_kind = IMAP_REQ_NONE;
+static uint32_t req_arg = 0;
+static uint32_t req_seq = 0;
+static uint32_t req_served = 0;
+static esp_err_t req_err = ESP_OK;
+
+static TaskHandle_t imap_task_handle = NULL;
+static volatile bool settings_changed = false;
+
+// imap_now_s
+static int64_t imap_now_s(void) {
+   return esp_timer_get_time() / 1000000;
+}
+
+// imap_fill
+// Reads more from the server into the connection's buffer
+static int imap_fill(imap_conn_t *c) {
+   int n = esp_tls_conn_read(c->tls, c->buf, sizeof(c->buf));
+   if (n == ESP_TLS_ERR_SSL_WANT_READ || n == ESP_TLS_ERR_SSL_WANT_WRITE) return IMAP_TIMEOUT;
+   if (n <= 0) return -1;
+   c->len = n;
+   c->pos = 0;
+   return n;
+}
+
+// imap_peekc
+// The next byte from the server without taking it, -1 if the connection failed. Everything is
+// read through the buffer a byte at a time, so it doesn't matter where the TLS records split
+static int imap_peekc(imap_conn_t *c) {
+   if (c->pos == c->len && imap_fill(c) <= 0) return -1;
+   return (unsigned char)c->buf[c->pos];
+}
+
+// imap_getc
+static int imap_getc(imap_conn_t *c) {
+   int ch = imap_peekc(c);
+   if (ch >= 0) c->pos++;
+   return ch;
+}
+
+// imap_readable
+// Waits up to 'ms' for the server to start saying something, for the places where it's fine
+// for it to be quiet (IDLE)
+static bool imap_readable(imap_conn_t *c, int ms) {
+   int fd;
+
+   if (c->pos < c->len || esp_tls_get_bytes_avail(c->tls) > 0) return true;
+   if (esp_tls_get_conn_sockfd(c->tls, &fd) != ESP_OK) return true;
+
+   fd_set rfds;
+   FD_ZERO(&rfds);
+   FD_SET(fd, &rfds);
+   struct timeval tv = { .tv_sec = ms / 1000, .tv_usec = (ms % 1000) * 1000 };
+   // An error is let through too, the read that follows is what notices the connection is gone
+   return select(fd + 1, &rfds, NULL, NULL, &tv) != 0;
+}
+
+// imap_read_bytes
+// Reads a literal of 'len' bytes, keeping the first 'keep' of them in 'out'
+static esp_err_t imap_read_bytes(imap_conn_t *c, char *out, size_t len, size_t keep) {
+   size_t got = 0;
+
+   while (got < len) {
+       if (c->pos == c->len && imap_fill(c) <= 0) return ESP_FAIL;
+
+       size_t n = c->len - c->pos;
+       if (n > len - got) n = len - got;
+       if (got < keep) memcpy(out + got, c->buf + c->pos, (n < keep - got) ? n : keep - got);
+       c->pos += n;
+       got += n;
+   }
+   return ESP_OK;
+}
+
+// imap_literal_len
+// If the line ends with a literal's {size} (or {size+}), returns the size, otherwise -1
+static long imap_literal_len(const char *line) {
+   size_t n = strlen(line);
+   if (n < 3 || line[n - 1] != '}') return -1;
+
+   const char *open = strrchr(line, '{');
+   if (!open) return -1;
+
+   char *end;
+   long len = strtol(open + 1, &end, 10);
+   if (end == open + 1 || (*end != '}' && !(*end == '+' && end[1] == '}'))) return -1;
+   return len;
+}
+
+// imap_rest
+// Reads the rest of a response as plain text into c->line, for the ones that are just words (OK,
+// CAPABILITY...) and aren't worth tokenizing. Anything past IMAP_LINE_LEN is dropped, and so are
+// literals in the middle of it
+static esp_err_t imap_rest(imap_conn_t *c) {
+   size_t n = 0;
+   size_t from = 0;
+
+   while (1) {
+       int ch = imap_getc(c);
+       if (ch < 0) return ESP_FAIL;
+
+       if (ch == '\n') {
+           if (n > from && c->line[n - 1] == '\r') n--;
+           c->line[n] = '\0';
+
+           long len = imap_literal_len(c->line + from);
+           if (len < 0) return ESP_OK;
+           if (imap_read_bytes(c, NULL, len, 0) != ESP_OK) return ESP_FAIL;
+           from = n;
+           continue;
+       }
+       if (n < sizeof(c->line) - 1) c->line[n++] = ch;
+   }
+}
+
+// imap_put
+// Adds a byte to the token being read, it's cut off at IMAP_LINE_LEN
+static void imap_put(imap_conn_t *c, imap_tok_t *t, int ch) {
+   if (t->len < sizeof(c->line) - 1) c->line[t->len++] = ch;
+   c->line[t->len] = '\0';
+}
+
+// imap_quoted
+// The rest of a "quoted string", with its escapes taken out
+static esp_err_t imap_quoted(imap_conn_t *c, imap_tok_t *t) {
+   while (1) {
+       int ch = imap_getc(c);
+       if (ch == '\\') ch = imap_getc(c);
+       else if (ch == '"') break;
+       if (ch < 0 || ch == '\r' || ch == '\n') return ESP_FAIL;
+       imap_put(c, t, ch);
+   }
+   t->type = IMAP_TOK_STRING;
+   return ESP_OK;
+}
+
+// imap_stream
+// Reads a literal straight into the sink a buffer at a time
+static esp_err_t imap_stream(imap_conn_t *c, size_t len) {
+   while (len > 0) {
+       if (c->pos == c->len && imap_fill(c) <= 0) return ESP_FAIL;
+
+       size_t n = c->len - c->pos;
+       if (n > len) n = len;
+       mime_feed(c->sink, c->buf + c->pos, n);
+       c->pos += n;
+       len -= n;
+   }
+   return ESP_OK;
+}
+
+// imap_literal
+// The rest of a {size} literal. A message's text goes to the sink as it's read (and in_body is
+// cleared to say so), where it's cut off at IMAP_BODY_MAX once rendered. Anything else goes into
+// c->lit with only the first IMAP_LINE_LEN - 1 bytes kept. Either way a huge literal costs time
+// but no memory
+static esp_err_t imap_literal(imap_conn_t *c, imap_tok_t *t) {
+   size_t len = 0;
+   int ch;
+
+   while ((ch = imap_getc(c)) >= '0' && ch <= '9') {
+       if (len > (SIZE_MAX - 9) / 10) return ESP_FAIL;
+       len = len * 10 + (ch - '0');
+   }
+   if (ch == '+') ch = imap_getc(c);
+   if (ch != '}' || imap_getc(c) != '\r' || imap_getc(c) != '\n') return ESP_FAIL;
+
+   t->type = IMAP_TOK_STRING;
+   c->lit[0] = '\0';
+
+   if (c->in_body && c->sink) {
+       c->in_body = false;
+       t->s = c->lit;
+       return imap_stream(c, len);
+   }
+
+   size_t keep = (len < sizeof(c->lit) - 1) ? len : sizeof(c->lit) - 1;
+   if (imap_read_bytes(c, c->lit, len, keep) != ESP_OK) return ESP_FAIL;
+   c->lit[keep] = '\0';
+
+   t->s = c->lit;
+   t->len = keep;
+   return ESP_OK;
+}
+
+// imap_atom
+// The rest of an atom (a number, a flag, a FETCH item name...). A [section] is kept in it along
+// with any spaces or parentheses inside it, so "BODY[HEADER.FIELDS (FROM)]<0>" is one token
+static esp_err_t imap_atom(imap_conn_t *c, int ch, imap_tok_t *t) {
+   int depth = 0;
+
+   while (1) {
+       imap_put(c, t, ch);
+       if (ch == '[') depth++;
+       else if (ch == ']' && depth > 0) depth--;
+
+       ch = imap_peekc(c);
+       if (ch < 0) return ESP_FAIL;
+       if (ch == '\r' || ch == '\n') break;
+       if (depth == 0 && (ch == ' ' || ch == '(' || ch == ')')) break;
+       c->pos++;
+   }
+   t->type = (strcasecmp(t->s, "NIL") == 0) ? IMAP_TOK_NIL : IMAP_TOK_ATOM;
+   return ESP_OK;
+}
+
+// imap_next
+// Reads the next token of a response. Strings and atoms are in c->line and literals in c->lit,
+// either way t->s points at it and it only lasts until the next token of the same kind
+static esp_err_t imap_next(imap_conn_t *c, imap_tok_t *t) {
+   int ch;
+
+   do {
+       ch = imap_getc(c);
+   } while (ch == ' ');
+   if (ch < 0) return ESP_FAIL;
+
+   t->s = c->line;
+   t->len = 0;
+   c->line[0] = '\0';
+
+   switch (ch) {
+   case '\r':
+       if (imap_getc(c) != '\n') return ESP_FAIL;
+       // fall through
+   case '\n':
+       t->type = IMAP_TOK_EOL;
+       return ESP_OK;
+   case '(':
+       t->type = IMAP_TOK_OPEN;
+       return ESP_OK;
+   case ')':
+       t->type = IMAP_TOK_CLOSE;
+       return ESP_OK;
+   case '"':
+       return imap_quoted(c, t);
+   case '{':
+       return imap_literal(c, t);
+   default:
+       return imap_atom(c, ch, t);
+   }
+}
+
+// imap_skip_list
+// Skips to the end of the list we're 'depth' lists into
+static esp_err_t imap_skip_list(imap_conn_t *c, int depth) {
+   imap_tok_t t;
+
+   while (depth > 0) {
+       if (imap_next(c, &t) != ESP_OK || t.type == IMAP_TOK_EOL) return ESP_FAIL;
+       if (t.type == IMAP_TOK_OPEN) depth++;
+       else if (t.type == IMAP_TOK_CLOSE) depth--;
+   }
+   return ESP_OK;
+}
+
+// imap_string
+// Reads a string (or NIL, which is empty) into out, which can be NULL to skip it. A list where a
+// string should be is skipped and taken as empty too
+static esp_err_t imap_string(imap_conn_t *c, char *out, size_t size) {
+   imap_tok_t t;
+
+   if (imap_next(c, &t) != ESP_OK) return ESP_FAIL;
+   if (out) out[0] = '\0';
+
+   switch (t.type) {
+   case IMAP_TOK_STRING:
+   case IMAP_TOK_ATOM:
+       if (out) snprintf(out, size, "%s", t.s);
+       return ESP_OK;
+   case IMAP_TOK_NIL:
+       return ESP_OK;
+   case IMAP_TOK_OPEN:
+       return imap_skip_list(c, 1);
+   default:
+       return ESP_FAIL;
+   }
+}
+
+// imap_address
+// An address list from an ENVELOPE, only the first address is kept. That's the display name if
+// it has one, otherwise mailbox@host
+static esp_err_t imap_address(imap_conn_t *c, char *out, size_t size) {
+   char name[IMAP_FIELD_LEN];
+   char mailbox[64];
+   char host[64];
+   imap_tok_t t;
+   bool first = true;
+
+   out[0] = '\0';
+   if (imap_next(c, &t) != ESP_OK) return ESP_FAIL;
+   if (t.type == IMAP_TOK_NIL) return ESP_OK;
+   if (t.type != IMAP_TOK_OPEN) return ESP_FAIL;
+
+   while (1) {
+       if (imap_next(c, &t) != ESP_OK) return ESP_FAIL;
+       if (t.type == IMAP_TOK_CLOSE) return ESP_OK;
+       if (t.type != IMAP_TOK_OPEN) return ESP_FAIL;
+
+       // (name adl mailbox host)
+       if (imap_string(c, name, sizeof(name)) != ESP_OK ||
+           imap_string(c, NULL, 0) != ESP_OK ||
+           imap_string(c, mailbox, sizeof(mailbox)) != ESP_OK ||
+           imap_string(c, host, sizeof(host)) != ESP_OK ||
+           imap_skip_list(c, 1) != ESP_OK) {
+           return ESP_FAIL;
+       }
+
+       if (first) {
+           if (name[0]) mime_header(name, out, size);
+           else snprintf(out, size, "%s%s%s", mailbox, host[0] ? "@" : "", host);
+           first = false;
+       }
+   }
+}
+
+// imap_envelope
+// The parts of an ENVELOPE the inbox shows: date, subject, and who it's from
+static esp_err_t imap_envelope(imap_conn_t *c, imap_summary_t *hdr) {
+   char subject[IMAP_LINE_LEN];
+   imap_tok_t t;
+
+   if (imap_next(c, &t) != ESP_OK || t.type != IMAP_TOK_OPEN) return ESP_FAIL;
+   if (imap_string(c, hdr->date, sizeof(hdr->date)) != ESP_OK ||
+       imap_string(c, subject, sizeof(subject)) != ESP_OK ||
+       imap_address(c, hdr->from, sizeof(hdr->from)) != ESP_OK) {
+       return ESP_FAIL;
+   }
+   mime_header(subject, hdr->subject, sizeof(hdr->subject));
+   // Sender, reply-to, to, cc, bcc, in-reply-to and message-id
+   return imap_skip_list(c, 1);
+}
+
+// imap_skip_part
+// Skips the rest of a body part, picking its file name out of its Content-Disposition on the
+// way if 'name' doesn't have one yet
+static esp_err_t imap_skip_part(imap_conn_t *c, char *name, size_t size) {
+   imap_tok_t t;
+   int depth = 1;
+   bool filename = false;
+
+   while (depth > 0) {
+       if (imap_next(c, &t) != ESP_OK || t.type == IMAP_TOK_EOL) return ESP_FAIL;
+       if (t.type == IMAP_TOK_OPEN) depth++;
+       else if (t.type == IMAP_TOK_CLOSE) depth--;
+
+       if (t.type == IMAP_TOK_STRING && filename && !name[0]) snprintf(name, size, "%s", t.s);
+       filename = (t.type == IMAP_TOK_STRING && strcasecmp(t.s, "FILENAME") == 0);
+   }
+   return ESP_OK;
+}
+
+// imap_add_attachment
+// Adds a part that isn't shown to the message's list of them
+static void imap_add_attachment(imap_summary_t *hdr, const char *name) {
+   char decoded[IMAP_FIELD_LEN];
+   size_t len = strlen(hdr->attachments);
+
+   mime_header(name, decoded, sizeof(decoded));
+   if (len + strlen(decoded) + 2 < sizeof(hdr->attachments)) {
+       snprintf(hdr->attachments + len, sizeof(hdr->attachments) - len, "%s%s", len ? ", " : "", decoded);
+   } else if (len + 5 < sizeof(hdr->attachments) && strcmp(hdr->attachments + len - 3, "...") != 0) {
+       snprintf(hdr->attachments + len, sizeof(hdr->attachments) - len, ", ...");
+   }
+}
+
+// imap_body_part
+// One body from a BODYSTRUCTURE, after its opening parenthesis. Multiparts are followed down to
+// IMAP_MAX_DEPTH. The text part that suits us best is kept in hdr->text, and every part that
+// isn't text (or is, but has a file name) is listed in hdr->attachments
+static esp_err_t imap_body_part(imap_conn_t *c, imap_summary_t *hdr, const char *section, int depth) {
+   imap_tok_t t;
+
+   if (depth >= IMAP_MAX_DEPTH) return imap_skip_list(c, 1);
+   if (imap_next(c, &t) != ESP_OK) return ESP_FAIL;
+
+   // A multipart is its parts, numbered from 1, then its subtype and extension data
+   if (t.type == IMAP_TOK_OPEN) {
+       char sub[sizeof(hdr->text.section)];
+       unsigned n = 0;
+
+       while (t.type == IMAP_TOK_OPEN) {
+           snprintf(sub, sizeof(sub), "%s%s%u", section, section[0] ? "." : "", ++n);
+           if (imap_body_part(c, hdr, sub, depth + 1) != ESP_OK) return ESP_FAIL;
+           if (imap_next(c, &t) != ESP_OK) return ESP_FAIL;
+       }
+       if (t.type == IMAP_TOK_CLOSE) return ESP_OK;
+       return imap_skip_list(c, 1);
+   }
+
+   // (type subtype (params) id description encoding size ...)
+   imap_part_t part = {0};
+   char type[16];
+   char name[IMAP_FIELD_LEN] = "";
+   if (t.type != IMAP_TOK_STRING && t.type != IMAP_TOK_ATOM) return ESP_FAIL;
+   snprintf(type, sizeof(type), "%s", t.s);
+   if (imap_string(c, part.subtype, sizeof(part.subtype)) != ESP_OK) return ESP_FAIL;
+
+   if (imap_next(c, &t) != ESP_OK) return ESP_FAIL;
+   bool params = (t.type == IMAP_TOK_OPEN);
+   while (params) {
+       char param[16];
+       if (imap_next(c, &t) != ESP_OK) return ESP_FAIL;
+       if (t.type == IMAP_TOK_CLOSE) break;
+       snprintf(param, sizeof(param), "%s", t.s);
+
+       esp_err_t err;
+       if (strcasecmp(param, "CHARSET") == 0) err = imap_string(c, part.charset, sizeof(part.charset));
+       else if (strcasecmp(param, "NAME") == 0) err = imap_string(c, name, sizeof(name));
+       else err = imap_string(c, NULL, 0);
+       if (err != ESP_OK) return ESP_FAIL;
+   }
+
+   if (imap_string(c, NULL, 0) != ESP_OK ||
+       imap_string(c, NULL, 0) != ESP_OK ||
+       imap_string(c, part.encoding, sizeof(part.encoding)) != ESP_OK ||
+       imap_next(c, &t) != ESP_OK) {
+       return ESP_FAIL;
+   }
+   part.size = strtoul(t.s, NULL, 10);
+   if (imap_skip_part(c, name, sizeof(name)) != ESP_OK) return ESP_FAIL;
+
+   bool plain = (strcasecmp(part.subtype, "PLAIN") == 0);
+   bool text = (strcasecmp(type, "TEXT") == 0) && (plain || strcasecmp(part.subtype, "HTML") == 0);
+   if (!text || name[0]) {
+       if (!name[0]) snprintf(name, sizeof(name), "%s/%s", type, part.subtype);
+       imap_add_attachment(hdr, name);
+       return ESP_OK;
+   }
+
+   if (!hdr->text.section[0] || (plain && strcasecmp(hdr->text.subtype, "PLAIN") != 0)) {
+       // A message that isn't multipart is all one part, section 1
+       snprintf(part.section, sizeof(part.section), "%s", section[0] ? section : "1");
+       hdr->text = part;
+   }
+   return ESP_OK;
+}
+
+// imap_fetch
+// The rest of a "* n FETCH (...)" response, which is handed to on_fetch once it's all read.
+// Items we didn't ask for (FLAGS the server tells us about on its own) are skipped
+static esp_err_t imap_fetch(imap_conn_t *c, uint32_t seq, imap_fetch_fn on_fetch, void *ctx) {
+   imap_fetch_t *f = &c->fetch;
+   imap_tok_t t;
+
+   memset(f, 0, sizeof(*f));
+   f->seq = seq;
+
+   if (imap_next(c, &t) != ESP_OK || t.type != IMAP_TOK_OPEN) return ESP_FAIL;
+
+   while (1) {
+       if (imap_next(c, &t) != ESP_OK) return ESP_FAIL;
+       if (t.type == IMAP_TOK_CLOSE) break;
+       if (t.type != IMAP_TOK_ATOM) return ESP_FAIL;
+
+       esp_err_t err;
+       if (strcasecmp(t.s, "UID") == 0) {
+           err = imap_next(c, &t);
+           f->hdr.uid = strtoul(t.s, NULL, 10);
+       } else if (strcasecmp(t.s, "ENVELOPE") == 0) {
+           err = imap_envelope(c, &f->hdr);
+       } else if (strcasecmp(t.s, "BODYSTRUCTURE") == 0) {
+           err = imap_next(c, &t);
+           if (err == ESP_OK && t.type == IMAP_TOK_OPEN) err = imap_body_part(c, &f->hdr, "", 0);
+       } else if (strncasecmp(t.s, "BODY[", 5) == 0) {
+           // A literal is streamed to the sink as it's read (which clears in_body), a short text
+           // can come as a quoted string instead and is handed over here. Only the message the
+           // sink is for goes to it, as far as we can tell before the UID has been seen
+           bool ours = c->sink && (f->hdr.uid == 0 || f->hdr.uid == c->sink_uid);
+           c->in_body = ours;
+           err = imap_next(c, &t);
+           if (err == ESP_OK && ours && t.type == IMAP_TOK_STRING) {
+               if (c->in_body) mime_feed(c->sink, t.s, t.len);
+               f->body = true;
+           }
+           c->in_body = false;
+       } else {
+           err = imap_next(c, &t);
+           if (err == ESP_OK && t.type == IMAP_TOK_OPEN) err = imap_skip_list(c, 1);
+       }
+       if (err != ESP_OK) return ESP_FAIL;
+   }
+
+   if (imap_rest(c) != ESP_OK) return ESP_FAIL;
+   if (on_fetch) on_fetch(ctx, f);
+   return ESP_OK;
+}
+
+// imap_write
+// Writes all of buf, esp_tls can take less than it's given
+static esp_err_t imap_write(imap_conn_t *c, const char *buf, size_t len) {
+   while (len > 0) {
+       int n = esp_tls_conn_write(c->tls, buf, len);
+       if (n == ESP_TLS_ERR_SSL_WANT_READ || n == ESP_TLS_ERR_SSL_WANT_WRITE) continue;
+       if (n <= 0) return ESP_FAIL;
+       buf += n;
+       len -= n;
+   }
+   return ESP_OK;
+}
+
+// imap_send_cmd
+// Sends a command with the next tag in front of it, and returns the tag
+static unsigned imap_send_cmd(imap_conn_t *c, const char *fmt, ...) {
+   char cmd[640];
+   va_list args;
+
+   unsigned tag = ++c->tag;
+   int n = snprintf(cmd, sizeof(cmd), "a%03u ", tag);
+
+   va_start(args, fmt);
+   n += vsnprintf(cmd + n, sizeof(cmd) - n, fmt, args);
+   va_end(args);
+
+   if (n > (int)sizeof(cmd) - 3) {
+       ESP_LOGE(IMAP_TAG, "Command too long");
+       return 0;
+   }
+   memcpy(cmd + n, "\r\n", 2);
+   return imap_write(c, cmd, n + 2) == ESP_OK ? tag : 0;
+}
+
+// imap_untagged
+// Handles a "* ..." response after the "*". The mailbox size and capabilities go into the
+// connection, a FETCH goes to on_fetch
+static esp_err_t imap_untagged(imap_conn_t *c, imap_fetch_fn on_fetch, void *ctx) {
+   imap_tok_t t;
+
+   if (imap_next(c, &t) != ESP_OK) return ESP_FAIL;
+   if (t.type == IMAP_TOK_EOL) return ESP_OK;
+
+   if (t.type == IMAP_TOK_ATOM && isdigit((unsigned char)t.s[0])) {
+       uint32_t num = strtoul(t.s, NULL, 10);
+       if (imap_next(c, &t) != ESP_OK) return ESP_FAIL;
+       if (t.type != IMAP_TOK_ATOM) return (t.type == IMAP_TOK_EOL) ? ESP_OK : imap_rest(c);
+
+       if (strcasecmp(t.s, "FETCH") == 0) {
+           return imap_fetch(c, num, on_fetch, ctx);
+       } else if (strcasecmp(t.s, "EXISTS") == 0) {
+           c->exists = num;
+           c->changed = true;
+       } else if (strcasecmp(t.s, "EXPUNGE") == 0) {
+           if (c->exists > 0) c->exists--;
+           c->expunged = true;
+           c->changed = true;
+       }
+       return imap_rest(c);
+   }
+
+   // Everything else is just words, only a couple of them matter
+   bool capability = (t.type == IMAP_TOK_ATOM && strcasecmp(t.s, "CAPABILITY") == 0);
+   if (t.type == IMAP_TOK_ATOM && strcasecmp(t.s, "BYE") == 0) c->bye = true;
+   if (imap_rest(c) != ESP_OK) return ESP_FAIL;
+
+   if ((capability || strncmp(c->line, " [CAPABILITY ", 13) == 0) && strstr(c->line, " IDLE")) {
+       c->can_idle = true;
+   }
+
+   const char *uv = strstr(c->line, "[UIDVALIDITY ");
+   if (uv) c->uidvalidity = strtoul(uv + 13, NULL, 10);
+   return ESP_OK;
+}
+
+// imap_response
+// Reads one whole response. Returns the tag of a tagged one (with *ok set to whether it was OK),
+// IMAP_UNTAGGED, IMAP_CONTINUE for a "+", or -1 if the connection failed
+static int imap_response(imap_conn_t *c, imap_fetch_fn on_fetch, void *ctx, bool *ok) {
+   imap_tok_t t;
+
+   if (imap_next(c, &t) != ESP_OK) return -1;
+   if (t.type == IMAP_TOK_EOL) return IMAP_UNTAGGED;
+
+   if (t.type == IMAP_TOK_ATOM && strcmp(t.s, "*") == 0) {
+       return (imap_untagged(c, on_fetch, ctx) == ESP_OK) ? IMAP_UNTAGGED : -1;
+   }
+
+   bool cont = (t.type == IMAP_TOK_ATOM && strcmp(t.s, "+") == 0);
+   int tag = (t.type == IMAP_TOK_ATOM && t.s[0] == 'a') ? atoi(t.s + 1) : 0;
+   if (imap_rest(c) != ESP_OK) return -1;
+
+   if (cont) return IMAP_CONTINUE;
+   if (tag <= 0) return IMAP_UNTAGGED;
+   *ok = (strncasecmp(c->line, " OK", 3) == 0);
+   return tag;
+}
+
+// imap_wait
+// Reads responses until the tagged one for 'tag', and returns whether it was OK
+static esp_err_t imap_wait(imap_conn_t *c, unsigned tag, imap_fetch_fn on_fetch, void *ctx) {
+   if (tag == 0) return ESP_FAIL;
+
+   while (1) {
+       bool ok = false;
+       int r = imap_response(c, on_fetch, ctx, &ok);
+       if (r < 0) {
+           ESP_LOGW(IMAP_TAG, "Connection lost waiting for a%03u", tag);
+           return ESP_FAIL;
+       }
+       if (r == (int)tag) {
+           if (ok) return ESP_OK;
+           ESP_LOGW(IMAP_TAG, "a%03u%s", tag, c->line);
+           return ESP_FAIL;
+       }
+   }
+}
+
+// imap_quote
+// Writes a string as an IMAP quoted string
+static void imap_quote(const char *src, char *dst, size_t size) {
+   size_t j = 0;
+
+   dst[j++] = '"';
+   for (; *src && j + 3 < size; src++) {
+       if (*src == '"' || *src == '\\') dst[j++] = '\\';
+       dst[j++] = *src;
+   }
+   dst[j++] = '"';
+   dst[j] = '\0';
+}
+
+// Messages being put together by a sync (or an older page), before they go where they're kept.
+// FETCH responses for UIDs under min_uid are left out
+typedef struct {
+   imap_msg_t msgs[IMAP_CACHE_MESSAGES];
+   size_t count;
+   uint32_t min_uid;
+} imap_sync_t;
+
+// imap_on_summary
+// A message's envelope and where its text is
+static void imap_on_summary(void *ctx, const imap_fetch_t *f) {
+   imap_sync_t *s = ctx;
+
+   if (f->hdr.uid == 0 || f->hdr.uid < s->min_uid || s->count == IMAP_CACHE_MESSAGES) return;
+
+   imap_msg_t *m = &s->msgs[s->count++];
+   memset(m, 0, sizeof(*m));
+   m->hdr = f->hdr;
+}
+
+// A message's text being rendered as it's fetched
+typedef struct {
+   imap_summary_t hdr;
+   mime_t mime;
+   char *out;
+   bool got;
+   bool mixed;
+} imap_text_t;
+
+// imap_on_text
+// Notes whether the text that went to the sink was the message it's for. A server that put the
+// UID after the text could have sent another message's there, that one is thrown away
+static void imap_on_text(void *ctx, const imap_fetch_t *f) {
+   imap_text_t *t = ctx;
+
+   if (!f->body) return;
+   if (f->hdr.uid == t->hdr.uid) t->got = true;
+   else t->mixed = true;
+}
+
+// imap_text_begin
+// Sets up the connection's sink to render a message's text part
+static esp_err_t imap_text_begin(imap_conn_t *c, imap_text_t *t) {
+   t->got = false;
+   t->mixed = false;
+   t->out = heap_caps_malloc(IMAP_BODY_MAX + 1, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+   if (!t->out) return ESP_ERR_NO_MEM;
+
+   mime_begin(&t->mime, t->out, IMAP_BODY_MAX + 1, t->hdr.text.subtype, t->hdr.text.encoding,
+              t->hdr.text.charset);
+   c->sink = &t->mime;
+   c->sink_uid = t->hdr.uid;
+   return ESP_OK;
+}
+
+// imap_text_end
+// Finishes the rendered text and returns it, trimmed to size, or NULL if it never came
+static char *imap_text_end(imap_conn_t *c, imap_text_t *t) {
+   static const char cut[] = "<p><i>[The rest of this message was cut off]</i>";
+
+   c->sink = NULL;
+   c->sink_uid = 0;
+   if (!t->got || t->mixed) {
+       heap_caps_free(t->out);
+       t->out = NULL;
+       return NULL;
+   }
+
+   size_t len = mime_finish(&t->mime);
+   if ((t->mime.full || t->hdr.text.size > IMAP_PART_MAX) && len + sizeof(cut) <= IMAP_BODY_MAX + 1) {
+       memcpy(t->out + len, cut, sizeof(cut));
+       len += sizeof(cut) - 1;
+   }
+
+   char *out = heap_caps_realloc(t->out, len + 1, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+   if (!out) out = t->out;
+   t->out = NULL;
+   return out;
+}
+
+// imap_fetch_text
+// Sends the command for a message's text part, up to IMAP_PART_MAX bytes of it
+static unsigned imap_fetch_text(imap_conn_t *c, const imap_summary_t *hdr) {
+   return imap_send_cmd(c, "UID FETCH %u (BODY.PEEK[%s]<0.%u>)", (unsigned)hdr->uid,
+                        hdr->text.section, (unsigned)IMAP_PART_MAX);
+}
+
+// imap_uid_cmp
+// Newest (highest UID) first
+static int imap_uid_cmp(const void *a, const void *b) {
+   uint32_t ua = ((const imap_msg_t *)a)->hdr.uid;
+   uint32_t ub = ((const imap_msg_t *)b)->hdr.uid;
+   return (ua < ub) - (ua > ub);
+}
+
+// imap_cached_body
+// Whether the cache already has a message's body. Must be called with cache_lock held
+static bool imap_cached_body(uint32_t uid) {
+   for (size_t i = 0; i < cache_count; i++) {
+       if (cache[i].hdr.uid == uid) return cache[i].body != NULL;
+   }
+   return false;
+}
+
+// imap_fetch_bodies
+// Fetches the text part of the messages in a sync that need it. The commands all go out before
+// any answer is read, so it's one round trip to the server instead of one per message. The
+// answers come back in order and each one is rendered as it's read
+static esp_err_t imap_fetch_bodies(imap_conn_t *c, imap_sync_t *s, const bool *need) {
+   unsigned tags[IMAP_CACHE_MESSAGES];
+   size_t which[IMAP_CACHE_MESSAGES];
+   esp_err_t err = ESP_OK;
+   size_t n = 0;
+
+   for (size_t i = 0; i < s->count; i++) {
+       if (!need[i]) continue;
+       which[n] = i;
+       tags[n] = imap_fetch_text(c, &s->msgs[i].hdr);
+       if (tags[n++] == 0) return ESP_FAIL;
+   }
+   if (n == 0) return ESP_OK;
+
+   imap_text_t *t = heap_caps_calloc(1, sizeof(imap_text_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+   if (!t) return ESP_ERR_NO_MEM;
+
+   for (size_t i = 0; err == ESP_OK && i < n; i++) {
+       imap_msg_t *m = &s->msgs[which[i]];
+       t->hdr = m->hdr;
+
+       // Still read the answer without anywhere to put it, so the ones after it line up
+       if (imap_text_begin(c, t) != ESP_OK) c->sink = NULL;
+       err = imap_wait(c, tags[i], imap_on_text, t);
+       m->body = imap_text_end(c, t);
+   }
+
+   heap_caps_free(t);
+   return err;
+}
+
+// imap_sync
+// Brings the cache up to date with the newest IMAP_CACHE_MESSAGES in the mailbox. When all that's
+// happened since the last sync is new mail, only the new messages are fetched (by UID, from just
+// past the newest one cached), otherwise the whole window is fetched again. Bodies are only
+// fetched for messages that aren't cached yet
+static esp_err_t imap_sync(imap_conn_t *c) {
+   bool need[IMAP_CACHE_MESSAGES];
+
+   imap_sync_t *s = heap_caps_calloc(1, sizeof(imap_sync_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+   if (!s) return ESP_ERR_NO_MEM;
+
+   xSemaphoreTake(cache_lock, portMAX_DELAY);
+   bool same_mailbox = (c->uidvalidity == cache_uidvalidity);
+   uint32_t newest = (cache_count > 0) ? cache[0].hdr.uid : 0;
+   xSemaphoreGive(cache_lock);
+
+   uint32_t added = c->exists - c->synced_exists;
+   bool incremental = same_mailbox && newest > 0 && !c->expunged &&
+                      c->exists >= c->synced_exists && added <= IMAP_CACHE_MESSAGES;
+   esp_err_t err = ESP_OK;
+   c->changed = false;
+   c->expunged = false;
+
+   if (incremental && added > 0) {
+       // "n:*" always has the newest message in it even when that's below n, min_uid drops it
+       s->min_uid = newest + 1;
+       unsigned tag = imap_send_cmd(c, "UID FETCH %u:* " IMAP_SUMMARY_ITEMS, (unsigned)s->min_uid);
+       err = imap_wait(c, tag, imap_on_summary, s);
+   } else if (!incremental && c->exists > 0) {
+       uint32_t first = (c->exists > IMAP_CACHE_MESSAGES) ? c->exists - IMAP_CACHE_MESSAGES + 1 : 1;
+       unsigned tag = imap_send_cmd(c, "FETCH %u:%u " IMAP_SUMMARY_ITEMS, (unsigned)first, (unsigned)c->exists);
+       err = imap_wait(c, tag, imap_on_summary, s);
+   }
+   if (err != ESP_OK) goto done;
+
+   // After only fetching what's new, the rest of the window is what's already cached
+   xSemaphoreTake(cache_lock, portMAX_DELAY);
+   for (size_t j = 0; incremental && j < cache_count && s->count < IMAP_CACHE_MESSAGES; j++) {
+       s->msgs[s->count].hdr = cache[j].hdr;
+       s->msgs[s->count++].body = NULL;
+   }
+   qsort(s->msgs, s->count, sizeof(s->msgs[0]), imap_uid_cmp);
+   for (size_t i = 0; i < s->count; i++) {
+       need[i] = s->msgs[i].hdr.text.section[0] && !(same_mailbox && imap_cached_body(s->msgs[i].hdr.uid));
+   }
+   xSemaphoreGive(cache_lock);
+
+   err = imap_fetch_bodies(c, s, need);
+   if (err != ESP_OK) goto done;
+
+   // Swap the new list in, bodies we already had move over from the old one
+   xSemaphoreTake(cache_lock, portMAX_DELAY);
+   if (!same_mailbox && cache_count > 0) {
+       ESP_LOGI(IMAP_TAG, "UIDVALIDITY changed, starting the cache over");
+   }
+   for (size_t i = 0; i < s->count; i++) {
+       imap_msg_t *m = &s->msgs[i];
+       for (size_t j = 0; same_mailbox && !m->body && j < cache_count; j++) {
+           if (cache[j].hdr.uid == m->hdr.uid) {
+               m->body = cache[j].body;
+               cache[j].body = NULL;
+           }
+       }
+   }
+   for (size_t j = 0; j < cache_count; j++) heap_caps_free(cache[j].body);
+   memcpy(cache, s->msgs, s->count * sizeof(s->msgs[0]));
+   cache_count = s->count;
+   cache_uidvalidity = c->uidvalidity;
+   s->count = 0;
+
+   // The older pages are counted back from the newest message, so they've all moved if anything
+   // came in or was expunged since the page was fetched, or the mailbox was recreated
+   if (!incremental || page_exists != c->exists || page_uidvalidity != c->uidvalidity) page_no = 0;
+
+   status.synced = true;
+   status.exists = c->exists;
+   status.cached = cache_count;
+   status.syncs++;
+   status.synced_us = esp_timer_get_time();
+   xSemaphoreGive(cache_lock);
+
+   c->synced_exists = c->exists;
+   ESP_LOGI(IMAP_TAG, "Synced, %u messages in INBOX, %u cached%s", (unsigned)c->exists,
+            (unsigned)cache_count, incremental ? "" : ", all fetched again");
+
+done:
+   for (size_t i = 0; i < s->count; i++) heap_caps_free(s->msgs[i].body);
+   heap_caps_free(s);
+   return err;
+}
+
+// imap_load_page
+// Fetches the envelopes of an older page of the inbox, counted back from the newest message by
+// sequence number. The messages on it are still sorted and linked to by UID, so one opened from
+// the page is the right one even if the mailbox has changed since
+static esp_err_t imap_load_page(imap_conn_t *c, uint32_t no) {
+   uint64_t skip = (uint64_t)no * IMAP_PAGE_SIZE;
+   esp_err_t err = ESP_OK;
+
+   imap_sync_t *s = heap_caps_calloc(1, sizeof(imap_sync_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+   if (!s) return ESP_ERR_NO_MEM;
+
+   if (skip < c->exists) {
+       uint32_t last = c->exists - skip;
+       uint32_t first = (last > IMAP_PAGE_SIZE) ? last - IMAP_PAGE_SIZE + 1 : 1;
+       unsigned tag = imap_send_cmd(c, "FETCH %u:%u " IMAP_SUMMARY_ITEMS, (unsigned)first, (unsigned)last);
+       err = imap_wait(c, tag, imap_on_summary, s);
+   }
+
+   if (err == ESP_OK) {
+       qsort(s->msgs, s->count, sizeof(s->msgs[0]), imap_uid_cmp);
+
+       xSemaphoreTake(cache_lock, portMAX_DELAY);
+       for (size_t i = 0; i < s->count; i++) page[i] = s->msgs[i].hdr;
+       page_count = s->count;
+       page_no = no;
+       page_exists = c->exists;
+       page_uidvalidity = c->uidvalidity;
+       xSemaphoreGive(cache_lock);
+   }
+
+   heap_caps_free(s);
+   return err;
+}
+
+// imap_load_body
+// Fetches the text of a message that isn't in the cache (one from an older page) into 'extra'
+static esp_err_t imap_load_body(imap_conn_t *c, uint32_t uid) {
+   imap_msg_t m = {0};
+   bool found = false;
+
+   xSemaphoreTake(cache_lock, portMAX_DELAY);
+   for (size_t i = 0; !found && i < cache_count; i++) {
+       if (cache[i].hdr.uid == uid) {
+           m.hdr = cache[i].hdr;
+           found = true;
+       }
+   }
+   for (size_t i = 0; !found && page_no > 0 && i < page_count; i++) {
+       if (page[i].uid == uid) {
+           m.hdr = page[i];
+           found = true;
+       }
+   }
+   xSemaphoreGive(cache_lock);
+
+   if (!found) return ESP_ERR_NOT_FOUND;
+
+   if (m.hdr.text.section[0]) {
+       imap_text_t *t = heap_caps_calloc(1, sizeof(imap_text_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+       if (!t) return ESP_ERR_NO_MEM;
+       t->hdr = m.hdr;
+
+       esp_err_t err = imap_text_begin(c, t);
+       if (err == ESP_OK) {
+           err = imap_wait(c, imap_fetch_text(c, &m.hdr), imap_on_text, t);
+           m.body = imap_text_end(c, t);
+       }
+       heap_caps_free(t);
+       if (err != ESP_OK) {
+           heap_caps_free(m.body);
+           return err;
+       }
+       // Expunged since the page was fetched
+       if (!m.body) return ESP_ERR_NOT_FOUND;
+   } else {
+       m.body = heap_caps_calloc(1, 1, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+       if (!m.body) return ESP_ERR_NO_MEM;
+   }
+
+   xSemaphoreTake(cache_lock, portMAX_DELAY);
+   heap_caps_free(extra.body);
+   extra = m;
+   xSemaphoreGive(cache_lock);
+   return ESP_OK;
+}
+
+// imap_request_take
+// Copies out the request waiting on the task, if there is one. seq is what it's answered with
+static imap_req_kind_t imap_request_take(uint32_t *arg, uint32_t *seq) {
+   portENTER_CRITICAL(&req_mux);
+   imap_req_kind_t kind = req_kind;
+   *arg = req_arg;
+   *seq = req_seq;
+   portEXIT_CRITICAL(&req_mux);
+   return kind;
+}
+
+// imap_request_pending
+// Whether a page is waiting on the task
+static bool imap_request_pending(void) {
+   uint32_t arg, seq;
+   return imap_request_take(&arg, &seq) != IMAP_REQ_NONE;
+}
+
+// imap_request_done
+// Hands the result of request seq back. If that caller gave up on it and another request has
+// come in since, the new one is left waiting and the result is passed over by its caller
+static void imap_request_done(uint32_t seq, esp_err_t err) {
+   portENTER_CRITICAL(&req_mux);
+   req_err = err;
+   req_served = seq;
+   if (req_seq == seq) req_kind = IMAP_REQ_NONE;
+   portEXIT_CRITICAL(&req_mux);
+   xSemaphoreGive(req_done);
+}
+
+// imap_service
+// Does whatever a page is waiting on. Only losing the connection is an error here, anything else
+// (a message that's gone) goes back to the page
+static esp_err_t imap_service(imap_conn_t *c) {
+   uint32_t arg, seq;
+
+   imap_req_kind_t kind = imap_request_take(&arg, &seq);
+   if (kind == IMAP_REQ_NONE) return ESP_OK;
+
+   esp_err_t err = (kind == IMAP_REQ_PAGE) ? imap_load_page(c, arg) : imap_load_body(c, arg);
+   imap_request_done(seq, err);
+   return (err == ESP_FAIL) ? ESP_FAIL : ESP_OK;
+}
+
+// imap_idle
+// Sits in IDLE until the server says the mailbox changed, it's time to renew the IDLE, or a page
+// is waiting on the task. The socket is checked every IMAP_IDLE_CHECK_MS so that last one is
+// seen quickly without a read timeout to wait out
+static esp_err_t imap_idle(imap_conn_t *c) {
+   bool ok = false;
+   int r;
+
+   unsigned tag = imap_send_cmd(c, "IDLE");
+   if (tag == 0) return ESP_FAIL;
+
+   // Wait for the go ahead, a server that turns it down gets polled instead
+   do {
+       r = imap_response(c, NULL, NULL, &ok);
+       if (r < 0) return ESP_FAIL;
+       if (r == (int)tag) {
+           c->can_idle = false;
+           return ESP_OK;
+       }
+   } while (r != IMAP_CONTINUE);
+
+   status.idle = true;
+   int64_t start = imap_now_s();
+   while (!c->changed && !settings_changed && imap_now_s() - start < IMAP_IDLE_RENEW_S) {
+       if (ulTaskNotifyTake(pdTRUE, 0) && imap_request_pending()) break;
+       if (!imap_readable(c, IMAP_IDLE_CHECK_MS)) continue;
+
+       if (imap_response(c, NULL, NULL, &ok) < 0) {
+           status.idle = false;
+           return ESP_FAIL;
+       }
+   }
+   status.idle = false;
+
+   if (imap_write(c, "DONE\r\n", 6) != ESP_OK) return ESP_FAIL;
+   return imap_wait(c, tag, NULL, NULL);
+}
+
+// imap_poll
+// For servers without IDLE, waits out the poll interval (or until wanted) and asks for news
+static esp_err_t imap_poll(imap_conn_t *c) {
+   ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(IMAP_POLL_S * 1000));
+   return imap_wait(c, imap_send_cmd(c, "NOOP"), NULL, NULL);
+}
+
+// imap_session
+// Logs in and keeps the cache in sync until the connection drops or the settings change
+static esp_err_t imap_session(const settings_email_t *email) {
+   char user[2 * sizeof(email->username) + 3];
+   char pass[2 * sizeof(email->password) + 3];
+   esp_err_t err = ESP_FAIL;
+   bool ok = false;
+
+   int port = atoi(email->imap_port);
+   if (port <= 0) port = 993;
+
+   imap_conn_t *c = heap_caps_calloc(1, sizeof(imap_conn_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+   if (!c) return ESP_ERR_NO_MEM;
+
+   esp_tls_cfg_t cfg = {
+       .crt_bundle_attach = esp_crt_bundle_attach,
+       .timeout_ms = IMAP_READ_TIMEOUT_MS,
+   };
+
+   c->tls = tls_cache_connect(email->imap_server, port, &cfg);
+   if (!c->tls) {
+       ESP_LOGE(IMAP_TAG, "TLS connection to %s:%d failed", email->imap_server, port);
+       goto done;
+   }
+   status.connects++;
+
+   // Greeting, it might already tell us the capabilities
+   if (imap_response(c, NULL, NULL, &ok) != IMAP_UNTAGGED || c->bye) {
+       ESP_LOGE(IMAP_TAG, "Bad greeting:%s", c->line);
+       goto done;
+   }
+
+   imap_quote(email->username, user, sizeof(user));
+   imap_quote(email->password, pass, sizeof(pass));
+   if (imap_wait(c, imap_send_cmd(c, "LOGIN %s %s", user, pass), NULL, NULL) != ESP_OK) {
+       ESP_LOGE(IMAP_TAG, "Login failed");
+       goto done;
+   }
+   memset(pass, 0, sizeof(pass));
+
+   // The capabilities can change after login
+   if (imap_wait(c, imap_send_cmd(c, "CAPABILITY"), NULL, NULL) != ESP_OK ||
+       imap_wait(c, imap_send_cmd(c, "SELECT INBOX"), NULL, NULL) != ESP_OK) {
+       goto done;
+   }
+
+   ESP_LOGI(IMAP_TAG, "Logged in to %s, %u messages, %s", email->imap_server,
+            (unsigned)c->exists, c->can_idle ? "IDLE" : "polling");
+   status.connected = true;
+   c->changed = true;
+
+   while (!settings_changed) {
+       if (c->changed && imap_sync(c) != ESP_OK) goto done;
+       if (imap_service(c) != ESP_OK) goto done;
+       if (settings_changed || c->changed || imap_request_pending()) continue;
+       if ((c->can_idle ? imap_idle(c) : imap_poll(c)) != ESP_OK) goto done;
+   }
+
+   imap_wait(c, imap_send_cmd(c, "LOGOUT"), NULL, NULL);
+   err = ESP_OK;
+
+done:
+   memset(pass, 0, sizeof(pass));
+   status.connected = false;
+   uint32_t arg, seq;
+   if (imap_request_take(&arg, &seq) != IMAP_REQ_NONE) imap_request_done(seq, ESP_FAIL);
+   if (c->tls) esp_tls_conn_destroy(c->tls);
+   heap_caps_free(c);
+   return err;
+}
+
+// on_email_settings
+// New server or login, the session is dropped and started again with them
+static void on_email_settings(const settings_t *settings, uint32_t changed, void *ctx) {
+   settings_changed = true;
+   if (imap_task_handle) xTaskNotifyGive(imap_task_handle);
+}
+
+// imap_init
+// Sets up the cache in PSRAM, call before starting imap_task
+void imap_init(void) {
+   cache_lock = xSemaphoreCreateMutex();
+   req_lock = xSemaphoreCreateMutex();
+   req_done = xSemaphoreCreateBinary();
+   cache = heap_caps_calloc(IMAP_CACHE_MESSAGES, sizeof(imap_msg_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+   page = heap_caps_calloc(IMAP_PAGE_SIZE, sizeof(imap_summary_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+   if (!cache_lock || !req_lock || !req_done || !cache || !page) {
+       ESP_LOGE(IMAP_TAG, "Failed to allocate the mailbox cache");
+       heap_caps_free(cache);
+       cache = NULL;
+   }
+   settings_subscribe(SETTINGS_EMAIL, on_email_settings, NULL);
+}
+
+// imap_task
+// Keeps a logged in connection to the IMAP server for as long as there are email settings and a
+// way out to the internet, reconnecting with a growing wait when it fails
+void imap_task(void *arg) {
+   settings_t cfg;
+   uint32_t retry_s = IMAP_RETRY_MIN_S;
+
+   imap_task_handle = xTaskGetCurrentTaskHandle();
+
+   while (1) {
+       settings_get(&cfg);
+       settings_changed = false;
+
+       if (!cache || !(cfg.present & SETTINGS_EMAIL) || !cfg.email.imap_server[0] || !is_sta_connected()) {
+           ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(IMAP_RETRY_MIN_S * 1000));
+           continue;
+       }
+
+       if (imap_session(&cfg.email) == ESP_OK) {
+           retry_s = IMAP_RETRY_MIN_S;
+           continue;
+       }
+
+       status.failures++;
+       ESP_LOGW(IMAP_TAG, "Session ended, retrying in %u s", (unsigned)retry_s);
+       ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(retry_s * 1000));
+       retry_s = (retry_s * 2 > IMAP_RETRY_MAX_S) ? IMAP_RETRY_MAX_S : retry_s * 2;
+   }
+}
+
+// imap_sync_now
+// Asks the task to check the mailbox as soon as it can. A server that can IDLE tells us about
+// new mail by itself, so this only cuts a poll short
+void imap_sync_now(void) {
+   if (imap_task_handle) xTaskNotifyGive(imap_task_handle);
+}
+
+// imap_request
+// Hands the task something to fetch for a page and waits for it. Blocks for up to
+// IMAP_FETCH_TIMEOUT_MS, so it's only for handlers running on the worker pool
+static esp_err_t imap_request(imap_req_kind_t kind, uint32_t arg) {
+   const TickType_t timeout = pdMS_TO_TICKS(IMAP_FETCH_TIMEOUT_MS);
+   TickType_t start = xTaskGetTickCount();
+   TickType_t waited;
+
+   if (!req_lock || !imap_task_handle || !status.connected) return ESP_ERR_INVALID_STATE;
+   if (xSemaphoreTake(req_lock, timeout) != pdTRUE) return ESP_ERR_TIMEOUT;
+
+   portENTER_CRITICAL(&req_mux);
+   uint32_t seq = req_seq + 1;
+   req_arg = arg;
+   req_seq = seq;
+   req_kind = kind;
+   portEXIT_CRITICAL(&req_mux);
+   xTaskNotifyGive(imap_task_handle);
+
+   // A give left behind by a request that timed out is passed over
+   esp_err_t err = ESP_ERR_TIMEOUT;
+   while ((waited = xTaskGetTickCount() - start) < timeout) {
+       if (xSemaphoreTake(req_done, timeout - waited) != pdTRUE) break;
+       portENTER_CRITICAL(&req_mux);
+       bool served = (req_served == seq);
+       if (served) err = req_err;
+       portEXIT_CRITICAL(&req_mux);
+       if (served) break;
+   }
+
+   // Given up on, so the task doesn't start on it if it hasn't yet
+   if (err == ESP_ERR_TIMEOUT) {
+       portENTER_CRITICAL(&req_mux);
+       if (req_seq == seq) req_kind = IMAP_REQ_NONE;
+       portEXIT_CRITICAL(&req_mux);
+   }
+
+   xSemaphoreGive(req_lock);
+   return err;
+}
+
+// imap_request_page
+// Fetches an older page of the inbox (1 and up), for imap_list to copy out after
+esp_err_t imap_request_page(uint32_t no) {
+   return imap_request(IMAP_REQ_PAGE, no);
+}
+
+// imap_request_body
+// Fetches the text of a message that isn't in the cache, for imap_get_body to copy out after
+esp_err_t imap_request_body(uint32_t uid) {
+   return imap_request(IMAP_REQ_BODY, uid);
+}
+
+// imap_list
+// Copies out a page of the inbox, newest first. Page 0 is the cache and is there once the first
+// sync is done, an older page only if it's the last one fetched with imap_request_page
+bool imap_list(uint32_t no, imap_summary_t *out, size_t max, size_t *count) {
+   bool found = false;
+
+   *count = 0;
+   if (!cache_lock) return false;
+
+   xSemaphoreTake(cache_lock, portMAX_DELAY);
+   if (no == 0) {
+       found = status.synced;
+       *count = (cache_count < max) ? cache_count : max;
+       for (size_t i = 0; i < *count; i++) out[i] = cache[i].hdr;
+   } else if (no == page_no) {
+       found = true;
+       *count = (page_count < max) ? page_count : max;
+       for (size_t i = 0; i < *count; i++) out[i] = page[i];
+   }
+   xSemaphoreGive(cache_lock);
+   return found;
+}
+
+// imap_get_body
+// Copies out a message and its body, false if it's neither cached nor the last one fetched with
+// imap_request_body
+bool imap_get_body(uint32_t uid, imap_summary_t *summary, char *body, size_t size) {
+   const imap_msg_t *m = NULL;
+
+   if (!cache_lock) return false;
+
+   xSemaphoreTake(cache_lock, portMAX_DELAY);
+   for (size_t i = 0; i < cache_count; i++) {
+       // One without a text part has nothing to fetch
+       if (cache[i].hdr.uid == uid && (cache[i].body || !cache[i].hdr.text.section[0])) {
+           m = &cache[i];
+           break;
+       }
+   }
+   if (!m && extra.body && extra.hdr.uid == uid) m = &extra;
+
+   if (m) {
+       *summary = m->hdr;
+       snprintf(body, size, "%s", m->body ? m->body : "");
+   }
+   xSemaphoreGive(cache_lock);
+   return m != NULL;
+}
+
+// imap_get_status
+// Copies out the connection state and counters for the stats page
+void imap_get_status(imap_status_t *out) {
+   if (cache_lock) xSemaphoreTake(cache_lock, portMAX_DELAY);
+   *out = status;
+   if (cache_lock) xSemaphoreGive(cache_lock);
+}
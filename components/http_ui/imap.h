@@ -0,0 +1,103 @@
+// Mailbox sync config
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+// Number of the newest messages in INBOX that are kept, headers and bodies
+#define IMAP_CACHE_MESSAGES 20
+
+// How much of each message's text part is fetched, anything past this is cut off
+#define IMAP_PART_MAX (32 * 1024)
+
+// How much of each message is kept once it's been rendered to HTML for the N64 (see mime.h),
+// anything past this is cut off too
+#define IMAP_BODY_MAX (8 * 1024)
+
+// Longest From, Subject and Date we hang on to
+#define IMAP_FIELD_LEN 128
+
+// Longest line read from the server, the rest of a longer line is dropped. A literal that isn't
+// a message's text (a subject or address sent as {size}) is cut to this too
+#define IMAP_LINE_LEN 512
+
+// How long a read waits before it's treated as the server having gone quiet
+#define IMAP_READ_TIMEOUT_MS 10000
+
+// How often the task looks up from IDLE to see if it's wanted
+#define IMAP_IDLE_CHECK_MS 500
+
+// Messages on each page of the inbox. The newest page is the cache, older ones are fetched
+// (envelopes only) when they're asked for
+#define IMAP_PAGE_SIZE IMAP_CACHE_MESSAGES
+
+// How long a page waits on the task to fetch something that isn't cached
+#define IMAP_FETCH_TIMEOUT_MS 8000
+
+// Deepest nesting of lists the response parser follows (a BODYSTRUCTURE with multiparts in
+// multiparts), anything deeper is skipped over
+#define IMAP_MAX_DEPTH 8
+
+// Servers drop an IDLE after 30 minutes, so it's restarted a bit before that
+#define IMAP_IDLE_RENEW_S (25 * 60)
+
+// How often the mailbox is checked when the server can't IDLE
+#define IMAP_POLL_S 120
+
+// Wait after a failed connection, doubled on every failure in a row up to the max
+#define IMAP_RETRY_MIN_S 15
+#define IMAP_RETRY_MAX_S (10 * 60)
+
+// Which part of a message is its text, from its BODYSTRUCTURE. The first text/plain part is
+// used, or the first text/html if there's no plain one. section is empty when there's neither
+typedef struct {
+   char section[16];
+   char subtype[8];
+   char encoding[20];
+   char charset[24];
+   uint32_t size;
+} imap_part_t;
+
+// A message without its body, from its ENVELOPE and BODYSTRUCTURE. The text fields are decoded to
+// Latin-1, attachments is the names of every part that isn't text, comma separated
+typedef struct {
+   uint32_t uid;
+   imap_part_t text;
+   char from[IMAP_FIELD_LEN];
+   char subject[IMAP_FIELD_LEN];
+   char date[IMAP_FIELD_LEN];
+   char attachments[IMAP_FIELD_LEN];
+} imap_summary_t;
+
+typedef struct {
+   bool connected;
+   bool synced;
+   bool idle;
+   uint32_t exists;
+   uint32_t cached;
+   uint32_t syncs;
+   uint32_t connects;
+   uint32_t failures;
+   int64_t synced_us;
+} imap_status_t;
+
+// prototypes
+void imap_init(void);
+void imap_task(void *arg);
+void imap_sync_now(void);
+bool imap_list(uint32_t page, imap_summary_t *out, size_t max, size_t *count);
+bool imap_get_body(uint32_t uid, imap_summary_t *summary, char *body, size_t size);
+esp_err_t imap_request_page(uint32_t page);
+esp_err_t imap_request_body(uint32_t uid);
+void imap_get_status(imap_status_t *out);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,772 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "mime.h"
+
+// Transfer encodings
+enum {
+   MIME_ENC_NONE,
+   MIME_ENC_QP,
+   MIME_ENC_BASE64,
+};
+
+// Charsets, anything that isn't one of the first three only keeps its ASCII
+enum {
+   MIME_CS_UTF8,
+   MIME_CS_LATIN1,
+   MIME_CS_CP1252,
+   MIME_CS_OTHER,
+};
+
+// Where the HTML renderer is
+enum {
+   MIME_TEXT,
+   MIME_TAG,
+   MIME_ENTITY,
+   MIME_COMMENT,
+};
+
+// What each of mime_open_t is written as
+static const char *const mime_tags[MIME_OPEN_COUNT] = {
+   "a", "b", "i", "u", "pre", "blockquote", "center",
+};
+
+// windows-1252's 0x80-0x9F, which are control characters in Latin-1
+static const uint16_t mime_cp1252[32] = {
+   0x20AC, 0, 0x201A, 0x0192, 0x201E, 0x2026, 0x2020, 0x2021,
+   0x02C6, 0x2030, 0x0160, 0x2039, 0x0152, 0, 0x017D, 0,
+   0, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+   0x02DC, 0x2122, 0x0161, 0x203A, 0x0153, 0, 0x017E, 0x0178,
+};
+
+// What's written for the characters mail uses most that Latin-1 doesn't have, anything else
+// outside Latin-1 is a '?'
+static const struct {
+   uint32_t cp;
+   const char *s;
+} mime_folds[] = {
+   {0x2018, "'"}, {0x2019, "'"}, {0x201A, "'"}, {0x2032, "'"}, {0x2039, "<"}, {0x203A, ">"},
+   {0x201C, "\""}, {0x201D, "\""}, {0x201E, "\""}, {0x2033, "\""},
+   {0x2010, "-"}, {0x2011, "-"}, {0x2012, "-"}, {0x2013, "-"}, {0x2014, "-"}, {0x2015, "-"},
+   {0x2212, "-"}, {0x2026, "..."}, {0x2022, "*"}, {0x2023, "*"}, {0x25CF, "*"},
+   {0x20AC, "EUR"}, {0x2122, "(TM)"}, {0x2020, "+"}, {0x2021, "+"}, {0x2030, "%"},
+   {0x0152, "OE"}, {0x0153, "oe"}, {0x0160, "S"}, {0x0161, "s"}, {0x0178, "Y"},
+   {0x017D, "Z"}, {0x017E, "z"}, {0x0192, "f"}, {0x02C6, "^"}, {0x02DC, "~"},
+   {0x2002, " "}, {0x2003, " "}, {0x2009, " "}, {0x200A, " "}, {0x202F, " "},
+   // Zero width characters, newsletters pad their previews out with them
+   {0x200B, ""}, {0x200C, ""}, {0x200D, ""}, {0x2060, ""}, {0xFEFF, ""}, {0x034F, ""},
+   {0x00AD, ""},
+};
+
+// Named entities HTML 3.2 doesn't have, and a few it does that are better as plain text.
+// Any other name is passed through, it's most likely one of the Latin-1 ones
+static const struct {
+   const char *name;
+   const char *s;
+} mime_entities[] = {
+   {"nbsp", " "}, {"amp", "&"}, {"lt", "<"}, {"gt", ">"}, {"quot", "\""}, {"apos", "'"},
+   {"lsquo", "'"}, {"rsquo", "'"}, {"sbquo", "'"}, {"ldquo", "\""}, {"rdquo", "\""},
+   {"bdquo", "\""}, {"ndash", "-"}, {"mdash", "-"}, {"minus", "-"}, {"hellip", "..."},
+   {"bull", "*"}, {"trade", "(TM)"}, {"euro", "EUR"}, {"thinsp", " "}, {"ensp", " "},
+   {"emsp", " "}, {"zwnj", ""}, {"zwj", ""}, {"shy", ""},
+};
+
+// Elements that are dropped along with everything in them
+static const char *const mime_dropped[] = {
+   "head", "style", "script", "title", "xml",
+};
+
+// Elements that only leave a line break behind
+static const char *const mime_blocks[] = {
+   "div", "tr", "table", "ul", "ol", "dl", "dt", "dd", "form", "section", "header", "footer",
+   "article", "address", "caption",
+};
+
+static void mime_char(mime_t *m, uint8_t c);
+
+// mime_encoding
+static uint8_t mime_encoding(const char *name) {
+   if (!name) return MIME_ENC_NONE;
+   if (strcasecmp(name, "QUOTED-PRINTABLE") == 0) return MIME_ENC_QP;
+   if (strcasecmp(name, "BASE64") == 0) return MIME_ENC_BASE64;
+   return MIME_ENC_NONE;
+}
+
+// mime_charset
+// No charset at all is taken as UTF-8, which also copes with the usual mislabelled Latin-1
+static uint8_t mime_charset(const char *name) {
+   if (!name || !name[0] || strcasecmp(name, "UTF-8") == 0 || strcasecmp(name, "UTF8") == 0 ||
+       strcasecmp(name, "US-ASCII") == 0) {
+       return MIME_CS_UTF8;
+   }
+   if (strcasecmp(name, "ISO-8859-1") == 0 || strcasecmp(name, "ISO-8859-15") == 0 ||
+       strcasecmp(name, "LATIN1") == 0) {
+       return MIME_CS_LATIN1;
+   }
+   if (strcasecmp(name, "WINDOWS-1252") == 0 || strcasecmp(name, "CP1252") == 0) {
+       return MIME_CS_CP1252;
+   }
+   return MIME_CS_OTHER;
+}
+
+// mime_unhex
+static int mime_unhex(char c) {
+   if (c >= '0' && c <= '9') return c - '0';
+   if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+   if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+   return -1;
+}
+
+// mime_decode_char
+// Takes one byte in a charset, returns the code point once there's a whole one or -1. A byte that
+// can't be UTF-8 is taken as Latin-1, that's what mail labelled wrong most often is
+static int32_t mime_decode_char(uint8_t charset, uint32_t *cp, uint8_t *cont, uint8_t b) {
+   switch (charset) {
+   case MIME_CS_LATIN1:
+       return b;
+   case MIME_CS_CP1252:
+       if (b >= 0x80 && b < 0xA0) return mime_cp1252[b - 0x80] ? mime_cp1252[b - 0x80] : 0xFFFD;
+       return b;
+   case MIME_CS_OTHER:
+       return (b < 0x80) ? b : 0xFFFD;
+   }
+
+   if (*cont > 0) {
+       if ((b & 0xC0) == 0x80) {
+           *cp = (*cp << 6) | (b & 0x3F);
+           return (--*cont == 0) ? (int32_t)*cp : -1;
+       }
+       // Cut short, start over from this byte
+       *cont = 0;
+   }
+
+   if (b < 0x80) return b;
+   if ((b & 0xE0) == 0xC0) {
+       *cp = b & 0x1F;
+       *cont = 1;
+   } else if ((b & 0xF0) == 0xE0) {
+       *cp = b & 0x0F;
+       *cont = 2;
+   } else if ((b & 0xF8) == 0xF0) {
+       *cp = b & 0x07;
+       *cont = 3;
+   } else {
+       return b;
+   }
+   return -1;
+}
+
+// mime_fold
+// What a code point is written as in Latin-1, 'one' is used for the ones that are a single
+// character
+static const char *mime_fold(uint32_t cp, char one[2]) {
+   for (size_t i = 0; i < sizeof(mime_folds) / sizeof(mime_folds[0]); i++) {
+       if (mime_folds[i].cp == cp) return mime_folds[i].s;
+   }
+
+   one[1] = '\0';
+   if (cp >= 0x80 && cp < 0xA0) one[0] = '\0';
+   else if (cp < 0x100) one[0] = cp;
+   else one[0] = '?';
+   return one;
+}
+
+// mime_put
+// Adds a piece of output, all of it or none of it. Once something doesn't fit nothing more goes
+// in, so the output never ends in half a tag
+static void mime_put(mime_t *m, const char *s, size_t n) {
+   if (m->full) return;
+   if (m->len + n > m->limit) {
+       m->full = true;
+       return;
+   }
+   memcpy(m->out + m->len, s, n);
+   m->len += n;
+}
+
+// mime_puts
+static void mime_puts(mime_t *m, const char *s) {
+   mime_put(m, s, strlen(s));
+}
+
+// mime_text
+// One character of text, escaped. Whitespace runs are made into one space (except in a <pre>),
+// and there's none at all right after a line break
+static void mime_text(mime_t *m, uint8_t c) {
+   bool pre = m->open[MIME_PRE] > 0;
+
+   if (c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == 0xA0) {
+       if (pre && c != '\r') {
+           mime_put(m, (c == '\n') ? "\n" : " ", 1);
+       } else if (!m->space && m->breaks == 0) {
+           mime_put(m, " ", 1);
+       }
+       m->space = true;
+       return;
+   }
+   if (c < 0x20 || c == 0x7F) return;
+
+   m->space = false;
+   m->breaks = 0;
+   switch (c) {
+   case '&': mime_put(m, "&amp;", 5); break;
+   case '<': mime_put(m, "&lt;", 4);  break;
+   case '>': mime_put(m, "&gt;", 4);  break;
+   default:
+       {
+           char ch = c;
+           mime_put(m, &ch, 1);
+       }
+   }
+}
+
+// mime_text_str
+static void mime_text_str(mime_t *m, const char *s) {
+   for (; *s; s++) mime_text(m, (uint8_t)*s);
+}
+
+// mime_break
+// Line breaks, as many as it takes to have n in a row, a <p> being two. Mail HTML nests blocks
+// many deep, this keeps that from turning into screens of blank lines
+static void mime_break(mime_t *m, uint8_t n) {
+   if (n >= 2 && m->breaks == 0) {
+       mime_puts(m, "<p>");
+       m->breaks = 2;
+   }
+   while (m->breaks < n) {
+       mime_puts(m, "<br>");
+       m->breaks++;
+   }
+}
+
+// mime_plain
+// text/plain, every line break is kept (up to two in a row)
+static void mime_plain(mime_t *m, uint8_t c) {
+   if (c == '\r') return;
+   if (c == '\n') {
+       if (m->breaks < 2) {
+           mime_puts(m, "<br>");
+           m->breaks++;
+       }
+       return;
+   }
+   mime_text(m, c);
+}
+
+// mime_attr
+// Copies the value of one of a tag's attributes, false if it doesn't have it
+static bool mime_attr(const char *tag, const char *name, char *out, size_t size) {
+   size_t name_len = strlen(name);
+   const char *p = tag;
+
+   while (*p && !isspace((unsigned char)*p)) p++;
+
+   while (*p) {
+       while (isspace((unsigned char)*p) || *p == '/') p++;
+
+       const char *attr = p;
+       while (*p && !isspace((unsigned char)*p) && *p != '=') p++;
+       size_t attr_len = p - attr;
+       while (isspace((unsigned char)*p)) p++;
+
+       const char *val = "";
+       size_t val_len = 0;
+       if (*p == '=') {
+           p++;
+           while (isspace((unsigned char)*p)) p++;
+           if (*p == '"' || *p == '\'') {
+               char q = *p++;
+               val = p;
+               while (*p && *p != q) p++;
+               val_len = p - val;
+               if (*p) p++;
+           } else {
+               val = p;
+               while (*p && !isspace((unsigned char)*p)) p++;
+               val_len = p - val;
+           }
+       }
+
+       if (attr_len == name_len && strncasecmp(attr, name, name_len) == 0) {
+           if (val_len > size - 1) val_len = size - 1;
+           memcpy(out, val, val_len);
+           out[val_len] = '\0';
+           return true;
+       }
+   }
+   return false;
+}
+
+// mime_close
+static void mime_close(mime_t *m, mime_open_t which) {
+   char tag[16];
+
+   if (m->open[which] == 0) return;
+   snprintf(tag, sizeof(tag), "</%s>", mime_tags[which]);
+   mime_puts(m, tag);
+   m->open[which]--;
+}
+
+// mime_open
+// One of the tags that's passed through. A link only keeps its href, and only for the kinds of
+// link the N64 can do something with
+static void mime_open(mime_t *m, mime_open_t which, bool whole) {
+   char tag[MIME_TAG_LEN + 16];
+
+   if (m->open[which] >= MIME_MAX_OPEN) return;
+
+   if (which == MIME_A) {
+       char href[MIME_TAG_LEN];
+       mime_close(m, MIME_A);
+       if (!whole || !mime_attr(m->tag, "href", href, sizeof(href))) return;
+       if (strncasecmp(href, "http://", 7) != 0 && strncasecmp(href, "https://", 8) != 0 &&
+           strncasecmp(href, "mailto:", 7) != 0) {
+           return;
+       }
+
+       // A quote takes three characters escaped, so a long href can outgrow tag. Cut short it
+       // would go somewhere else, so a link that doesn't fit with its "> is dropped
+       size_t n = snprintf(tag, sizeof(tag), "<a href=\"");
+       for (const char *p = href; *p; p++) {
+           if (n + 3 + sizeof("\">") > sizeof(tag)) return;
+           if (*p == '"') {
+               memcpy(tag + n, "%22", 3);
+               n += 3;
+           } else if (*p != '<' && *p != '>') {
+               tag[n++] = *p;
+           }
+       }
+       snprintf(tag + n, sizeof(tag) - n, "\">");
+   } else {
+       snprintf(tag, sizeof(tag), "<%s>", mime_tags[which]);
+   }
+
+   size_t before = m->len;
+   mime_puts(m, tag);
+   if (m->len != before) m->open[which]++;
+}
+
+// mime_image
+// An image is its alt text in brackets if it has any, otherwise nothing (a lot of them are
+// spacers and tracking pixels)
+static void mime_image(mime_t *m) {
+   char alt[48];
+
+   if (!mime_attr(m->tag, "alt", alt, sizeof(alt))) return;
+   const char *p = alt;
+   while (isspace((unsigned char)*p)) p++;
+   if (!*p) return;
+
+   mime_text(m, '[');
+   mime_text_str(m, p);
+   mime_text(m, ']');
+}
+
+// mime_tag
+// Does what a tag calls for, the tag without its < and > is in m->tag
+static void mime_tag(mime_t *m) {
+   bool whole = (m->tag_len < MIME_TAG_LEN);
+   const char *p = m->tag;
+   char name[12];
+   size_t n = 0;
+
+   if (!whole) m->tag[MIME_TAG_LEN - 1] = '\0';
+   else m->tag[m->tag_len] = '\0';
+
+   bool closing = (*p == '/');
+   if (closing) p++;
+   while (isalnum((unsigned char)*p) && n < sizeof(name) - 1) name[n++] = tolower((unsigned char)*p++);
+   name[n] = '\0';
+   if (n == 0) return;
+
+   if (m->skip[0]) {
+       // A <head> that's never closed ends where the <body> starts
+       if ((closing && strcmp(name, m->skip) == 0) ||
+           (!closing && strcmp(m->skip, "head") == 0 && strcmp(name, "body") == 0)) {
+           m->skip[0] = '\0';
+       }
+       return;
+   }
+
+   for (size_t i = 0; i < sizeof(mime_dropped) / sizeof(mime_dropped[0]); i++) {
+       if (strcmp(name, mime_dropped[i]) == 0) {
+           bool empty = whole && m->tag_len > 0 && m->tag[m->tag_len - 1] == '/';
+           if (!closing && !empty) snprintf(m->skip, sizeof(m->skip), "%s", name);
+           return;
+       }
+   }
+
+   for (size_t i = 0; i < sizeof(mime_blocks) / sizeof(mime_blocks[0]); i++) {
+       if (strcmp(name, mime_blocks[i]) == 0) {
+           mime_break(m, 1);
+           return;
+       }
+   }
+
+   if (strcmp(name, "p") == 0) {
+       mime_break(m, 2);
+   } else if (strcmp(name, "br") == 0) {
+       if (m->breaks < 2) {
+           mime_puts(m, "<br>");
+           m->breaks++;
+       }
+   } else if (strcmp(name, "hr") == 0) {
+       mime_puts(m, "<hr>");
+       m->breaks = 2;
+   } else if (strcmp(name, "li") == 0) {
+       if (!closing) {
+           mime_break(m, 1);
+           mime_text_str(m, "* ");
+       }
+   } else if (strcmp(name, "td") == 0 || strcmp(name, "th") == 0) {
+       mime_text(m, ' ');
+   } else if (n == 2 && name[0] == 'h' && name[1] >= '1' && name[1] <= '6') {
+       // Headings are just bold, the big ones take up most of the N64's screen
+       if (closing) mime_close(m, MIME_B);
+       mime_break(m, 2);
+       if (!closing) mime_open(m, MIME_B, whole);
+   } else if (strcmp(name, "img") == 0) {
+       mime_image(m);
+   } else {
+       int which = -1;
+       if (strcmp(name, "strong") == 0) which = MIME_B;
+       else if (strcmp(name, "em") == 0) which = MIME_I;
+       for (int i = 0; which < 0 && i < MIME_OPEN_COUNT; i++) {
+           if (strcmp(name, mime_tags[i]) == 0) which = i;
+       }
+       if (which < 0) return;
+
+       if (which == MIME_PRE || which == MIME_BLOCKQUOTE) m->breaks = 2;
+       if (closing) mime_close(m, which);
+       else mime_open(m, which, whole);
+   }
+}
+
+// mime_entity
+// An &entity; with what's between the & and ; in m->ent
+static void mime_entity(mime_t *m) {
+   char one[2];
+
+   if (m->ent[0] == '#') {
+       bool hex = (m->ent[1] == 'x' || m->ent[1] == 'X');
+       uint32_t cp = strtoul(m->ent + (hex ? 2 : 1), NULL, hex ? 16 : 10);
+       mime_text_str(m, mime_fold(cp, one));
+       return;
+   }
+
+   for (size_t i = 0; i < sizeof(mime_entities) / sizeof(mime_entities[0]); i++) {
+       if (strcmp(m->ent, mime_entities[i].name) == 0) {
+           mime_text_str(m, mime_entities[i].s);
+           return;
+       }
+   }
+
+   char ent[MIME_ENTITY_LEN + 2];
+   int n = snprintf(ent, sizeof(ent), "&%s;", m->ent);
+   mime_put(m, ent, n);
+   m->space = false;
+   m->breaks = 0;
+}
+
+// mime_html
+// text/html, one Latin-1 character at a time
+static void mime_html(mime_t *m, uint8_t c) {
+   switch (m->state) {
+   case MIME_TEXT:
+       if (c == '<') {
+           m->state = MIME_TAG;
+           m->tag_len = 0;
+           m->quote = 0;
+       } else if (!m->skip[0]) {
+           if (c == '&') {
+               m->state = MIME_ENTITY;
+               m->ent_len = 0;
+           } else {
+               mime_text(m, c);
+           }
+       }
+       return;
+
+   case MIME_TAG:
+       if (m->tag_len == 0 && !isalpha(c) && c != '/' && c != '!') {
+           // Not a tag, just a '<' in the text
+           m->state = MIME_TEXT;
+           if (!m->skip[0]) mime_text(m, '<');
+           mime_char(m, c);
+           return;
+       }
+       if (c == '>' && !m->quote) {
+           m->state = MIME_TEXT;
+           mime_tag(m);
+           return;
+       }
+       if (c == '"' || c == '\'') {
+           if (!m->quote) m->quote = c;
+           else if (m->quote == c) m->quote = 0;
+       }
+       // A tag too long for the buffer is marked by tag_len reaching MIME_TAG_LEN
+       if (m->tag_len < MIME_TAG_LEN - 1) m->tag[m->tag_len++] = c;
+       else m->tag_len = MIME_TAG_LEN;
+
+       if (m->tag_len == 3 && strncmp(m->tag, "!--", 3) == 0) {
+           m->state = MIME_COMMENT;
+           m->tag_len = 0;
+       }
+       return;
+
+   case MIME_COMMENT:
+       // Over at "-->", tag_len counts the dashes in a row before it
+       if (c == '>' && m->tag_len >= 2) m->state = MIME_TEXT;
+       else if (c == '-') m->tag_len++;
+       else m->tag_len = 0;
+       return;
+
+   case MIME_ENTITY:
+       if ((isalnum(c) || c == '#') && m->ent_len < MIME_ENTITY_LEN - 1) {
+           m->ent[m->ent_len++] = c;
+           return;
+       }
+       m->state = MIME_TEXT;
+       m->ent[m->ent_len] = '\0';
+       if (c == ';' && m->ent_len > 0) {
+           mime_entity(m);
+           return;
+       }
+       // Not an entity after all
+       mime_text(m, '&');
+       mime_text_str(m, m->ent);
+       mime_char(m, c);
+       return;
+   }
+}
+
+// mime_char
+// One character of Latin-1 to render
+static void mime_char(mime_t *m, uint8_t c) {
+   if (m->full) return;
+   if (m->html) mime_html(m, c);
+   else mime_plain(m, c);
+}
+
+// mime_byte
+// One byte of the part with its transfer encoding taken off, still in the part's charset
+static void mime_byte(mime_t *m, uint8_t b) {
+   char one[2];
+
+   int32_t cp = mime_decode_char(m->charset, &m->cp, &m->cont, b);
+   if (cp < 0) return;
+   for (const char *s = mime_fold(cp, one); *s; s++) mime_char(m, (uint8_t)*s);
+}
+
+// mime_transfer
+// One byte of the part as it came off the wire, base64 is taken off in mime_feed a block at a
+// time instead
+static void mime_transfer(mime_t *m, char c) {
+   switch (m->enc) {
+   case MIME_ENC_QP:
+       if (m->qp_len == 0) {
+           if (c == '=') m->qp_len = 1;
+           else mime_byte(m, c);
+       } else if (m->qp_len == 1) {
+           if (c == '\n') {
+               // Soft line break
+               m->qp_len = 0;
+           } else if (c == '\r' || mime_unhex(c) >= 0) {
+               m->qp[0] = c;
+               m->qp_len = 2;
+           } else {
+               // Not an escape, kept as it was
+               m->qp_len = 0;
+               mime_byte(m, '=');
+               mime_transfer(m, c);
+           }
+       } else {
+           m->qp_len = 0;
+           if (m->qp[0] == '\r') {
+               if (c != '\n') mime_transfer(m, c);
+           } else if (mime_unhex(c) >= 0) {
+               mime_byte(m, (mime_unhex(m->qp[0]) << 4) | mime_unhex(c));
+           } else {
+               mime_byte(m, '=');
+               mime_byte(m, m->qp[0]);
+               mime_transfer(m, c);
+           }
+       }
+       return;
+
+   default:
+       mime_byte(m, c);
+       return;
+   }
+}
+
+// mime_begin
+// Starts rendering a part into buf. subtype is the part's ("PLAIN" or "HTML"), encoding its
+// Content-Transfer-Encoding and charset the charset from its Content-Type, straight out of
+// the BODYSTRUCTURE
+void mime_begin(mime_t *m, char *buf, size_t size, const char *subtype, const char *encoding,
+                const char *charset) {
+   memset(m, 0, sizeof(*m));
+   m->out = buf;
+   m->size = size;
+   m->limit = (size > MIME_RESERVE + 1) ? size - MIME_RESERVE - 1 : 0;
+   m->html = subtype && strcasecmp(subtype, "HTML") == 0;
+   m->enc = mime_encoding(encoding);
+   m->charset = mime_charset(charset);
+   base64_decode_begin(&m->b64);
+
+   // Nothing leads with blank lines
+   m->breaks = 2;
+}
+
+// mime_feed
+// Renders the next piece of the part, it can be cut anywhere
+void mime_feed(mime_t *m, const char *data, size_t len) {
+   uint8_t bytes[BASE64_DECODED_MAX(MIME_BASE64_CHUNK)];
+
+   if (m->enc != MIME_ENC_BASE64) {
+       for (size_t i = 0; i < len && !m->full; i++) mime_transfer(m, data[i]);
+       return;
+   }
+
+   while (len > 0 && !m->full) {
+       size_t n = (len < MIME_BASE64_CHUNK) ? len : MIME_BASE64_CHUNK;
+       size_t got = base64_decode_feed(&m->b64, data, n, bytes);
+       for (size_t i = 0; i < got && !m->full; i++) mime_byte(m, bytes[i]);
+       data += n;
+       len -= n;
+   }
+}
+
+// mime_finish
+// Closes whatever tags are still open (there's room kept for that even when the output filled
+// up) and null terminates it. Returns the length
+size_t mime_finish(mime_t *m) {
+   uint8_t bytes[2];
+
+   if (m->size == 0) return 0;
+
+   // A base64 part that ended without its padding still has its last byte or two to go
+   if (m->enc == MIME_ENC_BASE64) {
+       size_t got = base64_decode_finish(&m->b64, bytes);
+       for (size_t i = 0; i < got && !m->full; i++) mime_byte(m, bytes[i]);
+   }
+
+   bool full = m->full;
+
+   m->full = false;
+   m->limit = m->size - 1;
+   for (int i = 0; i < MIME_OPEN_COUNT; i++) {
+       while (m->open[i] > 0) mime_close(m, i);
+   }
+   m->full = full;
+
+   m->out[m->len] = '\0';
+   return m->len;
+}
+
+// mime_header_put
+// Adds a code point to a decoded header, folded to Latin-1
+static void mime_header_put(char *out, size_t size, size_t *j, int32_t cp) {
+   char one[2];
+
+   if (cp < 0) return;
+   if (cp == '\r' || cp == '\n' || cp == '\t') cp = ' ';
+   for (const char *s = mime_fold(cp, one); *s && *j + 1 < size; s++) out[(*j)++] = *s;
+}
+
+// mime_word
+// Decodes one =?charset?B|Q?text?= encoded word, p is at its "=?". Returns where it ends, or NULL
+// if it isn't one
+static const char *mime_word(const char *p, char *out, size_t size, size_t *j) {
+   char name[24];
+   uint32_t cp = 0;
+   uint8_t cont = 0;
+
+   const char *cs = p + 2;
+   const char *q = strchr(cs, '?');
+   if (!q || !q[1] || q[2] != '?') return NULL;
+
+   char enc = toupper((unsigned char)q[1]);
+   const char *text = q + 3;
+   const char *end = strstr(text, "?=");
+   if (!end || (enc != 'B' && enc != 'Q')) return NULL;
+
+   // RFC 2231 can tack a language on, "UTF-8*en"
+   size_t n = strcspn(cs, "?*");
+   if (n >= sizeof(name)) n = sizeof(name) - 1;
+   memcpy(name, cs, n);
+   name[n] = '\0';
+   uint8_t charset = mime_charset(name);
+
+   if (enc == 'B') {
+       base64_decoder_t d;
+       uint8_t bytes[BASE64_DECODED_MAX(MIME_BASE64_CHUNK) + 2];
+       base64_decode_begin(&d);
+       for (const char *s = text; s < end; s += MIME_BASE64_CHUNK) {
+           size_t n = (end - s < MIME_BASE64_CHUNK) ? end - s : MIME_BASE64_CHUNK;
+           size_t got = base64_decode_feed(&d, s, n, bytes);
+           if (s + n == end) got += base64_decode_finish(&d, bytes + got);
+           for (size_t i = 0; i < got; i++) {
+               mime_header_put(out, size, j, mime_decode_char(charset, &cp, &cont, bytes[i]));
+           }
+       }
+       return end + 2;
+   }
+
+   for (const char *s = text; s < end; s++) {
+       int b;
+       if (*s == '_') {
+           b = ' ';
+       } else if (*s == '=' && end - s > 2 && mime_unhex(s[1]) >= 0 && mime_unhex(s[2]) >= 0) {
+           b = (mime_unhex(s[1]) << 4) | mime_unhex(s[2]);
+           s += 2;
+       } else {
+           b = (uint8_t)*s;
+       }
+       mime_header_put(out, size, j, mime_decode_char(charset, &cp, &cont, b));
+   }
+   return end + 2;
+}
+
+// mime_header
+// Decodes a header value (a Subject, a From name, an attachment's name) with RFC 2047 encoded
+// words in it into Latin-1, folded the same way as a body. Anything outside encoded words is
+// taken as UTF-8 as some servers send it that way
+void mime_header(const char *in, char *out, size_t size) {
+   uint32_t cp = 0;
+   uint8_t cont = 0;
+   size_t j = 0;
+   bool after_word = false;
+
+   if (size == 0) return;
+
+   const char *p = in;
+   while (*p && j + 1 < size) {
+       if (p[0] == '=' && p[1] == '?') {
+           const char *end = mime_word(p, out, size, &j);
+           if (end) {
+               p = end;
+               after_word = true;
+               continue;
+           }
+       }
+
+       // Whitespace between two encoded words isn't part of the text
+       if (after_word && isspace((unsigned char)*p)) {
+           const char *next = p;
+           while (isspace((unsigned char)*next)) next++;
+           if (next[0] == '=' && next[1] == '?') {
+               p = next;
+               continue;
+           }
+       }
+
+       after_word = false;
+       mime_header_put(out, size, &j, mime_decode_char(MIME_CS_UTF8, &cp, &cont, (uint8_t)*p++));
+   }
+   out[j] = '\0';
+}
@@ -0,0 +1,97 @@
+// Mail decoder config
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "base64.h"
+
+// Longest HTML tag that's looked at, anything longer is dropped whole (a link that long keeps
+// its text but loses its href)
+#define MIME_TAG_LEN 256
+
+// Longest &entity; that's recognised, anything longer is taken as plain text
+#define MIME_ENTITY_LEN 10
+
+// Room kept at the end of the output for the tags mime_finish closes
+#define MIME_RESERVE 192
+
+// How deep each of the tags that's passed through can nest, more are dropped
+#define MIME_MAX_OPEN 4
+
+// Base64 is decoded this many characters at a time, into a buffer on the stack
+#define MIME_BASE64_CHUNK 64
+
+// Tags that are passed through and have to be closed again, see mime_tags in mime.c
+typedef enum {
+   MIME_A,
+   MIME_B,
+   MIME_I,
+   MIME_U,
+   MIME_PRE,
+   MIME_BLOCKQUOTE,
+   MIME_CENTER,
+   MIME_OPEN_COUNT
+} mime_open_t;
+
+// Turns one text part of a message into HTML 3.2 in Latin-1, the most the N64's browser can make
+// sense of. The part's raw bytes are fed in a piece at a time as they come off the wire and go
+// through three stages, each keeping only a few bytes of state, so the part is never in memory
+// all at once:
+//
+//    transfer encoding   quoted-printable and base64 decoded
+//    charset             UTF-8 and windows-1252 folded to Latin-1, what has no Latin-1
+//                        character gets the nearest ASCII (curly quotes, dashes) or a '?'
+//    rendering           text/plain escaped with its line breaks kept, text/html cut down to
+//                        the tags HTML 3.2 has with every attribute but href dropped, and
+//                        <head>, <style> and <script> dropped along with what's in them
+//
+// The output goes into a buffer given to mime_begin and never gets cut in the middle of a tag
+// or entity. Once it's full the rest of the part is ignored and 'full' is set
+typedef struct {
+   char *out;
+   size_t len;
+   size_t limit;
+   size_t size;
+   bool full;
+   bool html;
+
+   // Transfer encoding
+   uint8_t enc;
+   base64_decoder_t b64;
+   char qp[2];
+   uint8_t qp_len;
+
+   // Charset
+   uint8_t charset;
+   uint32_t cp;
+   uint8_t cont;
+
+   // Rendering
+   uint8_t state;
+   char quote;
+   char tag[MIME_TAG_LEN];
+   size_t tag_len;
+   char ent[MIME_ENTITY_LEN];
+   size_t ent_len;
+   char skip[8];
+   uint8_t breaks;
+   bool space;
+   uint8_t open[MIME_OPEN_COUNT];
+} mime_t;
+
+// prototypes
+void mime_begin(mime_t *m, char *buf, size_t size, const char *subtype, const char *encoding,
+                const char *charset);
+void mime_feed(mime_t *m, const char *data, size_t len);
+size_t mime_finish(mime_t *m);
+void mime_header(const char *in, char *out, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,764 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <strings.h>
+#include "esp_log.h"
+#include "esp_tls.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "esp_crt_bundle.h"
+#include "esp_rom_crc.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include "outbox.h"
+#include "base64.h"
+#include "modem.h"
+#include "settings.h"
+#include "storage.h"
+#include "tls_cache.h"
+#include "worker.h"
+
+static const char *OUTBOX_TAG = "OUTBOX";
+
+#define OUTBOX_MAGIC 0x514d5753 // "SWMQ"
+
+// What a message's slot file starts with, the three strings follow it null terminated and in
+// this order. crc is over the strings, so a slot that was half written when the power went is
+// thrown away at boot instead of being sent
+typedef struct {
+   uint32_t magic;
+   uint32_t id;
+   uint32_t to_len;
+   uint32_t subject_len;
+   uint32_t body_len;
+   uint32_t crc;
+} outbox_record_t;
+
+// A queued message. data holds to, subject and body one after the other, ids go up with every
+// message so the oldest always goes first
+typedef struct {
+   bool used;
+   uint32_t id;
+   uint32_t attempts;
+   int64_t next_try_s;
+   char *data;
+   size_t size;
+   const char *to;
+   const char *subject;
+   const char *body;
+} outbox_msg_t;
+
+// One connection to the SMTP server. Replies are read a line at a time through buf, what's sent
+// is gathered in out, and the EHLO reply says which extensions we can use
+typedef struct {
+   esp_tls_t *tls;
+   char buf[512];
+   size_t len;
+   size_t pos;
+   char out[1024];
+   size_t out_len;
+   char line[OUTBOX_LINE_LEN];
+   bool ehlo;
+   bool pipelining;
+   bool auth_plain;
+} smtp_conn_t;
+
+static outbox_msg_t queue[OUTBOX_SLOTS];
+static SemaphoreHandle_t queue_lock = NULL;
+static uint32_t next_id = 1;
+static outbox_status_t status = {0};
+static TaskHandle_t outbox_task_handle = NULL;
+
+// Sessions in a row that couldn't get through what was due (no connection, the login turned
+// down, the connection lost), what the wait before the next one grows with
+static uint32_t session_failures = 0;
+
+// outbox_now_s
+static int64_t outbox_now_s(void) {
+   return esp_timer_get_time() / 1000000;
+}
+
+// outbox_path
+static void outbox_path(int slot, char *path, size_t size) {
+   snprintf(path, size, STORAGE_BASE_PATH "/mq%u.bin", (unsigned)slot);
+}
+
+// outbox_set_error
+// Keeps what went wrong for the config page
+static void outbox_set_error(const char *fmt, ...) {
+   va_list args;
+
+   xSemaphoreTake(queue_lock, portMAX_DELAY);
+   va_start(args, fmt);
+   vsnprintf(status.last_error, sizeof(status.last_error), fmt, args);
+   va_end(args);
+   xSemaphoreGive(queue_lock);
+}
+
+// The slot files are written by outbox_add on the Sharkwire server's task, and read and removed by
+// outbox_task, whose stack is in PSRAM. Both go through worker_run_internal with the arguments in
+// one of these, which runs the write right there and hands outbox_task's to the flash helper
+typedef struct {
+   int slot;
+   const outbox_msg_t *msg;
+   bool ok;
+} outbox_flash_args_t;
+
+// outbox_write_slot
+// Writes a message out to its slot file
+static void outbox_write_slot(void *arg) {
+   outbox_flash_args_t *a = arg;
+   const outbox_msg_t *m = a->msg;
+   char path[32];
+
+   a->ok = false;
+   if (!storage_is_mounted()) return;
+
+   outbox_record_t rec = {
+       .magic = OUTBOX_MAGIC,
+       .id = m->id,
+       .to_len = strlen(m->to),
+       .subject_len = strlen(m->subject),
+       .body_len = strlen(m->body),
+       .crc = esp_rom_crc32_le(0, (const uint8_t *)m->data, m->size),
+   };
+
+   outbox_path(a->slot, path, sizeof(path));
+   FILE *f = fopen(path, "wb");
+   if (!f) return;
+
+   a->ok = fwrite(&rec, sizeof(rec), 1, f) == 1 && fwrite(m->data, 1, m->size, f) == m->size;
+   fclose(f);
+   if (!a->ok) remove(path);
+}
+
+// outbox_remove_slot
+static void outbox_remove_slot(void *arg) {
+   outbox_flash_args_t *a = arg;
+   char path[32];
+
+   if (!storage_is_mounted()) return;
+   outbox_path(a->slot, path, sizeof(path));
+   remove(path);
+}
+
+// outbox_addr_ok
+// The address goes into RCPT TO as it is, so a line break in it would end the command there and
+// start one of the sender's own on the logged in session
+static bool outbox_addr_ok(const char *to) {
+   return to[0] && !strpbrk(to, "\r\n");
+}
+
+// outbox_read_slot
+// Loads whatever was still queued in a slot when we went down
+static void outbox_read_slot(void *arg) {
+   outbox_flash_args_t *a = arg;
+   outbox_msg_t *m = &queue[a->slot];
+   outbox_record_t rec;
+   char path[32];
+
+   a->ok = false;
+   if (!storage_is_mounted()) return;
+
+   outbox_path(a->slot, path, sizeof(path));
+   FILE *f = fopen(path, "rb");
+   if (!f) return;
+
+   if (fread(&rec, sizeof(rec), 1, f) == 1 && rec.magic == OUTBOX_MAGIC &&
+       rec.to_len < OUTBOX_ADDR_LEN && rec.subject_len < OUTBOX_SUBJECT_LEN &&
+       rec.body_len <= OUTBOX_BODY_MAX) {
+       size_t size = rec.to_len + rec.subject_len + rec.body_len + 3;
+       char *data = heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+
+       if (data && fread(data, 1, size, f) == size &&
+           esp_rom_crc32_le(0, (const uint8_t *)data, size) == rec.crc &&
+           data[rec.to_len] == '\0' && data[rec.to_len + rec.subject_len + 1] == '\0' &&
+           data[size - 1] == '\0' && outbox_addr_ok(data)) {
+           memset(m, 0, sizeof(*m));
+           m->used = true;
+           m->id = rec.id;
+           m->data = data;
+           m->size = size;
+           m->to = data;
+           m->subject = data + rec.to_len + 1;
+           m->body = m->subject + rec.subject_len + 1;
+           a->ok = true;
+       } else {
+           heap_caps_free(data);
+       }
+   }
+   fclose(f);
+
+   // Nothing we could send, so it's not worth keeping
+   if (!a->ok) remove(path);
+}
+
+// outbox_drop
+// Takes a message off the queue, sent or given up on
+static void outbox_drop(int slot) {
+   outbox_flash_args_t args = { .slot = slot };
+
+   worker_run_internal(outbox_remove_slot, &args);
+
+   xSemaphoreTake(queue_lock, portMAX_DELAY);
+   heap_caps_free(queue[slot].data);
+   memset(&queue[slot], 0, sizeof(queue[slot]));
+   status.queued--;
+   xSemaphoreGive(queue_lock);
+}
+
+// outbox_backoff_s
+// The wait after the nth failure in a row, doubling from OUTBOX_RETRY_MIN_S up to OUTBOX_RETRY_MAX_S
+static uint32_t outbox_backoff_s(uint32_t n) {
+   uint32_t wait_s = OUTBOX_RETRY_MIN_S;
+
+   for (uint32_t i = 1; i < n && wait_s < OUTBOX_RETRY_MAX_S; i++) wait_s *= 2;
+   return (wait_s > OUTBOX_RETRY_MAX_S) ? OUTBOX_RETRY_MAX_S : wait_s;
+}
+
+// outbox_wait
+// Puts a message back to be tried again in wait_s
+static void outbox_wait(int slot, uint32_t wait_s) {
+   outbox_msg_t *m = &queue[slot];
+
+   xSemaphoreTake(queue_lock, portMAX_DELAY);
+   m->next_try_s = outbox_now_s() + wait_s;
+   status.retries++;
+   xSemaphoreGive(queue_lock);
+   ESP_LOGW(OUTBOX_TAG, "Message %u not sent, trying again in %u s", (unsigned)m->id, (unsigned)wait_s);
+}
+
+// outbox_retry_later
+// The server said to try the message again later (a 4xx). Puts it back after a wait that grows
+// with each time, or drops it once it's had OUTBOX_MAX_ATTEMPTS
+static void outbox_retry_later(int slot) {
+   outbox_msg_t *m = &queue[slot];
+
+   if (++m->attempts >= OUTBOX_MAX_ATTEMPTS) {
+       ESP_LOGE(OUTBOX_TAG, "Giving up on message %u to %s after %u tries", (unsigned)m->id, m->to,
+                (unsigned)m->attempts);
+       status.failed++;
+       outbox_drop(slot);
+       return;
+   }
+   outbox_wait(slot, outbox_backoff_s(m->attempts));
+}
+
+// smtp_flush
+// Writes out whatever has been put so far, esp_tls can take less than it's given
+static esp_err_t smtp_flush(smtp_conn_t *c) {
+   const char *buf = c->out;
+   size_t len = c->out_len;
+
+   c->out_len = 0;
+   while (len > 0) {
+       int n = esp_tls_conn_write(c->tls, buf, len);
+       if (n == ESP_TLS_ERR_SSL_WANT_READ || n == ESP_TLS_ERR_SSL_WANT_WRITE) continue;
+       if (n <= 0) return ESP_FAIL;
+       buf += n;
+       len -= n;
+   }
+   return ESP_OK;
+}
+
+// smtp_put
+// Adds to what goes out next. Commands and message text are gathered up and written a buffer at
+// a time, so a pipelined group of commands goes out together and the message isn't a TLS record
+// per line
+static esp_err_t smtp_put(smtp_conn_t *c, const char *s, size_t len) {
+   while (len > 0) {
+       if (c->out_len == sizeof(c->out) && smtp_flush(c) != ESP_OK) return ESP_FAIL;
+
+       size_t n = sizeof(c->out) - c->out_len;
+       if (n > len) n = len;
+       memcpy(c->out + c->out_len, s, n);
+       c->out_len += n;
+       s += n;
+       len -= n;
+   }
+   return ESP_OK;
+}
+
+// smtp_send
+// Puts a command without waiting on its reply
+static esp_err_t smtp_send(smtp_conn_t *c, const char *fmt, ...) {
+   char cmd[384];
+   va_list args;
+
+   va_start(args, fmt);
+   int n = vsnprintf(cmd, sizeof(cmd) - 2, fmt, args);
+   va_end(args);
+
+   if (n < 0 || n >= (int)sizeof(cmd) - 2) return ESP_FAIL;
+   memcpy(cmd + n, "\r\n", 2);
+   return smtp_put(c, cmd, n + 2);
+}
+
+// smtp_getc
+// The next byte of a reply, -1 if the connection failed or went quiet
+static int smtp_getc(smtp_conn_t *c) {
+   if (c->pos == c->len) {
+       int n = esp_tls_conn_read(c->tls, c->buf, sizeof(c->buf));
+       if (n <= 0) return -1;
+       c->len = n;
+       c->pos = 0;
+   }
+   return (unsigned char)c->buf[c->pos++];
+}
+
+// smtp_extension
+// Picks out the extensions we use from a line of the EHLO reply
+static void smtp_extension(smtp_conn_t *c, const char *ext) {
+   if (strcasecmp(ext, "PIPELINING") == 0) {
+       c->pipelining = true;
+   } else if (strncasecmp(ext, "AUTH", 4) == 0 && (ext[4] == ' ' || ext[4] == '=')) {
+       for (const char *p = ext + 4; (p = strcasestr(p, "PLAIN")) != NULL; p += 5) {
+           if ((p[-1] == ' ' || p[-1] == '=') && (p[5] == ' ' || p[5] == '\0')) c->auth_plain = true;
+       }
+   }
+}
+
+// smtp_reply
+// Reads a whole reply, every line of a multiline one ("250-..." up to "250 ..."), and returns
+// its code, or -1 if the connection failed. The last line is left in c->line
+static int smtp_reply(smtp_conn_t *c) {
+   bool first = true;
+
+   if (c->out_len > 0 && smtp_flush(c) != ESP_OK) return -1;
+
+   while (1) {
+       size_t n = 0;
+       int ch;
+
+       while ((ch = smtp_getc(c)) != '\n') {
+           if (ch < 0) return -1;
+           if (ch != '\r' && n < sizeof(c->line) - 1) c->line[n++] = ch;
+       }
+       c->line[n] = '\0';
+       if (n < 3) return -1;
+
+       // The first line of the EHLO reply is the server's name, the rest are its extensions
+       if (c->ehlo && !first && n > 4) smtp_extension(c, c->line + 4);
+       first = false;
+
+       if (n == 3 || c->line[3] != '-') return atoi(c->line);
+   }
+}
+
+// smtp_cmd
+// Sends a command and returns the code of the reply, or -1 if the connection failed
+static int smtp_cmd(smtp_conn_t *c, const char *fmt, ...) {
+   char cmd[384];
+   va_list args;
+
+   va_start(args, fmt);
+   int n = vsnprintf(cmd, sizeof(cmd), fmt, args);
+   va_end(args);
+
+   if (n < 0 || n >= (int)sizeof(cmd)) return -1;
+   if (smtp_send(c, "%s", cmd) != ESP_OK) return -1;
+   return smtp_reply(c);
+}
+
+// smtp_login
+// Greeting, EHLO and AUTH. AUTH PLAIN sends the login with the command, so it's one round trip
+// instead of AUTH LOGIN's three, LOGIN is only used when the server doesn't have PLAIN. Anything
+// going wrong here is the server or the settings, not the messages, so they're all kept for
+// another try
+static esp_err_t smtp_login(smtp_conn_t *c, const settings_email_t *email) {
+   char plain[sizeof(email->username) + sizeof(email->password) + 2];
+   char b64[BASE64_ENCODED_LEN(sizeof(plain)) + 1];
+   esp_err_t err = ESP_OK;
+   int code;
+
+   if ((code = smtp_reply(c)) != 220) goto fail;
+
+   c->ehlo = true;
+   code = smtp_cmd(c, "EHLO esp32");
+   c->ehlo = false;
+   if (code != 250) goto fail;
+
+   if (email->username[0] && c->auth_plain) {
+       size_t ulen = strlen(email->username);
+       size_t plen = strlen(email->password);
+       plain[0] = '\0';
+       memcpy(plain + 1, email->username, ulen);
+       plain[ulen + 1] = '\0';
+       memcpy(plain + ulen + 2, email->password, plen);
+       if ((err = base64_encode(plain, ulen + plen + 2, b64, sizeof(b64))) != ESP_OK) goto fail;
+       code = smtp_cmd(c, "AUTH PLAIN %s", b64);
+       if (code != 235) goto fail;
+   } else if (email->username[0]) {
+       code = smtp_cmd(c, "AUTH LOGIN");
+       if (code == 334) {
+           if ((err = base64_encode(email->username, strlen(email->username), b64, sizeof(b64))) != ESP_OK) goto fail;
+           code = smtp_cmd(c, "%s", b64);
+       }
+       if (code == 334) {
+           if ((err = base64_encode(email->password, strlen(email->password), b64, sizeof(b64))) != ESP_OK) goto fail;
+           code = smtp_cmd(c, "%s", b64);
+       }
+       if (code != 235) goto fail;
+   }
+
+   memset(plain, 0, sizeof(plain));
+   memset(b64, 0, sizeof(b64));
+   return ESP_OK;
+
+fail:
+   memset(plain, 0, sizeof(plain));
+   memset(b64, 0, sizeof(b64));
+   outbox_set_error("Login to %s failed: %s", email->smtp_server,
+                    err != ESP_OK ? "login too long" : code < 0 ? "no reply" : c->line);
+   return ESP_FAIL;
+}
+
+// smtp_put_header
+// Puts one header, a line break in the value would start a header of its own so it's made a space
+static esp_err_t smtp_put_header(smtp_conn_t *c, const char *name, const char *value) {
+   if (smtp_put(c, name, strlen(name)) != ESP_OK || smtp_put(c, ": ", 2) != ESP_OK) return ESP_FAIL;
+   for (const char *p = value; *p; p++) {
+       char ch = (*p == '\r' || *p == '\n') ? ' ' : *p;
+       if (smtp_put(c, &ch, 1) != ESP_OK) return ESP_FAIL;
+   }
+   return smtp_put(c, "\r\n", 2);
+}
+
+// smtp_put_body
+// Puts the message text the way DATA needs it: every line break made a CRLF (the N64 sends bare
+// LFs) and a '.' at the start of a line doubled, so a line that's just "." can't end the message
+// early. It's read straight from the queued message, a run at a time between the bytes that need
+// something added
+static esp_err_t smtp_put_body(smtp_conn_t *c, const char *body) {
+   const char *run = body;
+   bool line_start = true;
+   char last = '\0';
+
+   for (const char *p = body; *p; last = *p++) {
+       const char *add = NULL;
+
+       if (*p == '\n' && last != '\r') add = "\r";
+       else if (last == '\r' && *p != '\n') add = (*p == '.') ? "\n." : "\n";
+       else if (line_start && *p == '.') add = ".";
+       line_start = (*p == '\n');
+       if (!add) continue;
+
+       if (smtp_put(c, run, p - run) != ESP_OK || smtp_put(c, add, strlen(add)) != ESP_OK) return ESP_FAIL;
+       run = p;
+   }
+   if (smtp_put(c, run, strlen(run)) != ESP_OK) return ESP_FAIL;
+
+   // The end of the message has to be on a line of its own
+   if (last == '\r') return smtp_put(c, "\n.\r\n", 4);
+   if (last != '\n' && last != '\0') return smtp_put(c, "\r\n.\r\n", 5);
+   return smtp_put(c, ".\r\n", 3);
+}
+
+// smtp_envelope
+// MAIL FROM, RCPT TO and DATA. With PIPELINING they go out together and the three replies are
+// read after, otherwise one at a time stopping at the first one turned down. Returns the code
+// of whichever reply decides it (354 when the message can follow), with its line in 'why'
+static int smtp_envelope(smtp_conn_t *c, const char *from, const outbox_msg_t *m, char *why, size_t size) {
+   int codes[3] = {0};
+   int n = 0;
+
+   if (!c->pipelining) {
+       if ((codes[0] = smtp_cmd(c, "MAIL FROM:<%s>", from)) == 250 &&
+           (codes[1] = smtp_cmd(c, "RCPT TO:<%s>", m->to)) / 10 == 25) {
+           codes[2] = smtp_cmd(c, "DATA");
+       }
+       snprintf(why, size, "%s", c->line);
+       for (n = 0; n < 2 && codes[n + 1] != 0; n++);
+       return codes[n];
+   }
+
+   if (smtp_send(c, "MAIL FROM:<%s>", from) != ESP_OK ||
+       smtp_send(c, "RCPT TO:<%s>", m->to) != ESP_OK ||
+       smtp_send(c, "DATA") != ESP_OK) {
+       return -1;
+   }
+   why[0] = '\0';
+   for (int i = 0; i < 3; i++) {
+       if ((codes[i] = smtp_reply(c)) < 0) return -1;
+
+       // The first one that's turned down is the reason, what comes after just follows from it
+       bool ok = (i == 0) ? codes[i] == 250 : (i == 1) ? codes[i] / 10 == 25 : codes[i] == 354;
+       if (!ok && !why[0]) {
+           snprintf(why, size, "%s", c->line);
+           n = i;
+       }
+   }
+
+   if (!why[0]) return 354;
+
+   // DATA can still have been taken when an earlier command wasn't, an empty message ends it
+   if (codes[2] == 354 && (smtp_put(c, ".\r\n", 3) != ESP_OK || smtp_reply(c) < 0)) return -1;
+   return codes[n];
+}
+
+// smtp_deliver
+// Sends one message on a logged in connection, in two round trips when the server pipelines.
+// ESP_OK once the server has taken it, ESP_ERR_INVALID_RESPONSE if it turned it down for good
+// (a 5xx) and ESP_ERR_TIMEOUT if it said to try later (a 4xx), either way the connection can go
+// on to the next message. ESP_FAIL means the connection is gone
+static esp_err_t smtp_deliver(smtp_conn_t *c, const char *from, const outbox_msg_t *m) {
+   char why[sizeof(c->line)];
+
+   int code = smtp_envelope(c, from, m, why, sizeof(why));
+   if (code == 354) {
+       if (smtp_put_header(c, "From", from) != ESP_OK ||
+           smtp_put_header(c, "To", m->to) != ESP_OK ||
+           smtp_put_header(c, "Subject", m->subject) != ESP_OK ||
+           smtp_put(c, "\r\n", 2) != ESP_OK ||
+           smtp_put_body(c, m->body) != ESP_OK) {
+           return ESP_FAIL;
+       }
+       if ((code = smtp_reply(c)) == 250) return ESP_OK;
+       snprintf(why, sizeof(why), "%s", c->line);
+   }
+   if (code < 0) return ESP_FAIL;
+
+   ESP_LOGW(OUTBOX_TAG, "Message %u to %s: %s", (unsigned)m->id, m->to, why);
+   outbox_set_error("Message to %s: %s", m->to, why);
+
+   // Back to a clean state for the next message
+   if (smtp_cmd(c, "RSET") < 0) return ESP_FAIL;
+   return (code >= 500) ? ESP_ERR_INVALID_RESPONSE : ESP_ERR_TIMEOUT;
+}
+
+// outbox_due
+// The slots of the messages that are due to go out, oldest first
+static size_t outbox_due(int *slots) {
+   int64_t now = outbox_now_s();
+   size_t n = 0;
+
+   xSemaphoreTake(queue_lock, portMAX_DELAY);
+   for (int i = 0; i < OUTBOX_SLOTS; i++) {
+       if (!queue[i].used || queue[i].next_try_s > now) continue;
+
+       size_t j = n++;
+       for (; j > 0 && queue[slots[j - 1]].id > queue[i].id; j--) slots[j] = slots[j - 1];
+       slots[j] = i;
+   }
+   xSemaphoreGive(queue_lock);
+   return n;
+}
+
+// outbox_session
+// Logs in once and sends everything that's due
+static void outbox_session(const settings_email_t *email) {
+   int slots[OUTBOX_SLOTS];
+   size_t n = outbox_due(slots);
+   size_t done = 0;
+
+   int port = atoi(email->smtp_port);
+   if (port <= 0) port = 465;
+
+   smtp_conn_t *c = heap_caps_calloc(1, sizeof(smtp_conn_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+   if (!c) return;
+
+   esp_tls_cfg_t cfg = {
+       .crt_bundle_attach = esp_crt_bundle_attach,
+       .timeout_ms = OUTBOX_READ_TIMEOUT_MS,
+   };
+
+   status.sending = true;
+   c->tls = tls_cache_connect(email->smtp_server, port, &cfg);
+   if (!c->tls) {
+       outbox_set_error("Can't connect to %s:%d", email->smtp_server, port);
+       goto done;
+   }
+   if (smtp_login(c, email) != ESP_OK) goto done;
+
+   for (; done < n; done++) {
+       const outbox_msg_t *m = &queue[slots[done]];
+       esp_err_t err = smtp_deliver(c, email->username, m);
+
+       if (err == ESP_OK) {
+           ESP_LOGI(OUTBOX_TAG, "Message %u sent to %s", (unsigned)m->id, m->to);
+           status.sent++;
+           outbox_drop(slots[done]);
+       } else if (err == ESP_ERR_INVALID_RESPONSE) {
+           status.failed++;
+           outbox_drop(slots[done]);
+       } else if (err == ESP_ERR_TIMEOUT) {
+           outbox_retry_later(slots[done]);
+       } else {
+           outbox_set_error("Connection to %s lost", email->smtp_server);
+           break;
+       }
+   }
+
+   // Nothing's left to hear from the server, so the QUIT isn't waited on
+   if (done == n && smtp_send(c, "QUIT") == ESP_OK) smtp_flush(c);
+
+done:
+   // Whatever didn't get its turn waits for the next session. That's down to the server or the
+   // settings rather than the messages, so it doesn't count against their attempts
+   if (done < n) {
+       uint32_t wait_s = outbox_backoff_s(++session_failures);
+       for (; done < n; done++) outbox_wait(slots[done], wait_s);
+   } else {
+       session_failures = 0;
+   }
+   if (c->tls) esp_tls_conn_destroy(c->tls);
+   heap_caps_free(c);
+   status.sending = false;
+}
+
+// outbox_wait_ticks
+// How long until the next message is due, portMAX_DELAY when there's nothing queued
+static TickType_t outbox_wait_ticks(void) {
+   int64_t now = outbox_now_s();
+   int64_t next = -1;
+
+   xSemaphoreTake(queue_lock, portMAX_DELAY);
+   for (int i = 0; i < OUTBOX_SLOTS; i++) {
+       if (queue[i].used && (next < 0 || queue[i].next_try_s < next)) next = queue[i].next_try_s;
+   }
+   xSemaphoreGive(queue_lock);
+
+   if (next < 0) return portMAX_DELAY;
+   return (next <= now) ? 0 : pdMS_TO_TICKS((next - now) * 1000);
+}
+
+// on_email_settings
+// New server or login, whatever's waiting on a retry gets another go with them right away and
+// the waits between sessions start over
+static void on_email_settings(const settings_t *settings, uint32_t changed, void *ctx) {
+   xSemaphoreTake(queue_lock, portMAX_DELAY);
+   for (int i = 0; i < OUTBOX_SLOTS; i++) queue[i].next_try_s = 0;
+   session_failures = 0;
+   xSemaphoreGive(queue_lock);
+   if (outbox_task_handle) xTaskNotifyGive(outbox_task_handle);
+}
+
+// outbox_init
+// Loads whatever was still queued from the storage filesystem, call after storage_init and
+// before starting outbox_task
+void outbox_init(void) {
+   queue_lock = xSemaphoreCreateMutex();
+   if (!queue_lock) {
+       ESP_LOGE(OUTBOX_TAG, "Failed to create the queue lock");
+       return;
+   }
+
+   for (int i = 0; i < OUTBOX_SLOTS; i++) {
+       outbox_flash_args_t args = { .slot = i };
+       worker_run_internal(outbox_read_slot, &args);
+       if (!args.ok) continue;
+
+       status.queued++;
+       if (queue[i].id >= next_id) next_id = queue[i].id + 1;
+   }
+   if (status.queued) ESP_LOGI(OUTBOX_TAG, "%u messages still waiting to go out", (unsigned)status.queued);
+
+   settings_subscribe(SETTINGS_EMAIL, on_email_settings, NULL);
+}
+
+// outbox_task
+// Sends whatever is queued as soon as there are email settings and a way out to the internet,
+// sleeping until the next message is due otherwise
+void outbox_task(void *arg) {
+   settings_t cfg;
+
+   outbox_task_handle = xTaskGetCurrentTaskHandle();
+
+   while (1) {
+       TickType_t wait = queue_lock ? outbox_wait_ticks() : portMAX_DELAY;
+       if (wait > 0) {
+           ulTaskNotifyTake(pdTRUE, wait);
+           continue;
+       }
+
+       settings_get(&cfg);
+       if (!(cfg.present & SETTINGS_EMAIL) || !cfg.email.smtp_server[0] || !is_sta_connected()) {
+           ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(OUTBOX_RETRY_MIN_S * 1000));
+           continue;
+       }
+
+       outbox_session(&cfg.email);
+   }
+}
+
+// outbox_add
+// Queues a message and wakes the task to send it. Once this returns ESP_OK the message is the
+// task's to deliver, it's in PSRAM and (unless the storage filesystem is missing or full) in
+// flash too. ESP_ERR_NO_MEM when the queue is full, ESP_ERR_INVALID_ARG for an address with a
+// line break in it
+esp_err_t outbox_add(const char *to, const char *subject, const char *body) {
+   if (!queue_lock) return ESP_ERR_INVALID_STATE;
+   if (!subject) subject = "";
+   if (!body) body = "";
+   if (!to || !outbox_addr_ok(to)) return ESP_ERR_INVALID_ARG;
+
+   size_t to_len = strlen(to);
+   size_t subject_len = strlen(subject);
+   size_t body_len = strlen(body);
+   if (to_len >= OUTBOX_ADDR_LEN || subject_len >= OUTBOX_SUBJECT_LEN || body_len > OUTBOX_BODY_MAX) {
+       return ESP_ERR_INVALID_SIZE;
+   }
+
+   outbox_msg_t m = {
+       .used = true,
+       .size = to_len + subject_len + body_len + 3,
+   };
+   m.data = heap_caps_malloc(m.size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+   if (!m.data) return ESP_ERR_NO_MEM;
+   memcpy(m.data, to, to_len + 1);
+   memcpy(m.data + to_len + 1, subject, subject_len + 1);
+   memcpy(m.data + to_len + subject_len + 2, body, body_len + 1);
+   m.to = m.data;
+   m.subject = m.data + to_len + 1;
+   m.body = m.subject + subject_len + 1;
+
+   // The slot is claimed under the lock, the task doesn't look at it until it's marked used
+   int slot = -1;
+   xSemaphoreTake(queue_lock, portMAX_DELAY);
+   for (int i = 0; slot < 0 && i < OUTBOX_SLOTS; i++) {
+       if (!queue[i].used && !queue[i].data) slot = i;
+   }
+   if (slot >= 0) {
+       m.id = next_id++;
+       queue[slot].data = m.data;
+   }
+   xSemaphoreGive(queue_lock);
+
+   if (slot < 0) {
+       heap_caps_free(m.data);
+       return ESP_ERR_NO_MEM;
+   }
+
+   outbox_flash_args_t args = { .slot = slot, .msg = &m };
+   worker_run_internal(outbox_write_slot, &args);
+   if (!args.ok) ESP_LOGW(OUTBOX_TAG, "Message %u is only queued in RAM", (unsigned)m.id);
+
+   xSemaphoreTake(queue_lock, portMAX_DELAY);
+   queue[slot] = m;
+   status.queued++;
+   xSemaphoreGive(queue_lock);
+
+   ESP_LOGI(OUTBOX_TAG, "Message %u to %s queued", (unsigned)m.id, to);
+   if (outbox_task_handle) xTaskNotifyGive(outbox_task_handle);
+   return ESP_OK;
+}
+
+// outbox_get_status
+// Copies out the queue and delivery counters for the config page
+void outbox_get_status(outbox_status_t *out) {
+   if (!queue_lock) {
+       memset(out, 0, sizeof(*out));
+       return;
+   }
+
+   TickType_t wait = outbox_wait_ticks();
+
+   xSemaphoreTake(queue_lock, portMAX_DELAY);
+   *out = status;
+   xSemaphoreGive(queue_lock);
+   out->next_retry_s = (wait == portMAX_DELAY) ? 0 : pdTICKS_TO_MS(wait) / 1000;
+}
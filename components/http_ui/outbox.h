@@ -0,0 +1,56 @@
+// Outgoing mail queue config
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+// Messages that can be waiting to go out at once. Each one is kept in PSRAM and in its own slot
+// file on the storage filesystem, so what hasn't gone out yet is still there after a reboot
+#define OUTBOX_SLOTS 8
+
+// Longest To, Subject and body a message can have
+#define OUTBOX_ADDR_LEN 256
+#define OUTBOX_SUBJECT_LEN 256
+#define OUTBOX_BODY_MAX (8 * 1024)
+
+// Longest reply line read from the server, the rest of a longer line is dropped
+#define OUTBOX_LINE_LEN 512
+
+// How long a read waits before the server is taken to have gone quiet
+#define OUTBOX_READ_TIMEOUT_MS 15000
+
+// Wait after a failed delivery, doubled on every failure in a row up to the max. A message the
+// server has told to try later OUTBOX_MAX_ATTEMPTS times is dropped, not getting through to the
+// server at all doesn't count
+#define OUTBOX_RETRY_MIN_S 30
+#define OUTBOX_RETRY_MAX_S (30 * 60)
+#define OUTBOX_MAX_ATTEMPTS 12
+
+// Delivery counters for the config page. last_error is what the server (or the connection) said
+// the last time something didn't go out
+typedef struct {
+   uint32_t queued;
+   uint32_t sent;
+   uint32_t failed;
+   uint32_t retries;
+   bool sending;
+   uint32_t next_retry_s;
+   char last_error[96];
+} outbox_status_t;
+
+// prototypes
+void outbox_init(void);
+void outbox_task(void *arg);
+esp_err_t outbox_add(const char *to, const char *subject, const char *body);
+void outbox_get_status(outbox_status_t *out);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,407 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+
+#include "page_cache.h"
+#include "storage.h"
+#include "worker.h"
+
+static const char *PAGE_CACHE_TAG = "PAGE_CACHE";
+
+#define SPILL_MAGIC 0x43505753 // "SWPC"
+
+// Max number of pages one insert can push out to the spill area, anything past that is
+// just dropped (it only happens when a big page pushes out lots of small ones)
+#define SPILL_MAX_VICTIMS 4
+
+typedef struct {
+   char key[PAGE_CACHE_KEY_LEN];
+   page_cache_page_t *page;
+   int64_t used_us;
+   bool revalidating;
+} page_cache_entry_t;
+
+typedef struct {
+   char key[PAGE_CACHE_KEY_LEN];
+   page_cache_page_t *page;
+} spill_victim_t;
+
+typedef struct {
+   uint32_t magic;
+   uint32_t len;
+   char key[PAGE_CACHE_KEY_LEN];
+   char etag[PAGE_CACHE_VALIDATOR_LEN];
+   char last_modified[PAGE_CACHE_VALIDATOR_LEN];
+} spill_header_t;
+
+static page_cache_entry_t *entries = NULL;
+static SemaphoreHandle_t cache_lock = NULL;
+static QueueHandle_t revalidate_queue = NULL;
+static page_cache_fetch_fn fetch_fn = NULL;
+static page_cache_stats_t cache_stats = {0};
+static size_t total_bytes = 0;
+
+// spill_path
+// Spilled pages live in a fixed number of direct mapped slots, so the spill area can never
+// grow past PAGE_CACHE_SPILL_SLOTS files. A collision just replaces the older page
+static void spill_path(const char *key, char *path, size_t size) {
+   uint32_t h = 2166136261u;
+   for (const char *p = key; *p; p++) {
+       h ^= (uint8_t)*p;
+       h *= 16777619u;
+   }
+   snprintf(path, size, STORAGE_BASE_PATH "/pc%02u.bin", (unsigned)(h % PAGE_CACHE_SPILL_SLOTS));
+}
+
+// page_alloc
+// Pages live in PSRAM with the cache holding the first reference
+static page_cache_page_t *page_alloc(size_t len) {
+   page_cache_page_t *page = heap_caps_malloc(sizeof(page_cache_page_t) + len + 1,
+                                              MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+   if (!page) return NULL;
+
+   memset(page, 0, sizeof(page_cache_page_t));
+   page->refs = 1;
+   page->len = len;
+   page->data[len] = '\0';
+   return page;
+}
+
+// page_unref
+// Drops a reference, must be called with cache_lock held
+static void page_unref(page_cache_page_t *page) {
+   if (--page->refs == 0) heap_caps_free(page);
+}
+
+// cache_find
+// Must be called with cache_lock held
+static page_cache_entry_t *cache_find(const char *key) {
+   for (int i = 0; i < PAGE_CACHE_MAX_PAGES; i++) {
+       if (entries[i].page && strcmp(entries[i].key, key) == 0) return &entries[i];
+   }
+   return NULL;
+}
+
+// cache_evict
+// Pulls a page out of PSRAM, handing the cache's reference over to the victim list so it can
+// be spilled once the lock is dropped. Must be called with cache_lock held
+static void cache_evict(page_cache_entry_t *e, spill_victim_t *victims, int *nvictims) {
+   total_bytes -= e->page->len;
+
+   if (*nvictims < SPILL_MAX_VICTIMS) {
+       strcpy(victims[*nvictims].key, e->key);
+       victims[*nvictims].page = e->page;
+       (*nvictims)++;
+   } else {
+       page_unref(e->page);
+   }
+
+   e->page = NULL;
+   e->key[0] = '\0';
+}
+
+// cache_insert
+// Adds or replaces a page, evicting least recently used pages until we're back under the
+// size bound. Must be called with cache_lock held
+static page_cache_entry_t *cache_insert(const char *key, page_cache_page_t *page,
+                                        spill_victim_t *victims, int *nvictims) {
+   page_cache_entry_t *e = cache_find(key);
+
+   if (e) {
+       total_bytes -= e->page->len;
+       page_unref(e->page);
+   } else {
+       e = &entries[0];
+       for (int i = 0; i < PAGE_CACHE_MAX_PAGES; i++) {
+           if (!entries[i].page) {
+               e = &entries[i];
+               break;
+           }
+           if (entries[i].used_us < e->used_us) e = &entries[i];
+       }
+       if (e->page) cache_evict(e, victims, nvictims);
+       strcpy(e->key, key);
+   }
+
+   e->page = page;
+   e->used_us = esp_timer_get_time();
+   e->revalidating = false;
+   total_bytes += page->len;
+
+   while (total_bytes > PAGE_CACHE_MAX_BYTES) {
+       page_cache_entry_t *lru = NULL;
+       for (int i = 0; i < PAGE_CACHE_MAX_PAGES; i++) {
+           if (!entries[i].page || &entries[i] == e) continue;
+           if (!lru || entries[i].used_us < lru->used_us) lru = &entries[i];
+       }
+       if (!lru) break;
+       cache_evict(lru, victims, nvictims);
+   }
+
+   return e;
+}
+
+// queue_revalidate
+// Hands a page to page_cache_task if it's due for a check. Must be called with cache_lock held
+static void queue_revalidate(page_cache_entry_t *e) {
+   int64_t age_us = esp_timer_get_time() - e->page->validated_us;
+
+   if (e->revalidating || !revalidate_queue) return;
+   if (e->page->validated_us != 0 && age_us < PAGE_CACHE_REVALIDATE_S * 1000000LL) return;
+
+   if (xQueueSend(revalidate_queue, e->key, 0) == pdTRUE) e->revalidating = true;
+}
+
+// spill_write
+// Writes an evicted page out to its slot on the storage filesystem
+static void spill_write(const char *key, const page_cache_page_t *page) {
+   char path[32];
+   spill_header_t hdr = {0};
+
+   if (!storage_is_mounted()) return;
+
+   spill_path(key, path, sizeof(path));
+   FILE *f = fopen(path, "wb");
+   if (!f) return;
+
+   hdr.magic = SPILL_MAGIC;
+   hdr.len = page->len;
+   strcpy(hdr.key, key);
+   strcpy(hdr.etag, page->etag);
+   strcpy(hdr.last_modified, page->last_modified);
+
+   bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 && fwrite(page->data, 1, page->len, f) == page->len;
+   fclose(f);
+
+   // A half written slot would just fail the length check later, but don't leave it around
+   if (!ok) remove(path);
+}
+
+// spill_read
+// Loads a page back from the spill area if its slot still holds it. We don't know how old it
+// is after a reboot, so it comes back marked as needing revalidation
+static page_cache_page_t *spill_read(const char *key) {
+   char path[32];
+   spill_header_t hdr;
+   page_cache_page_t *page = NULL;
+
+   if (!storage_is_mounted()) return NULL;
+
+   spill_path(key, path, sizeof(path));
+   FILE *f = fopen(path, "rb");
+   if (!f) return NULL;
+
+   if (fread(&hdr, sizeof(hdr), 1, f) == 1 && hdr.magic == SPILL_MAGIC &&
+       hdr.len <= PAGE_CACHE_MAX_PAGE_SIZE && strncmp(hdr.key, key, sizeof(hdr.key)) == 0) {
+       page = page_alloc(hdr.len);
+       if (page && fread(page->data, 1, hdr.len, f) == hdr.len) {
+           hdr.etag[sizeof(hdr.etag) - 1] = '\0';
+           hdr.last_modified[sizeof(hdr.last_modified) - 1] = '\0';
+           strcpy(page->etag, hdr.etag);
+           strcpy(page->last_modified, hdr.last_modified);
+       } else if (page) {
+           heap_caps_free(page);
+           page = NULL;
+       }
+   }
+
+   fclose(f);
+   return page;
+}
+
+// The spill area is touched from the HTTP workers too, whose stacks are in PSRAM, so reads
+// and writes go through worker_run_internal with their arguments in one of these
+typedef struct {
+   const char *key;
+   page_cache_page_t *page;
+} spill_read_args_t;
+
+typedef struct {
+   spill_victim_t *victims;
+   int nvictims;
+} spill_write_args_t;
+
+// spill_read_cb
+static void spill_read_cb(void *arg) {
+   spill_read_args_t *a = arg;
+   a->page = spill_read(a->key);
+}
+
+// spill_write_cb
+static void spill_write_cb(void *arg) {
+   spill_write_args_t *a = arg;
+   for (int i = 0; i < a->nvictims; i++) spill_write(a->victims[i].key, a->victims[i].page);
+}
+
+// spill_victims
+// Writes out whatever an insert pushed out of PSRAM, then lets go of it
+static void spill_victims(spill_victim_t *victims, int nvictims) {
+   if (nvictims == 0) return;
+
+   spill_write_args_t args = { .victims = victims, .nvictims = nvictims };
+   worker_run_internal(spill_write_cb, &args);
+
+   for (int i = 0; i < nvictims; i++) page_cache_release(victims[i].page);
+}
+
+// page_cache_init
+// Sets up the cache in PSRAM. The fetch function is what page_cache_task uses to
+// revalidate pages with the server
+void page_cache_init(page_cache_fetch_fn fetch) {
+   if (entries) return;
+
+   entries = heap_caps_calloc(PAGE_CACHE_MAX_PAGES, sizeof(page_cache_entry_t),
+                              MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+   if (!entries) {
+       ESP_LOGE(PAGE_CACHE_TAG, "Failed to allocate page cache, running uncached");
+       return;
+   }
+
+   cache_lock = xSemaphoreCreateMutex();
+   revalidate_queue = xQueueCreate(PAGE_CACHE_QUEUE_LEN, PAGE_CACHE_KEY_LEN);
+   fetch_fn = fetch;
+}
+
+// page_cache_get
+// Looks up a page in PSRAM, then in the spill area. The page returned holds a reference
+// that has to be given back with page_cache_release once it's been sent
+page_cache_page_t *page_cache_get(const char *key) {
+   page_cache_page_t *page = NULL;
+
+   if (!entries || strlen(key) >= PAGE_CACHE_KEY_LEN) return NULL;
+
+   xSemaphoreTake(cache_lock, portMAX_DELAY);
+   page_cache_entry_t *e = cache_find(key);
+   if (e) {
+       page = e->page;
+       page->refs++;
+       e->used_us = esp_timer_get_time();
+       queue_revalidate(e);
+       cache_stats.hits++;
+   }
+   xSemaphoreGive(cache_lock);
+
+   if (page) return page;
+
+   spill_read_args_t args = { .key = key };
+   worker_run_internal(spill_read_cb, &args);
+   page = args.page;
+
+   spill_victim_t victims[SPILL_MAX_VICTIMS];
+   int nvictims = 0;
+
+   xSemaphoreTake(cache_lock, portMAX_DELAY);
+   if (page) {
+       page->refs++;
+       queue_revalidate(cache_insert(key, page, victims, &nvictims));
+       cache_stats.hits++;
+       cache_stats.spill_hits++;
+   } else {
+       cache_stats.misses++;
+   }
+   xSemaphoreGive(cache_lock);
+
+   spill_victims(victims, nvictims);
+   return page;
+}
+
+// page_cache_release
+// Gives back a reference from page_cache_get
+void page_cache_release(page_cache_page_t *page) {
+   if (!page) return;
+
+   xSemaphoreTake(cache_lock, portMAX_DELAY);
+   page_unref(page);
+   xSemaphoreGive(cache_lock);
+}
+
+// page_cache_put
+// Caches a freshly fetched page along with the validators the server sent for it
+void page_cache_put(const char *key, const char *data, size_t len, const char *etag, const char *last_modified) {
+   if (!entries || len > PAGE_CACHE_MAX_PAGE_SIZE || strlen(key) >= PAGE_CACHE_KEY_LEN) return;
+
+   page_cache_page_t *page = page_alloc(len);
+   if (!page) return;
+
+   memcpy(page->data, data, len);
+   snprintf(page->etag, sizeof(page->etag), "%s", etag ? etag : "");
+   snprintf(page->last_modified, sizeof(page->last_modified), "%s", last_modified ? last_modified : "");
+   page->validated_us = esp_timer_get_time();
+
+   spill_victim_t victims[SPILL_MAX_VICTIMS];
+   int nvictims = 0;
+
+   xSemaphoreTake(cache_lock, portMAX_DELAY);
+   cache_insert(key, page, victims, &nvictims);
+   xSemaphoreGive(cache_lock);
+
+   spill_victims(victims, nvictims);
+}
+
+// page_cache_get_stats
+// Copies out the cache counters for the stats page
+void page_cache_get_stats(page_cache_stats_t *out) {
+   memset(out, 0, sizeof(*out));
+   if (!entries) return;
+
+   xSemaphoreTake(cache_lock, portMAX_DELAY);
+   *out = cache_stats;
+   for (int i = 0; i < PAGE_CACHE_MAX_PAGES; i++) {
+       if (entries[i].page) out->pages++;
+   }
+   out->bytes = total_bytes;
+   xSemaphoreGive(cache_lock);
+}
+
+// page_cache_task
+// Revalidates stale pages in the background so the N64 never waits on the server for a page
+// we already have. A 304 just restarts the page's clock, anything new gets put by the fetch function
+void page_cache_task(void *arg) {
+   ESP_LOGI(PAGE_CACHE_TAG, "page_cache_task started on core %d", xPortGetCoreID());
+
+   if (!revalidate_queue || !fetch_fn) {
+       vTaskDelete(NULL);
+       return;
+   }
+
+   char key[PAGE_CACHE_KEY_LEN];
+   char etag[PAGE_CACHE_VALIDATOR_LEN];
+   char last_modified[PAGE_CACHE_VALIDATOR_LEN];
+
+   while (1) {
+       if (xQueueReceive(revalidate_queue, key, portMAX_DELAY) != pdTRUE) continue;
+
+       xSemaphoreTake(cache_lock, portMAX_DELAY);
+       page_cache_entry_t *e = cache_find(key);
+       if (e) {
+           strcpy(etag, e->page->etag);
+           strcpy(last_modified, e->page->last_modified);
+       }
+       xSemaphoreGive(cache_lock);
+
+       if (!e) continue;
+
+       int status = fetch_fn(key, etag, last_modified);
+
+       xSemaphoreTake(cache_lock, portMAX_DELAY);
+       e = cache_find(key);
+       if (status == 304 && e) {
+           e->page->validated_us = esp_timer_get_time();
+           cache_stats.revalidated++;
+       } else if (status == 200) {
+           cache_stats.refreshed++;
+       }
+       if (e) e->revalidating = false;
+       xSemaphoreGive(cache_lock);
+
+       ESP_LOGI(PAGE_CACHE_TAG, "Revalidated %s (status=%d)", key, status);
+   }
+}
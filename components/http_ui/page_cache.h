@@ -0,0 +1,70 @@
+// Gamerz page cache config
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Max total size of the pages kept in PSRAM
+#define PAGE_CACHE_MAX_BYTES (1024 * 1024)
+
+// Max number of pages kept in PSRAM
+#define PAGE_CACHE_MAX_PAGES 64
+
+// Longest request path that gets cached, anything longer is always fetched
+#define PAGE_CACHE_KEY_LEN 128
+
+// Biggest single page worth keeping
+#define PAGE_CACHE_MAX_PAGE_SIZE (64 * 1024)
+
+// Max length of the ETag and Last-Modified values we hang on to for revalidation
+#define PAGE_CACHE_VALIDATOR_LEN 64
+
+// Pages that haven't been checked with the server in this long get revalidated in the
+// background the next time they're served (they're still served right away)
+#define PAGE_CACHE_REVALIDATE_S (6 * 60 * 60)
+
+// Pages evicted from PSRAM get spilled to this many slots on the storage filesystem
+#define PAGE_CACHE_SPILL_SLOTS 64
+
+// Max number of pages waiting to be revalidated
+#define PAGE_CACHE_QUEUE_LEN 8
+
+typedef struct {
+   int refs;
+   size_t len;
+   int64_t validated_us;
+   char etag[PAGE_CACHE_VALIDATOR_LEN];
+   char last_modified[PAGE_CACHE_VALIDATOR_LEN];
+   char data[];
+} page_cache_page_t;
+
+typedef struct {
+   uint32_t hits;
+   uint32_t misses;
+   uint32_t spill_hits;
+   uint32_t revalidated;
+   uint32_t refreshed;
+   uint32_t pages;
+   uint32_t bytes;
+} page_cache_stats_t;
+
+// Called from page_cache_task to revalidate a page. It should do a conditional GET with the
+// validators, call page_cache_put if the page changed, and return the HTTP status (or -1)
+typedef int (*page_cache_fetch_fn)(const char *key, const char *etag, const char *last_modified);
+
+// prototypes
+void page_cache_init(page_cache_fetch_fn fetch);
+page_cache_page_t *page_cache_get(const char *key);
+void page_cache_release(page_cache_page_t *page);
+void page_cache_put(const char *key, const char *data, size_t len, const char *etag, const char *last_modified);
+void page_cache_get_stats(page_cache_stats_t *out);
+void page_cache_task(void *arg);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "esp_log.h"
+#include "esp_http_server.h"
+#include "lwip/sockets.h"
+
+#include "freertos/FreeRTOS.h"
+
+#include "resp.h"
+
+static const char *RESP_TAG = "RESP";
+
+#ifndef MIN
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#endif
+
+static portMUX_TYPE resp_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+static resp_stats_t resp_stats = {0};
+
+// resp_nodelay
+// Every write is already as big as it's going to get, so there's no point in Nagle holding
+// the last partial segment of a response back until the previous one is ACKed
+static void resp_nodelay(httpd_req_t *req) {
+   int one = 1;
+   setsockopt(httpd_req_to_sockfd(req), IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+// resp_count_write
+// Counts a socket write for the stats page in the segments it takes
+static void resp_count_write(size_t len, bool writer) {
+   uint32_t segments = (len + RESP_SEG_SIZE - 1) / RESP_SEG_SIZE;
+
+   portENTER_CRITICAL(&resp_stats_lock);
+   if (writer) {
+       resp_stats.segments += segments;
+       if (len % RESP_SEG_SIZE) resp_stats.partial++;
+   } else {
+       resp_stats.other += segments;
+   }
+   resp_stats.bytes += len;
+   portEXIT_CRITICAL(&resp_stats_lock);
+}
+
+// resp_sock_write
+// One write to the socket, with errors turned into what esp_http_server's own send function
+// returns
+static int resp_sock_write(int sockfd, const char *buf, size_t len, int flags) {
+   int n = send(sockfd, buf, len, flags);
+   if (n < 0) {
+       if (errno == EAGAIN || errno == EINTR || errno == ETIMEDOUT) return HTTPD_SOCK_ERR_TIMEOUT;
+       return HTTPD_SOCK_ERR_FAIL;
+   }
+   return n;
+}
+
+// resp_out_flush
+// Sends what's been collected, a full segment or the end of a response
+static esp_err_t resp_out_flush(resp_out_t *out, int sockfd) {
+   const char *p = out->buf;
+   size_t len = out->len;
+
+   if (len > 0) resp_count_write(len, true);
+   out->len = 0;
+   while (len > 0) {
+       int n = resp_sock_write(sockfd, p, len, 0);
+       if (n < 0) {
+           ESP_LOGW(RESP_TAG, "Send failed on socket %d: %d", sockfd, n);
+           return ESP_FAIL;
+       }
+       p += n;
+       len -= n;
+   }
+   return ESP_OK;
+}
+
+// resp_sock_send
+// The send function on every session (see resp_session_open). While the response writer has
+// httpd putting a response together its writes are collected and go out a full segment at a
+// time, anything else goes straight to the socket as it would have
+static int resp_sock_send(httpd_handle_t hd, int sockfd, const char *buf, size_t len, int flags) {
+   if (!buf) return HTTPD_SOCK_ERR_INVALID;
+
+   resp_out_t *out = httpd_sess_get_transport_ctx(hd, sockfd);
+   if (!out) {
+       int n = resp_sock_write(sockfd, buf, len, flags);
+       if (n > 0) resp_count_write(n, false);
+       return n;
+   }
+
+   for (size_t left = len; left > 0;) {
+       size_t n = MIN(left, sizeof(out->buf) - out->len);
+       memcpy(out->buf + out->len, buf, n);
+       out->len += n;
+       buf += n;
+       left -= n;
+       if (out->len == sizeof(out->buf) && resp_out_flush(out, sockfd) != ESP_OK) return HTTPD_SOCK_ERR_FAIL;
+   }
+   return len;
+}
+
+// resp_collect
+// Points the session's writes at out, or back at the socket with NULL. Only set for the length
+// of one httpd_resp_* call so nothing is left pointing at a resp_t that's gone
+static void resp_collect(httpd_req_t *req, resp_out_t *out) {
+   httpd_sess_set_transport_ctx(req->handle, httpd_req_to_sockfd(req), out, NULL);
+}
+
+// resp_count
+static void resp_count(void) {
+   portENTER_CRITICAL(&resp_stats_lock);
+   resp_stats.responses++;
+   portEXIT_CRITICAL(&resp_stats_lock);
+}
+
+// resp_session_open
+// The open_fn for both servers, so every write on them goes through resp_sock_send
+esp_err_t resp_session_open(httpd_handle_t hd, int sockfd) {
+   return httpd_sess_set_send_override(hd, sockfd, resp_sock_send);
+}
+
+// resp_begin
+// Starts a response, nothing is sent until a full write's worth is buffered or resp_end
+void resp_begin(resp_t *r, httpd_req_t *req, const char *type) {
+   r->req = req;
+   r->type = type ? type : HTTPD_TYPE_TEXT;
+   r->err = ESP_OK;
+   r->started = false;
+   r->len = 0;
+   r->out.len = 0;
+
+   resp_nodelay(req);
+}
+
+// resp_send_buffered
+// Hands the buffered body to httpd, as the whole response if it's the last of it and nothing has
+// gone yet, otherwise as a chunk (followed by the last chunk if it's the end)
+static void resp_send_buffered(resp_t *r, bool last) {
+   esp_err_t err = ESP_OK;
+
+   resp_collect(r->req, &r->out);
+   if (!r->started) httpd_resp_set_type(r->req, r->type);
+   if (!r->started && last) {
+       err = httpd_resp_send(r->req, r->body, r->len);
+   } else {
+       if (r->len > 0) err = httpd_resp_send_chunk(r->req, r->body, r->len);
+       if (err == ESP_OK && last) err = httpd_resp_send_chunk(r->req, NULL, 0);
+       r->started = true;
+   }
+   resp_collect(r->req, NULL);
+
+   if (err == ESP_OK && last) err = resp_out_flush(&r->out, httpd_req_to_sockfd(r->req));
+   if (err != ESP_OK) r->err = ESP_FAIL;
+   r->len = 0;
+}
+
+// resp_write
+// Copies into the buffer, handing a chunk's worth to httpd each time it fills
+void resp_write(resp_t *r, const char *data, size_t len) {
+   while (len > 0 && r->err == ESP_OK) {
+       size_t n = MIN(len, sizeof(r->body) - r->len);
+       memcpy(r->body + r->len, data, n);
+       r->len += n;
+       data += n;
+       len -= n;
+       if (r->len == sizeof(r->body)) resp_send_buffered(r, false);
+   }
+}
+
+// resp_end
+// Sends what's left and finishes the response, in a single write with the headers if nothing has
+// gone out yet
+esp_err_t resp_end(resp_t *r) {
+   if (r->err != ESP_OK) return r->err;
+   resp_send_buffered(r, true);
+   resp_count();
+   return r->err;
+}
+
+// resp_send
+// A whole response that's already in memory. The headers and as much of the body as fits go out
+// in the first write, the rest a segment at a time
+esp_err_t resp_send(httpd_req_t *req, const char *type, const char *data, size_t len) {
+   resp_out_t out = { .len = 0 };
+
+   resp_nodelay(req);
+   httpd_resp_set_type(req, type ? type : HTTPD_TYPE_TEXT);
+
+   resp_collect(req, &out);
+   esp_err_t err = httpd_resp_send(req, data, len);
+   resp_collect(req, NULL);
+
+   if (err == ESP_OK) err = resp_out_flush(&out, httpd_req_to_sockfd(req));
+   resp_count();
+   return (err == ESP_OK) ? ESP_OK : ESP_FAIL;
+}
+
+// resp_get_stats
+// Copies out the counters for the stats page
+void resp_get_stats(resp_stats_t *out) {
+   portENTER_CRITICAL(&resp_stats_lock);
+   *out = resp_stats;
+   portEXIT_CRITICAL(&resp_stats_lock);
+}
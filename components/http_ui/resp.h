@@ -0,0 +1,72 @@
+// Response writer config
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "esp_http_server.h"
+#include "sdkconfig.h"
+
+// Most that goes to the socket in one write. Every write is sent as soon as it's made (the
+// socket has TCP_NODELAY set) so it's kept at one full segment, anything smaller wastes the
+// 40 bytes of TCP/IP header on a partial one at 19200bps
+#ifdef CONFIG_LWIP_TCP_MSS
+#define RESP_SEG_SIZE CONFIG_LWIP_TCP_MSS
+#else
+#define RESP_SEG_SIZE 1440
+#endif
+
+// What esp_http_server writes for a response, held until there's a full segment of it. The
+// status line and headers it makes (with whatever httpd_resp_set_status and httpd_resp_set_hdr
+// added) end up in the same write as the start of the body, and each chunk's framing in the same
+// write as the data around it
+typedef struct {
+   size_t len;
+   char buf[RESP_SEG_SIZE];
+} resp_out_t;
+
+// Sends a response with its headers and body coalesced into as few socket writes as possible.
+// esp_http_server's own httpd_resp_send writes the headers, the blank line and the body
+// separately, and httpd_resp_send_chunk does three writes per chunk, so over PPP a small page
+// costs several tiny segments each waiting on Nagle for the N64's ACK. Here the body is buffered
+// a segment's worth at a time and handed to httpd, whose writes are collected in 'out' (see
+// resp_session_open) and go out as full segments. A response that fits in the buffer goes out
+// with a Content-Length, a longer one is chunked. Errors are sticky like the template writer's
+typedef struct {
+   httpd_req_t *req;
+   const char *type;
+   esp_err_t err;
+   bool started;
+   size_t len;
+   char body[RESP_SEG_SIZE];
+   resp_out_t out;
+} resp_t;
+
+// Socket writes on the servers' sessions, counted in segments (a write bigger than one is
+// split by TCP). responses and segments are what went through the response writer, partial is
+// how many of its segments weren't full, other is segments from handlers that don't use it
+typedef struct {
+   uint32_t responses;
+   uint32_t segments;
+   uint32_t partial;
+   uint32_t other;
+   uint32_t bytes;
+} resp_stats_t;
+
+// prototypes
+esp_err_t resp_session_open(httpd_handle_t hd, int sockfd);
+void resp_begin(resp_t *r, httpd_req_t *req, const char *type);
+void resp_write(resp_t *r, const char *data, size_t len);
+esp_err_t resp_end(resp_t *r);
+esp_err_t resp_send(httpd_req_t *req, const char *type, const char *data, size_t len);
+void resp_get_stats(resp_stats_t *out);
+
+#ifdef __cplusplus
+}
+#endif
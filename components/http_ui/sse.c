@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_http_server.h"
+
+#include "sse.h"
+
+static const char *SSE_TAG = "SSE";
+
+// Sent once when a stream opens, there's no Content-Length since the response never ends
+static const char sse_headers[] =
+   "HTTP/1.1 200 OK\r\n"
+   "Content-Type: text/event-stream\r\n"
+   "Cache-Control: no-cache\r\n"
+   "Connection: keep-alive\r\n"
+   "\r\n";
+
+// sse_write
+// Writes all of buf to a client, httpd_send can take less than it's given
+static esp_err_t sse_write(httpd_req_t *req, const char *buf, size_t len) {
+   while (len > 0) {
+       int sent = httpd_send(req, buf, len);
+       if (sent <= 0) return ESP_FAIL;
+       buf += sent;
+       len -= sent;
+   }
+   return ESP_OK;
+}
+
+// sse_drop
+// Lets go of a client, the request goes back to the server and the socket gets closed
+static void sse_drop(sse_stream_t *s, size_t i) {
+   httpd_req_t *req = s->clients[i];
+   int fd = httpd_req_to_sockfd(req);
+
+   // Kept in the order they connected, oldest first
+   s->count--;
+   memmove(&s->clients[i], &s->clients[i + 1], (s->count - i) * sizeof(s->clients[0]));
+   s->clients[s->count] = NULL;
+
+   httpd_req_async_handler_complete(req);
+   httpd_sess_trigger_close(s->server, fd);
+   ESP_LOGI(SSE_TAG, "Client on socket %d dropped, %u left", fd, (unsigned)s->count);
+}
+
+// sse_broadcast
+// Writes the same bytes to every client, dropping the ones that fail
+static void sse_broadcast(sse_stream_t *s, const char *buf, size_t len) {
+   size_t i = 0;
+   while (i < s->count) {
+       if (sse_write(s->clients[i], buf, len) != ESP_OK) {
+           sse_drop(s, i);
+       } else {
+           i++;
+       }
+   }
+}
+
+// sse_keepalive_work
+// Runs on the server task, a comment line is ignored by EventSource but fails on a dead socket
+static void sse_keepalive_work(void *arg) {
+   sse_stream_t *s = arg;
+   sse_broadcast(s, ":\n\n", 3);
+}
+
+// sse_keepalive_timer
+// The timer only queues the work, sends have to come from the server task
+static void sse_keepalive_timer(void *arg) {
+   sse_stream_t *s = arg;
+   if (s->count > 0) httpd_queue_work(s->server, sse_keepalive_work, s);
+}
+
+// sse_init
+// Sets up a stream on a server, call before registering the handler that opens it
+void sse_init(sse_stream_t *s, httpd_handle_t server) {
+   memset(s, 0, sizeof(*s));
+   s->server = server;
+
+   const esp_timer_create_args_t args = {
+       .callback = sse_keepalive_timer,
+       .arg = s,
+       .name = "sse_keepalive",
+   };
+   if (esp_timer_create(&args, &s->keepalive) != ESP_OK ||
+       esp_timer_start_periodic(s->keepalive, SSE_KEEPALIVE_MS * 1000ULL) != ESP_OK) {
+       ESP_LOGE(SSE_TAG, "Failed to start keepalive timer");
+   }
+}
+
+// sse_open
+// Called from a GET handler to turn the request into an event stream. The request is kept with
+// the async request API so the server goes on without it, the handler just returns ESP_OK after.
+// When the stream is full the oldest client is let go, a page that was reloaded or closed never
+// tells us it left, so that's most likely one nobody is looking at anymore
+esp_err_t sse_open(sse_stream_t *s, httpd_req_t *req) {
+   if (s->count >= SSE_MAX_CLIENTS) {
+       sse_drop(s, 0);
+   }
+
+   httpd_req_t *async = NULL;
+   if (httpd_req_async_handler_begin(req, &async) != ESP_OK) {
+       httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Stream unavailable");
+       return ESP_FAIL;
+   }
+
+   char retry[32];
+   int n = snprintf(retry, sizeof(retry), "retry: %d\n\n", SSE_RETRY_MS);
+   if (sse_write(async, sse_headers, sizeof(sse_headers) - 1) != ESP_OK ||
+       sse_write(async, retry, n) != ESP_OK) {
+       httpd_req_async_handler_complete(async);
+       return ESP_FAIL;
+   }
+
+   s->clients[s->count++] = async;
+   ESP_LOGI(SSE_TAG, "Client on socket %d listening, %u open",
+            httpd_req_to_sockfd(async), (unsigned)s->count);
+   return ESP_OK;
+}
+
+// sse_send
+// Sends an event to every client. data has to be a single line, and this has to run on the
+// server task (from a handler, or queued with httpd_queue_work)
+void sse_send(sse_stream_t *s, const char *event, const char *data) {
+   char buf[SSE_MAX_EVENT];
+
+   if (s->count == 0) return;
+
+   int n = snprintf(buf, sizeof(buf), "event: %s\ndata: %s\n\n", event, data);
+   if (n < 0 || n >= (int)sizeof(buf)) {
+       ESP_LOGW(SSE_TAG, "Event %s too long, not sent", event);
+       return;
+   }
+   sse_broadcast(s, buf, n);
+}
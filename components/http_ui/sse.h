@@ -0,0 +1,50 @@
+// Server-sent events config
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "esp_http_server.h"
+#include "esp_timer.h"
+
+// Max number of pages listening on one stream. Each one keeps a socket on
+// the server for as long as the page is open, so this has to leave room
+// under the server's socket limit for the page loads themselves. A page
+// that comes in past this takes the place of the oldest one
+#define SSE_MAX_CLIENTS 2
+
+// How often every stream gets a comment line. Nothing is read from a stream
+// once it's open, so this is how a client that left without closing (a phone
+// that walked away from the AP) is noticed and its socket given back
+#define SSE_KEEPALIVE_MS 15000
+
+// How long a client waits before reconnecting after losing the stream
+#define SSE_RETRY_MS 3000
+
+// Longest event that can be sent, event name and framing included
+#define SSE_MAX_EVENT 512
+
+// An event stream that pages subscribe to with EventSource. Each client's request is held open
+// with the async request API and events are written straight to its socket. Everything here
+// runs on the server's own task (handlers, and work queued with httpd_queue_work), so the
+// client list needs no lock
+typedef struct {
+   httpd_handle_t server;
+   esp_timer_handle_t keepalive;
+   httpd_req_t *clients[SSE_MAX_CLIENTS];
+   size_t count;
+} sse_stream_t;
+
+// prototypes
+void sse_init(sse_stream_t *s, httpd_handle_t server);
+esp_err_t sse_open(sse_stream_t *s, httpd_req_t *req);
+void sse_send(sse_stream_t *s, const char *event, const char *data);
+
+#ifdef __cplusplus
+}
+#endif
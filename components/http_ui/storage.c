@@ -0,0 +1,40 @@
+#include <stdbool.h>
+#include "esp_log.h"
+#include "esp_spiffs.h"
+
+#include "storage.h"
+
+static const char *STORAGE_TAG = "STORAGE";
+
+static bool mounted = false;
+
+// storage_init
+// Mounts the SPIFFS partition that holds anything too big for NVS, like pages spilled out of
+// the page cache. It gets formatted the first time, which can take a while on a fresh flash
+void storage_init(void) {
+   if (mounted) return;
+
+   esp_vfs_spiffs_conf_t conf = {
+       .base_path = STORAGE_BASE_PATH,
+       .partition_label = STORAGE_PARTITION,
+       .max_files = STORAGE_MAX_FILES,
+       .format_if_mount_failed = true
+   };
+
+   esp_err_t err = esp_vfs_spiffs_register(&conf);
+   if (err != ESP_OK) {
+       ESP_LOGE(STORAGE_TAG, "Failed to mount %s: %s", STORAGE_BASE_PATH, esp_err_to_name(err));
+       return;
+   }
+
+   size_t total = 0, used = 0;
+   esp_spiffs_info(STORAGE_PARTITION, &total, &used);
+   ESP_LOGI(STORAGE_TAG, "Mounted %s (%u of %u bytes used)", STORAGE_BASE_PATH, (unsigned)used, (unsigned)total);
+   mounted = true;
+}
+
+// storage_is_mounted
+// Everything that uses the filesystem treats it as optional, so they check here first
+bool storage_is_mounted(void) {
+   return mounted;
+}
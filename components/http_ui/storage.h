@@ -0,0 +1,24 @@
+// Flash filesystem config
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+
+// Label of the SPIFFS partition (see partitions.csv) and where it gets mounted
+#define STORAGE_PARTITION "storage"
+#define STORAGE_BASE_PATH "/storage"
+
+// Max number of files that can be open at the same time
+#define STORAGE_MAX_FILES 4
+
+// prototypes
+void storage_init(void);
+bool storage_is_mounted(void);
+
+#ifdef __cplusplus
+}
+#endif
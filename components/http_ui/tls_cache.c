@@ -0,0 +1,215 @@
+// The session's master secret isn't in mbedTLS's public API, see tls_cache_master_id
+#define MBEDTLS_ALLOW_PRIVATE_ACCESS
+
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_tls.h"
+#include "mbedtls/ssl.h"
+#include "mbedtls/sha256.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "sdkconfig.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "tls_cache.h"
+
+static const char *TLS_CACHE_TAG = "TLS_CACHE";
+
+// esp-tls only has client sessions with CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS (see
+// sdkconfig.defaults), without it every handshake is a full one and only the counters are kept
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+#define TLS_CACHE_SESSIONS 1
+#else
+#define TLS_CACHE_SESSIONS 0
+#endif
+
+// Bytes of the master secret's SHA-256 kept to tell a resumed session from a new one
+#define TLS_CACHE_MASTER_ID_LEN 8
+
+// One server's saved session. While a connection to it is being made the session is taken out
+// (session is NULL), so it can't be freed out from under the handshake using it
+typedef struct {
+   char host[TLS_CACHE_HOST_LEN];
+   int port;
+#if TLS_CACHE_SESSIONS
+   esp_tls_client_session_t *session;
+   uint8_t master_id[TLS_CACHE_MASTER_ID_LEN];
+#endif
+   int64_t saved_us;
+   int64_t used_us;
+} tls_cache_entry_t;
+
+static tls_cache_entry_t *entries = NULL;
+static SemaphoreHandle_t cache_lock = NULL;
+static tls_cache_stats_t cache_stats = {0};
+
+// tls_cache_find
+// The entry for a server, or if there isn't one, the one to reuse for it (an empty one or the
+// one used longest ago). Must be called with cache_lock held
+static tls_cache_entry_t *tls_cache_find(const char *host, int port, bool *found) {
+   tls_cache_entry_t *victim = &entries[0];
+
+   for (int i = 0; i < TLS_CACHE_ENTRIES; i++) {
+       tls_cache_entry_t *e = &entries[i];
+       if (e->host[0] && e->port == port && strcmp(e->host, host) == 0) {
+           *found = true;
+           return e;
+       }
+       if (!e->host[0] || (victim->host[0] && e->used_us < victim->used_us)) victim = e;
+   }
+
+   *found = false;
+   return victim;
+}
+
+#if TLS_CACHE_SESSIONS
+// tls_cache_master_id
+// A fingerprint of a connection's master secret, false if there isn't one to take. A server that
+// resumes a TLS 1.2 session carries the master secret over, a full handshake makes a new one. The
+// session ID can't tell them apart, with a ticket the client makes up a new ID every time
+static bool tls_cache_master_id(esp_tls_t *tls, uint8_t id[TLS_CACHE_MASTER_ID_LEN]) {
+   mbedtls_ssl_context *ssl = esp_tls_get_ssl_context(tls);
+   mbedtls_ssl_session *session = ssl ? ssl->MBEDTLS_PRIVATE(session) : NULL;
+   uint8_t digest[32];
+
+   if (!session || mbedtls_ssl_get_version_number(ssl) != MBEDTLS_SSL_VERSION_TLS1_2) return false;
+   if (mbedtls_sha256(session->MBEDTLS_PRIVATE(master), sizeof(session->MBEDTLS_PRIVATE(master)), digest, 0) != 0) {
+       return false;
+   }
+   memcpy(id, digest, TLS_CACHE_MASTER_ID_LEN);
+   return true;
+}
+
+// tls_cache_take
+// Takes the saved session for a server out of the cache, NULL if there isn't a usable one. id
+// gets the master secret fingerprint saved with it
+static esp_tls_client_session_t *tls_cache_take(const char *host, int port, uint8_t id[TLS_CACHE_MASTER_ID_LEN]) {
+   esp_tls_client_session_t *session = NULL;
+   bool found;
+
+   xSemaphoreTake(cache_lock, portMAX_DELAY);
+   tls_cache_entry_t *e = tls_cache_find(host, port, &found);
+   if (found && e->session) {
+       session = e->session;
+       e->session = NULL;
+       memcpy(id, e->master_id, TLS_CACHE_MASTER_ID_LEN);
+       if (esp_timer_get_time() - e->saved_us > (int64_t)TLS_CACHE_MAX_AGE_S * 1000000) {
+           esp_tls_free_client_session(session);
+           session = NULL;
+           cache_stats.sessions--;
+       }
+   }
+   xSemaphoreGive(cache_lock);
+   return session;
+}
+
+// tls_cache_save
+// Keeps the session from a handshake that just finished, replacing whatever the server had
+static void tls_cache_save(const char *host, int port, esp_tls_client_session_t *session,
+                           const uint8_t id[TLS_CACHE_MASTER_ID_LEN]) {
+   bool found;
+
+   xSemaphoreTake(cache_lock, portMAX_DELAY);
+   tls_cache_entry_t *e = tls_cache_find(host, port, &found);
+   if (e->session) {
+       esp_tls_free_client_session(e->session);
+       cache_stats.sessions--;
+   }
+   if (!found) {
+       snprintf(e->host, sizeof(e->host), "%s", host);
+       e->port = port;
+   }
+   e->session = session;
+   memcpy(e->master_id, id, TLS_CACHE_MASTER_ID_LEN);
+   e->saved_us = e->used_us = esp_timer_get_time();
+   cache_stats.sessions++;
+   xSemaphoreGive(cache_lock);
+}
+#endif
+
+// tls_cache_init
+// Sets up the cache in PSRAM, call before anything connects
+void tls_cache_init(void) {
+   cache_lock = xSemaphoreCreateMutex();
+   entries = heap_caps_calloc(TLS_CACHE_ENTRIES, sizeof(tls_cache_entry_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+   if (!cache_lock || !entries) {
+       ESP_LOGE(TLS_CACHE_TAG, "Failed to allocate the session cache");
+       heap_caps_free(entries);
+       entries = NULL;
+   }
+}
+
+// tls_cache_connect
+// Makes a TLS connection like esp_tls_conn_new_sync, offering the session saved from the last
+// connection to the same server so the handshake can skip the key exchange and certificate
+// checks. Returns the connection (esp_tls_conn_destroy it when done) or NULL if it failed
+esp_tls_t *tls_cache_connect(const char *host, int port, esp_tls_cfg_t *cfg) {
+   bool offered = false, resumed = false;
+#if TLS_CACHE_SESSIONS
+   uint8_t offered_id[TLS_CACHE_MASTER_ID_LEN], id[TLS_CACHE_MASTER_ID_LEN] = {0};
+   bool cached = entries && strlen(host) < TLS_CACHE_HOST_LEN;
+   esp_tls_client_session_t *session = cached ? tls_cache_take(host, port, offered_id) : NULL;
+   cfg->client_session = session;
+   offered = (session != NULL);
+#endif
+
+   esp_tls_t *tls = esp_tls_init();
+   int64_t start = esp_timer_get_time();
+   int r = tls ? esp_tls_conn_new_sync(host, strlen(host), port, cfg, tls) : -1;
+   int64_t elapsed = esp_timer_get_time() - start;
+
+#if TLS_CACHE_SESSIONS
+   // Copied into the connection by the handshake, or no good if the handshake failed
+   cfg->client_session = NULL;
+   if (session) {
+       esp_tls_free_client_session(session);
+       xSemaphoreTake(cache_lock, portMAX_DELAY);
+       cache_stats.sessions--;
+       xSemaphoreGive(cache_lock);
+   }
+#endif
+
+   if (r != 1) {
+       if (tls) esp_tls_conn_destroy(tls);
+       if (cache_lock) xSemaphoreTake(cache_lock, portMAX_DELAY);
+       cache_stats.failed++;
+       if (cache_lock) xSemaphoreGive(cache_lock);
+       return NULL;
+   }
+
+#if TLS_CACHE_SESSIONS
+   // Only a server that took the session counts as resumed, one that turned it down did a full
+   // handshake
+   bool have_id = tls_cache_master_id(tls, id);
+   resumed = offered && have_id && memcmp(id, offered_id, sizeof(id)) == 0;
+   if (cached) {
+       esp_tls_client_session_t *saved = esp_tls_get_client_session(tls);
+       if (saved) tls_cache_save(host, port, saved, id);
+   }
+#endif
+
+   if (cache_lock) xSemaphoreTake(cache_lock, portMAX_DELAY);
+   if (resumed) {
+       cache_stats.resumed++;
+       cache_stats.resumed_us += elapsed;
+   } else {
+       cache_stats.full++;
+       cache_stats.full_us += elapsed;
+   }
+   if (cache_lock) xSemaphoreGive(cache_lock);
+
+   ESP_LOGI(TLS_CACHE_TAG, "%s:%d %s handshake in %lld ms", host, port,
+            resumed ? "resumed" : offered ? "full (session refused)" : "full", (long long)(elapsed / 1000));
+   return tls;
+}
+
+// tls_cache_get_stats
+// Copies out the handshake counters for the stats page
+void tls_cache_get_stats(tls_cache_stats_t *out) {
+   if (cache_lock) xSemaphoreTake(cache_lock, portMAX_DELAY);
+   *out = cache_stats;
+   if (cache_lock) xSemaphoreGive(cache_lock);
+}
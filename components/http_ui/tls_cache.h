@@ -0,0 +1,39 @@
+// TLS session cache config
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "esp_tls.h"
+
+// Number of servers a session is kept for, the one used longest ago makes room for a new one
+#define TLS_CACHE_ENTRIES 8
+
+// Longest host name that gets a session kept, anything longer always does a full handshake
+#define TLS_CACHE_HOST_LEN 128
+
+// Sessions older than this aren't offered, servers stop taking them long before anyway
+#define TLS_CACHE_MAX_AGE_S (4 * 60 * 60)
+
+// Handshake counters for the stats page. A resumed handshake is one where the server took the
+// saved session that was offered, one where it turned it down counts as full
+typedef struct {
+   uint32_t full;
+   uint32_t resumed;
+   uint32_t failed;
+   uint64_t full_us;
+   uint64_t resumed_us;
+   uint32_t sessions;
+} tls_cache_stats_t;
+
+// prototypes
+void tls_cache_init(void);
+esp_tls_t *tls_cache_connect(const char *host, int port, esp_tls_cfg_t *cfg);
+void tls_cache_get_stats(tls_cache_stats_t *out);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <string.h>
+#include "esp_http_server.h"
+
+#include "tpl.h"
+
+// tpl_begin
+// Starts a response, nothing is sent until a full write's worth is rendered or tpl_end
+void tpl_begin(tpl_writer_t *w, httpd_req_t *req, const char *type) {
+   resp_begin(&w->out, req, type);
+   w->sw_key[0] = '\0';
+}
+
+// tpl_end
+// Sends what's left and finishes the response
+esp_err_t tpl_end(tpl_writer_t *w) {
+   return resp_end(&w->out);
+}
+
+// tpl_set_sw_key
+// Sets the key sw slots are encoded with
+void tpl_set_sw_key(tpl_writer_t *w, const char *key) {
+   snprintf(w->sw_key, sizeof(w->sw_key), "%s", key ? key : "");
+}
+
+// tpl_put
+void tpl_put(tpl_writer_t *w, const char *data, size_t len) {
+   resp_write(&w->out, data, len);
+}
+
+// tpl_put_raw
+// A slot that goes out as is, for values that are already HTML
+void tpl_put_raw(tpl_writer_t *w, const char *s) {
+   if (s) tpl_put(w, s, strlen(s));
+}
+
+// tpl_put_escaped
+// Escapes the characters in 'special', runs of anything else are copied in one go
+static void tpl_put_escaped(tpl_writer_t *w, const char *s, const char *special) {
+   if (!s) return;
+
+   while (*s) {
+       size_t run = strcspn(s, special);
+       tpl_put(w, s, run);
+       s += run;
+       if (!*s) break;
+
+       switch (*s) {
+           case '&':  tpl_put(w, "&amp;", 5);  break;
+           case '<':  tpl_put(w, "&lt;", 4);   break;
+           case '>':  tpl_put(w, "&gt;", 4);   break;
+           case '"':  tpl_put(w, "&quot;", 6); break;
+           case '\'': tpl_put(w, "&#39;", 5);  break;
+       }
+       s++;
+   }
+}
+
+// tpl_put_html
+// A slot in element content
+void tpl_put_html(tpl_writer_t *w, const char *s) {
+   tpl_put_escaped(w, s, "&<>");
+}
+
+// tpl_put_attr
+// A slot inside a quoted attribute value, either quote style
+void tpl_put_attr(tpl_writer_t *w, const char *s) {
+   tpl_put_escaped(w, s, "&<>\"'");
+}
+
+// tpl_put_json
+// A slot inside a JSON string, control characters go out as \u escapes
+void tpl_put_json(tpl_writer_t *w, const char *s) {
+   static const char hex[] = "0123456789abcdef";
+
+   if (!s) return;
+
+   while (*s) {
+       const char *run = s;
+       while (*s && *s != '"' && *s != '\\' && (unsigned char)*s >= 0x20) s++;
+       tpl_put(w, run, s - run);
+       if (!*s) break;
+
+       if (*s == '"' || *s == '\\') {
+           char esc[2] = {'\\', *s};
+           tpl_put(w, esc, 2);
+       } else {
+           char esc[6] = {'\\', 'u', '0', '0', hex[(*s >> 4) & 0xF], hex[*s & 0xF]};
+           tpl_put(w, esc, 6);
+       }
+       s++;
+   }
+}
+
+// tpl_put_uint
+void tpl_put_uint(tpl_writer_t *w, uint32_t v) {
+   char num[12];
+   int n = snprintf(num, sizeof(num), "%u", (unsigned)v);
+   tpl_put(w, num, n);
+}
+
+// tpl_put_int
+void tpl_put_int(tpl_writer_t *w, int32_t v) {
+   char num[12];
+   int n = snprintf(num, sizeof(num), "%d", (int)v);
+   tpl_put(w, num, n);
+}
+
+// tpl_put_sw
+// A Sharkwire meta tag value. These are encoded against the key set with tpl_set_sw_key
+// (the gateway address as a string, see sharkwire_key in http_ui.c) two hex digits per
+// character, which is done here as it's written out instead of building the encoded string first
+void tpl_put_sw(tpl_writer_t *w, const char *s) {
+   static const char hex[] = "0123456789ABCDEF";
+   const char *key = w->sw_key;
+   size_t key_len = strlen(key);
+
+   if (!s || key_len == 0) return;
+
+   for (size_t i = 0; s[i]; i++) {
+       unsigned char encoded_value = (s[i] + key[i % key_len] - 1) % 255;
+       char out[2] = { hex[encoded_value >> 4], hex[encoded_value & 0x0F] };
+       tpl_put(w, out, 2);
+   }
+}
@@ -0,0 +1,47 @@
+// Template renderer config
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "esp_http_server.h"
+#include "resp.h"
+
+// Renders a page straight to the client. Templates in templates/ are compiled into
+// templates.c/templates.h at build time by tools/mktemplates.py, each one becoming a function
+// that writes its static text and slots through one of these, roughly:
+//
+//    tpl_writer_t w;
+//    tpl_begin(&w, req, "text/html");
+//    tpl_stats(&w, &args);
+//    return tpl_end(&w);
+//
+// The output goes through a resp_t on the handler's stack, so a page that fits in one write goes
+// out with its headers in a single segment and a bigger one is chunked. Errors are sticky, once a
+// send fails everything after it is dropped and tpl_end returns it
+typedef struct {
+   resp_t out;
+   char sw_key[16];
+} tpl_writer_t;
+
+// prototypes
+void tpl_begin(tpl_writer_t *w, httpd_req_t *req, const char *type);
+esp_err_t tpl_end(tpl_writer_t *w);
+void tpl_set_sw_key(tpl_writer_t *w, const char *key);
+void tpl_put(tpl_writer_t *w, const char *data, size_t len);
+void tpl_put_raw(tpl_writer_t *w, const char *s);
+void tpl_put_html(tpl_writer_t *w, const char *s);
+void tpl_put_attr(tpl_writer_t *w, const char *s);
+void tpl_put_json(tpl_writer_t *w, const char *s);
+void tpl_put_uint(tpl_writer_t *w, uint32_t v);
+void tpl_put_int(tpl_writer_t *w, int32_t v);
+void tpl_put_sw(tpl_writer_t *w, const char *s);
+
+#ifdef __cplusplus
+}
+#endif
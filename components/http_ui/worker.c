@@ -0,0 +1,180 @@
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "esp_memory_utils.h"
+#include "esp_http_server.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/idf_additions.h"
+
+#include "worker.h"
+
+static const char *WORKER_TAG = "WORKER";
+
+typedef struct {
+   httpd_req_t *req;
+   worker_job_t *job;
+   int64_t queued_us;
+} worker_item_t;
+
+typedef struct {
+   void (*fn)(void *arg);
+   void *arg;
+   TaskHandle_t caller;
+} worker_flash_item_t;
+
+static QueueHandle_t work_queue = NULL;
+static QueueHandle_t flash_queue = NULL;
+
+static portMUX_TYPE worker_lock = portMUX_INITIALIZER_UNLOCKED;
+static worker_job_t *jobs[WORKER_MAX_JOBS];
+static size_t job_count = 0;
+
+// worker_record
+// Adds one run of a handler to its counters, the first run also puts it on the stats page
+static void worker_record(worker_job_t *job, int64_t wait_us, int64_t service_us, bool ran_inline) {
+   portENTER_CRITICAL(&worker_lock);
+
+   size_t i = 0;
+   while (i < job_count && jobs[i] != job) i++;
+   if (i == job_count && job_count < WORKER_MAX_JOBS) jobs[job_count++] = job;
+
+   job->served++;
+   if (ran_inline) job->inline_runs++;
+   job->wait_us += wait_us;
+   if (wait_us > job->wait_max_us) job->wait_max_us = wait_us;
+   job->service_us += service_us;
+   if (service_us > job->service_max_us) job->service_max_us = service_us;
+
+   portEXIT_CRITICAL(&worker_lock);
+}
+
+// worker_task
+// Takes requests off the queue and runs their handlers. When the handler is done the request is
+// handed back to the server, which goes on with the connection like it would have on its own task
+static void worker_task(void *arg) {
+   worker_item_t item;
+
+   while (1) {
+       if (xQueueReceive(work_queue, &item, portMAX_DELAY) != pdTRUE) continue;
+
+       int64_t start_us = esp_timer_get_time();
+       esp_err_t err = item.job->handler(item.req);
+       int64_t end_us = esp_timer_get_time();
+
+       worker_record(item.job, start_us - item.queued_us, end_us - start_us, false);
+
+       // A failed handler leaves the connection in an unknown state, the server closes those too
+       if (err != ESP_OK) httpd_sess_trigger_close(item.req->handle, httpd_req_to_sockfd(item.req));
+       httpd_req_async_handler_complete(item.req);
+   }
+}
+
+// worker_flash_task
+// Runs flash access for the workers on a stack in internal RAM
+static void worker_flash_task(void *arg) {
+   worker_flash_item_t item;
+
+   while (1) {
+       if (xQueueReceive(flash_queue, &item, portMAX_DELAY) != pdTRUE) continue;
+       item.fn(item.arg);
+       xTaskNotifyGive(item.caller);
+   }
+}
+
+// worker_init
+// Starts the worker pool and its flash helper, this is called once from http_ui_task
+void worker_init(void) {
+   work_queue = xQueueCreate(WORKER_QUEUE_LEN, sizeof(worker_item_t));
+   flash_queue = xQueueCreate(WORKER_COUNT, sizeof(worker_flash_item_t));
+   if (!work_queue || !flash_queue) {
+       ESP_LOGE(WORKER_TAG, "Failed to create queues, slow requests will run on the server task");
+       work_queue = NULL;
+       return;
+   }
+
+   if (xTaskCreate(worker_flash_task, "worker_flash", WORKER_FLASH_TASK_SIZE, NULL, WORKER_FLASH_TASK_PRI, NULL) != pdPASS) {
+       ESP_LOGE(WORKER_TAG, "Failed to start the flash helper, slow requests will run on the server task");
+       work_queue = NULL;
+       return;
+   }
+
+   int started = 0;
+   for (int i = 0; i < WORKER_COUNT; i++) {
+       if (xTaskCreateWithCaps(worker_task, "http_worker", WORKER_TASK_SIZE, NULL, WORKER_TASK_PRI, NULL,
+                               MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT) == pdPASS) {
+           started++;
+       }
+   }
+
+   if (started == 0) {
+       ESP_LOGE(WORKER_TAG, "No workers started, slow requests will run on the server task");
+       work_queue = NULL;
+       return;
+   }
+   ESP_LOGI(WORKER_TAG, "%d workers started", started);
+}
+
+// worker_submit
+// Hands a request over to the pool and returns right away, so the server task can get on with
+// the next one. If the pool is backed up (or didn't start) the handler is run right here instead
+esp_err_t worker_submit(httpd_req_t *req, worker_job_t *job) {
+   httpd_req_t *async_req = NULL;
+
+   if (work_queue && httpd_req_async_handler_begin(req, &async_req) == ESP_OK) {
+       worker_item_t item = {
+           .req = async_req,
+           .job = job,
+           .queued_us = esp_timer_get_time(),
+       };
+       if (xQueueSend(work_queue, &item, 0) == pdTRUE) return ESP_OK;
+
+       ESP_LOGW(WORKER_TAG, "Queue full, running %s inline", job->name);
+       httpd_req_async_handler_complete(async_req);
+   }
+
+   int64_t start_us = esp_timer_get_time();
+   esp_err_t err = job->handler(req);
+   worker_record(job, 0, esp_timer_get_time() - start_us, true);
+   return err;
+}
+
+// worker_dispatch
+// For registering a handler to always go through the pool, with its worker_job_t as user_ctx
+esp_err_t worker_dispatch(httpd_req_t *req) {
+   return worker_submit(req, req->user_ctx);
+}
+
+// worker_run_internal
+// Runs fn on the flash helper if we're on a worker's PSRAM stack, or right here otherwise.
+// Anything that reads or writes flash (NVS, the storage filesystem) has to go through this
+// when it can be called from a worker
+void worker_run_internal(void (*fn)(void *arg), void *arg) {
+   int here;
+
+   if (!esp_ptr_external_ram(&here) || !flash_queue) {
+       fn(arg);
+       return;
+   }
+
+   worker_flash_item_t item = {
+       .fn = fn,
+       .arg = arg,
+       .caller = xTaskGetCurrentTaskHandle(),
+   };
+   xQueueSend(flash_queue, &item, portMAX_DELAY);
+   ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+}
+
+// worker_get_stats
+// Copies out the counters of every handler that's been run through the pool
+size_t worker_get_stats(worker_job_t *out, size_t max) {
+   portENTER_CRITICAL(&worker_lock);
+   size_t n = (job_count < max) ? job_count : max;
+   for (size_t i = 0; i < n; i++) out[i] = *jobs[i];
+   portEXIT_CRITICAL(&worker_lock);
+   return n;
+}
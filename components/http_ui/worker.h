@@ -0,0 +1,61 @@
+// HTTP worker pool config
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "esp_http_server.h"
+
+// Set the number of worker tasks that take the slow requests (the ones that
+// do TLS upstream) off the HTTP server task
+#define WORKER_COUNT 2
+
+// Set the task size for the workers, they do full HTTPS requests. The
+// stacks are in PSRAM so this doesn't come out of internal RAM
+#define WORKER_TASK_SIZE 16384
+
+// Set the task priority for the workers, just under the Sharkwire server
+// so it always gets to the fast local pages first
+#define WORKER_TASK_PRI 6
+
+// Max number of requests waiting for a worker, past that they're run right
+// on the server task like they used to be
+#define WORKER_QUEUE_LEN 8
+
+// Set the task size and priority for the helper that does flash access for
+// the workers. Nothing that touches flash can run on a PSRAM stack since the
+// cache (and PSRAM with it) is off while flash is busy
+#define WORKER_FLASH_TASK_SIZE 4096
+#define WORKER_FLASH_TASK_PRI 7
+
+// Max number of handlers with their own stats
+#define WORKER_MAX_JOBS 8
+
+// A handler that runs on the pool, with its counters. Times are in microseconds, the wait is
+// from the request being handed over to a worker picking it up
+typedef struct {
+   const char *name;
+   esp_err_t (*handler)(httpd_req_t *req);
+   uint32_t served;
+   uint32_t inline_runs;
+   uint64_t wait_us;
+   uint32_t wait_max_us;
+   uint64_t service_us;
+   uint32_t service_max_us;
+} worker_job_t;
+
+// prototypes
+void worker_init(void);
+esp_err_t worker_submit(httpd_req_t *req, worker_job_t *job);
+esp_err_t worker_dispatch(httpd_req_t *req);
+void worker_run_internal(void (*fn)(void *arg), void *arg);
+size_t worker_get_stats(worker_job_t *out, size_t max);
+
+#ifdef __cplusplus
+}
+#endif
@@ -24,11 +24,16 @@
 
 #include "esp_hid_host.h"
 #include "keyboard.h"
+#include "settings.h"
 
 static const char *BLE_HOST_TAG = "BLE_HOST";
 
 static uint8_t last_keys[MAX_KEYS] = {0};
 static uint8_t held_ticks[256] = {0};
+
+// Repeat timing from the settings record, it defaults to REPEAT_DELAY_TICKS and REPEAT_INTERVAL_TICKS
+static uint8_t repeat_delay = REPEAT_DELAY_TICKS;
+static uint8_t repeat_interval = REPEAT_INTERVAL_TICKS;
 static TaskHandle_t keyboard_repeat_task_handle = NULL;
 
 static bool bda_valid = false;
@@ -37,6 +42,7 @@ static esp_bd_addr_t last_bonded_bda = {0};
 char current_ble_manufacturer[64] = "Unknown";
 
 static int ble_battery_level = -1;
+static ble_status_cb_t ble_status_cb = NULL;
 
 static bool current_shift = false;
 static bool shift_sent = false;
@@ -139,9 +145,9 @@ void keyboard_tick() {
            }
            if (scancode == 0x71) queue_scancode(0xE0);
            queue_scancode(scancode);
-       } else if (held_ticks[key] == REPEAT_DELAY_TICKS ||
-                 ((held_ticks[key] > REPEAT_DELAY_TICKS) &&
-                 ((held_ticks[key] - REPEAT_DELAY_TICKS) & (REPEAT_INTERVAL_TICKS - 1)) == 0)) {
+       } else if (held_ticks[key] == repeat_delay ||
+                 ((held_ticks[key] > repeat_delay) &&
+                 ((held_ticks[key] - repeat_delay) & (repeat_interval - 1)) == 0)) {
            if (scancode == 0x71) queue_scancode(0xE0);
            queue_scancode(scancode);
        }
@@ -191,12 +197,32 @@ void handle_input(const uint8_t *data, size_t len) {
 // This is responsible for allowing the BLE key to be repeated if held, and
 // helps us time it at a specific rate
 void keyboard_repeat_task(void *arg) {
+   static settings_t cfg;
+
+   settings_get(&cfg);
+   if (cfg.kbd.repeat_delay) repeat_delay = cfg.kbd.repeat_delay;
+   if (cfg.kbd.repeat_interval) repeat_interval = cfg.kbd.repeat_interval;
+
    while (1) {
        keyboard_tick();
        vTaskDelay(pdMS_TO_TICKS(KB_TICK_RATE));
    }
 }
 
+// ble_status_subscribe
+// Sets the function called whenever something on the BLE status changes (connect, disconnect,
+// battery or bonding), so 'http_ui' can push it to the config page instead of polling for it.
+// It's called from the BLE event handler, so it has to hand the work off and return quickly
+void ble_status_subscribe(ble_status_cb_t cb) {
+   ble_status_cb = cb;
+}
+
+// ble_status_changed
+// Lets the subscriber know the BLE status changed
+static void ble_status_changed(void) {
+   if (ble_status_cb) ble_status_cb();
+}
+
 // get_ble_battery_level
 // We use this to return the BLE battery level is applicable, and it's mainly
 // used in the 'http_ui" component to show battery level in BLE status
@@ -253,6 +279,7 @@ bool unbond_ble_device(void) {
        if (err == ESP_OK) {
            ESP_LOGI(BLE_HOST_TAG, "Unbonded BLE device: %02X:%02X:%02X:%02X:%02X:%02X",
                     bda[0], bda[1], bda[2], bda[3], bda[4], bda[5]);
+           ble_status_changed();
            return true;
        } else {
            ESP_LOGE(BLE_HOST_TAG, "Failed to remove bonded device: %s", esp_err_to_name(err));
@@ -286,6 +313,7 @@ void hidh_callback(void *handler_args, esp_event_base_t base, int32_t id, void *
            ble_set_manufacturer(esp_hidh_dev_manufacturer_get(dev));
 
            ESP_LOGI(BLE_HOST_TAG, "Device connected.");
+           ble_status_changed();
        } else {  
            ESP_LOGE(BLE_HOST_TAG, "Failed to open device (status: 0x%02x)", param->open.status);  
 
@@ -295,6 +323,7 @@ void hidh_callback(void *handler_args, esp_event_base_t base, int32_t id, void *
            }
 
            ble_connected = false;
+           ble_status_changed();
            vTaskDelay(pdMS_TO_TICKS(5000));
            xTaskCreate(&ble_task, "ble_scan_retry", BLE_TASK_SIZE, NULL, BLE_TASK_PRI, NULL);
        }
@@ -308,6 +337,7 @@ void hidh_callback(void *handler_args, esp_event_base_t base, int32_t id, void *
            param->battery.level);
 
            ble_battery_level = param->battery.level;
+           ble_status_changed();
        }
        break;
    }
@@ -336,6 +366,7 @@ void hidh_callback(void *handler_args, esp_event_base_t base, int32_t id, void *
        }
 
        ble_connected = false;
+       ble_status_changed();
        xTaskCreate(&ble_task, "ble_scan_retry", BLE_TASK_SIZE, NULL, BLE_TASK_PRI, NULL);
        break;
    }
@@ -359,6 +390,7 @@ void ble_task(void *args)
 
            memcpy(last_bonded_bda, bonded_dev_list[0].bd_addr, sizeof(esp_bd_addr_t));
            bda_valid = true;
+           ble_status_changed();
 
            while (!ble_connected) {
                ESP_LOGI(BLE_HOST_TAG, "Trying to connect to bonded device: " ESP_BD_ADDR_STR,
@@ -6,6 +6,10 @@
 extern "C" {
 #endif
 
+// Called when the BLE status changes, from the BLE event handler
+typedef void (*ble_status_cb_t)(void);
+
+void ble_status_subscribe(ble_status_cb_t cb);
 bool is_ble_connected(void);
 bool unbond_ble_device(void);
 int get_ble_battery_level(void);
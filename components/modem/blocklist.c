@@ -0,0 +1,476 @@
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+#include "esp_partition.h"
+
+#include "blocklist.h"
+
+static const char *BLOCKLIST_TAG = "BLOCKLIST";
+
+// The blocklist lives in its own flash partition and gets memory mapped, so nothing
+// but the per-list hit counters ever has to live in RAM. The image looks like this:
+//
+//    [ header | Bloom filter | sorted entries ]
+//
+// Every entry is a 64-bit word made up of the top 56 bits of the FNV-1a hash of a
+// (lowercased) domain, with the low 8 bits holding the index of the list it came from.
+// A lookup hashes every suffix of the queried name ("a.b.com", "b.com", "com"), checks
+// the Bloom filter, and only does a binary search over the mapped entries when the
+// filter says it might be there.
+//
+// The partition is split into two slots of that, and an update is always written into the one
+// that isn't being served from, with the header's magic going in last on its own. A power cut
+// in the middle of an update leaves that slot without a valid header, and we carry on with the
+// image in the other one. Of two valid slots the one with the higher seq is the newer
+#define BLOCKLIST_MAGIC   0x4C425753 // "SWBL"
+#define BLOCKLIST_VERSION 2
+#define BLOCKLIST_PROBES  3
+
+typedef struct {
+   char name[BLOCKLIST_NAME_LEN];
+   uint32_t entries;
+} blocklist_list_hdr_t;
+
+typedef struct {
+   uint32_t magic;
+   uint16_t version;
+   uint16_t list_count;
+   uint32_t entry_count;
+   uint32_t bloom_bits;
+   uint32_t bloom_off;
+   uint32_t entries_off;
+   uint32_t seq;
+   blocklist_list_hdr_t lists[BLOCKLIST_MAX_LISTS];
+} blocklist_hdr_t;
+
+struct blocklist_update {
+   int list_id;
+   blocklist_list_hdr_t lists[BLOCKLIST_MAX_LISTS];
+   uint16_t list_count;
+   uint64_t *keys;
+   size_t count;
+   size_t capacity;
+   size_t max_entries;
+   uint32_t new_entries;
+   char line[256];
+   size_t line_len;
+};
+
+static const esp_partition_t *bl_part = NULL;
+static size_t bl_slot_size = 0;
+static int bl_slot = -1;
+static esp_partition_mmap_handle_t bl_map_handle;
+static const blocklist_hdr_t *bl_hdr = NULL;
+static const uint8_t *bl_bloom = NULL;
+static const uint64_t *bl_entries = NULL;
+static uint32_t bl_hits[BLOCKLIST_MAX_LISTS] = {0};
+static SemaphoreHandle_t bl_lock = NULL;
+
+// blocklist_key
+// Builds the 56-bit FNV-1a key for a domain, with the list index bits cleared
+static uint64_t blocklist_key(const char *s, size_t len) {
+   uint64_t h = 0xcbf29ce484222325ULL;
+   for (size_t i = 0; i < len; i++) {
+       h ^= (uint8_t)tolower((unsigned char)s[i]);
+       h *= 0x100000001b3ULL;
+   }
+   return h & ~0xFFULL;
+}
+
+// bloom_bit
+// Double hashing over the two halves of the key to get the Nth probe position
+static inline uint32_t bloom_bit(uint64_t key, int probe, uint32_t bits) {
+   uint32_t h1 = (uint32_t)(key >> 8);
+   uint32_t h2 = (uint32_t)(key >> 32) | 1;
+   return (h1 + probe * h2) & (bits - 1);
+}
+
+static bool bloom_test(uint64_t key) {
+   for (int k = 0; k < BLOCKLIST_PROBES; k++) {
+       uint32_t bit = bloom_bit(key, k, bl_hdr->bloom_bits);
+       if (!(bl_bloom[bit >> 3] & (1 << (bit & 7)))) return false;
+   }
+   return true;
+}
+
+// entries_find
+// Binary search over the mapped entries, returns the list index of the match or -1
+static int entries_find(uint64_t key) {
+   uint32_t lo = 0, hi = bl_hdr->entry_count;
+   while (lo < hi) {
+       uint32_t mid = lo + (hi - lo) / 2;
+       if ((bl_entries[mid] & ~0xFFULL) < key) lo = mid + 1;
+       else hi = mid;
+   }
+   if (lo < bl_hdr->entry_count && (bl_entries[lo] & ~0xFFULL) == key) {
+       return (int)(bl_entries[lo] & 0xFF);
+   }
+   return -1;
+}
+
+// blocklist_hdr_valid
+// Checks a slot's header, and that the Bloom filter and entries it points at are aligned and
+// inside the slot, since lookups index straight into them
+static bool blocklist_hdr_valid(const blocklist_hdr_t *hdr) {
+   return hdr->magic == BLOCKLIST_MAGIC && hdr->version == BLOCKLIST_VERSION &&
+          hdr->list_count <= BLOCKLIST_MAX_LISTS && hdr->bloom_bits >= 8 &&
+          (hdr->bloom_bits & (hdr->bloom_bits - 1)) == 0 &&
+          hdr->bloom_off >= sizeof(blocklist_hdr_t) && (hdr->bloom_off & 7) == 0 &&
+          (hdr->entries_off & 7) == 0 &&
+          hdr->bloom_off + (uint64_t)hdr->bloom_bits / 8 <= bl_slot_size &&
+          hdr->entries_off + (uint64_t)hdr->entry_count * sizeof(uint64_t) <= bl_slot_size;
+}
+
+// blocklist_map
+// Maps the partition and serves from the newest slot with a valid image. Must be called with
+// bl_lock held
+static void blocklist_map(void) {
+   const void *ptr = NULL;
+   const blocklist_hdr_t *hdr = NULL;
+
+   bl_hdr = NULL;
+   bl_slot = -1;
+   if (esp_partition_mmap(bl_part, 0, bl_part->size, ESP_PARTITION_MMAP_DATA,
+                          &ptr, &bl_map_handle) != ESP_OK) {
+       ESP_LOGE(BLOCKLIST_TAG, "Failed to mmap blocklist partition");
+       return;
+   }
+
+   for (int slot = 0; slot < 2; slot++) {
+       const blocklist_hdr_t *h = (const blocklist_hdr_t *)((const uint8_t *)ptr + slot * bl_slot_size);
+       if (!blocklist_hdr_valid(h)) continue;
+       if (!hdr || (int32_t)(h->seq - hdr->seq) > 0) {
+           hdr = h;
+           bl_slot = slot;
+       }
+   }
+   if (!hdr) {
+       ESP_LOGW(BLOCKLIST_TAG, "No valid blocklist image in flash");
+       esp_partition_munmap(bl_map_handle);
+       return;
+   }
+
+   bl_bloom = (const uint8_t *)hdr + hdr->bloom_off;
+   bl_entries = (const uint64_t *)((const uint8_t *)hdr + hdr->entries_off);
+   bl_hdr = hdr;
+
+   ESP_LOGI(BLOCKLIST_TAG, "Blocklist mapped from slot %d: %d lists, %d entries",
+            bl_slot, (int)hdr->list_count, (int)hdr->entry_count);
+}
+
+// blocklist_unmap
+// Drops the current mapping. Must be called with bl_lock held
+static void blocklist_unmap(void) {
+   if (bl_hdr) {
+       bl_hdr = NULL;
+       esp_partition_munmap(bl_map_handle);
+   }
+}
+
+// blocklist_init
+// Finds and maps the blocklist partition, this is called once from dns_task
+void blocklist_init(void) {
+   if (bl_lock) return;
+
+   bl_lock = xSemaphoreCreateMutex();
+   bl_part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+                                      BLOCKLIST_PARTITION);
+   if (!bl_part) {
+       ESP_LOGW(BLOCKLIST_TAG, "No '%s' partition, DNS blocking disabled", BLOCKLIST_PARTITION);
+       return;
+   }
+   bl_slot_size = (bl_part->size / 2) & ~(bl_part->erase_size - 1);
+
+   xSemaphoreTake(bl_lock, portMAX_DELAY);
+   blocklist_map();
+   xSemaphoreGive(bl_lock);
+}
+
+// blocklist_lookup
+// Checks the queried name and all of its parent domains against the blocklist, and
+// returns the index of the list that blocked it, or -1 if it should be resolved
+int blocklist_lookup(const char *name) {
+   int found = -1;
+
+   if (!bl_lock || !name) return -1;
+
+   xSemaphoreTake(bl_lock, portMAX_DELAY);
+   if (bl_hdr && bl_hdr->entry_count > 0) {
+       const char *p = name;
+       while (p && *p) {
+           uint64_t key = blocklist_key(p, strlen(p));
+           if (bloom_test(key) && (found = entries_find(key)) >= 0) break;
+           p = strchr(p, '.');
+           if (p) p++;
+       }
+       if (found >= 0 && found < BLOCKLIST_MAX_LISTS) bl_hits[found]++;
+   }
+   xSemaphoreGive(bl_lock);
+
+   return found;
+}
+
+// blocklist_get_stats
+// Copies out name, size and hit count of each list, mainly for the 'http_ui' config page
+size_t blocklist_get_stats(blocklist_stats_t *out, size_t max) {
+   size_t n = 0;
+
+   if (!bl_lock) return 0;
+
+   xSemaphoreTake(bl_lock, portMAX_DELAY);
+   if (bl_hdr) {
+       for (size_t i = 0; i < bl_hdr->list_count && n < max; i++) {
+           if (bl_hdr->lists[i].name[0] == '\0') continue;
+           memcpy(out[n].name, bl_hdr->lists[i].name, BLOCKLIST_NAME_LEN);
+           out[n].name[BLOCKLIST_NAME_LEN - 1] = '\0';
+           out[n].entries = bl_hdr->lists[i].entries;
+           out[n].hits = bl_hits[i];
+           n++;
+       }
+   }
+   xSemaphoreGive(bl_lock);
+
+   return n;
+}
+
+// update_push
+// Appends a key to the update, growing the PSRAM backed array as needed
+static bool update_push(blocklist_update_t *upd, uint64_t key) {
+   if (upd->count >= upd->max_entries) return false;
+
+   if (upd->count == upd->capacity) {
+       size_t new_cap = upd->capacity ? upd->capacity * 2 : 4096;
+       uint64_t *tmp = heap_caps_realloc(upd->keys, new_cap * sizeof(uint64_t),
+                                         MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+       if (!tmp) return false;
+       upd->keys = tmp;
+       upd->capacity = new_cap;
+   }
+
+   upd->keys[upd->count++] = key;
+   return true;
+}
+
+// blocklist_update_begin
+// Starts replacing the contents of a named list. Entries from every other list are
+// carried over from the mapped image, so only the new list has to be uploaded
+blocklist_update_t *blocklist_update_begin(const char *list_name) {
+   if (!bl_part || !list_name || !list_name[0]) return NULL;
+
+   blocklist_update_t *upd = calloc(1, sizeof(blocklist_update_t));
+   if (!upd) return NULL;
+
+   upd->list_id = -1;
+   upd->max_entries = (bl_slot_size - sizeof(blocklist_hdr_t)) /
+                      (sizeof(uint64_t) + BLOCKLIST_BLOOM_BITS_PER_ENTRY / 8 + 1);
+
+   xSemaphoreTake(bl_lock, portMAX_DELAY);
+   if (bl_hdr) {
+       memcpy(upd->lists, bl_hdr->lists, sizeof(upd->lists));
+       upd->list_count = bl_hdr->list_count;
+
+       for (uint32_t i = 0; i < bl_hdr->entry_count; i++) {
+           uint64_t e = bl_entries[i];
+           if ((e & 0xFF) >= BLOCKLIST_MAX_LISTS) continue;
+           if (strncmp(bl_hdr->lists[e & 0xFF].name, list_name, BLOCKLIST_NAME_LEN) == 0) continue;
+           if (!update_push(upd, e)) break;
+       }
+   }
+   xSemaphoreGive(bl_lock);
+
+   // Reuse the slot of an existing list with the same name, or the first empty one
+   for (int i = 0; i < upd->list_count; i++) {
+       if (strncmp(upd->lists[i].name, list_name, BLOCKLIST_NAME_LEN) == 0) {
+           upd->list_id = i;
+           break;
+       }
+   }
+   if (upd->list_id < 0) {
+       for (int i = 0; i < BLOCKLIST_MAX_LISTS; i++) {
+           if (i >= upd->list_count || upd->lists[i].name[0] == '\0') {
+               upd->list_id = i;
+               if (i >= upd->list_count) upd->list_count = i + 1;
+               break;
+           }
+       }
+   }
+   if (upd->list_id < 0) {
+       ESP_LOGE(BLOCKLIST_TAG, "No free list slot for '%s'", list_name);
+       blocklist_update_abort(upd);
+       return NULL;
+   }
+
+   strncpy(upd->lists[upd->list_id].name, list_name, BLOCKLIST_NAME_LEN - 1);
+   upd->lists[upd->list_id].name[BLOCKLIST_NAME_LEN - 1] = '\0';
+   return upd;
+}
+
+// update_add_line
+// Takes a single line of an uploaded list and adds the domain in it. This accepts plain
+// domain lists, hosts files ("0.0.0.0 ads.example.com") and simple adblock style
+// rules ("||ads.example.com^"), since that's what most public lists are published as
+static void update_add_line(blocklist_update_t *upd, char *line) {
+   char *hash = strchr(line, '#');
+   if (hash) *hash = '\0';
+   if (line[0] == '!') return;
+
+   char *saveptr = NULL;
+   char *tok = strtok_r(line, " \t\r", &saveptr);
+   if (!tok) return;
+
+   // hosts file format, the domain is the second token
+   if (isdigit((unsigned char)tok[0]) && strchr(tok, '.') && strspn(tok, "0123456789.") == strlen(tok)) {
+       tok = strtok_r(NULL, " \t\r", &saveptr);
+       if (!tok) return;
+   }
+
+   if (strncmp(tok, "||", 2) == 0) tok += 2;
+   if (strncmp(tok, "*.", 2) == 0) tok += 2;
+   while (*tok == '.') tok++;
+
+   size_t len = strcspn(tok, "^/$");
+   while (len > 0 && tok[len - 1] == '.') len--;
+   if (len == 0 || (len == 9 && strncasecmp(tok, "localhost", 9) == 0)) return;
+
+   if (update_push(upd, blocklist_key(tok, len) | (uint64_t)upd->list_id)) {
+       upd->new_entries++;
+   }
+}
+
+// blocklist_update_feed
+// Feeds a chunk of the uploaded list, lines may be split across chunks
+void blocklist_update_feed(blocklist_update_t *upd, const char *data, size_t len) {
+   for (size_t i = 0; i < len; i++) {
+       char c = data[i];
+       if (c == '\n') {
+           upd->line[upd->line_len] = '\0';
+           update_add_line(upd, upd->line);
+           upd->line_len = 0;
+       } else if (upd->line_len < sizeof(upd->line) - 1) {
+           upd->line[upd->line_len++] = c;
+       }
+   }
+}
+
+static int key_cmp(const void *a, const void *b) {
+   uint64_t ka = *(const uint64_t *)a, kb = *(const uint64_t *)b;
+   return (ka > kb) - (ka < kb);
+}
+
+// blocklist_update_finish
+// Sorts and dedupes the keys, builds the Bloom filter and writes the image into the slot that
+// isn't being served from, then switches over to it
+esp_err_t blocklist_update_finish(blocklist_update_t *upd, uint32_t *out_entries) {
+   esp_err_t err = ESP_OK;
+   uint8_t *bloom = NULL;
+
+   if (upd->line_len > 0) {
+       upd->line[upd->line_len] = '\0';
+       update_add_line(upd, upd->line);
+       upd->line_len = 0;
+   }
+
+   if (upd->count > 1) {
+       qsort(upd->keys, upd->count, sizeof(uint64_t), key_cmp);
+       size_t n = 1;
+       for (size_t i = 1; i < upd->count; i++) {
+           if (upd->keys[i] != upd->keys[n - 1]) upd->keys[n++] = upd->keys[i];
+       }
+       upd->count = n;
+   }
+
+   // An empty upload just removes the list
+   char name[BLOCKLIST_NAME_LEN];
+   memcpy(name, upd->lists[upd->list_id].name, sizeof(name));
+   uint32_t list_entries = 0;
+   for (size_t i = 0; i < upd->count; i++) {
+       if ((int)(upd->keys[i] & 0xFF) == upd->list_id) list_entries++;
+   }
+   upd->lists[upd->list_id].entries = list_entries;
+   if (list_entries == 0) memset(upd->lists[upd->list_id].name, 0, BLOCKLIST_NAME_LEN);
+
+   uint32_t bloom_bits = 1024;
+   while (bloom_bits < upd->count * BLOCKLIST_BLOOM_BITS_PER_ENTRY) bloom_bits <<= 1;
+
+   bloom = heap_caps_calloc(1, bloom_bits / 8, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+   if (!bloom) {
+       err = ESP_ERR_NO_MEM;
+       goto done;
+   }
+   for (size_t i = 0; i < upd->count; i++) {
+       uint64_t key = upd->keys[i] & ~0xFFULL;
+       for (int k = 0; k < BLOCKLIST_PROBES; k++) {
+           uint32_t bit = bloom_bit(key, k, bloom_bits);
+           bloom[bit >> 3] |= 1 << (bit & 7);
+       }
+   }
+
+   blocklist_hdr_t hdr = {
+       .magic = BLOCKLIST_MAGIC,
+       .version = BLOCKLIST_VERSION,
+       .list_count = upd->list_count,
+       .entry_count = upd->count,
+       .bloom_bits = bloom_bits,
+       .bloom_off = (sizeof(blocklist_hdr_t) + 7) & ~7,
+   };
+   memcpy(hdr.lists, upd->lists, sizeof(hdr.lists));
+   hdr.entries_off = (hdr.bloom_off + bloom_bits / 8 + 7) & ~7;
+
+   size_t image_len = hdr.entries_off + upd->count * sizeof(uint64_t);
+   if (image_len > bl_slot_size) {
+       err = ESP_ERR_INVALID_SIZE;
+       goto done;
+   }
+
+   // The old image keeps being served from its slot while the new one is written
+   xSemaphoreTake(bl_lock, portMAX_DELAY);
+   int slot = bl_hdr ? !bl_slot : 0;
+   hdr.seq = bl_hdr ? bl_hdr->seq + 1 : 1;
+   xSemaphoreGive(bl_lock);
+
+   size_t base = slot * bl_slot_size;
+   size_t erase_len = (image_len + bl_part->erase_size - 1) & ~(bl_part->erase_size - 1);
+   err = esp_partition_erase_range(bl_part, base, erase_len);
+   if (err == ESP_OK) err = esp_partition_write(bl_part, base + hdr.bloom_off, bloom, bloom_bits / 8);
+   if (err == ESP_OK && upd->count > 0) {
+       err = esp_partition_write(bl_part, base + hdr.entries_off, upd->keys, upd->count * sizeof(uint64_t));
+   }
+
+   // The header goes in with its magic still erased, then the magic on its own, so the slot
+   // only becomes valid once everything else in it is there
+   uint32_t magic = hdr.magic;
+   hdr.magic = 0xFFFFFFFF;
+   if (err == ESP_OK) err = esp_partition_write(bl_part, base, &hdr, sizeof(hdr));
+   if (err == ESP_OK) err = esp_partition_write(bl_part, base, &magic, sizeof(magic));
+
+   xSemaphoreTake(bl_lock, portMAX_DELAY);
+   blocklist_unmap();
+   if (err == ESP_OK) bl_hits[upd->list_id] = 0;
+   blocklist_map();
+   xSemaphoreGive(bl_lock);
+
+   if (err == ESP_OK) {
+       ESP_LOGI(BLOCKLIST_TAG, "Blocklist '%s' updated: %d domains (%d total)",
+                name, (int)list_entries, (int)upd->count);
+   } else {
+       ESP_LOGE(BLOCKLIST_TAG, "Failed to write blocklist: %s", esp_err_to_name(err));
+   }
+
+done:
+   if (out_entries) *out_entries = list_entries;
+   heap_caps_free(bloom);
+   blocklist_update_abort(upd);
+   return err;
+}
+
+// blocklist_update_abort
+// Frees an update without touching flash
+void blocklist_update_abort(blocklist_update_t *upd) {
+   if (!upd) return;
+   heap_caps_free(upd->keys);
+   free(upd);
+}
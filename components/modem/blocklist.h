@@ -0,0 +1,46 @@
+// DNS blocklist config
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+// Label of the flash partition that holds the blocklist image (see partitions.csv)
+#define BLOCKLIST_PARTITION "blocklist"
+
+// Max number of separately named lists (ads, trackers, etc) kept in the image
+#define BLOCKLIST_MAX_LISTS 8
+
+// Max length of a list name including the null terminator
+#define BLOCKLIST_NAME_LEN 16
+
+// Bits of Bloom filter reserved per entry, 10 bits gives us roughly a 1% false
+// positive rate with 3 probes, and a false positive only costs one binary search
+#define BLOCKLIST_BLOOM_BITS_PER_ENTRY 10
+
+typedef struct {
+   char name[BLOCKLIST_NAME_LEN];
+   uint32_t entries;
+   uint32_t hits;
+} blocklist_stats_t;
+
+typedef struct blocklist_update blocklist_update_t;
+
+// prototypes
+void blocklist_init(void);
+int blocklist_lookup(const char *name);
+size_t blocklist_get_stats(blocklist_stats_t *out, size_t max);
+
+blocklist_update_t *blocklist_update_begin(const char *list_name);
+void blocklist_update_feed(blocklist_update_t *upd, const char *data, size_t len);
+esp_err_t blocklist_update_finish(blocklist_update_t *upd, uint32_t *out_entries);
+void blocklist_update_abort(blocklist_update_t *upd);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,495 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_random.h"
+#include "esp_heap_caps.h"
+#include "nvs_flash.h"
+
+#include "dns_cache.h"
+#include "settings.h"
+
+static const char *DNS_CACHE_TAG = "DNS_CACHE";
+
+#define DNS_REPLY_MAX 512
+
+// Hot entries that nobody has asked for in this long stop getting refreshed
+#define DNS_HOT_IDLE_US (10LL * 60 * 1000000)
+
+// Task notification bits for dns_prefetch_task
+#define PREFETCH_PPP_UP   (1 << 0)
+#define PREFETCH_PPP_DOWN (1 << 1)
+#define PREFETCH_WARM_LIST (1 << 2)
+
+typedef struct {
+   char name[DNS_CACHE_NAME_LEN];
+   uint16_t qtype;
+   uint16_t len;
+   uint32_t hits;
+   uint32_t ttl;
+   int64_t stored_us;
+   int64_t used_us;
+   uint8_t reply[DNS_REPLY_MAX];
+} dns_cache_entry_t;
+
+static dns_cache_entry_t *cache = NULL;
+static SemaphoreHandle_t cache_lock = NULL;
+static dns_cache_stats_t cache_stats = {0};
+static TaskHandle_t prefetch_task_handle = NULL;
+static volatile bool ppp_up = false;
+
+// dns_skip_name
+// Skips over an encoded name (labels and/or a compression pointer) and returns the
+// offset right after it, or -1 if the packet is malformed
+static int dns_skip_name(const uint8_t *buf, int len, int off) {
+   while (off < len) {
+       uint8_t l = buf[off];
+       if (l == 0) return off + 1;
+       if ((l & 0xC0) == 0xC0) return (off + 2 <= len) ? off + 2 : -1;
+       off += l + 1;
+   }
+   return -1;
+}
+
+// dns_walk_ttls
+// Walks every resource record in a reply, optionally returning the smallest TTL in it
+// and/or taking 'age' seconds off every TTL so a cached answer doesn't outlive its welcome
+static bool dns_walk_ttls(uint8_t *buf, int len, uint32_t *min_ttl, uint32_t age) {
+   if (len < 12) return false;
+
+   int qdcount = (buf[4] << 8) | buf[5];
+   int rrcount = ((buf[6] << 8) | buf[7]) + ((buf[8] << 8) | buf[9]) + ((buf[10] << 8) | buf[11]);
+   int off = 12;
+
+   for (int i = 0; i < qdcount; i++) {
+       off = dns_skip_name(buf, len, off);
+       if (off < 0 || off + 4 > len) return false;
+       off += 4;
+   }
+
+   for (int i = 0; i < rrcount; i++) {
+       off = dns_skip_name(buf, len, off);
+       if (off < 0 || off + 10 > len) return false;
+
+       uint16_t type = (buf[off] << 8) | buf[off + 1];
+       uint16_t rdlen = (buf[off + 8] << 8) | buf[off + 9];
+
+       // The OPT pseudo record uses the TTL field for flags, leave it alone
+       if (type != 41) {
+           uint8_t *p = &buf[off + 4];
+           uint32_t ttl = ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+           if (min_ttl && ttl < *min_ttl) *min_ttl = ttl;
+           if (age) {
+               ttl = (ttl > age) ? ttl - age : 0;
+               p[0] = ttl >> 24; p[1] = ttl >> 16; p[2] = ttl >> 8; p[3] = ttl;
+           }
+       }
+
+       off += 10 + rdlen;
+       if (off > len) return false;
+   }
+
+   return true;
+}
+
+// cache_find
+// Linear scan for a name/type pair, the cache is small enough that this is cheaper than
+// keeping a hash table around. Must be called with cache_lock held
+static dns_cache_entry_t *cache_find(const char *name, uint16_t qtype) {
+   for (int i = 0; i < DNS_CACHE_ENTRIES; i++) {
+       if (cache[i].name[0] && cache[i].qtype == qtype && strcasecmp(cache[i].name, name) == 0) {
+           return &cache[i];
+       }
+   }
+   return NULL;
+}
+
+// cache_victim
+// Picks an empty slot, or the least recently used one. Must be called with cache_lock held
+static dns_cache_entry_t *cache_victim(void) {
+   dns_cache_entry_t *victim = &cache[0];
+   for (int i = 0; i < DNS_CACHE_ENTRIES; i++) {
+       if (cache[i].name[0] == '\0') return &cache[i];
+       if (cache[i].used_us < victim->used_us) victim = &cache[i];
+   }
+   return victim;
+}
+
+// dns_cache_init
+// Allocates the cache in PSRAM, this has to happen before dns_task and dns_prefetch_task start
+void dns_cache_init(void) {
+   if (cache) return;
+
+   cache = heap_caps_calloc(DNS_CACHE_ENTRIES, sizeof(dns_cache_entry_t),
+                            MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+   if (!cache) {
+       ESP_LOGE(DNS_CACHE_TAG, "Failed to allocate DNS cache, running uncached");
+       return;
+   }
+   cache_lock = xSemaphoreCreateMutex();
+}
+
+// dns_cache_lookup
+// Answers a query from the cache if we have a live entry for it. The cached reply gets
+// the asker's ID and question patched in and its TTLs aged. Returns the reply length,
+// or 0 on a miss
+int dns_cache_lookup(const uint8_t *query, int qend, const char *name, uint16_t qtype,
+                     uint8_t *reply, size_t reply_size) {
+   int out = 0;
+
+   if (!cache || qend <= 12 || !name[0]) return 0;
+
+   int64_t now = esp_timer_get_time();
+
+   xSemaphoreTake(cache_lock, portMAX_DELAY);
+   dns_cache_entry_t *e = cache_find(name, qtype);
+   if (e) {
+       e->hits++;
+       e->used_us = now;
+
+       uint32_t age = (now - e->stored_us) / 1000000;
+       if (age < e->ttl && e->len <= reply_size && qend <= e->len) {
+           memcpy(reply, e->reply, e->len);
+           reply[0] = query[0];
+           reply[1] = query[1];
+           memcpy(&reply[12], &query[12], qend - 12);
+           if (age) dns_walk_ttls(reply, e->len, NULL, age);
+           out = e->len;
+       }
+   }
+   if (out) cache_stats.hits++;
+   else cache_stats.misses++;
+   xSemaphoreGive(cache_lock);
+
+   return out;
+}
+
+// dns_cache_store
+// Caches a successful upstream reply. Errors, empty answers and truncated replies are
+// never cached so they get retried on the next query. Returns whether it was kept
+bool dns_cache_store(const char *name, uint16_t qtype, const uint8_t *reply, int len) {
+   if (!cache || len < 12 || len > DNS_REPLY_MAX) return false;
+   if (!name[0] || strlen(name) >= DNS_CACHE_NAME_LEN) return false;
+   if ((reply[2] & 0x02) || (reply[3] & 0x0F) != 0 || ((reply[6] << 8) | reply[7]) == 0) return false;
+
+   int64_t now = esp_timer_get_time();
+
+   xSemaphoreTake(cache_lock, portMAX_DELAY);
+   dns_cache_entry_t *e = cache_find(name, qtype);
+   if (!e) {
+       e = cache_victim();
+       memset(e, 0, offsetof(dns_cache_entry_t, reply));
+       strcpy(e->name, name);
+       e->qtype = qtype;
+       e->hits = 1;
+       e->used_us = now;
+   }
+
+   uint32_t ttl = UINT32_MAX;
+   memcpy(e->reply, reply, len);
+   bool stored = dns_walk_ttls(e->reply, len, &ttl, 0) && ttl != UINT32_MAX;
+   if (!stored) {
+       e->name[0] = '\0';
+   } else {
+       if (ttl < DNS_CACHE_MIN_TTL) ttl = DNS_CACHE_MIN_TTL;
+       if (ttl > 86400) ttl = 86400;
+       e->ttl = ttl;
+       e->len = len;
+       e->stored_us = now;
+   }
+   xSemaphoreGive(cache_lock);
+   return stored;
+}
+
+// dns_upstream_query
+// Forwards a raw query to the upstream DNS server and waits for the matching reply
+int dns_upstream_query(const uint8_t *query, int len, uint8_t *reply, size_t reply_size) {
+   // Create a temporary UDP socket for forwarding
+   int fwd_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+   if (fwd_sock < 0) return -1;
+
+   struct sockaddr_in dns_server = {
+       .sin_family = AF_INET,
+       .sin_port = htons(53),
+       .sin_addr.s_addr = inet_addr(DNS_UPSTREAM_SERVER)
+   };
+
+   // Set a short timeout to wait for the upstream response
+   struct timeval timeout = {
+       DNS_UPSTREAM_TIMEOUT_MS / 1000,
+       (DNS_UPSTREAM_TIMEOUT_MS % 1000) * 1000
+   };
+   setsockopt(fwd_sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+   int reply_len = -1;
+   if (sendto(fwd_sock, query, len, 0, (struct sockaddr*)&dns_server, sizeof(dns_server)) == len) {
+       // Drop anything that isn't an answer to our query ID
+       for (int tries = 0; tries < 4; tries++) {
+           reply_len = recvfrom(fwd_sock, reply, reply_size, 0, NULL, NULL);
+           if (reply_len < 0) break;
+           if (reply_len >= 12 && reply[0] == query[0] && reply[1] == query[1]) break;
+           reply_len = -1;
+       }
+   }
+
+   // Clean up forwarding socket
+   close(fwd_sock);
+   return reply_len;
+}
+
+// dns_cache_get_stats
+// Copies out the cache counters, mainly for the 'http_ui' config page
+void dns_cache_get_stats(dns_cache_stats_t *out) {
+   memset(out, 0, sizeof(*out));
+   if (!cache) return;
+
+   xSemaphoreTake(cache_lock, portMAX_DELAY);
+   *out = cache_stats;
+   for (int i = 0; i < DNS_CACHE_ENTRIES; i++) {
+       if (cache[i].name[0]) out->entries++;
+   }
+   xSemaphoreGive(cache_lock);
+}
+
+// dns_build_query
+// Builds a plain recursive query for a name, returns the packet length or -1
+static int dns_build_query(const char *name, uint16_t qtype, uint8_t *buf, size_t size) {
+   uint32_t id = esp_random();
+   size_t off = 12;
+
+   memset(buf, 0, 12);
+   buf[0] = id >> 8;
+   buf[1] = id;
+   buf[2] = 0x01; // RD=1
+   buf[5] = 1;    // QDCOUNT=1
+
+   const char *p = name;
+   while (*p) {
+       const char *dot = strchr(p, '.');
+       size_t l = dot ? (size_t)(dot - p) : strlen(p);
+       if (l == 0 || l > 63 || off + l + 6 > size) return -1;
+       buf[off++] = l;
+       memcpy(&buf[off], p, l);
+       off += l;
+       p += l;
+       if (*p == '.') p++;
+   }
+
+   buf[off++] = 0;
+   buf[off++] = qtype >> 8;
+   buf[off++] = qtype;
+   buf[off++] = 0x00;
+   buf[off++] = 0x01; // Class IN
+   return off;
+}
+
+// dns_resolve_into_cache
+// Resolves a name upstream on behalf of nobody in particular and caches the answer, true only
+// if the answer was one the cache kept
+static bool dns_resolve_into_cache(const char *name, uint16_t qtype) {
+   uint8_t query[DNS_REPLY_MAX];
+   uint8_t reply[DNS_REPLY_MAX];
+
+   int qlen = dns_build_query(name, qtype, query, sizeof(query));
+   if (qlen < 0) return false;
+
+   int rlen = dns_upstream_query(query, qlen, reply, sizeof(reply));
+   if (rlen <= 0) return false;
+
+   return dns_cache_store(name, qtype, reply, rlen);
+}
+
+// cache_is_fresh
+// Checks if a name already has a live entry, so warm-up doesn't resolve it twice
+static bool cache_is_fresh(const char *name) {
+   bool fresh = false;
+   int64_t now = esp_timer_get_time();
+
+   xSemaphoreTake(cache_lock, portMAX_DELAY);
+   dns_cache_entry_t *e = cache_find(name, 1);
+   if (e && (now - e->stored_us) / 1000000 + DNS_REFRESH_MARGIN_S < e->ttl) fresh = true;
+   xSemaphoreGive(cache_lock);
+
+   return fresh;
+}
+
+// dns_load_list
+// Reads a comma separated list of names from the "dns" NVS namespace
+static char *dns_load_list(const char *key) {
+   nvs_handle_t handle;
+   size_t size = 0;
+   char *list = NULL;
+
+   if (nvs_open("dns", NVS_READONLY, &handle) != ESP_OK) return NULL;
+
+   if (nvs_get_str(handle, key, NULL, &size) == ESP_OK && size > 1) {
+       list = malloc(size);
+       if (list && nvs_get_str(handle, key, list, &size) != ESP_OK) {
+           free(list);
+           list = NULL;
+       }
+   }
+
+   nvs_close(handle);
+   return list;
+}
+
+// dns_warm_list
+// Pre-resolves every name in a comma separated list. Each one also goes through
+// getaddrinfo so names the ESP32 resolves for itself (the gamegenie proxy, email servers)
+// are sitting in the lwip DNS table too
+static void dns_warm_list(char *list) {
+   char *saveptr = NULL;
+
+   for (char *name = strtok_r(list, ", \t\r\n", &saveptr); name;
+        name = strtok_r(NULL, ", \t\r\n", &saveptr)) {
+       if (cache_is_fresh(name)) continue;
+
+       if (dns_resolve_into_cache(name, 1)) {
+           xSemaphoreTake(cache_lock, portMAX_DELAY);
+           cache_stats.prefetched++;
+           xSemaphoreGive(cache_lock);
+           ESP_LOGI(DNS_CACHE_TAG, "Prefetched %s", name);
+       }
+
+       struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM };
+       struct addrinfo *res = NULL;
+       if (getaddrinfo(name, NULL, &hints, &res) == 0) freeaddrinfo(res);
+   }
+}
+
+// dns_warm_up
+// Runs right after PPP comes up, pre-resolving the configured list plus whatever was
+// most popular last session, so the first page the N64 loads doesn't pay for cold lookups
+static void dns_warm_up(void) {
+   static settings_t cfg;
+
+   settings_get(&cfg);
+   if (!(cfg.present & SETTINGS_DNS)) snprintf(cfg.dns.warm, sizeof(cfg.dns.warm), "%s", DNS_PREFETCH_DEFAULT);
+   dns_warm_list(cfg.dns.warm);
+
+   char *hot = dns_load_list("hot");
+   if (hot) {
+       dns_warm_list(hot);
+       free(hot);
+   }
+}
+
+static int hits_cmp(const void *a, const void *b) {
+   const dns_cache_entry_t *ea = *(dns_cache_entry_t * const *)a;
+   const dns_cache_entry_t *eb = *(dns_cache_entry_t * const *)b;
+   return (eb->hits > ea->hits) - (eb->hits < ea->hits);
+}
+
+// dns_save_hot_names
+// Saves the most queried names of the session to NVS for the next warm-up
+static void dns_save_hot_names(void) {
+   dns_cache_entry_t *sorted[DNS_CACHE_ENTRIES];
+   char *hot = malloc(DNS_HOT_NAMES * DNS_CACHE_NAME_LEN);
+   size_t n = 0, pos = 0;
+
+   if (!hot) return;
+   hot[0] = '\0';
+
+   xSemaphoreTake(cache_lock, portMAX_DELAY);
+   for (int i = 0; i < DNS_CACHE_ENTRIES; i++) {
+       if (cache[i].name[0] && cache[i].qtype == 1 && cache[i].hits >= DNS_HOT_HITS) {
+           sorted[n++] = &cache[i];
+       }
+   }
+   qsort(sorted, n, sizeof(sorted[0]), hits_cmp);
+   for (size_t i = 0; i < n && i < DNS_HOT_NAMES; i++) {
+       pos += snprintf(hot + pos, DNS_HOT_NAMES * DNS_CACHE_NAME_LEN - pos, "%s%s",
+                       i ? "," : "", sorted[i]->name);
+   }
+   xSemaphoreGive(cache_lock);
+
+   if (n > 0) {
+       nvs_handle_t handle;
+       if (nvs_open("dns", NVS_READWRITE, &handle) == ESP_OK) {
+           if (nvs_set_str(handle, "hot", hot) == ESP_OK) nvs_commit(handle);
+           nvs_close(handle);
+           ESP_LOGI(DNS_CACHE_TAG, "Saved %d hot names", (int)(n < DNS_HOT_NAMES ? n : DNS_HOT_NAMES));
+       }
+   }
+
+   free(hot);
+}
+
+// dns_refresh_hot
+// Re-resolves hot entries that are about to expire, so names the N64 keeps coming back
+// to are always answered straight from the cache
+static void dns_refresh_hot(void) {
+   for (int i = 0; i < DNS_CACHE_ENTRIES; i++) {
+       char name[DNS_CACHE_NAME_LEN];
+       uint16_t qtype = 0;
+       int64_t now = esp_timer_get_time();
+
+       name[0] = '\0';
+       xSemaphoreTake(cache_lock, portMAX_DELAY);
+       dns_cache_entry_t *e = &cache[i];
+       if (e->name[0] && e->hits >= DNS_HOT_HITS && (now - e->used_us) < DNS_HOT_IDLE_US) {
+           int64_t remaining = (int64_t)e->ttl - (now - e->stored_us) / 1000000;
+           if (remaining <= DNS_REFRESH_MARGIN_S) {
+               strcpy(name, e->name);
+               qtype = e->qtype;
+           }
+       }
+       xSemaphoreGive(cache_lock);
+
+       if (name[0] && dns_resolve_into_cache(name, qtype)) {
+           xSemaphoreTake(cache_lock, portMAX_DELAY);
+           cache_stats.refreshed++;
+           xSemaphoreGive(cache_lock);
+           ESP_LOGI(DNS_CACHE_TAG, "Refreshed %s", name);
+       }
+   }
+}
+
+// dns_prefetch_notify
+// Called from on_ppp_status to let dns_prefetch_task know when a session starts and ends
+void dns_prefetch_notify(bool up) {
+   ppp_up = up;
+   if (prefetch_task_handle) {
+       xTaskNotify(prefetch_task_handle, up ? PREFETCH_PPP_UP : PREFETCH_PPP_DOWN, eSetBits);
+   }
+}
+
+// on_dns_settings
+// A new prefetch list from the config page is warmed straight away if we're online
+static void on_dns_settings(const settings_t *settings, uint32_t changed, void *ctx) {
+   if (ppp_up && prefetch_task_handle) xTaskNotify(prefetch_task_handle, PREFETCH_WARM_LIST, eSetBits);
+}
+
+// dns_prefetch_task
+// Warms the cache when PPP comes up, keeps hot entries fresh while it's up, and saves
+// the session's most popular names when it goes down
+void dns_prefetch_task(void *arg) {
+   ESP_LOGI(DNS_CACHE_TAG, "dns_prefetch_task started on core %d", xPortGetCoreID());
+
+   if (!cache) {
+       vTaskDelete(NULL);
+       return;
+   }
+
+   prefetch_task_handle = xTaskGetCurrentTaskHandle();
+   settings_subscribe(SETTINGS_DNS, on_dns_settings, NULL);
+
+   while (1) {
+       uint32_t events = 0;
+       xTaskNotifyWait(0, UINT32_MAX, &events, pdMS_TO_TICKS(DNS_REFRESH_INTERVAL_MS));
+
+       if (events & PREFETCH_PPP_DOWN) dns_save_hot_names();
+       if (events & (PREFETCH_PPP_UP | PREFETCH_WARM_LIST)) dns_warm_up();
+       if (ppp_up) dns_refresh_hot();
+   }
+}
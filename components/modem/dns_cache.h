@@ -0,0 +1,65 @@
+// DNS cache and prefetch config
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Upstream DNS server that anything we don't resolve locally gets forwarded to
+#define DNS_UPSTREAM_SERVER "8.8.8.8"
+
+// How long to wait on the upstream server before giving up, in milliseconds
+#define DNS_UPSTREAM_TIMEOUT_MS 2000
+
+// Number of cached answers, each one takes a full 512 byte DNS reply in PSRAM
+#define DNS_CACHE_ENTRIES 64
+
+// Longest name we bother caching, anything longer is just forwarded every time
+#define DNS_CACHE_NAME_LEN 96
+
+// Floor for cached TTLs so very short TTLs don't make us go upstream on every page
+#define DNS_CACHE_MIN_TTL 30
+
+// A cached name counts as "hot" once it's been asked for this many times, and hot
+// names get refreshed in the background before they expire so they never miss
+#define DNS_HOT_HITS 3
+
+// How many seconds before expiry a hot entry gets refreshed
+#define DNS_REFRESH_MARGIN_S 15
+
+// How often the prefetch task checks the cache for hot entries that need refreshing
+#define DNS_REFRESH_INTERVAL_MS 5000
+
+// Max number of most queried names that get saved to NVS at the end of a session and
+// pre-resolved right after the next PPP connect
+#define DNS_HOT_NAMES 16
+
+// Names to pre-resolve at PPP connect if nothing has been configured in the config UI
+#define DNS_PREFETCH_DEFAULT "68k.news,gamegenie.com"
+
+typedef struct {
+   uint32_t hits;
+   uint32_t misses;
+   uint32_t prefetched;
+   uint32_t refreshed;
+   uint32_t entries;
+} dns_cache_stats_t;
+
+// prototypes
+void dns_cache_init(void);
+int dns_cache_lookup(const uint8_t *query, int qend, const char *name, uint16_t qtype,
+                     uint8_t *reply, size_t reply_size);
+bool dns_cache_store(const char *name, uint16_t qtype, const uint8_t *reply, int len);
+int dns_upstream_query(const uint8_t *query, int len, uint8_t *reply, size_t reply_size);
+void dns_cache_get_stats(dns_cache_stats_t *out);
+void dns_prefetch_notify(bool ppp_up);
+void dns_prefetch_task(void *arg);
+
+#ifdef __cplusplus
+}
+#endif
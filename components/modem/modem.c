@@ -14,9 +14,13 @@
 #include "netif/ppp/pppos.h"
 #include "lwip/lwip_napt.h"
 #include "lwip/ip_addr.h"
+#include "esp_timer.h"
 
 #include "http_ui.h"
 #include "modem.h"
+#include "blocklist.h"
+#include "dns_cache.h"
+#include "settings.h"
 
 wifi_config_t sta_config = {0};
 
@@ -27,12 +31,103 @@ static bool ppp_start_pending = false;
 static volatile bool ppp_needs_cleanup = false;
 static volatile int ppp_last_err = 0;
 
+static esp_netif_t *ap_netif = NULL;
+static volatile bool sta_connected = false;
+static volatile int64_t ap_assoc_us = 0;
+
+// Names that phones and laptops look up to check for internet (and for a captive portal)
+// as soon as they join a network
+static const char *captive_probe_names[] = {
+   "connectivitycheck.gstatic.com",
+   "connectivitycheck.android.com",
+   "clients1.google.com",
+   "clients3.google.com",
+   "captive.apple.com",
+   "www.msftconnecttest.com",
+   "ipv6.msftconnecttest.com",
+   "www.msftncsi.com",
+   "detectportal.firefox.com",
+   "nmcheck.gnome.org",
+   "connectivity-check.ubuntu.com",
+};
+
 static const char *MODEM_TAG = "MODEM";
 static const char *DNS_TAG = "DNS";
 static const char *PPP_TAG = "PPP";
 static const char *WIFI_TAG = "WIFI";
 
 
+// is_captive_probe
+// Checks if a name is one of the OS connectivity check names
+static bool is_captive_probe(const char *name) {
+   for (size_t i = 0; i < sizeof(captive_probe_names) / sizeof(captive_probe_names[0]); i++) {
+       if (strcasecmp(name, captive_probe_names[i]) == 0) return true;
+   }
+   return false;
+}
+
+// get_ap_ip
+// Returns the ESP32's own address on the AP side (192.168.4.1 by default), in network order
+uint32_t get_ap_ip(void) {
+   esp_netif_ip_info_t ip_info = {0};
+   if (ap_netif) esp_netif_get_ip_info(ap_netif, &ip_info);
+   return ip_info.ip.addr;
+}
+
+// is_ap_client
+// Checks if an address (in network order) belongs to a client on our AP subnet, as opposed
+// to the N64 on the other end of the PPP link
+bool is_ap_client(uint32_t addr) {
+   esp_netif_ip_info_t ip_info = {0};
+   if (!ap_netif || esp_netif_get_ip_info(ap_netif, &ip_info) != ESP_OK) return false;
+   if (ip_info.ip.addr == 0) return false;
+   return (addr & ip_info.netmask.addr) == (ip_info.ip.addr & ip_info.netmask.addr);
+}
+
+// is_sta_connected
+// Checks if the STA side is associated and has an address, meaning we actually have internet
+bool is_sta_connected(void) {
+   return sta_connected;
+}
+
+// get_ap_assoc_elapsed_ms
+// Returns how long ago the last client joined our AP, but only once per association so the
+// first page that asks for it gets the timing. Returns -1 if there's nothing to report
+int64_t get_ap_assoc_elapsed_ms(void) {
+   int64_t assoc = ap_assoc_us;
+   if (assoc == 0) return -1;
+   ap_assoc_us = 0;
+   return (esp_timer_get_time() - assoc) / 1000;
+}
+
+// dns_answer_local
+// Turns the query in dns_buf into an answer that points at one of our own addresses. Anything
+// that isn't an A query gets an empty NOERROR answer so the client doesn't sit waiting on it.
+// Returns the length of the reply
+static int dns_answer_local(uint8_t *dns_buf, int qend, uint32_t addr, uint8_t ttl) {
+   uint16_t qtype = (dns_buf[qend - 4] << 8) | dns_buf[qend - 3];
+   int offset = qend;
+
+   // Set flags: QR=1 (response), AA=1 (authoritative answer), RA=1 (recursion available)
+   dns_buf[2] = 0x81;
+   dns_buf[3] = 0x80;
+
+   // Just the question and our answer, drop any authority/additional records in the query
+   memset(&dns_buf[6], 0, 6);
+   if (qtype != 1) return offset;
+
+   dns_buf[7] = 1;
+
+   // Name pointer back to the query, Type A, Class IN, TTL, RDLENGTH = 4, then the address
+   const uint8_t rr[] = { 0xC0, 0x0C, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, ttl, 0x00, 0x04 };
+   memcpy(&dns_buf[offset], rr, sizeof(rr));
+   offset += sizeof(rr);
+   memcpy(&dns_buf[offset], &addr, 4);
+   offset += 4;
+
+   return offset;
+}
+
 // dns_task
 // Basically we use this to set up a custom DNS server so that we can do "captive portal" on very specific
 // domains that sharkwire attempts to reach out to, like for activation, or the SharkWire Online home page
@@ -62,6 +157,10 @@ void dns_task(void *arg) {
 
    ESP_LOGI(DNS_TAG, "DNS server started (PORT: 53)");
 
+   // Map the flash resident blocklist so we can drop ad/tracker lookups before they
+   // ever cost us any airtime over the PPP link
+   blocklist_init();
+
    while (1) {
        uint8_t dns_buf[512];          
        struct sockaddr_in client;
@@ -80,24 +179,38 @@ void dns_task(void *arg) {
        int i = 12;
        int pos = 0;
 
-       while (dns_buf[i] != 0 && i < len) {
+       while (i < len && dns_buf[i] != 0) {
            int label_len = dns_buf[i++];
            // Sanity check
-           if (label_len + i >= len) break;
+           if (label_len + i >= len || pos + label_len + 1 >= (int)sizeof(name)) break;
            for (int j = 0; j < label_len && i < len; j++) {
                name[pos++] = dns_buf[i++];
            }
            name[pos++] = '.';
        }
 
+       // End of the question section (zero label, QTYPE, QCLASS)
+       int qend = i + 5;
+
        // remove last dot
        if (pos > 0) name[pos - 1] = '\0';
        else name[0] = '\0';
 
        ESP_LOGI(DNS_TAG, "DNS Query for: %s", name);
 
+       // Phones and laptops joining our AP run connectivity checks right away. Answer those
+       // (and everything else while the STA side has no internet) with our AP address, so the
+       // OS pops up the config page immediately instead of waiting on the upstream timeout
+       if (qend <= len && qend + 16 <= (int)sizeof(dns_buf) && is_ap_client(client.sin_addr.s_addr) &&
+           (!is_sta_connected() || is_captive_probe(name))) {
+
+           ESP_LOGI(DNS_TAG, "Captive DNS map");
+
+           int offset = dns_answer_local(dns_buf, qend, get_ap_ip(), 10);
+           sendto(sock, dns_buf, offset, 0, (struct sockaddr*)&client, client_len);
+
        // Check if the domain matches our special case
-       if ((strcasecmp(name, "gamegenie.com") == 0) || (strcasecmp(name, "www.sharkwireonline.com") == 0) || (strcasecmp(name, "mail.sharkwire.com") == 0)) {
+       } else if ((strcasecmp(name, "gamegenie.com") == 0) || (strcasecmp(name, "www.sharkwireonline.com") == 0) || (strcasecmp(name, "mail.sharkwire.com") == 0)) {
 
            // Build the response for things we want to resolve locally, like activation or home trap
            ESP_LOGI(DNS_TAG, "Custom DNS map");
@@ -134,35 +247,40 @@ void dns_task(void *arg) {
            // Send the response back to the client and hope for the best
            sendto(sock, dns_buf, offset, 0, (struct sockaddr*)&client, client_len);
 
-       } else {
-           // Build the response for everything else, which should go to a normal DNS server (8.8.8.8 for example)
-
-           // Create a temporary UDP socket for forwarding
-           int fwd_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-           if (fwd_sock < 0) continue;
+       } else if (qend <= len && blocklist_lookup(name) >= 0) {
+           // Blocked ad/tracker domain, answer NXDOMAIN right away so the browser gives
+           // up on it instead of waiting on an upstream lookup and the fetch after it
+           ESP_LOGI(DNS_TAG, "Blocked: %s", name);
 
-           struct sockaddr_in dns_server;
-           dns_server.sin_family = AF_INET;
-           dns_server.sin_port = htons(53);
-           dns_server.sin_addr.s_addr = inet_addr("8.8.8.8");
+           // Set flags: QR=1 (response), RD=1, RA=1, RCODE=3 (NXDOMAIN)
+           dns_buf[2] = 0x81;
+           dns_buf[3] = 0x83;
 
-           // Send the original DNS request to 8.8.8.8
-           sendto(fwd_sock, dns_buf, len, 0, (struct sockaddr*)&dns_server, sizeof(dns_server));
+           // No answer, authority or additional records, just echo the question
+           memset(&dns_buf[6], 0, 6);
 
-           // Set a short timeout to wait for the upstream response
-           struct timeval timeout = {2, 0};
-           setsockopt(fwd_sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+           sendto(sock, dns_buf, qend, 0, (struct sockaddr*)&client, client_len);
 
-           // Receive the upstream response
+       } else {
+           // Build the response for everything else, straight from the cache if we've seen
+           // it recently, otherwise from a normal DNS server (8.8.8.8 for example)
+           uint16_t qtype = (qend <= len) ? ((dns_buf[qend - 4] << 8) | dns_buf[qend - 3]) : 0;
            uint8_t dns_reply[512];
-           int dns_len = recvfrom(fwd_sock, dns_reply, sizeof(dns_reply), 0, NULL, NULL);
+           int dns_len = 0;
+
+           if (qend <= len) {
+               dns_len = dns_cache_lookup(dns_buf, qend, name, qtype, dns_reply, sizeof(dns_reply));
+           }
+
+           if (dns_len == 0) {
+               dns_len = dns_upstream_query(dns_buf, len, dns_reply, sizeof(dns_reply));
+               if (dns_len > 0 && qend <= len) dns_cache_store(name, qtype, dns_reply, dns_len);
+           }
+
            if (dns_len > 0) {
                // Forward the reply directly to the original client
                sendto(sock, dns_reply, dns_len, 0, (struct sockaddr*)&client, client_len);
            }
-
-           // Clean up forwarding socket
-           close(fwd_sock);
        }
    }
 }
@@ -174,14 +292,34 @@ static void wifi_event_handler(void* arg, esp_event_base_t event_base, int32_t e
    if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED) {
        ESP_LOGI(WIFI_TAG, "WiFi STA connected");
    }
+   if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
+       sta_connected = false;
+   }
+   if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_AP_STACONNECTED) {
+       // Start the clock for how long it takes the client to land on the config page
+       ap_assoc_us = esp_timer_get_time();
+       ESP_LOGI(WIFI_TAG, "WiFi AP client connected");
+   }
    if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
        ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
        char ip_str[16];
        esp_ip4addr_ntoa(&event->ip_info.ip, ip_str, sizeof(ip_str));
        ESP_LOGI(WIFI_TAG, "Got IP: %s", ip_str);
+       sta_connected = true;
    }
 }
 
+// on_wifi_settings
+// New STA credentials saved from the config page are used right away, no power cycle needed
+static void on_wifi_settings(const settings_t *settings, uint32_t changed, void *ctx) {
+   if (!load_sta_credentials(&sta_config)) return;
+
+   ESP_LOGI(WIFI_TAG, "WiFi credentials changed, reconnecting to SSID: %s", settings->wifi.ssid);
+   esp_wifi_disconnect();
+   esp_wifi_set_config(ESP_IF_WIFI_STA, &sta_config);
+   esp_wifi_connect();
+}
+
 // on_ppp_status
 // This is the callback function for lwip PPP connection. I've opted to make any error
 // just attempt a cleanup and fall back to AT cmd mode for redial, and it seems to work
@@ -190,10 +328,12 @@ static void on_ppp_status(ppp_pcb *pcb, int err_code, void *ctx) {
    if (err_code == PPPERR_NONE) {
        ESP_LOGI(PPP_TAG, "PPP connected.");
        ip_napt_enable(netif_ip4_addr(&ppp_netif)->addr, 1);
+       dns_prefetch_notify(true);
    } else {
        ESP_LOGI(PPP_TAG, "PPP disconnected (code=%d)", err_code);
        ppp_last_err = err_code;
        ppp_needs_cleanup = true;
+       dns_prefetch_notify(false);
    }
 }
 
@@ -230,14 +370,14 @@ void modem_task(void *arg) {
 
    esp_netif_create_default_wifi_sta();
 
-   esp_netif_create_default_wifi_ap();
+   ap_netif = esp_netif_create_default_wifi_ap();
 
    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
    esp_wifi_init(&cfg);
 
-   // Try to load saved Wi-Fi credentials from NVS
+   // Try to load saved Wi-Fi credentials
    if (load_sta_credentials(&sta_config)) {
-       ESP_LOGI(WIFI_TAG, "Loaded Wi-Fi credentials from NVS. SSID: %s", sta_config.sta.ssid);
+       ESP_LOGI(WIFI_TAG, "Loaded saved Wi-Fi credentials. SSID: %s", sta_config.sta.ssid);
    } else {
        // Fallback to defaults if nothing saved
        strcpy((char*)sta_config.sta.ssid, "None");
@@ -261,16 +401,23 @@ void modem_task(void *arg) {
    esp_wifi_set_config(ESP_IF_WIFI_AP, &ap_config);
    esp_wifi_start();
    esp_wifi_connect();
+   settings_subscribe(SETTINGS_WIFI, on_wifi_settings, NULL);
 
+   dns_cache_init();
    xTaskCreate(dns_task, "dns_task", DNS_TASK_SIZE, NULL, DNS_TASK_PRI, NULL);
+   xTaskCreate(dns_prefetch_task, "dns_prefetch_task", DNS_PREFETCH_TASK_SIZE, NULL, DNS_PREFETCH_TASK_PRI, NULL);
    xTaskCreate(http_ui_task, "http_ui_task", HTTP_UI_TASK_SIZE, NULL, HTTP_UI_TASK_PRI, NULL);
 
    // Enable NAT
    ip_napt_enable(IPADDR_ANY, 1);
 
-   // These are the settings for the actual HW modem in ESP32
+   // These are the settings for the actual HW modem in ESP32, the speed is from the settings
+   // record (19200 unless it's been changed)
+   settings_t settings;
+   settings_get(&settings);
+
    uart_config_t uart_config = {
-       .baud_rate = 19200,
+       .baud_rate = settings.modem.baud,
        .data_bits = UART_DATA_8_BITS,
        .parity    = UART_PARITY_DISABLE,
        .stop_bits = UART_STOP_BITS_1,
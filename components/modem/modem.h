@@ -6,6 +6,8 @@
 extern "C" {
 #endif
 
+#include <stdint.h>
+#include <stdbool.h>
 #include "lwip/netif.h"
 
 extern struct netif ppp_netif;
@@ -24,6 +26,14 @@ extern struct netif ppp_netif;
 // be serviced
 #define DNS_TASK_PRI 8
 
+// Set the task size for the DNS prefetch task that warms up
+// the DNS cache at PPP connect and keeps hot names fresh
+#define DNS_PREFETCH_TASK_SIZE 4096
+
+// Set the task priority for the DNS prefetch task, it's all
+// background work so it sits below the DNS server itself
+#define DNS_PREFETCH_TASK_PRI 5
+
 // Set the task size for the built in HTTP server that
 // provides captive portal services for activation and
 // home page service as well as configuration services
@@ -59,6 +69,10 @@ extern struct netif ppp_netif;
 // prototypes
 void init_uart(void);
 void modem_task(void *arg);
+uint32_t get_ap_ip(void);
+bool is_ap_client(uint32_t addr);
+bool is_sta_connected(void);
+int64_t get_ap_assoc_elapsed_ms(void);
 
 #ifdef __cplusplus
 }
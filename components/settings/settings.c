@@ -0,0 +1,375 @@
+#include <string.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "nvs_flash.h"
+
+#include "settings.h"
+
+static const char *SETTINGS_TAG = "SETTINGS";
+
+// Magic at the start of every settings record
+#define SETTINGS_MAGIC 0x34365353
+
+// A slot holds this header followed by the body, which is settings_t from present on. seq goes
+// up by one with every save, and the good slot with the newest one is current
+typedef struct {
+   uint32_t magic;
+   uint16_t schema;
+   uint16_t len;
+   uint32_t seq;
+   uint32_t crc;
+} settings_hdr_t;
+
+#define SETTINGS_BODY_SIZE (sizeof(settings_t) - offsetof(settings_t, present))
+
+// Where each setting lived in NVS before there was a settings record, they're only read to
+// bring settings saved by older firmware over
+typedef struct {
+   uint32_t group;
+   const char *ns;
+   const char *key;
+   size_t offset;
+   size_t size;
+} settings_key_t;
+
+#define SETTINGS_KEY(group, ns, field, key) \
+   { group, ns, key, offsetof(settings_t, field), sizeof(((settings_t *)0)->field) }
+
+static const settings_key_t settings_legacy_keys[] = {
+   SETTINGS_KEY(SETTINGS_WIFI,  "wifi",  wifi.ssid,          "ssid"),
+   SETTINGS_KEY(SETTINGS_WIFI,  "wifi",  wifi.pass,          "pass"),
+   SETTINGS_KEY(SETTINGS_EMAIL, "email", email.smtp_server,  "smtp_server"),
+   SETTINGS_KEY(SETTINGS_EMAIL, "email", email.smtp_port,    "smtp_port"),
+   SETTINGS_KEY(SETTINGS_EMAIL, "email", email.imap_server,  "imap_server"),
+   SETTINGS_KEY(SETTINGS_EMAIL, "email", email.imap_port,    "imap_port"),
+   SETTINGS_KEY(SETTINGS_EMAIL, "email", email.username,     "username"),
+   SETTINGS_KEY(SETTINGS_EMAIL, "email", email.password,     "password"),
+   SETTINGS_KEY(SETTINGS_DNS,   "dns",   dns.warm,           "warm"),
+};
+
+#define SETTINGS_KEY_COUNT (sizeof(settings_legacy_keys) / sizeof(settings_legacy_keys[0]))
+
+static const uint32_t settings_groups[] = { SETTINGS_WIFI, SETTINGS_EMAIL, SETTINGS_DNS };
+
+typedef struct {
+   uint32_t groups;
+   settings_cb_t cb;
+   void *ctx;
+} settings_sub_t;
+
+// The live copy. Readers never take a lock, they copy it out and check seq didn't move while
+// they did (it's odd while a write is in the middle). Writes are in a critical section, so a
+// reader is never left waiting on a writer that got preempted
+static settings_t current;
+static volatile uint32_t seq = 0;
+static bool dirty = false;
+static portMUX_TYPE settings_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static settings_sub_t subs[SETTINGS_MAX_SUBSCRIBERS];
+static size_t sub_count = 0;
+
+static TaskHandle_t settings_task_handle = NULL;
+
+// The slot the current record is in and its seq, the next save goes to the other one
+static int active_slot = -1;
+static uint32_t active_seq = 0;
+
+// settings_load_legacy
+// Reads every group from the per-key NVS strings older firmware saved them as, a group only
+// counts as present if all of its keys are there. Returns whether anything was found
+static bool settings_load_legacy(settings_t *s) {
+   for (size_t g = 0; g < sizeof(settings_groups) / sizeof(settings_groups[0]); g++) {
+       nvs_handle_t handle;
+       bool complete = true;
+       const char *ns = NULL;
+
+       for (size_t i = 0; i < SETTINGS_KEY_COUNT; i++) {
+           if (settings_legacy_keys[i].group == settings_groups[g]) ns = settings_legacy_keys[i].ns;
+       }
+       if (nvs_open(ns, NVS_READONLY, &handle) != ESP_OK) continue;
+
+       for (size_t i = 0; i < SETTINGS_KEY_COUNT; i++) {
+           const settings_key_t *k = &settings_legacy_keys[i];
+           if (k->group != settings_groups[g]) continue;
+
+           char *value = (char *)s + k->offset;
+           size_t size = k->size;
+           if (nvs_get_str(handle, k->key, value, &size) != ESP_OK) {
+               value[0] = '\0';
+               complete = false;
+           }
+           value[k->size - 1] = '\0';
+       }
+       nvs_close(handle);
+
+       if (complete) s->present |= settings_groups[g];
+   }
+
+   // No SSID is as good as no WiFi settings at all
+   if (s->wifi.ssid[0] == '\0') s->present &= ~SETTINGS_WIFI;
+   return s->present != 0;
+}
+
+// settings_defaults
+// What every setting starts as, and what fields added since a record was saved start as
+static void settings_defaults(settings_t *s) {
+   memset(s, 0, sizeof(*s));
+   s->modem.baud = SETTINGS_DEFAULT_MODEM_BAUD;
+   s->kbd.repeat_delay = SETTINGS_DEFAULT_REPEAT_DELAY;
+   s->kbd.repeat_interval = SETTINGS_DEFAULT_REPEAT_INTERVAL;
+}
+
+// settings_read_slot
+// Reads one slot into s if it's good, leaving anything an older record didn't have at its
+// default and skipping anything a newer one has that we don't know about
+static bool settings_read_slot(nvs_handle_t handle, const char *key, settings_t *s, settings_hdr_t *hdr) {
+   size_t size = 0;
+   bool ok = false;
+
+   if (nvs_get_blob(handle, key, NULL, &size) != ESP_OK || size < sizeof(*hdr)) return false;
+
+   uint8_t *buf = malloc(size);
+   if (!buf) return false;
+
+   if (nvs_get_blob(handle, key, buf, &size) == ESP_OK) {
+       const uint8_t *body = buf + sizeof(*hdr);
+       memcpy(hdr, buf, sizeof(*hdr));
+
+       if (hdr->magic != SETTINGS_MAGIC || hdr->len != size - sizeof(*hdr)) {
+           ESP_LOGW(SETTINGS_TAG, "Settings in %s aren't a settings record", key);
+       } else if (esp_rom_crc32_le(0, body, hdr->len) != hdr->crc) {
+           ESP_LOGW(SETTINGS_TAG, "Settings in %s failed their CRC", key);
+       } else {
+           settings_defaults(s);
+           memcpy(&s->present, body, (hdr->len < SETTINGS_BODY_SIZE) ? hdr->len : SETTINGS_BODY_SIZE);
+           ok = true;
+       }
+   }
+
+   free(buf);
+   return ok;
+}
+
+// settings_load
+// Loads the newest good record. If neither slot has one, the settings are brought over from
+// the old per-key strings. Returns whether what was loaded needs saving in the current layout
+static bool settings_load(settings_t *s) {
+   static settings_t other;
+   settings_hdr_t hdr_a, hdr_b;
+   nvs_handle_t handle;
+   bool ok_a = false, ok_b = false;
+
+   settings_defaults(s);
+
+   if (nvs_open(SETTINGS_NVS_NAMESPACE, NVS_READONLY, &handle) == ESP_OK) {
+       ok_a = settings_read_slot(handle, SETTINGS_SLOT_A, s, &hdr_a);
+       ok_b = settings_read_slot(handle, SETTINGS_SLOT_B, &other, &hdr_b);
+       nvs_close(handle);
+   }
+
+   settings_hdr_t *hdr = NULL;
+   if (ok_b && (!ok_a || (int32_t)(hdr_b.seq - hdr_a.seq) > 0)) {
+       *s = other;
+       hdr = &hdr_b;
+       active_slot = 1;
+   } else if (ok_a) {
+       hdr = &hdr_a;
+       active_slot = 0;
+   }
+
+   if (!hdr) {
+       ESP_LOGI(SETTINGS_TAG, "No settings record, looking for settings saved by older firmware");
+       settings_defaults(s);
+       return settings_load_legacy(s);
+   }
+
+   active_seq = hdr->seq;
+   ESP_LOGI(SETTINGS_TAG, "Loaded settings from slot %c (schema %d, seq %u)",
+            'A' + active_slot, hdr->schema, (unsigned)active_seq);
+
+   // A newer schema is left as it is, saving it in ours would lose what we don't know about
+   return hdr->schema < SETTINGS_SCHEMA;
+}
+
+// settings_write
+// Saves the settings as one record to the slot that isn't current, then makes it current. If
+// power goes mid-save the other slot is untouched, and the half written one fails its CRC
+static void settings_write(const settings_t *s) {
+   static uint8_t buf[sizeof(settings_hdr_t) + SETTINGS_BODY_SIZE];
+   nvs_handle_t handle;
+   int slot = (active_slot == 0) ? 1 : 0;
+   const char *key = slot ? SETTINGS_SLOT_B : SETTINGS_SLOT_A;
+
+   settings_hdr_t hdr = {
+       .magic = SETTINGS_MAGIC,
+       .schema = SETTINGS_SCHEMA,
+       .len = SETTINGS_BODY_SIZE,
+       .seq = active_seq + 1,
+       .crc = esp_rom_crc32_le(0, (const uint8_t *)&s->present, SETTINGS_BODY_SIZE),
+   };
+   memcpy(buf, &hdr, sizeof(hdr));
+   memcpy(buf + sizeof(hdr), &s->present, SETTINGS_BODY_SIZE);
+
+   esp_err_t err = nvs_open(SETTINGS_NVS_NAMESPACE, NVS_READWRITE, &handle);
+   if (err != ESP_OK) {
+       ESP_LOGE(SETTINGS_TAG, "Failed to open NVS namespace '%s': %s", SETTINGS_NVS_NAMESPACE, esp_err_to_name(err));
+       return;
+   }
+
+   err = nvs_set_blob(handle, key, buf, sizeof(buf));
+   if (err == ESP_OK) err = nvs_commit(handle);
+   nvs_close(handle);
+
+   if (err != ESP_OK) {
+       ESP_LOGE(SETTINGS_TAG, "Failed to save settings to slot %c: %s", 'A' + slot, esp_err_to_name(err));
+       return;
+   }
+
+   active_slot = slot;
+   active_seq = hdr.seq;
+   ESP_LOGI(SETTINGS_TAG, "Saved settings to slot %c (seq %u)", 'A' + slot, (unsigned)active_seq);
+}
+
+// settings_notify
+// Tells everyone subscribed to any of the changed groups
+static void settings_notify(uint32_t changed) {
+   static settings_t snap;
+   settings_sub_t list[SETTINGS_MAX_SUBSCRIBERS];
+   size_t n;
+
+   settings_get(&snap);
+
+   portENTER_CRITICAL(&settings_lock);
+   n = sub_count;
+   memcpy(list, subs, n * sizeof(list[0]));
+   portEXIT_CRITICAL(&settings_lock);
+
+   for (size_t i = 0; i < n; i++) {
+       if (list[i].groups & changed) list[i].cb(&snap, list[i].groups & changed, list[i].ctx);
+   }
+}
+
+// settings_task
+// Applies changes as they come in, then writes them behind once things have been quiet for
+// SETTINGS_WRITE_DELAY_MS. Handlers saving settings never wait on flash
+static void settings_task(void *arg) {
+   static settings_t snap;
+
+   while (1) {
+       uint32_t changed = 0;
+       xTaskNotifyWait(0, UINT32_MAX, &changed, portMAX_DELAY);
+
+       do {
+           settings_notify(changed);
+           changed = 0;
+       } while (xTaskNotifyWait(0, UINT32_MAX, &changed, pdMS_TO_TICKS(SETTINGS_WRITE_DELAY_MS)) == pdTRUE);
+
+       settings_get(&snap);
+       portENTER_CRITICAL(&settings_lock);
+       bool save = dirty;
+       dirty = false;
+       portEXIT_CRITICAL(&settings_lock);
+
+       if (save) settings_write(&snap);
+   }
+}
+
+// settings_update
+// Swaps in a new value for one group, everything is done in RAM and the settings task takes
+// it from there
+static void settings_update(uint32_t group, void *dst, const void *src, size_t len) {
+   bool changed = false;
+
+   portENTER_CRITICAL(&settings_lock);
+   if (memcmp(dst, src, len) != 0 || !(current.present & group)) {
+       seq++;
+       __atomic_thread_fence(__ATOMIC_RELEASE);
+       memcpy(dst, src, len);
+       current.present |= group;
+       current.version++;
+       __atomic_thread_fence(__ATOMIC_RELEASE);
+       seq++;
+       dirty = true;
+       changed = true;
+   }
+   portEXIT_CRITICAL(&settings_lock);
+
+   if (changed && settings_task_handle) xTaskNotify(settings_task_handle, group, eSetBits);
+}
+
+// settings_init
+// Loads everything from NVS once, after this nothing reads NVS for settings again. Has to be
+// called after nvs_flash_init and before anything asks for settings, it's done from app_main
+void settings_init(void) {
+   static settings_t loaded;
+   bool migrated = settings_load(&loaded);
+
+   portENTER_CRITICAL(&settings_lock);
+   seq++;
+   __atomic_thread_fence(__ATOMIC_RELEASE);
+   current = loaded;
+   __atomic_thread_fence(__ATOMIC_RELEASE);
+   seq++;
+   portEXIT_CRITICAL(&settings_lock);
+
+   ESP_LOGI(SETTINGS_TAG, "Settings loaded (wifi=%d email=%d dns=%d)",
+            !!(loaded.present & SETTINGS_WIFI), !!(loaded.present & SETTINGS_EMAIL),
+            !!(loaded.present & SETTINGS_DNS));
+
+   xTaskCreate(settings_task, "settings_task", SETTINGS_TASK_SIZE, NULL, SETTINGS_TASK_PRI, &settings_task_handle);
+
+   // Settings that came from older firmware (or an older record) get saved in the current
+   // layout right away, the old keys are left alone
+   if (migrated) {
+       portENTER_CRITICAL(&settings_lock);
+       dirty = true;
+       portEXIT_CRITICAL(&settings_lock);
+       if (settings_task_handle) xTaskNotify(settings_task_handle, 0, eSetBits);
+   }
+}
+
+// settings_get
+// Copies out a consistent snapshot of the current settings without taking any lock
+void settings_get(settings_t *out) {
+   uint32_t start;
+
+   do {
+       start = __atomic_load_n(&seq, __ATOMIC_ACQUIRE);
+       memcpy(out, &current, sizeof(*out));
+       __atomic_thread_fence(__ATOMIC_ACQUIRE);
+   } while ((start & 1) || __atomic_load_n(&seq, __ATOMIC_RELAXED) != start);
+}
+
+// settings_set_wifi
+void settings_set_wifi(const settings_wifi_t *wifi) {
+   settings_update(SETTINGS_WIFI, &current.wifi, wifi, sizeof(*wifi));
+}
+
+// settings_set_email
+void settings_set_email(const settings_email_t *email) {
+   settings_update(SETTINGS_EMAIL, &current.email, email, sizeof(*email));
+}
+
+// settings_set_dns
+void settings_set_dns(const settings_dns_t *dns) {
+   settings_update(SETTINGS_DNS, &current.dns, dns, sizeof(*dns));
+}
+
+// settings_subscribe
+// Registers cb to be called on the settings task whenever any of groups changes
+esp_err_t settings_subscribe(uint32_t groups, settings_cb_t cb, void *ctx) {
+   esp_err_t err = ESP_ERR_NO_MEM;
+
+   portENTER_CRITICAL(&settings_lock);
+   if (sub_count < SETTINGS_MAX_SUBSCRIBERS) {
+       subs[sub_count++] = (settings_sub_t){ .groups = groups, .cb = cb, .ctx = ctx };
+       err = ESP_OK;
+   }
+   portEXIT_CRITICAL(&settings_lock);
+
+   return err;
+}
@@ -0,0 +1,106 @@
+// Settings store config
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+// Set the task size and priority for the task that writes changed settings
+// back to NVS and tells subscribers about them. It has to have its stack in
+// internal RAM since it writes flash
+#define SETTINGS_TASK_SIZE 4096
+#define SETTINGS_TASK_PRI 3
+
+// How long after a change the settings task waits before writing to NVS, so
+// everything saved around the same time goes out together
+#define SETTINGS_WRITE_DELAY_MS 500
+
+// Max number of settings subscribers
+#define SETTINGS_MAX_SUBSCRIBERS 8
+
+// Longest DNS prefetch list, including the null terminator
+#define SETTINGS_WARM_LEN 256
+
+// NVS namespace and the two keys the settings record alternates between. A save always goes
+// to the slot that isn't the current one, so losing power in the middle of it leaves the last
+// good record where it was
+#define SETTINGS_NVS_NAMESPACE "settings"
+#define SETTINGS_SLOT_A "slot_a"
+#define SETTINGS_SLOT_B "slot_b"
+
+// Layout version of the settings record. Fields are only ever added to the end of settings_t,
+// and this goes up when they are (see settings_defaults for what a new field starts as)
+#define SETTINGS_SCHEMA 1
+
+// Set the defaults for the modem UART speed and the keyboard repeat timing,
+// until something is saved over them these are the same as before they
+// were settings (see keyboard.h for what the ticks mean)
+#define SETTINGS_DEFAULT_MODEM_BAUD 19200
+#define SETTINGS_DEFAULT_REPEAT_DELAY 50
+#define SETTINGS_DEFAULT_REPEAT_INTERVAL 10
+
+// Groups of settings, what subscribers ask to hear about
+#define SETTINGS_WIFI  (1 << 0)
+#define SETTINGS_EMAIL (1 << 1)
+#define SETTINGS_DNS   (1 << 2)
+
+typedef struct {
+   char ssid[33];
+   char pass[65];
+} settings_wifi_t;
+
+typedef struct {
+   char smtp_server[128];
+   char smtp_port[16];
+   char imap_server[128];
+   char imap_port[16];
+   char username[128];
+   char password[128];
+} settings_email_t;
+
+typedef struct {
+   char warm[SETTINGS_WARM_LEN];
+} settings_dns_t;
+
+typedef struct {
+   uint32_t baud;
+} settings_modem_t;
+
+typedef struct {
+   uint8_t repeat_delay;
+   uint8_t repeat_interval;
+} settings_kbd_t;
+
+// Everything we keep in NVS. The version goes up by one on every change, and a group's bit
+// is only in present once it's been saved (an unsaved group reads back all empty). Everything
+// after version is what's stored in the record, so new fields only ever go at the end
+typedef struct {
+   uint32_t version;
+   uint32_t present;
+   settings_wifi_t wifi;
+   settings_email_t email;
+   settings_dns_t dns;
+   settings_modem_t modem;
+   settings_kbd_t kbd;
+} settings_t;
+
+// Called on the settings task with the new settings and the groups that changed
+typedef void (*settings_cb_t)(const settings_t *settings, uint32_t changed, void *ctx);
+
+// prototypes
+void settings_init(void);
+void settings_get(settings_t *out);
+void settings_set_wifi(const settings_wifi_t *wifi);
+void settings_set_email(const settings_email_t *email);
+void settings_set_dns(const settings_dns_t *dns);
+esp_err_t settings_subscribe(uint32_t groups, settings_cb_t cb, void *ctx);
+
+#ifdef __cplusplus
+}
+#endif
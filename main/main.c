@@ -18,6 +18,7 @@
 
 #include "modem.h"
 #include "keyboard.h"
+#include "settings.h"
 
 static const char *MAIN_TAG = "MAIN";
 
@@ -38,6 +39,10 @@ void app_main(void) {
    }
 
    ESP_ERROR_CHECK( ret );
+
+   // Everything saved in NVS is loaded once here, before anything that needs it starts
+   settings_init();
+
    ESP_LOGI(MAIN_TAG, "setting hid gap, mode:%d", HID_HOST_MODE);
    ESP_ERROR_CHECK( esp_hid_gap_init(HID_HOST_MODE) );
    ESP_ERROR_CHECK( esp_ble_gattc_register_callback(esp_hidh_gattc_event_handler) );
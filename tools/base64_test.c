@@ -0,0 +1,242 @@
+// base64_test.c
+// Round trip tests and a benchmark for the base64 codec in components/http_ui/base64.c, built
+// and run on the host. Random data of random lengths is encoded, broken into lines the way a
+// mailer does, and decoded again in pieces cut at random places, with every piece checked
+// against BASE64_DECODED_MAX. Exits non-zero on the first failure.
+//
+// usage (from the top of the repo):
+//    cc -O2 -Itools/host -Icomponents/http_ui -o base64_test tools/base64_test.c components/http_ui/base64.c
+//    ./base64_test [iterations]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "base64.h"
+
+#define MAX_LEN    1024
+#define LINE_LEN   76
+#define BENCH_SIZE (3 * 1024 * 1024)
+#define BENCH_RUNS 20
+
+// Big enough for MAX_LEN bytes encoded with a line break after every line, plus padding
+#define WIRE_SIZE (BASE64_ENCODED_LEN(MAX_LEN) / LINE_LEN * 2 + BASE64_ENCODED_LEN(MAX_LEN) + 8)
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+   if (!(cond)) { \
+       printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+       printf(__VA_ARGS__); \
+       printf("\n"); \
+       failures++; \
+       return; \
+   } \
+} while (0)
+
+// now_s
+static double now_s(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// decode_pieces
+// Decodes text in pieces of 1 to max_piece characters, checking each one stays inside what
+// BASE64_DECODED_MAX says it can write. Returns how many bytes came out
+static size_t decode_pieces(const char *text, size_t len, size_t max_piece, uint8_t *out, bool *bound_ok) {
+   base64_decoder_t d;
+   uint8_t piece_out[BASE64_DECODED_MAX(MAX_LEN) + 8];
+   size_t n = 0;
+
+   *bound_ok = true;
+   base64_decode_begin(&d);
+   for (size_t pos = 0; pos < len;) {
+       size_t piece = 1 + rand() % max_piece;
+       if (piece > len - pos) piece = len - pos;
+
+       // Poisoned past the bound so a write over it shows up
+       memset(piece_out, 0xa5, sizeof(piece_out));
+       size_t got = base64_decode_feed(&d, text + pos, piece, piece_out);
+       if (got > BASE64_DECODED_MAX(piece)) *bound_ok = false;
+       for (size_t i = BASE64_DECODED_MAX(piece); i < sizeof(piece_out); i++) {
+           if (piece_out[i] != 0xa5) *bound_ok = false;
+       }
+
+       memcpy(out + n, piece_out, got);
+       n += got;
+       pos += piece;
+   }
+
+   size_t got = base64_decode_finish(&d, out + n);
+   if (got > 2) *bound_ok = false;
+   return n + got;
+}
+
+// test_vectors
+// The examples from RFC 4648
+static void test_vectors(void) {
+   static const char *const vectors[][2] = {
+       { "", "" },
+       { "f", "Zg==" },
+       { "fo", "Zm8=" },
+       { "foo", "Zm9v" },
+       { "foob", "Zm9vYg==" },
+       { "fooba", "Zm9vYmE=" },
+       { "foobar", "Zm9vYmFy" },
+   };
+   char enc[16];
+   uint8_t dec[16];
+   bool bound_ok;
+
+   for (size_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+       size_t len = strlen(vectors[i][0]);
+       CHECK(base64_encode(vectors[i][0], len, enc, sizeof(enc)) == ESP_OK, "encode \"%s\"", vectors[i][0]);
+       CHECK(strcmp(enc, vectors[i][1]) == 0, "\"%s\" encoded to %s, not %s", vectors[i][0], enc, vectors[i][1]);
+
+       size_t n = decode_pieces(vectors[i][1], strlen(vectors[i][1]), 4, dec, &bound_ok);
+       CHECK(n == len && memcmp(dec, vectors[i][0], len) == 0, "%s decoded wrong", vectors[i][1]);
+       CHECK(bound_ok, "%s wrote past BASE64_DECODED_MAX", vectors[i][1]);
+   }
+}
+
+// test_encode_size
+// base64_encode takes exactly BASE64_ENCODED_LEN(len) + 1 and nothing less
+static void test_encode_size(void) {
+   uint8_t in[64] = {0};
+   char out[128];
+
+   for (size_t len = 0; len <= sizeof(in); len++) {
+       size_t need = BASE64_ENCODED_LEN(len) + 1;
+       memset(out, 0x5a, sizeof(out));
+       CHECK(base64_encode(in, len, out, need) == ESP_OK, "len %zu in %zu bytes", len, need);
+       CHECK(strlen(out) == need - 1 && out[need] == 0x5a, "len %zu wrote the wrong length", len);
+       CHECK(base64_encode(in, len, out, need - 1) == ESP_ERR_INVALID_SIZE, "len %zu fit in %zu bytes", len, need - 1);
+   }
+   CHECK(base64_encode(in, 0, out, 0) == ESP_ERR_INVALID_SIZE, "no room for the null");
+   CHECK(base64_encode(in, (size_t)-1, out, sizeof(out)) == ESP_ERR_INVALID_SIZE, "huge len");
+}
+
+// test_round_trip
+// Random lengths, line breaks, padding left off sometimes, random piece sizes
+static void test_round_trip(int iterations) {
+   static uint8_t in[MAX_LEN], dec[MAX_LEN + 8];
+   static char enc[BASE64_ENCODED_LEN(MAX_LEN) + 1], wire[WIRE_SIZE];
+   bool bound_ok;
+
+   for (int it = 0; it < iterations; it++) {
+       size_t len = rand() % (MAX_LEN + 1);
+       for (size_t i = 0; i < len; i++) in[i] = rand();
+
+       CHECK(base64_encode(in, len, enc, sizeof(enc)) == ESP_OK, "encode %zu bytes", len);
+       CHECK(strlen(enc) == BASE64_ENCODED_LEN(len), "encoded %zu bytes to %zu", len, strlen(enc));
+
+       size_t w = 0;
+       for (size_t i = 0; enc[i]; i++) {
+           wire[w++] = enc[i];
+           if (i % LINE_LEN == LINE_LEN - 1) {
+               wire[w++] = '\r';
+               wire[w++] = '\n';
+           }
+       }
+       if (it & 1) {
+           while (w > 0 && wire[w - 1] == '=') w--;
+       }
+
+       size_t max_piece = 1 + rand() % 300;
+       size_t n = decode_pieces(wire, w, max_piece, dec, &bound_ok);
+       CHECK(bound_ok, "%zu bytes in pieces of up to %zu wrote past BASE64_DECODED_MAX", len, max_piece);
+       CHECK(n == len && memcmp(dec, in, len) == 0,
+             "%zu bytes in pieces of up to %zu decoded to %zu", len, max_piece, n);
+   }
+}
+
+// test_concatenated
+// Padding in the middle ends a group, some mailers paste encoded parts together like this
+static void test_concatenated(void) {
+   const char *text = "YQ==Yg==\r\nYw=";
+   uint8_t dec[16];
+   bool bound_ok;
+
+   for (size_t piece = 1; piece <= strlen(text); piece++) {
+       size_t n = decode_pieces(text, strlen(text), piece, dec, &bound_ok);
+       CHECK(n == 3 && memcmp(dec, "abc", 3) == 0, "pieces of up to %zu decoded wrong", piece);
+       CHECK(bound_ok, "pieces of up to %zu wrote past BASE64_DECODED_MAX", piece);
+   }
+}
+
+// bench
+// Encode and decode speed, decoding the way mime.c gets a body: lines with line breaks, a TCP
+// segment's worth at a time
+static void bench(void) {
+   uint8_t *raw = malloc(BENCH_SIZE);
+   uint8_t *back = malloc(BENCH_SIZE + 8);
+   size_t enc_size = BASE64_ENCODED_LEN(BENCH_SIZE) + 1;
+   char *enc = malloc(enc_size);
+   char *wire = malloc((enc_size / LINE_LEN + 1) * 2 + enc_size);
+   base64_decoder_t d;
+
+   if (!raw || !back || !enc || !wire) {
+       printf("FAIL: no memory for the benchmark\n");
+       failures++;
+       goto done;
+   }
+   for (size_t i = 0; i < BENCH_SIZE; i++) raw[i] = rand();
+
+   double t = now_s();
+   for (int r = 0; r < BENCH_RUNS; r++) base64_encode(raw, BENCH_SIZE, enc, enc_size);
+   double encode_s = now_s() - t;
+
+   size_t enc_len = strlen(enc);
+   size_t w = 0;
+   for (size_t i = 0; i < enc_len; i += LINE_LEN) {
+       size_t n = enc_len - i < LINE_LEN ? enc_len - i : LINE_LEN;
+       memcpy(wire + w, enc + i, n);
+       w += n;
+       wire[w++] = '\r';
+       wire[w++] = '\n';
+   }
+
+   size_t n = 0;
+   t = now_s();
+   for (int r = 0; r < BENCH_RUNS; r++) {
+       n = 0;
+       base64_decode_begin(&d);
+       for (size_t pos = 0; pos < w; pos += 1460) {
+           n += base64_decode_feed(&d, wire + pos, w - pos < 1460 ? w - pos : 1460, back + n);
+       }
+       n += base64_decode_finish(&d, back + n);
+   }
+   double decode_s = now_s() - t;
+
+   if (n != BENCH_SIZE || memcmp(raw, back, BENCH_SIZE) != 0) {
+       printf("FAIL: benchmark data didn't round trip\n");
+       failures++;
+       goto done;
+   }
+
+   double mb = (double)BENCH_SIZE * BENCH_RUNS / (1024 * 1024);
+   printf("encode: %.0f MB/s of input\n", mb / encode_s);
+   printf("decode: %.0f MB/s of output, %d byte lines in 1460 byte pieces\n", mb / decode_s, LINE_LEN);
+
+done:
+   free(raw);
+   free(back);
+   free(enc);
+   free(wire);
+}
+
+int main(int argc, char **argv) {
+   int iterations = argc > 1 ? atoi(argv[1]) : 20000;
+
+   srand(1);
+   test_vectors();
+   test_encode_size();
+   test_round_trip(iterations);
+   test_concatenated();
+   if (failures == 0) printf("base64: all tests passed (%d round trips)\n", iterations);
+
+   bench();
+   return failures ? 1 : 0;
+}
@@ -0,0 +1,315 @@
+// form_bench.c
+// Host microbenchmark for the form parser in components/http_ui/form.c, against the
+// parse_post_data / get_post_value / free_form_fields it replaced (kept below as they were).
+// Each form body is parsed and every field its handler reads is looked up, by both, and the
+// values are checked to be the same. form_recv is also run with the body coming in a TCP
+// segment at a time, which the old single httpd_req_recv couldn't take. Shows the time and heap
+// allocations per form.
+//
+// The allocator is counted with the linker's --wrap, so this needs GNU ld.
+//
+// usage (from the top of the repo):
+//    cc -O2 -Itools/host -Icomponents/http_ui -o form_bench tools/form_bench.c components/http_ui/form.c -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc,--wrap=strdup
+//    ./form_bench [iterations]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "form.h"
+
+#define BENCH_SEGMENT 536
+
+static volatile size_t allocs = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+char *__real_strdup(const char *s);
+
+void *__wrap_malloc(size_t size) {
+   allocs++;
+   return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+   allocs++;
+   return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size) {
+   allocs++;
+   return __real_realloc(p, size);
+}
+
+// glibc's strdup gets its memory without going through malloc's symbol, so it's counted itself
+char *__wrap_strdup(const char *s) {
+   allocs++;
+   return __real_strdup(s);
+}
+
+// The old parser, as it was in http_ui.c before form.c
+
+typedef struct {
+   char *key;
+   char *value;
+} FormField;
+
+static void free_form_fields(FormField *fields, size_t count) {
+   if (!fields) return;
+   for (size_t i = 0; i < count; i++) {
+       free(fields[i].key);
+       free(fields[i].value);
+   }
+   free(fields);
+}
+
+static void url_decode(char *str) {
+   char *src = str;
+   char *dst = str;
+   char hex[3] = {0};
+
+   while (*src) {
+       if (*src == '+') {
+           *dst++ = ' ';
+           src++;
+       } else if (*src == '%' && src[1] && src[2]) {
+           hex[0] = src[1];
+           hex[1] = src[2];
+           *dst++ = (char) strtol(hex, NULL, 16);
+           src += 3;
+       } else {
+           *dst++ = *src++;
+       }
+   }
+   *dst = '\0';
+}
+
+static bool parse_post_data(char *data, FormField **out_fields, size_t *out_count) {
+   if (!data || !out_fields || !out_count) return false;
+
+   *out_fields = NULL;
+   *out_count = 0;
+
+   char *saveptr = NULL;
+   char *pair = strtok_r(data, "&", &saveptr);
+
+   while (pair) {
+       char *eq = strchr(pair, '=');
+       if (eq) {
+           *eq = '\0';
+           char *key = pair;
+           char *value = eq + 1;
+
+           url_decode(key);
+           url_decode(value);
+
+           FormField *tmp = realloc(*out_fields, (*out_count + 1) * sizeof(FormField));
+           if (!tmp) {
+               free_form_fields(*out_fields, *out_count);
+               return false;
+           }
+           *out_fields = tmp;
+
+           (*out_fields)[*out_count].key = strdup(key ? key : "");
+           (*out_fields)[*out_count].value = strdup(value ? value : "");
+
+           if (!(*out_fields)[*out_count].key || !(*out_fields)[*out_count].value) {
+               free_form_fields(*out_fields, *out_count);
+               return false;
+           }
+
+           (*out_count)++;
+       }
+       pair = strtok_r(NULL, "&", &saveptr);
+   }
+
+   return true;
+}
+
+static const char *get_post_value(const char *key, FormField *fields, int field_count) {
+   for (int i = 0; i < field_count; i++) {
+       if (strcmp(fields[i].key, key) == 0) {
+           return fields[i].value;
+       }
+   }
+   return NULL;
+}
+
+// The forms, each with the fields its handler reads
+
+typedef struct {
+   const char *name;
+   form_field_t field;
+} bench_field_t;
+
+typedef struct {
+   const char *name;
+   const char *body;
+   bench_field_t fields[8];
+   size_t nfields;
+} bench_form_t;
+
+static char email_body[4096];
+
+static bench_form_t forms[] = {
+   {
+       "save_email",
+       "smtp_server=smtp.example.com&smtp_port=465&imap_server=imap.example.com&imap_port=993"
+       "&username=player1%40example.com&password=p%40ss%26w%3Drd",
+       {
+           { "smtp_server", FORM_SMTP_SERVER }, { "smtp_port", FORM_SMTP_PORT },
+           { "imap_server", FORM_IMAP_SERVER }, { "imap_port", FORM_IMAP_PORT },
+           { "username", FORM_USERNAME }, { "password", FORM_PASSWORD },
+       },
+       6,
+   },
+   {
+       "newuser",
+       "t_name1=player1&t_password1=hunter2&t_name2=player1&t_password2=hunter2",
+       {
+           { "t_name1", FORM_T_NAME1 }, { "t_name2", FORM_T_NAME2 },
+           { "t_password1", FORM_T_PASSWORD1 }, { "t_password2", FORM_T_PASSWORD2 },
+       },
+       4,
+   },
+   {
+       "send_email",
+       email_body,
+       {
+           { "DFrom", FORM_DFROM }, { "DTo", FORM_DTO }, { "DEmailID", FORM_DEMAILID },
+           { "DSubject", FORM_DSUBJECT }, { "Body", FORM_BODY },
+       },
+       5,
+   },
+};
+
+// make_email_body
+// A couple of KB of mail the way the N64's browser sends it, spaces as '+' and line breaks escaped
+static void make_email_body(void) {
+   size_t n = snprintf(email_body, sizeof(email_body),
+                       "DFrom=player1%%40example.com&DTo=p2%%40example.com&DEmailID=12"
+                       "&DSubject=Re%%3A+High+scores+%%26+cheat+codes&Body=");
+   while (n + 80 < sizeof(email_body) / 2) {
+       n += snprintf(email_body + n, sizeof(email_body) - n,
+                     "Got+120+stars+with+8033B21D+0064%%2C+your+turn%%21%%0D%%0A");
+   }
+}
+
+// now_s
+static double now_s(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The request form_recv reads from, a segment at a time
+static const char *recv_body = NULL;
+static size_t recv_pos = 0;
+
+int httpd_req_recv(httpd_req_t *r, char *buf, size_t buf_len) {
+   size_t n = r->content_len - recv_pos;
+   if (n > buf_len) n = buf_len;
+   if (n > BENCH_SEGMENT) n = BENCH_SEGMENT;
+   memcpy(buf, recv_body + recv_pos, n);
+   recv_pos += n;
+   return n;
+}
+
+// check_form
+// Both parsers have to come up with the same values
+static bool check_form(const bench_form_t *f) {
+   char old_buf[4096], new_buf[4096];
+   FormField *fields = NULL;
+   size_t count = 0;
+   form_t form;
+   bool ok = true;
+
+   snprintf(old_buf, sizeof(old_buf), "%s", f->body);
+   snprintf(new_buf, sizeof(new_buf), "%s", f->body);
+   if (!parse_post_data(old_buf, &fields, &count) || form_parse(&form, new_buf, strlen(new_buf)) != ESP_OK) {
+       printf("FAIL %s: didn't parse\n", f->name);
+       return false;
+   }
+
+   for (size_t i = 0; i < f->nfields; i++) {
+       const char *a = get_post_value(f->fields[i].name, fields, count);
+       const char *b = form_get(&form, f->fields[i].field);
+       if (!a || !b || strcmp(a, b) != 0) {
+           printf("FAIL %s: %s is \"%s\" in the old parser, \"%s\" in form.c\n", f->name,
+                  f->fields[i].name, a ? a : "(none)", b ? b : "(none)");
+           ok = false;
+       }
+   }
+
+   free_form_fields(fields, count);
+   form_free(&form);
+   return ok;
+}
+
+// bench_form
+static void bench_form(const bench_form_t *f, int iterations) {
+   static char buf[4096];
+   size_t len = strlen(f->body);
+   volatile size_t found = 0;
+
+   // The old way
+   allocs = 0;
+   double t = now_s();
+   for (int i = 0; i < iterations; i++) {
+       FormField *fields = NULL;
+       size_t count = 0;
+       memcpy(buf, f->body, len + 1);
+       parse_post_data(buf, &fields, &count);
+       for (size_t k = 0; k < f->nfields; k++) found += get_post_value(f->fields[k].name, fields, count) != NULL;
+       free_form_fields(fields, count);
+   }
+   double old_s = now_s() - t;
+   double old_allocs = (double)allocs / iterations;
+
+   // form_parse on a body already in memory
+   allocs = 0;
+   t = now_s();
+   for (int i = 0; i < iterations; i++) {
+       form_t form;
+       memcpy(buf, f->body, len + 1);
+       form_parse(&form, buf, len);
+       for (size_t k = 0; k < f->nfields; k++) found += form_get(&form, f->fields[k].field) != NULL;
+       form_free(&form);
+   }
+   double parse_s = now_s() - t;
+   double parse_allocs = (double)allocs / iterations;
+
+   // form_recv, the body coming in a segment at a time
+   allocs = 0;
+   t = now_s();
+   for (int i = 0; i < iterations; i++) {
+       httpd_req_t req = { .content_len = len };
+       form_t form;
+       recv_body = f->body;
+       recv_pos = 0;
+       form_recv(&req, &form);
+       for (size_t k = 0; k < f->nfields; k++) found += form_get(&form, f->fields[k].field) != NULL;
+       form_free(&form);
+   }
+   double recv_s = now_s() - t;
+   double recv_allocs = (double)allocs / iterations;
+
+   printf("%-10s %5zu bytes  old %7.0f ns %4.1f allocs  form_parse %6.0f ns %4.1f allocs  "
+          "form_recv %6.0f ns %4.1f allocs  (%.1fx)\n", f->name, len,
+          old_s / iterations * 1e9, old_allocs, parse_s / iterations * 1e9, parse_allocs,
+          recv_s / iterations * 1e9, recv_allocs, old_s / parse_s);
+}
+
+int main(int argc, char **argv) {
+   int iterations = argc > 1 ? atoi(argv[1]) : 200000;
+   bool ok = true;
+
+   make_email_body();
+   for (size_t i = 0; i < sizeof(forms) / sizeof(forms[0]); i++) ok = check_form(&forms[i]) && ok;
+   if (!ok) return 1;
+
+   for (size_t i = 0; i < sizeof(forms) / sizeof(forms[0]); i++) bench_form(&forms[i], iterations);
+   return 0;
+}
@@ -0,0 +1,37 @@
+// Host stand-in for the parts of ESP-IDF's esp_http_server.h that resp.c, tpl.c and form.c use.
+// The host program provides the functions, as a fake server that sends through the session's
+// send override the way the real one does
+
+#pragma once
+
+#include <sys/types.h>
+#include "esp_err.h"
+
+typedef void *httpd_handle_t;
+
+typedef struct httpd_req {
+   httpd_handle_t handle;
+   int method;
+   const char uri[512 + 1];
+   size_t content_len;
+   void *aux;
+   void *user_ctx;
+} httpd_req_t;
+
+typedef int (*httpd_send_func_t)(httpd_handle_t hd, int sockfd, const char *buf, size_t buf_len, int flags);
+typedef void (*httpd_free_ctx_fn_t)(void *ctx);
+
+#define HTTPD_SOCK_ERR_FAIL    -1
+#define HTTPD_SOCK_ERR_INVALID -2
+#define HTTPD_SOCK_ERR_TIMEOUT -3
+
+#define HTTPD_TYPE_TEXT "text/html"
+
+int httpd_req_to_sockfd(httpd_req_t *r);
+int httpd_req_recv(httpd_req_t *r, char *buf, size_t buf_len);
+esp_err_t httpd_resp_set_type(httpd_req_t *r, const char *type);
+esp_err_t httpd_resp_send(httpd_req_t *r, const char *buf, ssize_t buf_len);
+esp_err_t httpd_resp_send_chunk(httpd_req_t *r, const char *buf, ssize_t buf_len);
+esp_err_t httpd_sess_set_send_override(httpd_handle_t hd, int sockfd, httpd_send_func_t send_func);
+void *httpd_sess_get_transport_ctx(httpd_handle_t hd, int sockfd);
+void httpd_sess_set_transport_ctx(httpd_handle_t hd, int sockfd, void *ctx, httpd_free_ctx_fn_t free_fn);
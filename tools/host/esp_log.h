@@ -0,0 +1,11 @@
+// Host stand-in for ESP-IDF's esp_log.h, warnings and errors go to stderr
+
+#pragma once
+
+#include <stdio.h>
+#include "esp_err.h"
+
+#define ESP_LOGE(tag, fmt, ...) fprintf(stderr, "E %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) fprintf(stderr, "W %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) ((void)(tag))
+#define ESP_LOGD(tag, fmt, ...) ((void)(tag))
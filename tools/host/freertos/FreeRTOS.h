@@ -0,0 +1,14 @@
+// Host stand-in for FreeRTOS.h, the host programs are single threaded so critical sections are
+// nothing
+
+#pragma once
+
+#include <stdint.h>
+
+typedef struct {
+   int unused;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED { 0 }
+#define portENTER_CRITICAL(mux) ((void)(mux))
+#define portEXIT_CRITICAL(mux) ((void)(mux))
@@ -0,0 +1,7 @@
+// Host stand-in for lwIP's sockets.h
+
+#pragma once
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
@@ -0,0 +1,6 @@
+// Host stand-in for the generated sdkconfig.h, with the options the host builds depend on set to
+// what an ESP-IDF build of this project ends up with
+
+#pragma once
+
+#define CONFIG_LWIP_TCP_MSS 1440
@@ -0,0 +1,96 @@
+// mime_test.c
+// Tests for how components/http_ui/mime.c passes links through, built and run on the host. Hrefs
+// full of quotes, each of which grows three times over escaped, are fed in whole and a byte at a
+// time, and every link that comes out has to be the whole href. Build it with ASan so a write past
+// the tag buffer on the stack shows up. Exits non-zero on the first failure.
+//
+// usage (from the top of the repo):
+//    cc -g -fsanitize=address,undefined -Itools/host -Icomponents/http_ui -o mime_test tools/mime_test.c components/http_ui/mime.c components/http_ui/base64.c
+//    ./mime_test
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mime.h"
+
+#define OUT_SIZE 4096
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+   if (!(cond)) { \
+       printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+       printf(__VA_ARGS__); \
+       printf("\n"); \
+       failures++; \
+       return; \
+   } \
+} while (0)
+
+// render
+// An HTML part through mime.c, in pieces of up to piece bytes
+static void render(const char *html, size_t piece, char *out) {
+   mime_t m;
+   size_t len = strlen(html);
+
+   mime_begin(&m, out, OUT_SIZE, "html", "7bit", "us-ascii");
+   for (size_t pos = 0; pos < len; pos += piece) {
+       mime_feed(&m, html + pos, len - pos < piece ? len - pos : piece);
+   }
+   mime_finish(&m);
+}
+
+// test_link
+// A plain link comes through with its href and text
+static void test_link(void) {
+   char out[OUT_SIZE];
+
+   render("<p>See <a class=\"x\" href=\"http://example.com/a?b=1\">this</a></p>", 1024, out);
+   CHECK(strstr(out, "<a href=\"http://example.com/a?b=1\">this</a>"), "got %s", out);
+}
+
+// test_quoted_href
+// Quotes in a single quoted href are escaped, and a link that won't fit escaped is dropped whole
+// rather than cut short, keeping its text. Goes through every length up to a tag's worth, the
+// longest used to run off the end of mime_open's buffer
+static void test_quoted_href(void) {
+   static const size_t pieces[] = { 1, 7, 1024 };
+   char html[MIME_TAG_LEN + 64], href[MIME_TAG_LEN * 3 + 16], out[OUT_SIZE];
+
+   for (size_t quotes = 1; quotes < MIME_TAG_LEN; quotes++) {
+       size_t h = snprintf(href, sizeof(href), "http://x");
+       for (size_t i = 0; i < quotes; i++) h += snprintf(href + h, sizeof(href) - h, "%%22");
+       size_t n = snprintf(html, sizeof(html), "<a href='http://x");
+       for (size_t i = 0; i < quotes && n < sizeof(html) - 32; i++) html[n++] = '"';
+       snprintf(html + n, sizeof(html) - n, "'>text</a> after");
+
+       for (size_t i = 0; i < sizeof(pieces) / sizeof(pieces[0]); i++) {
+           render(html, pieces[i], out);
+           CHECK(strstr(out, "text") && strstr(out, "after"), "%zu quotes lost the text: %s", quotes, out);
+
+           const char *a = strstr(out, "<a href=\"");
+           if (!a) continue;
+           CHECK(strncmp(a + 9, href, h) == 0 && strncmp(a + 9 + h, "\">text</a>", 10) == 0,
+                 "%zu quotes in pieces of %zu: %s", quotes, pieces[i], out);
+       }
+   }
+}
+
+// test_other_schemes
+// Only links the N64 can follow keep their href
+static void test_other_schemes(void) {
+   char out[OUT_SIZE];
+
+   render("<a href=\"javascript:alert(1)\">x</a><a href='mailto:a@b.c'>y</a>", 1024, out);
+   CHECK(!strstr(out, "javascript"), "got %s", out);
+   CHECK(strstr(out, "<a href=\"mailto:a@b.c\">y</a>"), "got %s", out);
+}
+
+int main(void) {
+   test_link();
+   test_quoted_href();
+   test_other_schemes();
+   if (failures == 0) printf("mime: all tests passed\n");
+   return failures ? 1 : 0;
+}
@@ -0,0 +1,202 @@
+#!/usr/bin/env python3
+#
+# mkassets.py
+# Packs the config page's static files in components/http_ui/assets into C, so they're served
+# straight out of flash already minified and gzipped (see asset.h) instead of being rendered on
+# every GET. Only the settings and stats on the page are dynamic, and those come from
+# /config.json.
+#
+# Each file is minified by type, gzipped, and given a content hash that's used as its ETag.
+# CSS and JS files are served under a name with the hash in it:
+#
+#    config.css -> /assets/config.1a2b3c4d.css
+#
+# so they can be cached for good, a new build is a new name. HTML files keep their own name
+# (the page URL can't change) and get revalidated instead, references to "/assets/<file>" in
+# them are rewritten to the hashed names, so the hashes of the CSS and JS end up in the page's.
+#
+# usage: mkassets.py --out-dir DIR assets/*
+
+import argparse
+import gzip
+import hashlib
+import os
+import re
+import sys
+
+TYPES = {
+    ".html": "text/html",
+    ".css": "text/css",
+    ".js": "application/javascript",
+}
+
+HASH_LEN = 8
+
+
+def minify_html(text):
+    # Same as the templates, indentation and line breaks go, and so do comments
+    text = re.sub(r"<!--.*?-->", "", text, flags=re.S)
+    return "".join(line.strip() for line in text.split("\n"))
+
+
+def minify_css(text):
+    text = re.sub(r"/\*.*?\*/", "", text, flags=re.S)
+    text = re.sub(r"\s+", " ", text)
+    text = re.sub(r"\s*([{}:;,>])\s*", r"\1", text)
+    return text.replace(";}", "}").strip()
+
+
+def minify_js(text):
+    # Kept to what can't change the meaning: indentation, blank lines and whole line comments
+    # go, the line breaks stay so semicolon insertion still works the same
+    lines = []
+    for line in text.split("\n"):
+        line = line.strip()
+        if line and not line.startswith("//"):
+            lines.append(line)
+    return "\n".join(lines)
+
+
+MINIFY = {
+    ".html": minify_html,
+    ".css": minify_css,
+    ".js": minify_js,
+}
+
+
+def c_bytes(data):
+    out = []
+    for i in range(0, len(data), 16):
+        out.append("   " + " ".join("0x%02x," % b for b in data[i:i + 16]))
+    return "\n".join(out)
+
+
+def c_name(path):
+    return re.sub(r"[^A-Za-z0-9]", "_", path.strip("/")).upper()
+
+
+def pack(name, text):
+    ext = os.path.splitext(name)[1]
+    body = MINIFY[ext](text).encode("latin-1")
+    digest = hashlib.sha256(body).hexdigest()[:HASH_LEN]
+
+    # mtime 0 so the output only changes when the file does
+    data = gzip.compress(body, compresslevel=9, mtime=0)
+
+    if ext == ".html":
+        path = "/" + name
+    else:
+        stem = os.path.splitext(name)[0]
+        path = "/assets/%s.%s%s" % (stem, digest, ext)
+
+    return {
+        "name": name,
+        "path": path,
+        "type": TYPES[ext],
+        "etag": "\"%s\"" % digest,
+        "immutable": ext != ".html",
+        "data": data,
+        "size": len(body),
+    }
+
+
+def generate(assets):
+    h = [
+        "// Generated by tools/mkassets.py from assets/*, don't edit",
+        "",
+        "#pragma once",
+        "",
+        "#ifdef __cplusplus",
+        "extern \"C\" {",
+        "#endif",
+        "",
+        "#include \"asset.h\"",
+        "",
+        "// Where each file is served",
+    ]
+    c = [
+        "// Generated by tools/mkassets.py from assets/*, don't edit",
+        "",
+        "#include \"assets.h\"",
+        "",
+    ]
+
+    for i, a in enumerate(assets):
+        h.append("#define ASSET_%s \"%s\"" % (c_name(a["name"]), a["path"]))
+        c.append("// %s, %d bytes minified, %d gzipped" % (a["name"], a["size"], len(a["data"])))
+        c.append("static const uint8_t asset_%d[] = {" % i)
+        c.append(c_bytes(a["data"]))
+        c.append("};")
+        c.append("")
+
+    c.append("const asset_t assets[] = {")
+    for i, a in enumerate(assets):
+        c.append("   {\"%s\", \"%s\", asset_%d, sizeof(asset_%d), \"%s\", %s}," %
+                 (a["path"], a["type"], i, i, a["etag"].replace("\"", "\\\""),
+                  "true" if a["immutable"] else "false"))
+    c.append("};")
+    c.append("")
+    c.append("const size_t asset_count = %d;" % len(assets))
+    c.append("")
+
+    h += [
+        "",
+        "extern const asset_t assets[];",
+        "extern const size_t asset_count;",
+        "",
+        "#ifdef __cplusplus",
+        "}",
+        "#endif",
+        "",
+    ]
+
+    return "\n".join(h), "\n".join(c)
+
+
+def write_if_changed(path, text):
+    # Keeps the timestamps alone when nothing changed, so nothing gets rebuilt for no reason
+    try:
+        with open(path) as f:
+            if f.read() == text:
+                return
+    except OSError:
+        pass
+    with open(path, "w") as f:
+        f.write(text)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Pack the SharkShit64 config page assets into C")
+    parser.add_argument("--out-dir", required=True, help="where assets.c and assets.h go")
+    parser.add_argument("assets", nargs="+", help="asset files")
+    args = parser.parse_args()
+
+    sources = {}
+    for path in sorted(args.assets):
+        name = os.path.basename(path)
+        if os.path.splitext(name)[1] not in TYPES:
+            sys.exit("%s: don't know how to serve this" % path)
+        with open(path, encoding="latin-1") as f:
+            sources[name] = f.read()
+
+    # CSS and JS first, the HTML needs their hashed names
+    packed = {}
+    for name in sorted(sources, key=lambda n: n.endswith(".html")):
+        text = sources[name]
+        if name.endswith(".html"):
+            for other, a in packed.items():
+                text = text.replace("/assets/" + other, a["path"])
+            missing = re.findall(r"/assets/[\w.-]+", text)
+            missing = [m for m in missing if m not in [a["path"] for a in packed.values()]]
+            if missing:
+                sys.exit("%s: no asset for %s" % (name, ", ".join(missing)))
+        packed[name] = pack(name, text)
+
+    header, source = generate(sorted(packed.values(), key=lambda a: a["path"]))
+    os.makedirs(args.out_dir, exist_ok=True)
+    write_if_changed(os.path.join(args.out_dir, "assets.h"), header)
+    write_if_changed(os.path.join(args.out_dir, "assets.c"), source)
+
+
+if __name__ == "__main__":
+    main()
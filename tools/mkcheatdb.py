@@ -0,0 +1,298 @@
+#!/usr/bin/env python3
+#
+# mkcheatdb.py
+# Builds the offline cheat database image for the 'cheatdb' partition from a cheat dump,
+# so the Gamerz pages can be served straight out of flash instead of through the
+# gamegenie.com proxy. The pages it generates use the same layout the proxy produces.
+#
+# The dump is a plain text file with one block per game:
+#
+#    [Super Mario 64]
+#    Infinite Lives
+#    8033B21D 0064
+#    Have 120 Stars
+#    8020770B 0078
+#
+# Lines starting with '#' or ';' are comments. Anything that looks like a code
+# ("XXXXXXXX YYYY") belongs to the cheat named on the line before it.
+#
+# usage: mkcheatdb.py cheats.txt cheatdb.bin [--size 0x400000]
+#
+# The image can be flashed by hand with:
+#    parttool.py write_partition --partition-name cheatdb --input cheatdb.bin
+#
+# The partition holds two slots, a sync on the device writes into whichever isn't in use (see
+# cheatdb.c). This image goes in the first one, and runs on over the header of the second so an
+# older synced database there can't win over it
+
+import argparse
+import html
+import re
+import struct
+import sys
+import zlib
+
+BASE_PATH = "/cheats/gameshark/n64/"
+
+MAGIC = 0x44435753  # "SWCD"
+VERSION = 1
+SECTOR = 4096
+DATA_OFFSET = SECTOR
+HEADER_FMT = "<IHHIIIIIIII24x"
+ENTRY_FMT = "<IIII"
+FLAG_SEARCH = 0x0001
+
+# These have to match cheatsearch.h and cheatdb.c
+SEARCH_PATH = BASE_PATH + "search.html"
+TERM_LEN = 24
+BLOCK_TERMS = 16
+TITLE_SCAN = 512
+
+CODE_RE = re.compile(r"^[0-9A-Fa-f]{8}[ :-]?[0-9A-Fa-f]{4}$")
+
+PAGE_HEAD = (
+    "<html><head><title>{title}</title></head>"
+    "<center><font size=\"1\">Offline cheat database</font></center>"
+    "<body bgcolor=\"#FFFFFF\" text=\"#000000\" link=\"#0000FF\" vlink=\"#800080\" alink=\"#FF0000\">"
+    "<font size=\"1\">"
+)
+PAGE_TAIL = "</font></body></html>"
+SEARCH_FORM = (
+    "<form method=\"GET\" action=\"" + SEARCH_PATH + "\">"
+    "<input type=\"text\" name=\"q\" size=\"16\">"
+    "<input type=\"submit\" value=\"Search\"></form>"
+)
+
+
+def parse_dump(path):
+    games = []
+    game = None
+    cheat = None
+
+    with open(path, encoding="latin-1") as f:
+        for lineno, raw in enumerate(f, 1):
+            line = raw.strip()
+            if not line or line[0] in "#;":
+                continue
+
+            if line.startswith("[") and line.endswith("]"):
+                game = {"title": line[1:-1].strip(), "cheats": []}
+                games.append(game)
+                cheat = None
+                continue
+
+            if game is None:
+                sys.exit("%s:%d: cheat outside of a [game] block" % (path, lineno))
+
+            if CODE_RE.match(line):
+                if cheat is None:
+                    cheat = {"name": "Codes", "codes": []}
+                    game["cheats"].append(cheat)
+                code = re.sub(r"[ :-]", "", line).upper()
+                cheat["codes"].append(code[:8] + " " + code[8:])
+            else:
+                cheat = {"name": line, "codes": []}
+                game["cheats"].append(cheat)
+
+    return games
+
+
+def slugify(title, used):
+    slug = re.sub(r"[^a-z0-9]+", "_", title.lower()).strip("_") or "game"
+    base, n = slug, 2
+    while slug in used:
+        slug = "%s_%d" % (base, n)
+        n += 1
+    used.add(slug)
+    return slug
+
+
+def letter_of(title):
+    c = title[:1].lower()
+    return c if "a" <= c <= "z" else "0"
+
+
+def page(title, body):
+    return (PAGE_HEAD.format(title=html.escape(title)) + body + PAGE_TAIL).encode("latin-1", "replace")
+
+
+def build_pages(games):
+    pages = {}
+    used = set()
+    letters = {}
+
+    for game in sorted(games, key=lambda g: g["title"].lower()):
+        slug = slugify(game["title"], used)
+        game["path"] = BASE_PATH + slug + ".html"
+        letters.setdefault(letter_of(game["title"]), []).append(game)
+
+        body = "<b>%s</b><br><br>" % html.escape(game["title"])
+        for cheat in game["cheats"]:
+            body += "<b>%s</b><br>" % html.escape(cheat["name"])
+            body += "".join("%s<br>" % c for c in cheat["codes"])
+            body += "<br>"
+        pages[game["path"]] = page(game["title"], body)
+
+    # Game title index, split up by first letter so no single page gets huge at 19200bps
+    body = SEARCH_FORM + "<b>N64 GameShark Codes</b><br><br>"
+    for letter in sorted(letters):
+        label = "#" if letter == "0" else letter.upper()
+        body += "<a href=\"%sindex_%s.html\">%s</a> " % (BASE_PATH, letter, label)
+    pages[BASE_PATH + "index.html"] = page("N64 GameShark Codes", body)
+
+    for letter, lgames in letters.items():
+        label = "#" if letter == "0" else letter.upper()
+        body = SEARCH_FORM + "<b>N64 GameShark Codes - %s</b><br><br>" % label
+        for game in lgames:
+            body += "<a href=\"%s\">%s</a><br>" % (game["path"], html.escape(game["title"]))
+        pages[BASE_PATH + "index_%s.html" % letter] = page("N64 GameShark Codes - " + label, body)
+
+    return pages
+
+
+def page_title(data):
+    # Same as cheatdb_page_title: the text between <title> and </title> with any tags dropped
+    data = data[:TITLE_SCAN]
+    start = data.lower().find(b"<title>")
+    if start < 0:
+        return b""
+    rest = data[start + 7:]
+    stop = rest.lower().find(b"</title>")
+    if stop >= 0:
+        rest = rest[:stop]
+    return re.sub(rb"<[^>]*(>|$)", b"", rest)[:TITLE_SCAN - 1]
+
+
+def terms_of(text):
+    # Same as cheatsearch_next_term: lowercase ASCII letter/digit runs, skipping tags and entities
+    terms = []
+    i, n = 0, len(text)
+    while i < n:
+        c = text[i:i + 1]
+        if c == b"<":
+            j = text.find(b">", i)
+            i = n if j < 0 else j + 1
+        elif c == b"&":
+            i += 1
+            while i < n and (text[i:i + 1].isalnum() or text[i:i + 1] == b"#"):
+                i += 1
+            if i < n and text[i:i + 1] == b";":
+                i += 1
+        elif c.isalnum():
+            j = i
+            while j < n and text[j:j + 1].isalnum():
+                j += 1
+            terms.append(text[i:j].lower()[:TERM_LEN - 1])
+            i = j
+        else:
+            i += 1
+    return terms
+
+
+def varint(v):
+    out = bytearray()
+    while v >= 0x80:
+        out.append((v & 0x7F) | 0x80)
+        v >>= 7
+    out.append(v)
+    return bytes(out)
+
+
+def build_search(paths, pages):
+    # See cheatsearch.c for the layout
+    postings_of = {}
+    for doc, path in enumerate(paths):
+        if path.rsplit("/", 1)[-1].startswith("index"):
+            continue
+        for term in terms_of(page_title(pages[path])):
+            postings_of.setdefault(term, set()).add(doc)
+
+    if not postings_of:
+        return b""
+
+    terms = bytearray()
+    postings = bytearray()
+    block_off = []
+    prev = b""
+    for count, term in enumerate(sorted(postings_of)):
+        start = len(postings)
+        last = 0
+        for i, doc in enumerate(sorted(postings_of[term])):
+            postings += varint(doc - last if i else doc)
+            last = doc
+
+        prefix = 0
+        if count % BLOCK_TERMS == 0:
+            block_off.append(len(terms))
+            terms += varint(start)
+        else:
+            while prefix < min(len(prev), len(term)) and prev[prefix] == term[prefix]:
+                prefix += 1
+
+        terms += bytes([prefix, len(term) - prefix]) + term[prefix:]
+        terms += varint(len(postings_of[term])) + varint(len(postings) - start)
+        prev = term
+
+    blocks_start = 12 + 4 * len(block_off)
+    out = struct.pack("<III", len(postings_of), len(block_off), blocks_start + len(terms))
+    out += b"".join(struct.pack("<I", blocks_start + off) for off in block_off)
+    return out + bytes(terms) + bytes(postings)
+
+
+def build_image(pages, size):
+    data = bytearray()
+    entries = []
+    paths = bytearray()
+
+    for path in sorted(pages):
+        encoded = path.encode("latin-1")
+        if len(encoded) + 1 > 128:
+            sys.exit("path too long: " + path)
+        entries.append((len(paths), DATA_OFFSET + len(data), len(pages[path])))
+        paths += encoded + b"\0"
+        data += pages[path]
+
+    data += b"\0" * (-len(data) % 4)
+    index_off = DATA_OFFSET + len(data)
+    for path_off, data_off, data_len in entries:
+        data += struct.pack(ENTRY_FMT, path_off, data_off, data_len, 0)
+    paths_off = DATA_OFFSET + len(data)
+    data += paths
+
+    search = build_search(sorted(pages), pages)
+    search_off = DATA_OFFSET + len(data)
+    data += search
+
+    image_size = DATA_OFFSET + len(data)
+    slot_size = size // 2 // SECTOR * SECTOR
+    if image_size > slot_size:
+        sys.exit("image is %d bytes, a slot is only %d" % (image_size, slot_size))
+
+    crc = zlib.crc32(data) & 0xFFFFFFFF
+    header = struct.pack(HEADER_FMT, MAGIC, VERSION, FLAG_SEARCH if search else 0, len(entries),
+                         index_off, paths_off, image_size, crc,
+                         search_off if search else 0, len(search), 0)
+    image = header + b"\xFF" * (DATA_OFFSET - len(header)) + bytes(data)
+    return image + b"\xFF" * (slot_size + SECTOR - len(image))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Build the SharkShit64 offline cheat database image")
+    parser.add_argument("dump", help="cheat dump text file")
+    parser.add_argument("output", help="image to write")
+    parser.add_argument("--size", type=lambda s: int(s, 0), default=0x400000,
+                        help="size of the cheatdb partition (default 4MB)")
+    args = parser.parse_args()
+
+    games = parse_dump(args.dump)
+    pages = build_pages(games)
+    image = build_image(pages, args.size)
+
+    with open(args.output, "wb") as f:
+        f.write(image)
+
+    print("cheatdb: %d games, %d pages, %d bytes" % (len(games), len(pages), len(image)))
+
+
+if __name__ == "__main__":
+    main()
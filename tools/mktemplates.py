@@ -0,0 +1,269 @@
+#!/usr/bin/env python3
+#
+# mktemplates.py
+# Compiles the templates in components/http_ui/templates (HTML pages, and the JSON the config
+# page is filled in from) into C, so pages are rendered by writing out static strings and typed
+# slots through tpl_writer_t (see tpl.h) instead of being snprintf'd into a malloc'd buffer.
+#
+# A template file holds one or more named templates:
+#
+#    {{! comments are dropped }}
+#    {{define stats_page}}
+#       <p>{{pages|uint}} pages, last search: {{query}}</p>
+#    {{end}}
+#
+# Every template becomes "esp_err_t tpl_<name>(tpl_writer_t *w, const tpl_<name>_args_t *a)",
+# with one args field per slot (or just "tpl_<name>(tpl_writer_t *w)" if it has none). Slots
+# are {{field}} or {{field|policy}}, the policy picking both the field type and how it's written:
+#
+#    html   const char *, escaped for element content (the default)
+#    attr   const char *, escaped for a quoted attribute value
+#    raw    const char *, written as is, for values that are already HTML
+#    json   const char *, escaped for inside a JSON string
+#    sw     const char *, Sharkwire meta tag encoding
+#    uint   uint32_t
+#    int    int32_t
+#
+# Template text has its indentation and line breaks stripped, so markup can be laid out
+# readably. Use "{{define name verbatim}}" for a page where the line breaks matter.
+#
+# usage: mktemplates.py --out-dir DIR templates/*.html templates/*.json
+
+import argparse
+import os
+import re
+import sys
+
+POLICIES = {
+    "html": ("const char *", "tpl_put_html"),
+    "attr": ("const char *", "tpl_put_attr"),
+    "raw":  ("const char *", "tpl_put_raw"),
+    "json": ("const char *", "tpl_put_json"),
+    "sw":   ("const char *", "tpl_put_sw"),
+    "uint": ("uint32_t ", "tpl_put_uint"),
+    "int":  ("int32_t ", "tpl_put_int"),
+}
+
+TAG_RE = re.compile(r"\{\{(.*?)\}\}", re.S)
+NAME_RE = re.compile(r"^[A-Za-z_][A-Za-z0-9_]*$")
+
+
+def fail(path, text, pos, msg):
+    line = text.count("\n", 0, pos) + 1
+    sys.exit("%s:%d: %s" % (path, line, msg))
+
+
+def squash(text):
+    # Drop indentation and line breaks
+    return "".join(line.lstrip() for line in text.split("\n"))
+
+
+def parse_file(path):
+    with open(path, encoding="latin-1") as f:
+        text = f.read()
+
+    templates = []
+    current = None
+    pos = 0
+
+    for m in TAG_RE.finditer(text):
+        tag = m.group(1).strip()
+        literal = text[pos:m.start()]
+        pos = m.end()
+
+        if tag.startswith("!"):
+            if current is not None:
+                current["parts"].append(("text", literal))
+            continue
+
+        words = tag.split()
+        if words and words[0] == "define":
+            if current is not None:
+                fail(path, text, m.start(), "define inside define")
+            if len(words) not in (2, 3) or not NAME_RE.match(words[1]) or \
+               (len(words) == 3 and words[2] != "verbatim"):
+                fail(path, text, m.start(), "bad define: {{%s}}" % tag)
+            current = {"name": words[1], "verbatim": len(words) == 3, "parts": []}
+            # The line break right after the define tag isn't part of the template
+            if text.startswith("\n", pos):
+                pos += 1
+            continue
+
+        if current is None:
+            if tag != "end":
+                fail(path, text, m.start(), "slot outside of a define")
+            fail(path, text, m.start(), "end without define")
+
+        current["parts"].append(("text", literal))
+
+        if tag == "end":
+            templates.append(current)
+            current = None
+            continue
+
+        field, _, policy = tag.partition("|")
+        field, policy = field.strip(), (policy.strip() or "html")
+        if not NAME_RE.match(field):
+            fail(path, text, m.start(), "bad slot name: {{%s}}" % tag)
+        if policy not in POLICIES:
+            fail(path, text, m.start(), "unknown policy '%s'" % policy)
+        current["parts"].append(("slot", field, policy))
+
+    if current is not None:
+        sys.exit("%s: define %s has no end" % (path, current["name"]))
+
+    # Squash the whole body with the slots standing in as placeholders, so text on either
+    # side of a slot (or a comment) is treated as the same line, then split it back up
+    for t in templates:
+        body = ""
+        slots = []
+        for part in t["parts"]:
+            if part[0] == "text":
+                body += part[1]
+            else:
+                body += "\0%d\0" % len(slots)
+                slots.append(part)
+        if not t["verbatim"]:
+            body = squash(body)
+
+        t["parts"] = []
+        for i, piece in enumerate(body.split("\0")):
+            if i % 2:
+                t["parts"].append(slots[int(piece)])
+            elif piece:
+                t["parts"].append(("text", piece))
+        t["source"] = os.path.basename(path)
+
+    return templates
+
+
+def c_string(s):
+    out = []
+    for ch in s.encode("latin-1"):
+        c = chr(ch)
+        if c == "\\":
+            out.append("\\\\")
+        elif c == "\"":
+            out.append("\\\"")
+        elif c == "\n":
+            out.append("\\n")
+        elif c == "\t":
+            out.append("\\t")
+        elif 0x20 <= ch < 0x7F and c != "?":
+            out.append(c)
+        else:
+            # Octal so a following digit can't be swallowed into the escape
+            out.append("\\%03o" % ch)
+    return "\"" + "".join(out) + "\""
+
+
+def fields_of(t):
+    fields = {}
+    for part in t["parts"]:
+        if part[0] != "slot":
+            continue
+        ctype = POLICIES[part[2]][0]
+        if part[1] in fields and fields[part[1]] != ctype:
+            sys.exit("%s: slot %s in %s is used with two types" % (t["source"], part[1], t["name"]))
+        fields[part[1]] = ctype
+    return fields
+
+
+def signature(t, fields):
+    if fields:
+        return "esp_err_t tpl_%s(tpl_writer_t *w, const tpl_%s_args_t *a)" % (t["name"], t["name"])
+    return "esp_err_t tpl_%s(tpl_writer_t *w)" % t["name"]
+
+
+def generate(templates):
+    h = [
+        "// Generated by tools/mktemplates.py from templates/*, don't edit",
+        "",
+        "#pragma once",
+        "",
+        "#ifdef __cplusplus",
+        "extern \"C\" {",
+        "#endif",
+        "",
+        "#include <stdint.h>",
+        "#include \"tpl.h\"",
+        "",
+    ]
+    c = [
+        "// Generated by tools/mktemplates.py from templates/*, don't edit",
+        "",
+        "#include \"templates.h\"",
+        "",
+    ]
+
+    for t in templates:
+        fields = fields_of(t)
+
+        if fields:
+            h.append("typedef struct {")
+            for name, ctype in fields.items():
+                h.append("   %s%s;" % (ctype, name))
+            h.append("} tpl_%s_args_t;" % t["name"])
+            h.append("")
+
+        c.append("// %s: %s" % (t["source"], t["name"]))
+        body = []
+        seg = 0
+        for part in t["parts"]:
+            if part[0] == "text":
+                var = "tpl_%s_s%d" % (t["name"], seg)
+                seg += 1
+                c.append("static const char %s[] = %s;" % (var, c_string(part[1])))
+                body.append("   tpl_put(w, %s, sizeof(%s) - 1);" % (var, var))
+            else:
+                body.append("   %s(w, a->%s);" % (POLICIES[part[2]][1], part[1]))
+
+        c.append(signature(t, fields) + " {")
+        c.extend(body)
+        c.append("   return w->out.err;")
+        c.append("}")
+        c.append("")
+
+    h.append("// prototypes")
+    for t in templates:
+        h.append(signature(t, fields_of(t)) + ";")
+    h += ["", "#ifdef __cplusplus", "}", "#endif", ""]
+
+    return "\n".join(h), "\n".join(c)
+
+
+def write_if_changed(path, text):
+    # Keeps the timestamps alone when nothing changed, so nothing gets rebuilt for no reason
+    try:
+        with open(path) as f:
+            if f.read() == text:
+                return
+    except OSError:
+        pass
+    with open(path, "w") as f:
+        f.write(text)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Compile the SharkShit64 HTML templates into C")
+    parser.add_argument("--out-dir", required=True, help="where templates.c and templates.h go")
+    parser.add_argument("templates", nargs="+", help="template files")
+    args = parser.parse_args()
+
+    templates = []
+    seen = set()
+    for path in sorted(args.templates):
+        for t in parse_file(path):
+            if t["name"] in seen:
+                sys.exit("%s: template %s is defined twice" % (path, t["name"]))
+            seen.add(t["name"])
+            templates.append(t)
+
+    header, source = generate(templates)
+    os.makedirs(args.out_dir, exist_ok=True)
+    write_if_changed(os.path.join(args.out_dir, "templates.h"), header)
+    write_if_changed(os.path.join(args.out_dir, "templates.c"), source)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,289 @@
+// tpl_bench.c
+// Host benchmark for the page renderer: the templates compiled by tools/mktemplates.py, tpl.c
+// and resp.c, sending to a stand-in for esp_http_server that puts the headers and chunks
+// together the way it does. For each page it shows the bytes rendered, how fast, the socket
+// writes it took and the heap allocations made per render (which should be none).
+//
+// The socket and the allocator are swapped out with the linker's --wrap, so this needs GNU ld.
+//
+// usage (from the top of the repo):
+//    python3 tools/mktemplates.py --out-dir /tmp/tplgen components/http_ui/templates/*.html components/http_ui/templates/*.json
+//    cc -O2 -Itools/host -Icomponents/http_ui -I/tmp/tplgen -o tpl_bench tools/tpl_bench.c components/http_ui/tpl.c components/http_ui/resp.c /tmp/tplgen/templates.c -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc,--wrap=send,--wrap=setsockopt
+//    ./tpl_bench [renders]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "templates.h"
+#include "resp.h"
+
+#define BENCH_SOCK 3
+
+static volatile size_t allocs = 0;
+static size_t wire_bytes = 0;
+static size_t wire_writes = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+void *__wrap_malloc(size_t size) {
+   allocs++;
+   return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+   allocs++;
+   return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size) {
+   allocs++;
+   return __real_realloc(p, size);
+}
+
+// __wrap_send
+// The socket, counts what resp.c writes to it
+ssize_t __wrap_send(int sockfd, const void *buf, size_t len, int flags) {
+   (void)sockfd;
+   (void)buf;
+   (void)flags;
+   wire_bytes += len;
+   wire_writes++;
+   return len;
+}
+
+int __wrap_setsockopt(int sockfd, int level, int name, const void *val, unsigned int len) {
+   (void)sockfd;
+   (void)level;
+   (void)name;
+   (void)val;
+   (void)len;
+   return 0;
+}
+
+// The stand-in server, one session with its send override and transport context, like
+// esp_http_server keeps for each socket
+static httpd_send_func_t sess_send = NULL;
+static void *sess_ctx = NULL;
+static const char *resp_type = HTTPD_TYPE_TEXT;
+static bool resp_started = false;
+
+esp_err_t httpd_sess_set_send_override(httpd_handle_t hd, int sockfd, httpd_send_func_t send_func) {
+   (void)hd;
+   (void)sockfd;
+   sess_send = send_func;
+   return ESP_OK;
+}
+
+void *httpd_sess_get_transport_ctx(httpd_handle_t hd, int sockfd) {
+   (void)hd;
+   (void)sockfd;
+   return sess_ctx;
+}
+
+void httpd_sess_set_transport_ctx(httpd_handle_t hd, int sockfd, void *ctx, httpd_free_ctx_fn_t free_fn) {
+   (void)hd;
+   (void)sockfd;
+   (void)free_fn;
+   sess_ctx = ctx;
+}
+
+int httpd_req_to_sockfd(httpd_req_t *r) {
+   (void)r;
+   return BENCH_SOCK;
+}
+
+int httpd_req_recv(httpd_req_t *r, char *buf, size_t buf_len) {
+   (void)r;
+   (void)buf;
+   (void)buf_len;
+   return HTTPD_SOCK_ERR_FAIL;
+}
+
+esp_err_t httpd_resp_set_type(httpd_req_t *r, const char *type) {
+   (void)r;
+   resp_type = type;
+   return ESP_OK;
+}
+
+// server_send
+static esp_err_t server_send(const char *buf, size_t len) {
+   return sess_send(NULL, BENCH_SOCK, buf, len, 0) == (int)len ? ESP_OK : ESP_FAIL;
+}
+
+// httpd_resp_send
+// Status line, each header and the body as separate sends, like httpd_resp_send
+esp_err_t httpd_resp_send(httpd_req_t *r, const char *buf, ssize_t buf_len) {
+   char line[64];
+   (void)r;
+
+   server_send("HTTP/1.1 200 OK\r\n", 17);
+   server_send("Content-Type: ", 14);
+   server_send(resp_type, strlen(resp_type));
+   server_send("\r\n", 2);
+   server_send(line, snprintf(line, sizeof(line), "Content-Length: %d\r\n", (int)buf_len));
+   server_send("\r\n", 2);
+   return buf_len > 0 ? server_send(buf, buf_len) : ESP_OK;
+}
+
+// httpd_resp_send_chunk
+// The headers the first time, then each chunk as its size line, data and line break
+esp_err_t httpd_resp_send_chunk(httpd_req_t *r, const char *buf, ssize_t buf_len) {
+   char line[16];
+   (void)r;
+
+   if (!resp_started) {
+       server_send("HTTP/1.1 200 OK\r\n", 17);
+       server_send("Content-Type: ", 14);
+       server_send(resp_type, strlen(resp_type));
+       server_send("\r\n", 2);
+       server_send("Transfer-Encoding: chunked\r\n", 28);
+       server_send("\r\n", 2);
+       resp_started = true;
+   }
+   server_send(line, snprintf(line, sizeof(line), "%x\r\n", buf ? (unsigned)buf_len : 0));
+   if (buf && buf_len > 0) server_send(buf, buf_len);
+   return server_send("\r\n", 2);
+}
+
+// render_stats
+static void render_stats(httpd_req_t *req) {
+   static const char *const jobs[] = { "cache_spill", "cheatdb", "outbox", "storage", "imap", "blocklist" };
+   tpl_writer_t w;
+   tpl_stats_args_t args = {
+       .pc_pages = 31, .pc_kb = 412, .pc_hits = 18211, .pc_misses = 2210, .pc_ratio = 89,
+       .cdb_pages = 1204, .cdb_kb = 1830, .cdb_search = 1, .cdb_hits = 5521,
+       .dns_entries = 212, .dns_hits = 99123, .dns_misses = 1021, .dns_ratio = 98,
+       .rs_responses = 20101, .rs_segments = 61023, .rs_kb = 88123,
+       .mb_state = "idle", .mb_cached = 40, .mb_exists = 1289, .mb_syncs = 120,
+       .tls_full = 12, .tls_full_ms = 1800, .tls_resumed = 311, .tls_resumed_ms = 240,
+       .hp_opened = 44, .hp_reused = 1202, .hp_ratio = 96,
+   };
+
+   tpl_begin(&w, req, "text/html");
+   tpl_stats(&w, &args);
+   for (size_t i = 0; i < sizeof(jobs) / sizeof(jobs[0]); i++) {
+       tpl_stats_worker_row_args_t row = { .name = jobs[i], .served = 1000 + i, .wait_avg_ms = 3, .wait_max_ms = 40 };
+       tpl_stats_worker_row(&w, &row);
+   }
+   tpl_stats_tail(&w);
+   tpl_end(&w);
+}
+
+// render_config_json
+static void render_config_json(httpd_req_t *req) {
+   static const char *const lists[] = { "ads", "trackers", "malware", "social" };
+   tpl_writer_t w;
+   tpl_config_json_head_args_t head = {
+       .ssid = "HomeNetwork", .pass = "hunter2\"quoted\"", .smtp_server = "smtp.example.com",
+       .smtp_port = "465", .imap_server = "imap.example.com", .imap_port = "993",
+       .username = "player1@example.com", .password = "p@ss<word>", .warm = "1",
+       .dns_entries = 212, .dns_hits = 99123, .dns_misses = 1021,
+   };
+   tpl_config_json_tail_args_t tail = {
+       .pages = 1204, .kb = 1830, .hits = 5521, .syncing = "false", .mq_sending = "false",
+       .mq_error = "Message to c@x: 451 greylisted",
+   };
+
+   tpl_begin(&w, req, "application/json");
+   tpl_config_json_head(&w, &head);
+   for (size_t i = 0; i < sizeof(lists) / sizeof(lists[0]); i++) {
+       tpl_config_json_blocklist_args_t row = { .sep = i ? "," : "", .name = lists[i], .entries = 40000, .hits = 123 };
+       tpl_config_json_blocklist(&w, &row);
+   }
+   tpl_config_json_tail(&w, &tail);
+   tpl_end(&w);
+}
+
+// render_inbox
+static void render_inbox(httpd_req_t *req) {
+   tpl_writer_t w;
+   tpl_inbox_head_args_t head = { .exists = 1289 };
+
+   tpl_begin(&w, req, "text/html");
+   tpl_inbox_head(&w, &head);
+   for (uint32_t i = 0; i < 20; i++) {
+       tpl_inbox_row_args_t row = {
+           .uid = 5000 + i, .page = 0,
+           .subject = "Re: High scores & <b>cheat codes</b> for Mario Kart 64",
+           .from = "\"Player Two\" <p2@example.com>",
+           .date = "Sat, 17 Oct 2026 21:04:11 +0000",
+       };
+       tpl_inbox_row(&w, &row);
+   }
+   tpl_inbox_older_args_t older = { .page = 1 };
+   tpl_inbox_older(&w, &older);
+   tpl_inbox_tail(&w);
+   tpl_end(&w);
+}
+
+// render_search
+static void render_search(httpd_req_t *req) {
+   tpl_writer_t w;
+   tpl_search_head_args_t head = { .action = "/cheats/gameshark/n64/search.html", .query = "mario" };
+   tpl_search_count_args_t count = { .total = 25, .more = "" };
+
+   tpl_begin(&w, req, "text/html");
+   tpl_search_head(&w, &head);
+   tpl_search_count(&w, &count);
+   for (int i = 0; i < 25; i++) {
+       tpl_search_row_args_t row = { .path = "/cheats/gameshark/n64/super_mario_64.html", .title = "Super Mario 64 (USA)" };
+       tpl_search_row(&w, &row);
+   }
+   tpl_search_tail(&w);
+   tpl_end(&w);
+}
+
+// render_newuser_ok
+// A Sharkwire page, its slots go through the sw encoding
+static void render_newuser_ok(httpd_req_t *req) {
+   tpl_writer_t w;
+   tpl_newuser_ok_args_t args = {
+       .username = "player1", .password = "hunter2", .cangoto = "http://10.0.0.1/content",
+       .disconnect = "http://10.0.0.1/disconnect",
+   };
+
+   tpl_begin(&w, req, NULL);
+   tpl_set_sw_key(&w, "10.0.0.1");
+   tpl_newuser_ok(&w, &args);
+   tpl_end(&w);
+}
+
+// now_s
+static double now_s(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// bench
+static void bench(const char *name, void (*render)(httpd_req_t *), int renders) {
+   httpd_req_t req = {0};
+
+   wire_bytes = wire_writes = allocs = 0;
+   double t = now_s();
+   for (int i = 0; i < renders; i++) {
+       resp_started = false;
+       render(&req);
+   }
+   double s = now_s() - t;
+
+   printf("%-12s %6zu bytes %6.1f writes %8.0f renders/s %7.1f MB/s %5.2f allocs/render\n", name,
+          wire_bytes / renders, (double)wire_writes / renders, renders / s,
+          wire_bytes / s / (1024 * 1024), (double)allocs / renders);
+}
+
+int main(int argc, char **argv) {
+   int renders = argc > 1 ? atoi(argv[1]) : 200000;
+
+   resp_session_open(NULL, BENCH_SOCK);
+   bench("stats", render_stats, renders);
+   bench("config_json", render_config_json, renders);
+   bench("inbox", render_inbox, renders);
+   bench("search", render_search, renders);
+   bench("newuser_ok", render_newuser_ok, renders);
+   return 0;
+}